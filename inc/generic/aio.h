@@ -0,0 +1,167 @@
+/**
+ * @file aio.h
+ * @brief Asynchronous writer declaration
+ *
+ * This file contains the declaration of the asynchronous writer shared by
+ * the capture files, the decoded output and the flow export. The bytes are
+ * gathered in a fixed pool of aligned buffers, each full buffer being handed
+ * to io_uring while the next one is filled: the capture thread only waits
+ * when every buffer is in flight. Without io_uring, the buffers are written
+ * synchronously.
+ */
+
+#ifndef AIO_H
+#define AIO_H
+
+#include <stdio.h>
+
+#include "types.h"
+
+#define AIO_BUF_LEN (1 << 20) /**< Size of a buffer */
+#define AIO_ALIGN 4096 /**< Alignment of the buffers, for O_DIRECT */
+#define AIO_DEPTH 8 /**< Buffers of the pool, at most in flight */
+
+/**
+ * @brief Buffer of the pool
+ */
+struct aio_buf {
+    u_char *data;           /**< AIO_BUF_LEN bytes aligned on AIO_ALIGN */
+    size_t len;             /**< Bytes to write */
+    size_t done;            /**< Bytes already written */
+    uint64_t offset;        /**< Offset in the file, for a seekable file */
+    int index;              /**< Index of the registered buffer */
+    struct aio_file *file;  /**< File written */
+    struct aio_buf *next;   /**< Next free or queued buffer */
+};
+
+/**
+ * @brief File written through the pool
+ */
+struct aio_file {
+    int fd;
+    int seekable;           /**< 0 for a pipe or terminal, written in order */
+    int interactive;        /**< 1 for a terminal, written at every line */
+    int error;              /**< errno of the first failed write, 0 if none */
+    uint64_t offset;        /**< Offset of the next buffer */
+    int inflight;           /**< Buffers being written */
+    struct aio_buf *fill;   /**< Buffer being filled, NULL if none */
+    struct aio_buf *queue;  /**< Buffers waiting for the previous write */
+    struct aio_buf *queue_tail;
+};
+
+/**
+ * @brief Initialize the pool
+ *
+ * @param uring 1 to write with io_uring, 0 to write synchronously
+ * @return int 0 on success, -1 on allocation failure. Without io_uring
+ * support, a warning is printed and the writes are synchronous.
+ */
+int aio_init(int uring);
+
+/**
+ * @brief Check if the writes go through io_uring
+ *
+ * @return int 1 with io_uring, 0 otherwise
+ */
+int aio_async(void);
+
+/**
+ * @brief Start writing a file descriptor through the pool
+ *
+ * @param fd The file descriptor, positioned where to write
+ * @return struct aio_file* The file, NULL on allocation failure
+ */
+struct aio_file *aio_attach(int fd);
+
+/**
+ * @brief Get a free buffer
+ *
+ * Wait for a write to complete if every buffer is in flight.
+ *
+ * @return struct aio_buf* The buffer, empty
+ */
+struct aio_buf *aio_buf_get(void);
+
+/**
+ * @brief Write a buffer
+ *
+ * The buffer goes back to the pool once written.
+ *
+ * @param file The file
+ * @param buf The buffer, its len bytes are written at the end of the file
+ */
+void aio_buf_write(struct aio_file *file, struct aio_buf *buf);
+
+/**
+ * @brief Append bytes to a file
+ *
+ * The bytes are copied in the buffer being filled, written when full.
+ *
+ * @param file The file
+ * @param data The bytes
+ * @param len The number of bytes
+ */
+void aio_append(struct aio_file *file, const void *data, size_t len);
+
+/**
+ * @brief Write the buffer being filled
+ *
+ * @param file The file
+ */
+void aio_flush(struct aio_file *file);
+
+/**
+ * @brief Wait for the writes of a file
+ *
+ * @param file The file
+ * @return int 0 on success, -1 if a write failed
+ */
+int aio_drain(struct aio_file *file);
+
+/**
+ * @brief Stop writing a file through the pool
+ *
+ * Write the buffer being filled and wait for the writes. The file descriptor
+ * is left open, positioned after the bytes written.
+ *
+ * @param file The file
+ * @return int 0 on success, -1 if a write failed
+ */
+int aio_detach(struct aio_file *file);
+
+/**
+ * @brief Open a stream writing a file descriptor through the pool
+ *
+ * A terminal is line buffered. Closing the stream detaches the file and
+ * closes the file descriptor, unless it is the standard output.
+ *
+ * @param fd The file descriptor
+ * @return FILE* The stream, NULL on error
+ */
+FILE *aio_fdopen(int fd);
+
+/**
+ * @brief Open a file for writing
+ *
+ * Through the pool with io_uring, with stdio otherwise.
+ *
+ * @param path The file, truncated if it exists
+ * @return FILE* The stream, NULL on error
+ */
+FILE *aio_fopen(const char *path);
+
+/**
+ * @brief Print the statistics of the asynchronous writes
+ *
+ * Number of writes and of waits for a free buffer, on stderr.
+ */
+void aio_report(void);
+
+/**
+ * @brief Free the pool
+ *
+ * Every file must have been detached.
+ */
+void aio_free(void);
+
+#endif // AIO_H
@@ -0,0 +1,110 @@
+/**
+ * @file capindex.h
+ * @brief Capture index declaration
+ *
+ * This file contains the declaration of the index of the capture files, kept
+ * next to a capture as <capture>.idx and written by -w --index or by the
+ * index command. The packets are indexed by blocks of INDEX_BLOCK_PACKETS:
+ * a block gives the offset of its first packet and the time span of its
+ * packets, and every host and conversation gives the list of the blocks it
+ * appears in, as varint deltas. A query on a time range, a host or a flow
+ * only reads the blocks that may hold its packets.
+ */
+
+#ifndef CAPINDEX_H
+#define CAPINDEX_H
+
+#include <stdio.h>
+
+#include "flow.h"
+#include "types.h"
+
+#define INDEX_BLOCK_PACKETS 256 /**< Packets of a block */
+#define INDEX_SUFFIX ".idx" /**< Appended to the name of the capture */
+
+/**
+ * @brief Query on a capture file
+ */
+struct capindex_query {
+    uint64_t start;         /**< Start of the time range (ns), 0 for none */
+    uint64_t end;           /**< End of the time range (ns), excluded, 0 for none */
+    int has_host;           /**< 1 to keep the packets of a host */
+    uint8_t host_family;    /**< AF_INET or AF_INET6 */
+    uint8_t host[16];       /**< Address, IPv4 in the first 4 bytes */
+    int has_flow;           /**< 1 to keep the packets of a conversation */
+    struct flow_key flow;   /**< Normalized key of the conversation */
+};
+
+/**
+ * @brief Set the host of a query
+ *
+ * @param query The query
+ * @param addr The IPv4 or IPv6 address
+ * @return int 0 on success, -1 if the address is malformed
+ */
+int capindex_query_host(struct capindex_query *query, const char *addr);
+
+/**
+ * @brief Set the conversation of a query
+ *
+ * The conversation is written proto,address,port,address,port, the protocol
+ * being a name or a number, in either direction.
+ *
+ * @param query The query
+ * @param spec The conversation
+ * @return int 0 on success, -1 if the conversation is malformed
+ */
+int capindex_query_flow(struct capindex_query *query, const char *spec);
+
+/**
+ * @brief Start indexing a capture file
+ */
+void capindex_begin(void);
+
+/**
+ * @brief Index a packet
+ *
+ * @param offset The offset of the pcap record of the packet in the file
+ * @param ts The time of the packet (ns)
+ * @param packet The frame
+ * @param caplen The captured size of the frame
+ * @return int 0 on success, -1 on allocation failure
+ */
+int capindex_add(uint64_t offset, uint64_t ts, const u_char *packet,
+                 uint32_t caplen);
+
+/**
+ * @brief Write the index of a capture file
+ *
+ * The index replaces <capture>.idx once complete.
+ *
+ * @param capture The capture file
+ * @param size The size of the capture file
+ * @return int 0 on success, -1 on error
+ */
+int capindex_end(const char *capture, uint64_t size);
+
+/**
+ * @brief Index a capture file
+ *
+ * Implement the index command. The file must be a pcap file.
+ *
+ * @param path The capture file
+ * @return int 0 on success, -1 on error
+ */
+int capindex_build(const char *path);
+
+/**
+ * @brief Open the packets of a capture file matching a query
+ *
+ * The stream gives the header of the capture, then the records of the
+ * packets matching the query. Without an up to date index, the whole file is
+ * read. The file must be a regular pcap file.
+ *
+ * @param path The capture file
+ * @param query The query
+ * @return FILE* The stream, NULL on error
+ */
+FILE *capindex_fopen(const char *path, const struct capindex_query *query);
+
+#endif // CAPINDEX_H
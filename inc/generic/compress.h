@@ -0,0 +1,110 @@
+/**
+ * @file compress.h
+ * @brief Compressed captures declaration
+ *
+ * This file contains the declaration of the compression of the capture files,
+ * with zstd or lz4 when built with the libraries. The capture writer cuts the
+ * pcap stream in blocks of COMPRESS_BLOCK_LEN bytes, each compressed by a pool
+ * of threads in its own frame, and the frames are written in order. As the
+ * frames are independent, a compressed capture given to -r is decompressed by
+ * the same threads, several frames ahead of the decoder.
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdio.h>
+
+#include "aio.h"
+#include "types.h"
+
+#define COMPRESS_BLOCK_LEN (1 << 20) /**< Bytes compressed in a frame */
+
+/**
+ * @brief Compression formats
+ */
+enum compress_codec {
+    COMPRESS_NONE = 0,
+    COMPRESS_ZSTD,
+    COMPRESS_LZ4
+};
+
+struct compress_file;
+
+/**
+ * @brief Check if a format is supported by this build
+ *
+ * @param codec The format (enum compress_codec)
+ * @return int 1 if supported, 0 otherwise
+ */
+int compress_supported(int codec);
+
+/**
+ * @brief Set the number of compression threads
+ *
+ * The threads are started at the first compressed file.
+ *
+ * @param threads The number of threads, 0 for one per processor
+ */
+void compress_init(int threads);
+
+/**
+ * @brief Start compressing the bytes written to a file
+ *
+ * @param out The file the frames are written to
+ * @param codec The format (enum compress_codec)
+ * @param level The compression level
+ * @return struct compress_file* The compressed file, NULL on error
+ */
+struct compress_file *compress_attach(struct aio_file *out, int codec,
+                                      int level);
+
+/**
+ * @brief Compress bytes
+ *
+ * The bytes are gathered in a block, compressed once full. The frames
+ * compressed are written to the file, in order.
+ *
+ * @param file The compressed file
+ * @param data The bytes
+ * @param len The number of bytes
+ * @return int 0 on success, -1 if a block could not be compressed
+ */
+int compress_append(struct compress_file *file, const void *data, size_t len);
+
+/**
+ * @brief Stop compressing the bytes written to a file
+ *
+ * Compress the last block and write the frames left to the file.
+ *
+ * @param file The compressed file
+ * @return int 0 on success, -1 if a block could not be compressed
+ */
+int compress_detach(struct compress_file *file);
+
+/**
+ * @brief Find the format of a capture file
+ *
+ * @param path The file, "-" for stdin
+ * @return int The format (enum compress_codec), COMPRESS_NONE if the file
+ * is not compressed or can't be read
+ */
+int compress_probe(const char *path);
+
+/**
+ * @brief Open a compressed capture file for reading
+ *
+ * The stream gives the bytes decompressed. The file must be a regular file.
+ *
+ * @param path The file
+ * @param codec The format (enum compress_codec)
+ * @return FILE* The stream, NULL on error
+ */
+FILE *compress_fopen(const char *path, int codec);
+
+/**
+ * @brief Stop the compression threads
+ */
+void compress_free(void);
+
+#endif // COMPRESS_H
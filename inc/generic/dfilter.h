@@ -0,0 +1,128 @@
+/**
+ * @file dfilter.h
+ * @brief Display filter declaration
+ *
+ * This file contains the declaration of the display filter. Unlike the
+ * capture filter run by libpcap on the raw bytes, it is evaluated on the
+ * fields decoded by the dissectors, application fields included, and decides
+ * whether the decoded packet is printed. The fields of the headers are read
+ * before the dissection, so that only the packets whose match depends on the
+ * application fields have their output held back.
+ *
+ * A filter is compiled once into a flat program of tests, each one jumping
+ * to the next test to run depending on its result, as in BPF.
+ */
+
+#ifndef DFILTER_H
+#define DFILTER_H
+
+#include <stdio.h>
+
+#include "types.h"
+
+#define DFILTER_MAX_INSNS 256 /**< Tests in a compiled filter */
+#define DFILTER_STR_LEN 256 /**< Longest string field kept */
+
+/**
+ * @brief Fields of the display filter
+ *
+ * The numeric fields are read from current_packet, the string fields are
+ * given by the dissectors with dfilter_set.
+ */
+enum dfilter_field {
+    DF_FRAME_LEN = 0,   /**< frame.len */
+    DF_VLAN,            /**< vlan, 0 if untagged */
+    DF_IP_VERSION,      /**< ip.version, 4 or 6 */
+    DF_IP_PROTO,        /**< ip.proto */
+    DF_IP_TTL,          /**< ip.ttl, hop limit in IPv6 */
+    DF_SRC_PORT,        /**< src.port */
+    DF_DST_PORT,        /**< dst.port */
+    DF_APP,             /**< Application protocol (enum app_proto) */
+    DF_IP_SRC,          /**< ip.src */
+    DF_IP_DST,          /**< ip.dst */
+    DF_DNS_QNAME,       /**< dns.qname, name of the first question */
+    DF_HTTP_HOST,       /**< http.host, Host header of a request */
+    DF_TLS_SNI,         /**< tls.sni, server name of the connection */
+    DF_MAX
+};
+
+#define DF_FIRST_STR DF_DNS_QNAME /**< First string field */
+
+/**
+ * @brief Compile a display filter
+ *
+ * The errors are printed on stderr.
+ *
+ * @param expr The filter expression
+ * @return int 0 on success, -1 if the expression is malformed
+ */
+int dfilter_compile(const char *expr);
+
+/**
+ * @brief Print a compiled display filter
+ *
+ * One line per test, with its jump targets.
+ */
+void dfilter_dump(void);
+
+/**
+ * @brief Check if a display filter is set
+ *
+ * @return int 1 if a display filter is compiled, 0 otherwise
+ */
+int dfilter_active(void);
+
+/**
+ * @brief Check if the display filter reads a field
+ *
+ * The dissectors skip the decoding of fields no filter needs.
+ *
+ * @param field The field (enum dfilter_field)
+ * @return int 1 if the filter reads the field, 0 otherwise
+ */
+int dfilter_wants(int field);
+
+/**
+ * @brief Set a string field of the current packet
+ *
+ * The value is copied, and truncated to DFILTER_STR_LEN - 1 characters.
+ *
+ * @param field The field (enum dfilter_field)
+ * @param value The value
+ */
+void dfilter_set(int field, const char *value);
+
+/**
+ * @brief Start the dissection of a packet
+ *
+ * The filter is run on the headers of the frame. If they decide it, the
+ * output of the dissectors goes to the stream, or is discarded. Otherwise it
+ * is held back until the packet is matched by dfilter_end.
+ *
+ * @param packet The frame
+ * @param caplen The captured size of the frame
+ * @param len The length of the frame on the wire
+ * @param stream The output of the capture
+ * @return FILE* The output of the dissectors
+ */
+FILE *dfilter_begin(const u_char *packet, uint32_t caplen, uint32_t len,
+                    FILE *stream);
+
+/**
+ * @brief End the dissection of a packet
+ *
+ * Run the filter on the fields of a packet held back and print its output if
+ * it matches.
+ *
+ * @param len The length of the frame on the wire
+ * @param stream The output of the capture
+ * @return int 1 if the packet matches, 0 otherwise
+ */
+int dfilter_end(uint32_t len, FILE *stream);
+
+/**
+ * @brief Free the display filter
+ */
+void dfilter_free(void);
+
+#endif // DFILTER_H
@@ -0,0 +1,33 @@
+/**
+ * @file dpi.h
+ * @brief Application protocol classification
+ *
+ * This file contains the declaration of the heuristic classifier which finds
+ * the application protocol of a flow from its first payload bytes, whatever
+ * the ports used.
+ */
+
+#ifndef DPI_H
+#define DPI_H
+
+#include "flow.h"
+#include "types.h"
+
+#define DPI_MAX_TRIES 4 /**< Payload packets inspected before giving up */
+#define DPI_PROBE_LEN 16 /**< Bytes given to the text signature checks */
+
+/**
+ * @brief Classify a flow
+ *
+ * Run the application signature checks on the payload of a flow that has no
+ * verdict yet. The verdict is cached in the flow so that later packets skip
+ * the classification.
+ *
+ * @param flow The flow of the packet
+ * @param payload The transport payload
+ * @param len The length of the payload
+ * @return int The application protocol of the flow (enum app_proto)
+ */
+int dpi_classify(struct flow *flow, const u_char *payload, int len);
+
+#endif // DPI_H
@@ -0,0 +1,67 @@
+/**
+ * @file expect.h
+ * @brief Expected flows declaration
+ *
+ * This file contains the definition of the expectation table. A dissector
+ * that sees a connection being negotiated (e.g. FTP PORT/PASV) registers the
+ * announced endpoint, so that the flow is classified from its first SYN.
+ */
+
+#ifndef EXPECT_H
+#define EXPECT_H
+
+#include "flow.h"
+#include "types.h"
+
+#define EXPECT_TIMEOUT 60000000000ull /**< Lifetime of an expectation (ns) */
+#define EXPECT_MAX_ENTRIES (1 << 16) /**< Expectations pending at most */
+
+/**
+ * @brief Register an expected flow
+ *
+ * The flow is expected towards the given endpoint. An older expectation for
+ * the same endpoint is replaced.
+ *
+ * @param family AF_INET or AF_INET6
+ * @param proto IPPROTO_TCP or IPPROTO_UDP
+ * @param addr The destination address, in network order
+ * @param port The destination port, in host order
+ * @param app The application of the expected flow (enum app_proto)
+ * @param data The dissector state given to the flow
+ * @param free_data Release the dissector state, may be NULL
+ * @return int 0 on success, -1 if the table is full or on allocation failure
+ */
+int expect_add(uint8_t family, uint8_t proto, const uint8_t *addr,
+               uint16_t port, uint8_t app, void *data,
+               void (*free_data)(void *data));
+
+/**
+ * @brief Match a new flow against the expectations
+ *
+ * If the destination of the packet is expected, the flow gets the
+ * application and the dissector state of the expectation, which is removed.
+ *
+ * @param flow The flow of the packet, without a verdict yet
+ * @param key The flow key as seen on the wire
+ * @return int 1 if the flow was expected, 0 otherwise
+ */
+int expect_match(struct flow *flow, const struct flow_key *key);
+
+/**
+ * @brief Advance the clock of the expectation table
+ *
+ * Called before every packet, release the expectations older than
+ * EXPECT_TIMEOUT about once per second of capture time.
+ *
+ * @param now The capture time of the packet (ns)
+ */
+void expect_tick(uint64_t now);
+
+/**
+ * @brief Free the expectation table
+ *
+ * Release every pending expectation.
+ */
+void expect_table_free(void);
+
+#endif // EXPECT_H
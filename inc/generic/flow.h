@@ -0,0 +1,186 @@
+/**
+ * @file flow.h
+ * @brief Flow table declaration
+ *
+ * This file contains the definition of the flow key, the flow record and the
+ * functions to look flows up in the flow table.
+ * Both directions of a conversation share the same flow record, which counts
+ * the packets and bytes of each direction. When an expiry handler is set, the
+ * idle, long-lived and closed flows are handed to it and released.
+ */
+
+#ifndef FLOW_H
+#define FLOW_H
+
+#include "types.h"
+
+/**
+ * @brief Application protocols
+ *
+ * Verdicts stored in a flow once its payload has been classified.
+ */
+enum app_proto {
+    APP_UNKNOWN = 0, /**< Not classified yet */
+    APP_NONE,        /**< Classified, no known application */
+    APP_HTTP,
+    APP_TLS,
+    APP_SMTP,
+    APP_FTP,
+    APP_POP,
+    APP_IMAP,
+    APP_DNS,
+    APP_TELNET,
+    APP_BOOTP,
+    APP_DHCPV6,
+    APP_FTP_DATA,    /**< Data connection negotiated by an FTP session */
+    APP_MAX
+};
+
+/**
+ * @brief Flow key
+ *
+ * Addresses and ports identifying a conversation. Ports are in host order,
+ * addresses in network order (IPv4 addresses use the first 4 bytes).
+ */
+struct flow_key {
+    uint8_t family;     /**< AF_INET or AF_INET6 */
+    uint8_t proto;      /**< IPPROTO_TCP, IPPROTO_UDP... */
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t saddr[16];
+    uint8_t daddr[16];
+};
+
+/**
+ * @brief Directions of a flow
+ */
+#define FLOW_DIR_ORIG 0  /**< Same direction as the first packet of the flow */
+#define FLOW_DIR_REPLY 1 /**< Opposite direction */
+
+/**
+ * @brief Reasons of the end of a flow record
+ *
+ * Same values as the IPFIX flowEndReason element.
+ */
+enum flow_end {
+    FLOW_END_IDLE = 1,   /**< No packet during the idle timeout */
+    FLOW_END_ACTIVE = 2, /**< Active timeout, the flow goes on */
+    FLOW_END_CLOSED = 3, /**< TCP connection closed by FIN or RST */
+    FLOW_END_FORCED = 4  /**< End of the capture */
+};
+
+/**
+ * @brief Flow record
+ *
+ * The key is stored normalized: the lowest (address, port) pair is the source.
+ */
+struct flow {
+    struct flow_key key;
+    uint8_t app;        /**< Application verdict (enum app_proto) */
+    uint8_t tries;      /**< Payload packets inspected without a verdict */
+    uint8_t swapped;    /**< 1 if the first packet went from daddr to saddr */
+    uint8_t tcp_flags[2]; /**< TCP flags seen in each direction (FLOW_DIR_*) */
+    uint16_t pmtu;      /**< Smallest MTU reported by ICMP, 0 if none */
+    uint32_t unreachables; /**< ICMP destination unreachable quoting the flow */
+    uint32_t too_big;   /**< ICMP fragmentation needed or packet too big */
+    uint32_t hash;      /**< Hash of the key */
+    uint64_t packets[2]; /**< Packets of each direction (FLOW_DIR_*) */
+    uint64_t bytes[2];  /**< IP bytes of each direction (FLOW_DIR_*) */
+    uint64_t first;     /**< Time of the first packet of the record (ns) */
+    uint64_t last;      /**< Time of the last packet (ns) */
+    void *data;         /**< State of the application dissector */
+    void (*free_data)(void *data); /**< Release the dissector state */
+};
+
+/**
+ * @brief Handler of the expired flows
+ *
+ * @param flow The flow, released after the call unless the reason is
+ * FLOW_END_ACTIVE
+ * @param reason Why the record ends (enum flow_end)
+ */
+typedef void (*flow_expire_fn)(const struct flow *flow, int reason);
+
+/**
+ * @brief Normalize a flow key
+ *
+ * Order the endpoints so that both directions of a conversation give the
+ * same key.
+ *
+ * @param key The key as seen on the wire
+ * @param norm The normalized key
+ * @return int 1 if the endpoints were swapped, 0 otherwise
+ */
+int flow_key_normalize(const struct flow_key *key, struct flow_key *norm);
+
+/**
+ * @brief Find a flow
+ *
+ * Find the flow matching the key in either direction, without creating it.
+ *
+ * @param key The flow key as seen on the wire
+ * @param dir Where to store the direction of the packet (FLOW_DIR_*), may be NULL
+ * @return struct flow* The flow, NULL if there is none
+ */
+struct flow *flow_find(const struct flow_key *key, uint8_t *dir);
+
+/**
+ * @brief Look up a flow
+ *
+ * Find the flow matching the key in either direction, create it if needed.
+ *
+ * @param key The flow key as seen on the wire
+ * @param dir Where to store the direction of the packet (FLOW_DIR_*), may be NULL
+ * @return struct flow* The flow, NULL on allocation failure
+ */
+struct flow *flow_lookup(const struct flow_key *key, uint8_t *dir);
+
+/**
+ * @brief Account a packet in its flow
+ *
+ * @param flow The flow
+ * @param dir The direction of the packet (FLOW_DIR_*)
+ * @param bytes The size of the IP packet
+ * @param tcp_flags The TCP flags of the packet, 0 for other protocols
+ */
+void flow_count(struct flow *flow, uint8_t dir, uint32_t bytes,
+                uint8_t tcp_flags);
+
+/**
+ * @brief Set the expiry of the flows
+ *
+ * Without handler, the idle and closed flows are still released.
+ *
+ * @param idle Idle timeout (ns)
+ * @param active Active timeout (ns), a record is cut every active timeout
+ * @param handler Called on every expired flow, and on every flow left at the
+ * end of the capture, NULL if none
+ */
+void flow_expire_set(uint64_t idle, uint64_t active, flow_expire_fn handler);
+
+/**
+ * @brief Advance the clock of the flow table
+ *
+ * Called before every packet, expire the flows about once per second of
+ * capture time.
+ *
+ * @param now The capture time of the packet (ns)
+ */
+void flow_tick(uint64_t now);
+
+/**
+ * @brief Call a function on every flow
+ *
+ * @param fn The function, called with the flow and arg
+ * @param arg The argument given to fn
+ */
+void flow_table_walk(void (*fn)(struct flow *flow, void *arg), void *arg);
+
+/**
+ * @brief Free the flow table
+ *
+ * Release every flow of the table, after giving it to the expiry handler.
+ */
+void flow_table_free(void);
+
+#endif // FLOW_H
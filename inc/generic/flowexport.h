@@ -0,0 +1,52 @@
+/**
+ * @file flowexport.h
+ * @brief Flow export declaration
+ *
+ * This file contains the declaration of the flow export. Every expired flow
+ * is written to a file as a bidirectional record: an IPFIX data record
+ * (RFC 7011, with the reverse elements of RFC 5103) or a JSON object per
+ * line.
+ */
+
+#ifndef FLOWEXPORT_H
+#define FLOWEXPORT_H
+
+#include "flow.h"
+#include "types.h"
+
+/**
+ * @brief Formats of the exported records
+ */
+enum flow_format {
+    FLOW_FORMAT_JSON = 0, /**< One JSON object per line */
+    FLOW_FORMAT_IPFIX     /**< IPFIX messages, as in an IPFIX file (RFC 5655) */
+};
+
+/**
+ * @brief Open the export file
+ *
+ * @param path The file, truncated if it exists
+ * @param format The format of the records (enum flow_format)
+ * @return int 0 on success, -1 on error
+ */
+int flow_export_open(const char *path, int format);
+
+/**
+ * @brief Export a flow record
+ *
+ * The initiator of the flow is the source of the record, the packets and
+ * bytes of the other direction are the reverse counters.
+ *
+ * @param flow The flow
+ * @param reason Why the record ends (enum flow_end)
+ */
+void flow_export_record(const struct flow *flow, int reason);
+
+/**
+ * @brief Close the export file
+ *
+ * Write the pending records and print how many were exported.
+ */
+void flow_export_close(void);
+
+#endif // FLOWEXPORT_H
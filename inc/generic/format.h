@@ -0,0 +1,85 @@
+/**
+ * @file format.h
+ * @brief Address formatters declaration
+ *
+ * This file contains the declaration of the address formatters shared by the
+ * layers. They write in a buffer given by the caller and never allocate.
+ */
+
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stddef.h>
+
+#include "types.h"
+
+#define MAC_STR_LEN 18 /**< Size of a formatted MAC, XX:XX:XX:XX:XX:XX */
+#define IPV4_STR_LEN 16 /**< Size of a formatted IPv4 address, A.B.C.D */
+#define IPV6_STR_LEN 46 /**< Size of a formatted IPv6 address (INET6_ADDRSTRLEN) */
+#define HADDR_MAX_LEN 16 /**< Longest hardware address formatted */
+#define HADDR_STR_LEN (3 * HADDR_MAX_LEN) /**< Size of a formatted hardware address */
+#define LINE_PRINT_LEN 120 /**< Characters of a text line formatted */
+#define LINE_STR_LEN (LINE_PRINT_LEN + 4) /**< Size of a formatted text line, "..." included */
+
+/**
+ * @brief Format a MAC address
+ *
+ * @param mac The 6 bytes of the address
+ * @param buf The destination, at least MAC_STR_LEN bytes
+ * @return char* The destination
+ */
+char *format_mac(const uint8_t *mac, char *buf);
+
+/**
+ * @brief Format an IPv4 address
+ *
+ * @param addr The 4 bytes of the address, in network order
+ * @param buf The destination, at least IPV4_STR_LEN bytes
+ * @return char* The destination
+ */
+char *format_ipv4(const uint8_t *addr, char *buf);
+
+/**
+ * @brief Format an IPv6 address
+ *
+ * @param addr The 16 bytes of the address, in network order
+ * @param buf The destination, at least IPV6_STR_LEN bytes
+ * @return char* The destination
+ */
+char *format_ipv6(const uint8_t *addr, char *buf);
+
+/**
+ * @brief Format an IPv4 or IPv6 address
+ *
+ * @param family AF_INET or AF_INET6
+ * @param addr The address, in network order
+ * @param buf The destination, at least IPV6_STR_LEN bytes
+ * @return char* The destination
+ */
+char *format_addr(uint8_t family, const uint8_t *addr, char *buf);
+
+/**
+ * @brief Format a hardware address of any length
+ *
+ * @param addr The address
+ * @param len The length of the address, only the first HADDR_MAX_LEN bytes
+ * are formatted
+ * @param buf The destination, at least HADDR_STR_LEN bytes
+ * @return char* The destination
+ */
+char *format_haddr(const uint8_t *addr, int len, char *buf);
+
+/**
+ * @brief Format a line of a text protocol
+ *
+ * The line ending is dropped, the non printable characters become dots and
+ * a line longer than LINE_PRINT_LEN characters is cut and ends with "...".
+ *
+ * @param line The line
+ * @param len The length of the line
+ * @param buf The destination, at least LINE_STR_LEN bytes
+ * @return char* The destination
+ */
+char *format_line(const u_char *line, size_t len, char *buf);
+
+#endif // FORMAT_H
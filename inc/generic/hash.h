@@ -0,0 +1,40 @@
+/**
+ * @file hash.h
+ * @brief Byte hash declaration
+ *
+ * This file contains the declaration of the FNV-1a hashes used by the hash
+ * tables of the layers. A key made of several fields is hashed by chaining
+ * the calls, starting from the offset basis.
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+
+#include "types.h"
+
+#define FNV32_OFFSET 2166136261u /**< FNV-1a 32 bits offset basis */
+#define FNV64_OFFSET 14695981039346656037ULL /**< FNV-1a 64 bits offset basis */
+
+/**
+ * @brief Hash bytes with the 32 bits FNV-1a
+ *
+ * @param h The hash of the previous fields, FNV32_OFFSET for the first one
+ * @param data The bytes
+ * @param len The number of bytes
+ * @return uint32_t The hash
+ */
+uint32_t fnv1a32(uint32_t h, const void *data, size_t len);
+
+/**
+ * @brief Hash bytes with the 64 bits FNV-1a
+ *
+ * @param h The hash of the previous fields, FNV64_OFFSET for the first one
+ * @param data The bytes
+ * @param len The number of bytes
+ * @return uint64_t The hash
+ */
+uint64_t fnv1a64(uint64_t h, const void *data, size_t len);
+
+#endif // HASH_H
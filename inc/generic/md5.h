@@ -0,0 +1,29 @@
+/**
+ * @file md5.h
+ * @brief MD5 digest declaration
+ *
+ * This file contains the declaration of the MD5 digest (RFC 1321) used for the
+ * TLS fingerprints.
+ */
+
+#ifndef MD5_H
+#define MD5_H
+
+#include <stddef.h>
+#include "types.h"
+
+#define MD5_DIGEST_LEN 16 /**< Size of a digest in bytes */
+#define MD5_HEX_LEN 33 /**< Size of a digest in hexadecimal, NUL included */
+
+/**
+ * @brief MD5 hexadecimal digest
+ *
+ * Compute the MD5 digest of a buffer and format it in lowercase hexadecimal.
+ *
+ * @param data The buffer
+ * @param len The size of the buffer
+ * @param hex The destination, at least MD5_HEX_LEN bytes
+ */
+void md5_hex(const void *data, size_t len, char hex[MD5_HEX_LEN]);
+
+#endif // MD5_H
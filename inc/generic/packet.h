@@ -0,0 +1,42 @@
+/**
+ * @file packet.h
+ * @brief Packet being analyzed
+ *
+ * This file contains the definition of the information shared by the layers
+ * while a packet is dissected.
+ * The network and transport layers fill it, the upper layers read it.
+ */
+
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <net/ethernet.h>
+#include <stdio.h>
+
+#include "flow.h"
+#include "types.h"
+
+/**
+ * @brief Packet information
+ *
+ * Information gathered on the packet being analyzed. It is reset by
+ * packet_analyzer before every packet. The dissectors print to out, which is
+ * the output of the capture or, with a display filter, a stream holding back
+ * or discarding the output of the packet.
+ */
+struct packet_info {
+    struct flow_key key;    /**< Addresses and ports of the packet */
+    struct flow *flow;      /**< Flow of the packet, NULL if none */
+    uint8_t dir;            /**< Direction of the packet in its flow */
+    uint8_t ttl;            /**< TTL or hop limit of the IP header */
+    uint32_t ip_len;        /**< Size of the IP packet, header included */
+    uint16_t vlan;          /**< VLAN of the frame, 0 if untagged */
+    uint8_t src_mac[ETH_ALEN]; /**< Source MAC of the frame */
+    uint64_t ts;            /**< Capture time of the packet (ns) */
+    const u_char *end;      /**< End of the captured bytes of the frame */
+    FILE *out;              /**< Stream of the decoded output */
+};
+
+extern struct packet_info current_packet; /**< Packet being analyzed */
+
+#endif // PACKET_H
@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <stdint.h>
 // #include "lists.h"
 
 /**
@@ -27,6 +28,35 @@ struct arguments {
     char *filter;
     int verbose;
     int count;
+    int tstamp;     /**< Timestamp mode (enum ts_mode) */
+    int precision;  /**< Digits printed after the second (TS_PRECISION_*) */
+    char *tstamp_type; /**< Timestamp source of a live capture, NULL for default */
+    int arp_watch;  /**< 1 to report ARP events instead of decoding packets */
+    uint64_t groups_at; /**< Time of the multicast listener snapshot (ns), 0 if none */
+    char *display_filter; /**< Filter on the decoded fields, NULL if none */
+    int dfilter_dump; /**< 1 to print the compiled display filter and exit */
+    char *prefilter; /**< Hosts, ports, protocols and VLANs to decode, NULL for all */
+    char *flow_export; /**< File of the expired flow records, NULL if none */
+    int flow_format; /**< Format of the flow records (enum flow_format) */
+    uint32_t flow_idle; /**< Idle timeout of the flows (s) */
+    uint32_t flow_active; /**< Active timeout of the flows (s) */
+    uint64_t file_size; /**< Bytes per capture file, 0 for no limit */
+    uint32_t rotate_seconds; /**< Seconds per capture file, 0 for no limit */
+    uint64_t file_packets; /**< Packets per capture file, 0 for no limit */
+    uint32_t file_count; /**< Capture files of the ring, 0 for no ring */
+    int direct_io; /**< 1 to write the capture files with O_DIRECT */
+    int async_io; /**< 1 to write the files and the output with io_uring */
+    int print; /**< 1 to decode the packets written with -w */
+    int compress; /**< Compression of the capture files (enum compress_codec) */
+    int compress_level; /**< Compression level */
+    int compress_threads; /**< Compression threads, 0 for one per processor */
+    int index; /**< 1 to index the capture files written */
+    char **index_files; /**< Capture files of the index command, NULL if none */
+    int nb_index_files;
+    uint64_t range_start; /**< Start of the packets read (ns), 0 if none */
+    uint64_t range_end; /**< End of the packets read (ns), excluded, 0 if none */
+    char *host; /**< Host of the packets read, NULL for all */
+    char *flow; /**< Conversation of the packets read, NULL for all */
 };
 
 /**
@@ -0,0 +1,62 @@
+/**
+ * @file prefilter.h
+ * @brief Prefilter declaration
+ *
+ * This file contains the declaration of the prefilter. It runs before any
+ * dissector: the fixed-offset Ethernet, VLAN, IP and TCP/UDP headers are
+ * read into a flow key, which is looked up in the sets of wanted hosts,
+ * ports, protocols and VLANs. The packets out of the sets are dropped without
+ * being decoded, nor accounted in the flows and statistics.
+ */
+
+#ifndef PREFILTER_H
+#define PREFILTER_H
+
+#include "flow.h"
+#include "types.h"
+
+#define PREFILTER_MAX_HOSTS 1024 /**< Wanted hosts at most */
+
+/**
+ * @brief Compile the prefilter
+ *
+ * The specification is a comma separated list of host=address,
+ * port=number, proto=name|number and vlan=number items. A packet is kept if
+ * it matches one item of every kind given. The errors are printed on stderr.
+ *
+ * @param spec The specification
+ * @return int 0 on success, -1 if the specification is malformed
+ */
+int prefilter_compile(const char *spec);
+
+/**
+ * @brief Read the flow key of a frame
+ *
+ * @param packet The frame
+ * @param caplen The captured size of the frame
+ * @param key The flow key, ports left untouched if absent
+ * @param vlan The inner VLAN, as kept by the Ethernet layer, 0 if untagged
+ * @param has_ports Set to 1 if the ports were read
+ * @return int 0 if the frame is IP, -1 otherwise
+ */
+int prefilter_key(const u_char *packet, uint32_t caplen, struct flow_key *key,
+                  uint16_t *vlan, int *has_ports);
+
+/**
+ * @brief Check if a packet passes the prefilter
+ *
+ * Always true when no prefilter is set. A frame that is not IP is only
+ * tested against the VLANs.
+ *
+ * @param packet The frame
+ * @param caplen The captured size of the frame
+ * @return int 1 if the packet is to be decoded, 0 if dropped
+ */
+int prefilter_match(const u_char *packet, uint32_t caplen);
+
+/**
+ * @brief Print the number of packets dropped by the prefilter
+ */
+void prefilter_report(void);
+
+#endif // PREFILTER_H
@@ -0,0 +1,67 @@
+/**
+ * @file stats.h
+ * @brief Statistics declaration
+ *
+ * This file contains the declaration of the latency histograms filled by the
+ * dissectors and printed at the end of the capture.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include "types.h"
+
+#define LATENCY_BUCKETS 40 /**< Power of 2 buckets of nanoseconds, up to ~9 min */
+
+/**
+ * @brief Latency histogram
+ *
+ * Durations are in nanoseconds. Bucket i counts the durations in
+ * [2^i, 2^(i+1)) ns, bucket 0 also counts the null durations.
+ */
+struct latency_stats {
+    const char *name;   /**< Name printed in the report */
+    uint64_t count;     /**< Number of samples */
+    uint64_t sum;       /**< Sum of the samples */
+    uint64_t min;       /**< Shortest sample */
+    uint64_t max;       /**< Longest sample */
+    uint64_t buckets[LATENCY_BUCKETS];
+};
+
+/**
+ * @brief Get a latency histogram
+ *
+ * Find the histogram with the given name, create it if needed.
+ *
+ * @param name The name of the histogram, must outlive the capture
+ * @return struct latency_stats* The histogram, NULL if too many histograms
+ */
+struct latency_stats *latency_stats_get(const char *name);
+
+/**
+ * @brief Add a sample to a latency histogram
+ *
+ * @param stats The histogram, may be NULL
+ * @param ns The duration in nanoseconds
+ */
+void latency_add(struct latency_stats *stats, uint64_t ns);
+
+/**
+ * @brief Format a duration
+ *
+ * @param ns The duration in nanoseconds
+ * @param buf The destination
+ * @param size The size of the destination
+ * @return char* The destination
+ */
+char *format_duration(uint64_t ns, char *buf, size_t size);
+
+/**
+ * @brief Print the statistics
+ *
+ * Print every histogram that received samples.
+ */
+void stats_print(void);
+
+#endif // STATS_H
@@ -0,0 +1,60 @@
+/**
+ * @file tee.h
+ * @brief Tee mode declaration
+ *
+ * This file contains the declaration of the tee mode, where the capture is
+ * written to a file and decoded at the same time. The capture thread writes
+ * every packet to the file and copies it in a ring read by a decoder thread,
+ * so that a slow decoder never holds the capture back. When the ring fills
+ * up, the packets are sampled for the decoder instead of being lost for the
+ * file.
+ */
+
+#ifndef TEE_H
+#define TEE_H
+
+#include <pcap.h>
+
+#include "types.h"
+
+#define TEE_RING_LEN (64 << 20) /**< Size of the ring */
+
+/**
+ * @brief Function decoding a packet in the decoder thread
+ *
+ * @param frame The number of the packet in the capture, from 1
+ * @param header The header of the packet
+ * @param packet The packet
+ */
+typedef void (*tee_handler)(uint64_t frame, const struct pcap_pkthdr *header,
+                            const u_char *packet);
+
+/**
+ * @brief Start the decoder thread
+ *
+ * @param handler The function decoding the packets
+ * @param wait 1 to wait for the decoder when the ring is full, for a
+ * capture file, 0 to sample the packets decoded, for a live capture
+ * @return int 0 on success, -1 on error
+ */
+int tee_start(tee_handler handler, int wait);
+
+/**
+ * @brief Hand a packet to the decoder thread
+ *
+ * The packet is copied in the ring, unless it is left out by the sampling.
+ *
+ * @param header The header of the packet
+ * @param packet The packet
+ */
+void tee_push(const struct pcap_pkthdr *header, const u_char *packet);
+
+/**
+ * @brief Stop the decoder thread
+ *
+ * Wait for the packets of the ring to be decoded, then print the number of
+ * packets decoded and left out on stderr.
+ */
+void tee_stop(void);
+
+#endif // TEE_H
@@ -0,0 +1,50 @@
+/**
+ * @file timestamp.h
+ * @brief Timestamp formatter declaration
+ *
+ * This file contains the declaration of the timestamp formatter used to print
+ * the capture time of every packet.
+ */
+
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+#include "types.h"
+
+/**
+ * @brief Timestamp modes
+ *
+ * Ordered like the number of -t given on the command line, as tcpdump does.
+ */
+enum ts_mode {
+    TS_LOCAL = 0,   /**< Date and time in the local time zone (default) */
+    TS_NONE,        /**< -t: no timestamp */
+    TS_EPOCH,       /**< -tt: seconds since the Epoch */
+    TS_DELTA,       /**< -ttt: time since the previous packet */
+    TS_DATE,        /**< -tttt: date and time in the local time zone */
+    TS_RELATIVE,    /**< -ttttt: time since the first packet */
+    TS_UTC          /**< -u: date and time in UTC */
+};
+
+#define TS_PRECISION_MICRO 6 /**< Digits of a microsecond timestamp */
+#define TS_PRECISION_NANO 9 /**< Digits of a nanosecond timestamp */
+
+/**
+ * @brief Set up the timestamp formatter
+ *
+ * @param mode The timestamp mode (enum ts_mode)
+ * @param digits The number of digits after the second (TS_PRECISION_*)
+ */
+void timestamp_init(int mode, int digits);
+
+/**
+ * @brief Format a capture timestamp
+ *
+ * @param sec The seconds since the Epoch
+ * @param nsec The nanoseconds within the second
+ * @return const char* The formatted timestamp, valid until the next call,
+ * NULL in TS_NONE mode
+ */
+const char *timestamp_format(uint64_t sec, uint32_t nsec);
+
+#endif // TIMESTAMP_H
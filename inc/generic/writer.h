@@ -0,0 +1,68 @@
+/**
+ * @file writer.h
+ * @brief Capture writer declaration
+ *
+ * This file contains the declaration of the capture writer used by -w. The
+ * packets are written in the pcap format through the buffers of the
+ * asynchronous writer, optionally compressed and with O_DIRECT, and the files
+ * are rotated by size, time or number of packets, possibly in a ring of a
+ * fixed number of files. Each file may be indexed for the queries of -r.
+ */
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <pcap.h>
+
+#include "types.h"
+
+/**
+ * @brief Options of the capture writer
+ */
+struct writer_options {
+    const char *path;       /**< File name, "-" for stdout */
+    uint64_t file_size;     /**< Uncompressed bytes per file, 0 for no limit */
+    uint32_t seconds;       /**< Seconds per file, 0 for no limit */
+    uint64_t packets;       /**< Packets per file, 0 for no limit */
+    uint32_t files;         /**< Files of the ring, 0 for no ring */
+    int direct;             /**< 1 to bypass the page cache (O_DIRECT) */
+    int codec;              /**< Compression (enum compress_codec) */
+    int level;              /**< Compression level */
+    int index;              /**< 1 to index every file (capindex.h) */
+};
+
+/**
+ * @brief Open the capture writer
+ *
+ * When rotating by time, the first file is opened at the first packet.
+ *
+ * @param options The options, the path must stay valid until writer_close
+ * @param linktype The link type of the capture (DLT_*)
+ * @param snaplen The snapshot length of the capture
+ * @param nano 1 if the timestamps are in nanoseconds
+ * @return int 0 on success, -1 on error
+ */
+int writer_open(const struct writer_options *options, int linktype,
+                int snaplen, int nano);
+
+/**
+ * @brief Write a packet
+ *
+ * Switch to the next file first if the current one is full.
+ *
+ * @param header The header of the packet
+ * @param packet The packet
+ * @return int 0 on success, -1 on error
+ */
+int writer_write(const struct pcap_pkthdr *header, const u_char *packet);
+
+/**
+ * @brief Close the capture writer
+ *
+ * Write the buffered packets and close the current file.
+ *
+ * @return int 0 on success, -1 on error
+ */
+int writer_close(void);
+
+#endif // WRITER_H
@@ -13,6 +13,8 @@
 
 #include "types.h"
 
+#define DHCP_MAX_LEASES (1 << 16) /**< Clients tracked at most */
+
 /**
  * @brief BOOTP header structure
  * 
@@ -37,16 +39,34 @@ struct bootphdr {
     uint8_t bh_file[128];
 };
 
+/**
+ * @brief Check if a packet is a BOOTP/DHCP message
+ * 
+ * @param packet Pointer to the packet
+ * @param data_size Size of the data
+ * @return int 1 if the packet is a BOOTP message, 0 otherwise
+ */
+int is_bootp(const u_char* packet, int data_size);
+
 /**
  * @brief Cast BOOTP header
  * 
- * Get BOOTP header from packet.
+ * Get BOOTP header from packet, decode the DHCP options and track the lease
+ * of the client.
  * 
  * @param packet Pointer to the packet
+ * @param data_size Size of the message
  * @return int 0 on success, -1 on error
  * 
  * @see cast_bootp
  */
-int cast_bootp(const u_char* packet);
+int cast_bootp(const u_char* packet, int data_size);
+
+/**
+ * @brief Free the lease table
+ * 
+ * Release the leases of every client.
+ */
+void bootp_leases_free(void);
 
 #endif // BOOTP_H
\ No newline at end of file
@@ -0,0 +1,64 @@
+/**
+ * @file dhcpv6.h
+ * @brief DHCPv6 Protocol Header File
+ * @ingroup application
+ *
+ * This file contains the definition of the DHCPv6 header.
+ * It provides functions to decode DHCPv6 messages, relayed ones included.
+ */
+
+#ifndef DHCPV6_H
+#define DHCPV6_H
+
+#include "types.h"
+
+#define DHCPV6_CLIENT_PORT 546 /**< Port of the DHCPv6 clients */
+#define DHCPV6_SERVER_PORT 547 /**< Port of the DHCPv6 servers and relays */
+
+/**
+ * @brief DHCPv6 client/server message header
+ */
+struct dhcpv6hdr {
+    uint8_t d6_type;
+    uint8_t d6_xid[3];
+};
+
+/**
+ * @brief DHCPv6 relay message header
+ */
+struct dhcpv6_relayhdr {
+    uint8_t d6r_type;
+    uint8_t d6r_hops;
+    uint8_t d6r_link[16];
+    uint8_t d6r_peer[16];
+};
+
+/**
+ * @brief Check if a packet is a DHCPv6 message
+ *
+ * @param packet Pointer to the packet
+ * @param data_size Size of the data
+ * @return int 1 if the packet is a DHCPv6 message, 0 otherwise
+ */
+int is_dhcpv6(const u_char *packet, int data_size);
+
+/**
+ * @brief Cast DHCPv6 header
+ *
+ * Decode a DHCPv6 message, unwrap the relayed messages and measure the delays
+ * of the server per transaction.
+ *
+ * @param packet Pointer to the message
+ * @param data_size Size of the message
+ * @return int 0 on success, -1 on error
+ */
+int cast_dhcpv6(const u_char *packet, int data_size);
+
+/**
+ * @brief Free the DHCPv6 transactions
+ *
+ * Release the state of every client.
+ */
+void dhcpv6_clients_free(void);
+
+#endif // DHCPV6_H
@@ -35,6 +35,15 @@ struct dnshdr {
     uint16_t dh_additionalRRs;
 };
 
+/**
+ * @brief Check if a packet is a DNS message
+ * 
+ * @param packet Pointer to the packet
+ * @param data_size Size of the data
+ * @return int 1 if the packet is a DNS message, 0 otherwise
+ */
+int is_dns(const u_char* packet, int data_size);
+
 /**
  * @brief Cast DNS header
  * 
@@ -5,7 +5,8 @@
  * @ingroup application
  * 
  * This file contains the definition of the FTP layer.
- * It provides functions to check if a packet is an FTP packet.
+ * It provides functions to check if a packet is an FTP packet, and to follow
+ * the data connections negotiated on the control connection.
  */
 
 #ifndef FTP_H
@@ -21,4 +22,33 @@
  */
 int is_ftp(const u_char *packet);
 
+/**
+ * @brief Handle an FTP control segment
+ *
+ * This function looks for the data connections negotiated by the commands
+ * PORT and EPRT and by the replies to PASV and EPSV, and registers them in
+ * the expectation table.
+ *
+ * @param packet The TCP payload
+ * @param data_size The size of the payload
+ * @return int 0 if the segment is well handled, -1 otherwise
+ */
+int cast_ftp(const u_char *packet, int data_size);
+
+/**
+ * @brief Handle an FTP data segment
+ *
+ * @param packet The TCP payload
+ * @param data_size The size of the payload
+ * @return int 0 if the segment is well handled, -1 otherwise
+ */
+int cast_ftp_data(const u_char *packet, int data_size);
+
+/**
+ * @brief End an FTP data transfer
+ *
+ * Print the throughput of the transfer, once, when its flow is closed.
+ */
+void ftp_data_close(void);
+
 #endif // FTP_H
\ No newline at end of file
@@ -5,7 +5,8 @@
  * @ingroup application
  * 
  * This file contains the definition of the HTTP layer.
- * It provides functions to check if a packet is an HTTP packet.
+ * It provides functions to check if a packet is an HTTP packet and to give
+ * its fields to the display filter.
  */
 
 #ifndef HTTP_H
@@ -21,4 +22,14 @@
  */
 int is_http(const u_char* packet);
 
+/**
+ * @brief Give the fields of an HTTP request to the display filter
+ *
+ * The Host header is looked for up to the end of the headers.
+ *
+ * @param packet The packet, null terminated
+ * @param data_size The size of the packet
+ */
+void http_fields(const u_char *packet, int data_size);
+
 #endif // HTTP_H
\ No newline at end of file
@@ -0,0 +1,39 @@
+/**
+ * @file imap.h
+ * @brief IMAP Protocol Header File
+ * @ingroup application
+ *
+ * This file contains the definition of the IMAP layer.
+ * It provides functions to check if a packet is an IMAP packet and to decode
+ * IMAP sessions.
+ */
+
+#ifndef IMAP_H
+#define IMAP_H
+
+#include "types.h"
+
+/**
+ * @brief Check if a packet is an IMAP packet
+ *
+ * @param packet The packet to check
+ * @param data_size The size of the data
+ * @return int 1 if the packet is an IMAP packet, 0 otherwise
+ */
+int is_imap(const u_char *packet, int data_size);
+
+/**
+ * @brief Handle an IMAP segment
+ *
+ * This function splits the session in command and response lines, skips the
+ * literals by their length and measures the delay between a tagged command
+ * and its tagged response.
+ *
+ * @param packet The TCP payload
+ * @param data_size The size of the payload
+ * @param seq The TCP sequence number of the payload
+ * @return int 0 if the segment is well handled, -1 otherwise
+ */
+int cast_imap(const u_char *packet, int data_size, uint32_t seq);
+
+#endif // IMAP_H
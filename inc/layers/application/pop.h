@@ -5,7 +5,8 @@
  * @ingroup application
  * 
  * This file contains the definition of the POP layer.
- * It provides functions to check if a packet is a POP packet.
+ * It provides functions to check if a packet is a POP packet and to follow
+ * POP3 sessions.
  */
 
 #ifndef POP_H
@@ -21,4 +22,18 @@
  */
 int is_pop(const u_char *packet);
 
+/**
+ * @brief Handle a POP3 segment
+ *
+ * This function splits the session in command and status lines, and follows
+ * the state of the session. The multi-line responses are skipped up to their
+ * terminating line without being printed.
+ *
+ * @param packet The TCP payload
+ * @param data_size The size of the payload
+ * @param seq The TCP sequence number of the payload
+ * @return int 0 if the segment is well handled, -1 otherwise
+ */
+int cast_pop(const u_char *packet, int data_size, uint32_t seq);
+
 #endif // POP_H
\ No newline at end of file
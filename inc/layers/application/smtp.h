@@ -5,7 +5,8 @@
  * @ingroup application
  * 
  * This file contains the definition of the SMTP header.
- * It provides functions to check if a packet is a SMTP packet.
+ * It provides functions to check if a packet is a SMTP packet and to follow
+ * SMTP sessions.
  */
 
 #ifndef SMTP_H
@@ -21,4 +22,18 @@
  */
 int is_smtp(const u_char* packet);
 
+/**
+ * @brief Handle an SMTP segment
+ *
+ * This function splits the session in command and reply lines, and follows
+ * the state of the session. The message body is skipped up to its
+ * terminating line without being printed.
+ *
+ * @param packet The TCP payload
+ * @param data_size The size of the payload
+ * @param seq The TCP sequence number of the payload
+ * @return int 0 if the segment is well handled, -1 otherwise
+ */
+int cast_smtp(const u_char *packet, int data_size, uint32_t seq);
+
 #endif // SMTP_H
\ No newline at end of file
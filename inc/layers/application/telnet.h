@@ -5,7 +5,8 @@
  * @ingroup application
  * 
  * This file contains the definition of the Telnet layer.
- * It provides the function to handle Telnet packets.
+ * It provides the functions to detect Telnet sessions and to decode their
+ * option negotiation.
  */
 
 #ifndef TELNET_H
@@ -15,13 +16,26 @@
 
 
 /**
- * @brief Handle a Telnet packet
- * 
- * This function handles a Telnet packet.
+ * @brief Check if a packet is a Telnet packet
  * 
- * @param packet The packet to handle
+ * @param packet The packet to check
+ * @param data_size The size of the data
+ * @return int 1 if the packet starts with a Telnet command, 0 otherwise
+ */
+int is_telnet(const u_char *packet, int data_size);
+
+/**
+ * @brief Handle a Telnet packet
+ *
+ * This function decodes the commands of the segment, strips them from the
+ * data and prints the data. The echo latency of the keystrokes is measured
+ * while the server echoes.
+ *
+ * @param packet The TCP payload
+ * @param data_size The size of the payload
+ * @param seq The TCP sequence number of the payload
  * @return int 0 if the packet is well handled, -1 otherwise
  */
-int telnet_handler(const u_char *packet);
+int telnet_handler(const u_char *packet, int data_size, uint32_t seq);
 
 #endif // TELNET_H
\ No newline at end of file
@@ -20,6 +20,9 @@
 #include <netinet/if_ether.h>
 #include "types.h"
 
+#define ETHERTYPE_QINQ 0x88a8 /**< 802.1ad service tag */
+#define VLAN_TAG_LEN 4 /**< Size of an 802.1Q tag */
+
 
 /**
  * @brief Handle an Ethernet frame
@@ -27,8 +30,9 @@
  * This function handles an Ethernet frame.
  * 
  * @param packet The packet to handle
+ * @param size The captured size of the frame
  * @return int 0 if the packet is well handled, -1 otherwise
  */
-int cast_ethernet(const u_char* packet);    /* Get ethernet frame from packet then handle the ethernet type */
+int cast_ethernet(const u_char* packet, uint32_t size);    /* Get ethernet frame from packet then handle the ethernet type */
 
 #endif // ETHERNET_H
\ No newline at end of file
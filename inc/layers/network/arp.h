@@ -5,7 +5,8 @@
  * @ingroup network
  * 
  * This file contains the definition of the ARP layer.
- * It provides the function to handle ARP packets.
+ * It provides the function to handle ARP and RARP packets, which share the
+ * same header.
  * 
  * @note There is a large debate on whether the ARP layer should be considered as a network layer or a data link layer. Some people even consider it as a layer 2.5. In this project, we consider it as a network layer.
  */
@@ -25,13 +26,49 @@
 
 
 /**
- * @brief Handle an ARP packet
+ * @brief ARP or RARP packet
+ *
+ * The addresses point into the packet, nothing is copied.
+ */
+struct arp_info {
+    uint16_t hrd;       /**< Hardware type */
+    uint16_t pro;       /**< Protocol type */
+    uint16_t op;        /**< Operation code (ARPOP_*) */
+    uint8_t hln;        /**< Length of a hardware address */
+    uint8_t pln;        /**< Length of a protocol address */
+    const uint8_t *sha; /**< Sender hardware address */
+    const uint8_t *spa; /**< Sender protocol address */
+    const uint8_t *tha; /**< Target hardware address */
+    const uint8_t *tpa; /**< Target protocol address */
+};
+
+/**
+ * @brief Parse an ARP or RARP packet
+ *
+ * @param packet The ARP header
+ * @param size The captured size from the ARP header
+ * @param info The parsed packet
+ * @return int 0 on success, -1 if the packet is truncated
+ */
+int arp_parse(const u_char *packet, uint32_t size, struct arp_info *info);
+
+/**
+ * @brief Check if a packet maps an IPv4 address on Ethernet
+ *
+ * @param info The parsed packet
+ * @return int 1 if the addresses are a MAC and an IPv4 address, 0 otherwise
+ */
+int arp_is_ether_ipv4(const struct arp_info *info);
+
+/**
+ * @brief Handle an ARP or RARP packet
  * 
- * This function handles an ARP packet.
+ * This function handles an ARP or RARP packet and feeds the binding table.
  * 
  * @param packet The packet to handle
+ * @param size The captured size from the ARP header
  * @return int 0 if the packet is well handled, -1 otherwise
  */
-int cast_arp(const u_char *packet);
+int cast_arp(const u_char *packet, uint32_t size);
 
-#endif // ARP_H
\ No newline at end of file
+#endif // ARP_H
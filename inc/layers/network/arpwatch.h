@@ -0,0 +1,52 @@
+/**
+ * @file arpwatch.h
+ * @brief ARP analysis declaration
+ * @ingroup network
+ *
+ * This file contains the declaration of the ARP analysis mode. Instead of
+ * printing every ARP frame, it keeps the IP to MAC bindings and the rate of
+ * every sender, and reports storms, duplicate IP conflicts and binding flips
+ * as aggregated events.
+ */
+
+#ifndef ARPWATCH_H
+#define ARPWATCH_H
+
+#include "arp.h"
+#include "types.h"
+
+#define ARP_RATE 15 /**< Sustained ARP frames per second allowed per sender */
+#define ARP_BURST 30 /**< ARP frames a sender may send at once */
+#define ARP_CONFLICT_WINDOW 10000000000ULL /**< A binding seen less than 10 s ago is still in use (ns) */
+#define ARP_MAX_ENTRIES (1 << 20) /**< Bindings or senders tracked at most */
+
+/**
+ * @brief Analyze an ARP or RARP packet
+ *
+ * Update the binding of the sender and its rate, print an event when a storm,
+ * a conflict or a flip begins.
+ *
+ * @param info The parsed packet
+ * @param ts The capture time of the packet (ns)
+ * @return int 0 if the packet was analyzed, -1 if it doesn't map an IPv4
+ * address on Ethernet
+ */
+int arp_watch(const struct arp_info *info, uint64_t ts);
+
+/**
+ * @brief Print the ARP analysis report
+ *
+ * Close the ongoing storms and summarize the conflicts and flips per address.
+ * Nothing is printed if no ARP packet was analyzed.
+ *
+ * @param events_only 1 to print nothing if there was no storm, conflict or
+ * flip
+ */
+void arp_watch_report(int events_only);
+
+/**
+ * @brief Free the ARP analysis tables
+ */
+void arp_watch_free(void);
+
+#endif // ARPWATCH_H
@@ -0,0 +1,100 @@
+/**
+ * @file echo.h
+ * @brief ICMP echo and traceroute tracking declaration
+ * @ingroup network
+ *
+ * This file contains the declaration of the echo correlation: ICMP and ICMPv6
+ * echo requests are matched with their replies to measure the round trip
+ * time, the loss and the jitter per path, and the time exceeded errors are
+ * gathered into the hop list of the traced paths. The probes of a traceroute
+ * are ICMP echo requests or UDP datagrams sent to the traceroute ports.
+ */
+
+#ifndef ECHO_H
+#define ECHO_H
+
+#include "flow.h"
+#include "types.h"
+
+#define ECHO_TIMEOUT 10000000000ULL /**< A request unanswered for 10 s is lost (ns) */
+#define ECHO_MAX_PENDING (1 << 16) /**< Requests and probes waiting at most */
+#define ECHO_MAX_PATHS (1 << 16) /**< Paths tracked at most */
+#define TRACE_MAX_HOPS 32 /**< Hops kept per traced path */
+#define TRACE_UDP_PORT_MIN 33434 /**< First port of the UDP traceroute probes */
+#define TRACE_UDP_PORT_MAX 33534 /**< Last port of the UDP traceroute probes */
+
+/**
+ * @brief Record an echo request
+ *
+ * The addresses, TTL and time of the request are taken from current_packet.
+ *
+ * @param id The identifier of the request
+ * @param seq The sequence number of the request
+ */
+void echo_request(uint16_t id, uint16_t seq);
+
+/**
+ * @brief Match an echo reply with its request
+ *
+ * Print the round trip time if the request was seen.
+ *
+ * @param id The identifier of the reply
+ * @param seq The sequence number of the reply
+ */
+void echo_reply(uint16_t id, uint16_t seq);
+
+/**
+ * @brief Record a UDP traceroute probe
+ *
+ * The datagram in current_packet is kept as a probe if its destination port
+ * is a traceroute port.
+ */
+void echo_udp_probe(void);
+
+/**
+ * @brief Record a hop of a traced path
+ *
+ * The router is the sender of the time exceeded error in current_packet.
+ * A quoted UDP probe is matched by its ports.
+ *
+ * @param probe The key of the quoted probe
+ * @param id The identifier of a quoted echo request, 0 otherwise
+ * @param seq The sequence number of a quoted echo request, 0 otherwise
+ */
+void echo_time_exceeded(const struct flow_key *probe, uint16_t id,
+                        uint16_t seq);
+
+/**
+ * @brief Record the end of a UDP traceroute
+ *
+ * The destination answers the last probes with a port unreachable error,
+ * its sender in current_packet becomes the last hop of the path.
+ *
+ * @param probe The key of the quoted probe
+ */
+void echo_unreachable(const struct flow_key *probe);
+
+/**
+ * @brief Advance the clock of the echo tables
+ *
+ * Called before every packet, drop the requests and probes unanswered for
+ * ECHO_TIMEOUT about once per second of capture time.
+ *
+ * @param now The capture time of the packet (ns)
+ */
+void echo_tick(uint64_t now);
+
+/**
+ * @brief Print the echo and traceroute report
+ *
+ * Print the RTT, loss and jitter of every pinged path, then the hops of every
+ * traced path, and the requests that didn't fit in the tables.
+ */
+void echo_report(void);
+
+/**
+ * @brief Free the echo tables
+ */
+void echo_free(void);
+
+#endif // ECHO_H
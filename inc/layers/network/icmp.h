@@ -29,8 +29,9 @@
  * This function handles an ICMP packet.
  * 
  * @param packet The packet to handle
+ * @param size The size of the ICMP message
  * @return int 0 if the packet is well handled, -1 otherwise
  */
-int cast_icmp(const u_char *packet);
+int cast_icmp(const u_char *packet, int size);
 
 #endif // ICMP_H
\ No newline at end of file
@@ -0,0 +1,48 @@
+/**
+ * @file icmperr.h
+ * @brief ICMP error quoting declaration
+ * @ingroup network
+ *
+ * This file contains the declaration of the decoder of the datagram quoted by
+ * the ICMP and ICMPv6 error messages. Errors about a TCP or UDP datagram are
+ * attributed to its flow.
+ */
+
+#ifndef ICMPERR_H
+#define ICMPERR_H
+
+#include "types.h"
+
+/**
+ * @brief Kinds of ICMP errors counted per flow
+ */
+enum icmp_error {
+    ICMP_ERR_OTHER = 0, /**< Only printed */
+    ICMP_ERR_UNREACH,   /**< Destination unreachable */
+    ICMP_ERR_TOO_BIG,   /**< Fragmentation needed or packet too big */
+    ICMP_ERR_TIME_EXCEEDED /**< Not counted per flow, gives a traceroute hop */
+};
+
+/**
+ * @brief Decode the datagram quoted by an ICMP error
+ *
+ * Print the IP header and the first transport bytes of the datagram that
+ * caused the error, and count the error in the flow of the datagram.
+ *
+ * @param quote The quoted datagram, starting with its IP header
+ * @param size The size of the quote
+ * @param kind The kind of error (enum icmp_error)
+ * @param mtu The MTU reported by a ICMP_ERR_TOO_BIG error, 0 if unknown
+ * @return int 0 on success, -1 if the quote is truncated or unknown
+ */
+int icmp_quote(const u_char *quote, int size, int kind, uint32_t mtu);
+
+/**
+ * @brief Print the ICMP errors per flow
+ *
+ * Print the flows that received destination unreachable or packet too big
+ * errors, with their smallest reported MTU.
+ */
+void icmp_errors_report(void);
+
+#endif // ICMPERR_H
@@ -40,8 +40,9 @@
  * This function handles an ICMPv6 packet.
  * 
  * @param packet The packet to handle
+ * @param size The size of the ICMPv6 message
  * @return int 0 if the packet is well handled, -1 otherwise
  */
-int cast_icmp6(const u_char *packet);
+int cast_icmp6(const u_char *packet, int size);
 
 #endif // ICMPv6_H
\ No newline at end of file
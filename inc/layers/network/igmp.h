@@ -0,0 +1,48 @@
+/**
+ * @file igmp.h
+ * @brief IGMP and MLD declaration
+ * @ingroup network
+ *
+ * This file contains the declaration of the IGMP (v1 to v3) and MLD (v1 and
+ * v2) decoders. Both share the layout of their version 3 and version 2
+ * membership records, which feed the multicast group membership table.
+ */
+
+#ifndef IGMP_H
+#define IGMP_H
+
+#include <netinet/icmp6.h>
+#include <netinet/igmp.h>
+#include "types.h"
+
+#define IGMP_V3_MEMBERSHIP_REPORT 0x22 /**< IGMPv3 membership report */
+#define IGMP_V3_QUERY_MINLEN 12 /**< Size of an IGMPv3 query without sources */
+#define MLD_V2_LISTENER_REPORT 143 /**< MLDv2 listener report */
+#define MLD_MINLEN 24 /**< Size of an MLDv1 message */
+#define MLD_V2_QUERY_MINLEN 28 /**< Size of an MLDv2 query without sources */
+
+/**
+ * @brief Handle an IGMP packet
+ *
+ * Print the message and its membership records, and account them in the
+ * multicast group membership table.
+ *
+ * @param packet The packet to handle
+ * @param size The size of the IGMP message
+ * @return int 0 if the packet is well handled, -1 if truncated
+ */
+int cast_igmp(const u_char *packet, int size);
+
+/**
+ * @brief Decode an MLD message
+ *
+ * Print the group or the membership records of a query, report or done
+ * message, and account them in the multicast group membership table.
+ *
+ * @param icmp6 The ICMPv6 header of the message
+ * @param size The size of the message
+ * @return int 0 if the message is well decoded, -1 if truncated
+ */
+int cast_mld(const struct icmp6_hdr *icmp6, int size);
+
+#endif // IGMP_H
@@ -0,0 +1,95 @@
+/**
+ * @file mcast.h
+ * @brief Multicast group membership declaration
+ * @ingroup network
+ *
+ * This file contains the declaration of the multicast group membership
+ * table. It is built from the IGMP and MLD reports per VLAN, measures how
+ * long the traffic of a group takes to start after a join and to stop after
+ * the last leave, and prints the listeners of every group at a given time.
+ */
+
+#ifndef MCAST_H
+#define MCAST_H
+
+#include "types.h"
+
+#define MCAST_BUCKETS 4096 /**< Buckets of the group table */
+#define MCAST_MEMBERSHIP_INTERVAL 260000000000ULL /**< A listener not heard from for 260 s left (ns) */
+#define MCAST_IDLE 1000000000ULL /**< A group without data for 1 s is not flowing (ns) */
+#define MCAST_PRUNE_TIMEOUT 10000000000ULL /**< Data 10 s after the last leave is never pruned (ns) */
+#define MCAST_MAX_QUERIERS 64 /**< Queriers tracked at most */
+
+/**
+ * @brief Membership records
+ *
+ * The first six are the record types of IGMPv3 and MLDv2, the last two stand
+ * for the reports and leaves of the previous versions.
+ */
+enum mcast_record {
+    MCAST_IS_INCLUDE = 1,   /**< Current state, listening to the sources */
+    MCAST_IS_EXCLUDE,       /**< Current state, listening except the sources */
+    MCAST_TO_INCLUDE,       /**< Change to include mode */
+    MCAST_TO_EXCLUDE,       /**< Change to exclude mode */
+    MCAST_ALLOW,            /**< Sources added */
+    MCAST_BLOCK,            /**< Sources removed */
+    MCAST_JOIN,             /**< IGMPv1/v2 report or MLDv1 report */
+    MCAST_LEAVE             /**< IGMPv2 leave or MLDv1 done */
+};
+
+/**
+ * @brief Account a membership record
+ *
+ * The listener, family, VLAN and time are taken from current_packet. The
+ * link-local groups are ignored.
+ *
+ * @param group The group, in network order
+ * @param type The record type (enum mcast_record)
+ * @param nb_sources The number of sources of the record
+ */
+void mcast_record(const uint8_t *group, int type, int nb_sources);
+
+/**
+ * @brief Account a membership query
+ *
+ * The querier is the source of current_packet.
+ */
+void mcast_query(void);
+
+/**
+ * @brief Account a packet sent to a multicast group
+ *
+ * Print the join latency if this is the first packet after a join.
+ *
+ * @param size The size of the IP payload
+ */
+void mcast_data(int size);
+
+/**
+ * @brief Set the time of the listener snapshot
+ *
+ * @param ts The time (ns), 0 for no snapshot
+ */
+void mcast_snapshot_at(uint64_t ts);
+
+/**
+ * @brief Print the listener snapshot when its time has come
+ *
+ * @param ts The capture time of the current packet (ns)
+ */
+void mcast_tick(uint64_t ts);
+
+/**
+ * @brief Print the multicast report
+ *
+ * Print the pending snapshot, the queriers, and the groups with their
+ * listeners. Nothing is printed if no membership message was seen.
+ */
+void mcast_report(void);
+
+/**
+ * @brief Free the group table
+ */
+void mcast_free(void);
+
+#endif // MCAST_H
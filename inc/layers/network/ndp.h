@@ -0,0 +1,57 @@
+/**
+ * @file ndp.h
+ * @brief ICMPv6 Neighbor Discovery declaration
+ * @ingroup network
+ *
+ * This file contains the declaration of the Neighbor Discovery decoder. The
+ * messages and their options are decoded, and a passive neighbor and router
+ * cache is rebuilt from them: the IPv6 counterpart of the ARP bindings, with
+ * router advertisement floods and duplicate address detection.
+ */
+
+#ifndef NDP_H
+#define NDP_H
+
+#include <netinet/icmp6.h>
+#include "types.h"
+
+#define ND_OPT_RDNSS 25 /**< Recursive DNS server option (RFC 8106) */
+#define ND_HOP_LIMIT 255 /**< Hop limit of the messages sent on the link */
+#define ND_RA_RATE 10 /**< Sustained router advertisements per second on the link */
+#define ND_RA_BURST 20 /**< Router advertisements allowed at once */
+#define ND_CONFLICT_WINDOW 10000000000ULL /**< A binding seen less than 10 s ago is still in use (ns) */
+#define ND_DAD_WINDOW 3000000000ULL /**< An advertisement less than 3 s after a DAD probe defends the address (ns) */
+#define ND_MAX_ENTRIES (1 << 20) /**< Neighbors tracked at most */
+#define ND_MAX_ROUTERS 64 /**< Routers tracked at most */
+#define ND_MAX_PREFIXES 8 /**< Prefixes kept per router */
+#define ND_MAX_DNS 3 /**< DNS servers kept per router */
+
+/**
+ * @brief Decode a Neighbor Discovery message
+ *
+ * Print the fixed fields and the options of a router solicitation, router
+ * advertisement, neighbor solicitation, neighbor advertisement or redirect,
+ * then update the neighbor and router cache. The addresses and hop limit are
+ * taken from current_packet.
+ *
+ * @param icmp6 The ICMPv6 header of the message
+ * @param size The size of the message
+ * @return int 0 if the message is well decoded, -1 if it is truncated
+ */
+int cast_ndp(const struct icmp6_hdr *icmp6, int size);
+
+/**
+ * @brief Print the Neighbor Discovery report
+ *
+ * Close an ongoing flood, list the routers with their prefixes and DNS
+ * servers, and the neighbors that had a conflict or a flip. Nothing is
+ * printed if no Neighbor Discovery message was decoded.
+ */
+void ndp_report(void);
+
+/**
+ * @brief Free the neighbor cache
+ */
+void ndp_free(void);
+
+#endif // NDP_H
@@ -3,26 +3,71 @@
  * @file tls.h
  * @brief TLS layer
  * @ingroup session
- * 
+ *
  * This file contains the definition of the TLS layer.
+ * It provides functions to recognize TLS records and to decode the handshake
+ * of a TLS connection.
  */
 
 #ifndef TLS_H
 #define TLS_H
 
+#include <endian.h>
 #include <stdint.h>
+#include "types.h"
 
 
 /**
  * @brief TLS record layer
- * 
- * This structure represents the TLS record layer.
+ *
+ * This structure represents the TLS record layer. Multi-byte fields are in
+ * network byte order.
  */
 struct tlshdr {
     uint8_t tls_ct;
     uint16_t tls_lv;
     uint16_t tls_len;
 } __attribute__((packed));
-#define TLS_V(tls) (((tls)->tls_lv & 0x00FF)) /**< Get the TLS version */
+#define TLS_V(tls) (be16toh((tls)->tls_lv)) /**< Get the TLS version */
+#define TLS_LEN(tls) (be16toh((tls)->tls_len)) /**< Get the record length */
 
-#endif // TLS_H
\ No newline at end of file
+/**
+ * @brief TLS record content types
+ */
+#define TLS_CT_CHANGE_CIPHER_SPEC 20
+#define TLS_CT_ALERT 21
+#define TLS_CT_HANDSHAKE 22
+#define TLS_CT_APPLICATION_DATA 23
+
+/**
+ * @brief TLS handshake message types
+ */
+#define TLS_HS_CLIENT_HELLO 1
+#define TLS_HS_SERVER_HELLO 2
+
+#define TLS_MAX_RECORD 18432 /**< 2^14 bytes of data plus expansion */
+
+/**
+ * @brief Check if a packet starts with a TLS record
+ *
+ * @param packet The packet to check
+ * @param data_size The size of the data
+ * @return int 1 if the packet starts with a TLS record header, 0 otherwise
+ */
+int is_tls(const u_char *packet, int data_size);
+
+/**
+ * @brief Handle a TLS segment
+ *
+ * This function reassembles the records of the connection and decodes the
+ * ClientHello and ServerHello messages. Once the handshake is over, the
+ * segments are only counted.
+ *
+ * @param packet The TCP payload
+ * @param data_size The size of the payload
+ * @param seq The TCP sequence number of the payload
+ * @return int 0 if the segment is well handled, -1 otherwise
+ */
+int cast_tls(const u_char *packet, int data_size, uint32_t seq);
+
+#endif // TLS_H
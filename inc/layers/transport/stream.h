@@ -0,0 +1,84 @@
+/**
+ * @file stream.h
+ * @brief TCP stream reassembly
+ * @ingroup transport
+ *
+ * This file contains the definition of the reassembly buffer used by the
+ * dissectors which need the payload of a TCP direction as a contiguous stream.
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h>
+#include "types.h"
+
+#define STREAM_MAX_LEN 65536 /**< Maximum number of bytes waiting in a stream */
+
+/**
+ * @brief Reassembly buffer
+ *
+ * Bytes received in order and not consumed yet by the dissector.
+ */
+struct stream {
+    u_char *buf;        /**< Bytes waiting to be parsed */
+    size_t len;         /**< Number of bytes waiting */
+    size_t cap;         /**< Size of the buffer */
+    size_t skip;        /**< Bytes to drop as they arrive, without buffering */
+    uint32_t next_seq;  /**< Sequence number expected next */
+    uint8_t synced;     /**< 1 once next_seq is known */
+};
+
+/**
+ * @brief Append bytes to a stream
+ *
+ * @param stream The stream
+ * @param data The bytes to append
+ * @param len The number of bytes
+ * @return int 0 on success, -1 if the stream would exceed STREAM_MAX_LEN
+ */
+int stream_push(struct stream *stream, const u_char *data, size_t len);
+
+/**
+ * @brief Append a TCP segment to a stream
+ *
+ * Retransmitted bytes are dropped. A segment starting after the expected
+ * sequence number means bytes were lost: the stream can't be parsed anymore.
+ * Bytes still to skip are dropped instead of being appended.
+ *
+ * @param stream The stream
+ * @param seq The sequence number of the segment
+ * @param data The payload of the segment
+ * @param len The length of the payload
+ * @return int Number of new bytes appended, -1 on a gap or overflow
+ */
+int stream_append(struct stream *stream, uint32_t seq, const u_char *data,
+                  int len);
+
+/**
+ * @brief Drop bytes from the front of a stream
+ *
+ * @param stream The stream
+ * @param len The number of bytes parsed by the dissector
+ */
+void stream_consume(struct stream *stream, size_t len);
+
+/**
+ * @brief Skip bytes of a stream
+ *
+ * Drop the bytes waiting in the stream, and the ones still to come, without
+ * buffering them. Used to jump over length-prefixed data.
+ *
+ * @param stream The stream
+ * @param len The number of bytes to skip
+ */
+void stream_skip(struct stream *stream, size_t len);
+
+/**
+ * @brief Release the buffer of a stream
+ *
+ * @param stream The stream
+ */
+void stream_free(struct stream *stream);
+
+#endif // STREAM_H
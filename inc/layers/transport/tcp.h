@@ -26,7 +26,7 @@
  * This function handles a TCP packet.
  * 
  * @param packet The packet to handle
- * @param remain_size The remaining size of the packet
+ * @param remain_size The captured size of the IP payload
  * @return int 0 if the packet is well handled, -1 otherwise
  */
 int cast_tcp(const u_char *packet, int remain_size);
@@ -20,8 +20,9 @@
  * This function handles a UDP packet.
  * 
  * @param packet The packet to handle
+ * @param size The captured size of the IP payload
  * @return int 0 if the packet is well handled, -1 otherwise
  */
-int cast_udp(const u_char* packet);
+int cast_udp(const u_char* packet, int size);
 
 #endif // UDP_H
\ No newline at end of file
@@ -0,0 +1,606 @@
+/**
+ * @file aio.c
+ * @brief Asynchronous writer definition
+ *
+ * This file contains the definition of the asynchronous writer. The io_uring
+ * rings are set up with the raw system calls, and the buffers of the pool are
+ * registered so that the kernel doesn't map them at every write. A write to a
+ * seekable file carries its own offset, so the writes of a file may complete
+ * in any order. A pipe or a terminal has one write in flight at most, the
+ * next buffers being queued until it completes. A short write is submitted
+ * again for the remaining bytes.
+ *
+ * @see aio.h
+ * @see aio_buf_write
+ */
+
+#define _GNU_SOURCE // fopencookie
+
+// General libraries
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define AIO_URING 1
+#endif
+
+// Local header files
+#include "aio.h"
+
+static struct aio_buf pool[AIO_DEPTH];  /**< Buffers */
+static struct aio_buf *free_bufs = NULL; /**< Free buffers */
+static int pool_ready = 0;
+static unsigned long nb_writes = 0;     /**< Writes submitted */
+static uint64_t nb_bytes = 0;           /**< Bytes written */
+static unsigned long nb_waits = 0;      /**< Waits for a free buffer */
+
+#ifdef AIO_URING
+static int ring_fd = -1;                /**< io_uring instance, -1 if none */
+static int registered = 0;              /**< 1 if the buffers are registered */
+static void *sq_ring = MAP_FAILED;      /**< Submission ring */
+static void *cq_ring = MAP_FAILED;      /**< Completion ring */
+static size_t sq_ring_len = 0;
+static size_t cq_ring_len = 0;
+static struct io_uring_sqe *sqes = MAP_FAILED; /**< Submission entries */
+static size_t sqes_len = 0;
+static unsigned *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+
+
+/**
+ * @brief Set up the io_uring instance
+ *
+ * @return int 0 on success, -1 if io_uring is not available
+ */
+static int uring_setup(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd = syscall(__NR_io_uring_setup, AIO_DEPTH, &params);
+    if (ring_fd < 0)
+        return -1;
+
+    sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_len = params.cq_off.cqes +
+                  params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_ring_len > sq_ring_len)
+            sq_ring_len = cq_ring_len;
+        cq_ring_len = sq_ring_len;
+    }
+    sq_ring = mmap(NULL, sq_ring_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED)
+        return -1;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap(NULL, cq_ring_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED)
+            return -1;
+    }
+    sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        return -1;
+
+    sq_tail = (unsigned *)((char *)sq_ring + params.sq_off.tail);
+    sq_mask = (unsigned *)((char *)sq_ring + params.sq_off.ring_mask);
+    sq_array = (unsigned *)((char *)sq_ring + params.sq_off.array);
+    cq_head = (unsigned *)((char *)cq_ring + params.cq_off.head);
+    cq_tail = (unsigned *)((char *)cq_ring + params.cq_off.tail);
+    cq_mask = (unsigned *)((char *)cq_ring + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)((char *)cq_ring + params.cq_off.cqes);
+
+    // Fails when the buffers exceed RLIMIT_MEMLOCK, plain writes are used
+    struct iovec iov[AIO_DEPTH];
+    for (int i = 0; i < AIO_DEPTH; i++) {
+        iov[i].iov_base = pool[i].data;
+        iov[i].iov_len = AIO_BUF_LEN;
+    }
+    registered = syscall(__NR_io_uring_register, ring_fd,
+                         IORING_REGISTER_BUFFERS, iov, AIO_DEPTH) == 0;
+    return 0;
+}
+
+
+/**
+ * @brief Release the io_uring instance
+ */
+static void uring_free(void)
+{
+    if (sqes != MAP_FAILED)
+        munmap(sqes, sqes_len);
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_len);
+    if (sq_ring != MAP_FAILED)
+        munmap(sq_ring, sq_ring_len);
+    if (ring_fd >= 0)
+        close(ring_fd);
+    sqes = MAP_FAILED;
+    sq_ring = cq_ring = MAP_FAILED;
+    ring_fd = -1;
+    registered = 0;
+}
+#endif
+
+
+/**
+ * @brief Give a buffer back to the pool
+ *
+ * @param buf The buffer
+ */
+static void buf_release(struct aio_buf *buf)
+{
+    buf->file = NULL;
+    buf->next = free_bufs;
+    free_bufs = buf;
+}
+
+
+/**
+ * @brief Write a buffer synchronously
+ *
+ * @param buf The buffer
+ */
+static void write_sync(struct aio_buf *buf)
+{
+    struct aio_file *file = buf->file;
+    while (buf->done < buf->len) {
+        ssize_t n = write(file->fd, buf->data + buf->done,
+                          buf->len - buf->done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            if (file->error == 0)
+                file->error = errno;
+            break;
+        }
+        buf->done += n;
+    }
+    buf_release(buf);
+}
+
+
+/**
+ * @brief Submit the write of a buffer
+ *
+ * @param buf The buffer, its bytes from done to len are written
+ */
+static void submit(struct aio_buf *buf)
+{
+    struct aio_file *file = buf->file;
+    file->inflight++;
+#ifdef AIO_URING
+    if (ring_fd >= 0) {
+        unsigned tail = *sq_tail;
+        unsigned index = tail & *sq_mask;
+        struct io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd = file->fd;
+        sqe->addr = (uintptr_t)(buf->data + buf->done);
+        sqe->len = buf->len - buf->done;
+        sqe->off = file->seekable ? buf->offset + buf->done : (uint64_t)-1;
+        sqe->buf_index = buf->index;
+        sqe->user_data = (uintptr_t)buf;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        while (syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, NULL, 0) < 0 &&
+               errno == EINTR)
+            ;
+        return;
+    }
+#endif
+    file->inflight--;
+    write_sync(buf);
+}
+
+
+#ifdef AIO_URING
+/**
+ * @brief Handle the completion of a write
+ *
+ * @param buf The buffer
+ * @param res The result of the write, bytes written or -errno
+ */
+static void complete(struct aio_buf *buf, int res)
+{
+    struct aio_file *file = buf->file;
+    file->inflight--;
+    if (res == -EINTR || res == -EAGAIN) {
+        submit(buf);
+        return;
+    }
+    if (res < 0 || (res == 0 && buf->done < buf->len)) {
+        if (file->error == 0)
+            file->error = res < 0 ? -res : EIO;
+        buf_release(buf);
+    } else if (buf->done + res < buf->len) {
+        buf->done += res; // Short write
+        submit(buf);
+        return;
+    } else {
+        buf_release(buf);
+    }
+
+    if (file->queue != NULL && file->inflight == 0) {
+        struct aio_buf *next = file->queue;
+        file->queue = next->next;
+        submit(next);
+    }
+}
+
+
+/**
+ * @brief Handle the completed writes
+ *
+ * @param wait 1 to wait for a completion if none is ready
+ */
+static void reap(int wait)
+{
+    unsigned head = *cq_head;
+    if (wait && head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        while (syscall(__NR_io_uring_enter, ring_fd, 0, 1,
+                       IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+               errno == EINTR)
+            ;
+    }
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        struct aio_buf *buf = (struct aio_buf *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        head++;
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        complete(buf, res);
+    }
+}
+#endif
+
+
+/**
+ * @brief Initialize the pool
+ *
+ * @param uring 1 to write with io_uring, 0 to write synchronously
+ * @return int 0 on success, -1 on allocation failure. Without io_uring
+ * support, a warning is printed and the writes are synchronous.
+ */
+int aio_init(int uring)
+{
+    if (pool_ready)
+        return 0;
+    for (int i = 0; i < AIO_DEPTH; i++) {
+        pool[i].data = aligned_alloc(AIO_ALIGN, AIO_BUF_LEN);
+        if (pool[i].data == NULL) {
+            perror("aligned_alloc");
+            aio_free();
+            return -1;
+        }
+        pool[i].index = i;
+        buf_release(&pool[i]);
+    }
+    pool_ready = 1;
+
+    if (!uring)
+        return 0;
+#ifdef AIO_URING
+    if (uring_setup() == 0)
+        return 0;
+    uring_free();
+#endif
+    fprintf(stderr, "io_uring not available, writing synchronously\n");
+    return 0;
+}
+
+
+/**
+ * @brief Check if the writes go through io_uring
+ *
+ * @return int 1 with io_uring, 0 otherwise
+ */
+int aio_async(void)
+{
+#ifdef AIO_URING
+    return ring_fd >= 0;
+#else
+    return 0;
+#endif
+}
+
+
+/**
+ * @brief Start writing a file descriptor through the pool
+ *
+ * @param fd The file descriptor, positioned where to write
+ * @return struct aio_file* The file, NULL on allocation failure
+ */
+struct aio_file *aio_attach(int fd)
+{
+    struct aio_file *file = calloc(1, sizeof(struct aio_file));
+    if (file == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    file->fd = fd;
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    file->seekable = offset >= 0;
+    file->offset = offset >= 0 ? (uint64_t)offset : 0;
+    file->interactive = isatty(fd);
+    return file;
+}
+
+
+/**
+ * @brief Get a free buffer
+ *
+ * Wait for a write to complete if every buffer is in flight.
+ *
+ * @return struct aio_buf* The buffer, empty
+ */
+struct aio_buf *aio_buf_get(void)
+{
+#ifdef AIO_URING
+    if (ring_fd >= 0) {
+        reap(0);
+        if (free_bufs == NULL)
+            nb_waits++;
+        while (free_bufs == NULL)
+            reap(1);
+    }
+#endif
+    struct aio_buf *buf = free_bufs;
+    free_bufs = buf->next;
+    buf->len = buf->done = 0;
+    buf->next = NULL;
+    return buf;
+}
+
+
+/**
+ * @brief Write a buffer
+ *
+ * The buffer goes back to the pool once written.
+ *
+ * @param file The file
+ * @param buf The buffer, its len bytes are written at the end of the file
+ */
+void aio_buf_write(struct aio_file *file, struct aio_buf *buf)
+{
+    buf->file = file;
+    buf->done = 0;
+    buf->offset = file->offset;
+    file->offset += buf->len;
+    nb_writes++;
+    nb_bytes += buf->len;
+    if (file->seekable || file->inflight == 0) {
+        submit(buf);
+    } else { // Written after the previous buffers
+        buf->next = NULL;
+        if (file->queue == NULL)
+            file->queue = buf;
+        else
+            file->queue_tail->next = buf;
+        file->queue_tail = buf;
+    }
+}
+
+
+/**
+ * @brief Append bytes to a file
+ *
+ * The bytes are copied in the buffer being filled, written when full.
+ *
+ * @param file The file
+ * @param data The bytes
+ * @param len The number of bytes
+ */
+void aio_append(struct aio_file *file, const void *data, size_t len)
+{
+    const u_char *p = data;
+    while (len > 0) {
+        if (file->fill == NULL)
+            file->fill = aio_buf_get();
+        struct aio_buf *buf = file->fill;
+        size_t n = AIO_BUF_LEN - buf->len;
+        if (n > len)
+            n = len;
+        memcpy(buf->data + buf->len, p, n);
+        buf->len += n;
+        p += n;
+        len -= n;
+        if (buf->len == AIO_BUF_LEN)
+            aio_flush(file);
+    }
+}
+
+
+/**
+ * @brief Write the buffer being filled
+ *
+ * @param file The file
+ */
+void aio_flush(struct aio_file *file)
+{
+    struct aio_buf *buf = file->fill;
+    if (buf == NULL)
+        return;
+    file->fill = NULL;
+    if (buf->len == 0)
+        buf_release(buf);
+    else
+        aio_buf_write(file, buf);
+}
+
+
+/**
+ * @brief Wait for the writes of a file
+ *
+ * @param file The file
+ * @return int 0 on success, -1 if a write failed
+ */
+int aio_drain(struct aio_file *file)
+{
+#ifdef AIO_URING
+    while (file->inflight > 0 || file->queue != NULL)
+        reap(1);
+#endif
+    if (file->error != 0) {
+        errno = file->error;
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Stop writing a file through the pool
+ *
+ * Write the buffer being filled and wait for the writes. The file descriptor
+ * is left open, positioned after the bytes written.
+ *
+ * @param file The file
+ * @return int 0 on success, -1 if a write failed
+ */
+int aio_detach(struct aio_file *file)
+{
+    aio_flush(file);
+    int ret = aio_drain(file);
+    // The writes with an offset leave the position of the file unchanged
+    if (file->seekable && lseek(file->fd, file->offset, SEEK_SET) < 0)
+        ret = -1;
+    free(file);
+    return ret;
+}
+
+
+/**
+ * @brief Write function of the streams
+ *
+ * @param cookie The file
+ * @param data The bytes
+ * @param len The number of bytes
+ * @return ssize_t The number of bytes, -1 after a failed write
+ */
+static ssize_t stream_write(void *cookie, const char *data, size_t len)
+{
+    struct aio_file *file = cookie;
+    if (file->error != 0) {
+        errno = file->error;
+        return -1;
+    }
+    aio_append(file, data, len);
+    if (file->interactive)
+        aio_flush(file);
+    return len;
+}
+
+
+/**
+ * @brief Close function of the streams
+ *
+ * @param cookie The file
+ * @return int 0 on success, -1 if a write failed
+ */
+static int stream_close(void *cookie)
+{
+    struct aio_file *file = cookie;
+    int fd = file->fd;
+    int ret = aio_detach(file);
+    if (fd != STDOUT_FILENO && close(fd) < 0)
+        ret = -1;
+    return ret;
+}
+
+
+/**
+ * @brief Open a stream writing a file descriptor through the pool
+ *
+ * A terminal is line buffered. Closing the stream detaches the file and
+ * closes the file descriptor, unless it is the standard output.
+ *
+ * @param fd The file descriptor
+ * @return FILE* The stream, NULL on error
+ */
+FILE *aio_fdopen(int fd)
+{
+    struct aio_file *file = aio_attach(fd);
+    if (file == NULL)
+        return NULL;
+    cookie_io_functions_t functions = {
+        .read = NULL, .write = stream_write, .seek = NULL,
+        .close = stream_close};
+    FILE *stream = fopencookie(file, "w", functions);
+    if (stream == NULL) {
+        perror("fopencookie");
+        free(file);
+        return NULL;
+    }
+    if (file->interactive)
+        setvbuf(stream, NULL, _IOLBF, BUFSIZ);
+    return stream;
+}
+
+
+/**
+ * @brief Open a file for writing
+ *
+ * Through the pool with io_uring, with stdio otherwise.
+ *
+ * @param path The file, truncated if it exists
+ * @return FILE* The stream, NULL on error
+ */
+FILE *aio_fopen(const char *path)
+{
+    if (!aio_async())
+        return fopen(path, "w");
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return NULL;
+    FILE *stream = aio_fdopen(fd);
+    if (stream == NULL)
+        close(fd);
+    return stream;
+}
+
+
+/**
+ * @brief Print the statistics of the asynchronous writes
+ *
+ * Number of writes and of waits for a free buffer, on stderr.
+ */
+void aio_report(void)
+{
+    if (!aio_async())
+        return;
+    fprintf(stderr, "Async I/O: %lu writes, %lu MiB, %lu waits for a free "
+                    "buffer\n", nb_writes,
+            (unsigned long)(nb_bytes >> 20), nb_waits);
+}
+
+
+/**
+ * @brief Free the pool
+ *
+ * Every file must have been detached.
+ */
+void aio_free(void)
+{
+#ifdef AIO_URING
+    uring_free();
+#endif
+    for (int i = 0; i < AIO_DEPTH; i++) {
+        free(pool[i].data);
+        pool[i].data = NULL;
+    }
+    free_bufs = NULL;
+    pool_ready = 0;
+}
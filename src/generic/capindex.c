@@ -0,0 +1,1188 @@
+/**
+ * @file capindex.c
+ * @brief Capture index definition
+ *
+ * This file contains the definition of the index of the capture files. The
+ * index is laid out as:
+ * - a header giving the size of the capture indexed, so that an index left
+ *   behind by an older capture of the same name is ignored,
+ * - the block table, as varints: for every block, the offset of its first
+ *   record after the previous one, its number of packets, the time of its
+ *   oldest packet after the previous one (zigzag, the timestamps may go
+ *   backwards) and its time span,
+ * - the keys, sorted, each the 64 bits FNV-1a hash of a host or of a
+ *   normalized flow key with the offset of its posting list,
+ * - the posting lists, the blocks of a key as varint deltas.
+ *
+ * Two keys with the same hash share their posting list: the blocks read are
+ * a superset of the blocks wanted, and every packet read is checked against
+ * the query anyway. While indexing, the posting lists are appended to chunks
+ * of a single arena, so that a key costs no allocation of its own.
+ *
+ * The capture is mapped in memory: a query only touches the pages of the
+ * blocks selected, read ahead one run of consecutive blocks at a time.
+ *
+ * @see capindex.h
+ * @see capindex_add
+ * @see capindex_fopen
+ */
+
+#define _GNU_SOURCE // fopencookie
+
+// General libraries
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Local header files
+#include "capindex.h"
+#include "hash.h"
+#include "prefilter.h"
+
+#define INDEX_MAGIC "NSIX" /**< Magic of an index file */
+#define INDEX_VERSION 1 /**< Version of the index format */
+#define CHUNK_LEN 28 /**< Bytes of posting list in a chunk */
+#define PCAP_HEADER_LEN 24 /**< Bytes of the header of a pcap file */
+#define RECORD_HEADER_LEN 16 /**< Bytes of the header of a pcap record */
+
+/**
+ * @brief Header of an index file
+ */
+struct index_header {
+    char magic[4];          /**< INDEX_MAGIC */
+    uint32_t version;       /**< INDEX_VERSION */
+    uint64_t capture_size;  /**< Size of the capture indexed */
+    uint64_t nb_blocks;
+    uint64_t nb_keys;
+    uint64_t blocks_len;    /**< Bytes of the block table */
+    uint64_t postings_len;  /**< Bytes of the posting lists */
+};
+
+/**
+ * @brief Key of an index file
+ */
+struct index_key {
+    uint64_t hash;
+    uint64_t postings;      /**< Offset of the posting list */
+};
+
+/**
+ * @brief Block being indexed
+ */
+struct index_block {
+    uint64_t offset;        /**< Offset of the first record */
+    uint64_t min;           /**< Time of the oldest packet (ns) */
+    uint64_t max;           /**< Time of the newest packet (ns) */
+    uint32_t packets;
+};
+
+/**
+ * @brief Posting list being indexed, slot of the key table
+ */
+struct posting {
+    uint64_t hash;
+    uint32_t last;          /**< Last block listed plus 1, 0 if free */
+    uint32_t head;          /**< First chunk */
+    uint32_t tail;          /**< Last chunk */
+    uint32_t len;           /**< Bytes of the list */
+};
+
+/**
+ * @brief Chunk of posting list
+ */
+struct chunk {
+    u_char data[CHUNK_LEN];
+    uint32_t next;          /**< Next chunk, 0 if last */
+};
+
+/**
+ * @brief Growing byte buffer
+ */
+struct bytes {
+    u_char *data;
+    size_t len;
+    size_t cap;
+};
+
+/**
+ * @brief Capture file mapped in memory
+ */
+struct capture {
+    const u_char *map;
+    uint64_t size;
+    int swapped;            /**< 1 if written with the other byte order */
+    int nano;               /**< 1 if the timestamps are in nanoseconds */
+};
+
+/**
+ * @brief Run of consecutive blocks to read
+ */
+struct range {
+    uint64_t start;
+    uint64_t end;
+};
+
+/**
+ * @brief Stream of the packets matching a query
+ */
+struct capindex_reader {
+    struct capture capture;
+    struct capindex_query query;
+    char *path;
+    struct range *ranges;
+    size_t nb_ranges;
+    size_t next_range;      /**< Range read after the current one */
+    uint64_t pos;           /**< Offset of the next record */
+    uint64_t end;           /**< End of the current range */
+    const u_char *pending;  /**< Bytes left to give, header or record */
+    size_t pending_len;
+    int indexed;            /**< 1 if the blocks were selected by the index */
+    uint64_t blocks_read;
+    uint64_t nb_blocks;
+    uint64_t nb_read;       /**< Packets read */
+    uint64_t nb_matched;    /**< Packets given */
+};
+
+static struct index_block *blocks = NULL;
+static uint64_t nb_blocks = 0;
+static uint64_t cap_blocks = 0;
+static uint64_t nb_packets = 0;
+static struct posting *slots = NULL; /**< Key table, open addressing */
+static uint64_t nb_slots = 0; /**< A power of 2 */
+static uint64_t nb_keys = 0;
+static struct chunk *chunks = NULL; /**< Arena, chunk 0 unused */
+static uint32_t nb_chunks = 0;
+static uint32_t cap_chunks = 0;
+
+
+/**
+ * @brief Hash a host
+ *
+ * @param family AF_INET or AF_INET6
+ * @param addr The address, IPv4 in the first 4 bytes and zeros after
+ * @return uint64_t The key of the host
+ */
+static uint64_t host_hash(uint8_t family, const uint8_t *addr)
+{
+    uint8_t kind[2] = {'H', family};
+    return fnv1a64(fnv1a64(FNV64_OFFSET, kind, sizeof(kind)), addr, 16);
+}
+
+
+/**
+ * @brief Hash a conversation
+ *
+ * @param norm The normalized flow key
+ * @return uint64_t The key of the conversation
+ */
+static uint64_t flow_hash(const struct flow_key *norm)
+{
+    uint8_t kind = 'F';
+    return fnv1a64(fnv1a64(FNV64_OFFSET, &kind, 1), norm, sizeof(*norm));
+}
+
+
+/**
+ * @brief Read the flow key of a frame
+ *
+ * @param packet The frame
+ * @param caplen The captured size of the frame
+ * @param key The flow key, addresses and ports zeroed when absent
+ * @return int 0 if the frame is IP, -1 otherwise
+ */
+static int packet_key(const u_char *packet, uint32_t caplen,
+                      struct flow_key *key)
+{
+    uint16_t vlan = 0;
+    int has_ports = 0;
+    memset(key, 0, sizeof(*key));
+    return prefilter_key(packet, caplen, key, &vlan, &has_ports);
+}
+
+
+/**
+ * @brief Append a varint to a buffer
+ *
+ * @param buf The buffer
+ * @param v The value, 7 bits per byte, low bits first
+ * @return int 0 on success, -1 on allocation failure
+ */
+static int bytes_varint(struct bytes *buf, uint64_t v)
+{
+    if (buf->len + 10 > buf->cap) {
+        size_t cap = buf->cap ? 2 * buf->cap : 4096;
+        u_char *data = realloc(buf->data, cap);
+        if (data == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        buf->data = data;
+        buf->cap = cap;
+    }
+    do {
+        buf->data[buf->len++] = (v & 0x7f) | (v >= 0x80 ? 0x80 : 0);
+        v >>= 7;
+    } while (v);
+    return 0;
+}
+
+
+/**
+ * @brief Read a varint
+ *
+ * @param p The bytes, moved after the varint
+ * @param end The end of the bytes
+ * @param v The value
+ * @return int 0 on success, -1 if the varint is truncated or too long
+ */
+static int varint_get(const u_char **p, const u_char *end, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        u_char b = *(*p)++;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+
+/**
+ * @brief Free the index being built
+ */
+static void index_reset(void)
+{
+    free(blocks);
+    free(slots);
+    free(chunks);
+    blocks = NULL;
+    slots = NULL;
+    chunks = NULL;
+    nb_blocks = cap_blocks = nb_packets = 0;
+    nb_slots = nb_keys = 0;
+    nb_chunks = cap_chunks = 0;
+}
+
+
+/**
+ * @brief Find the slot of a key
+ *
+ * @param hash The key
+ * @return struct posting* The slot of the key, or the free slot where to
+ * insert it
+ */
+static struct posting *slot_find(uint64_t hash)
+{
+    uint64_t i = (hash ^ hash >> 32) & (nb_slots - 1);
+    while (slots[i].last != 0 && slots[i].hash != hash)
+        i = (i + 1) & (nb_slots - 1);
+    return &slots[i];
+}
+
+
+/**
+ * @brief Double the key table
+ *
+ * @return int 0 on success, -1 on allocation failure
+ */
+static int slots_grow(void)
+{
+    struct posting *old = slots;
+    uint64_t old_slots = nb_slots;
+    nb_slots = nb_slots ? 2 * nb_slots : 4096;
+    slots = calloc(nb_slots, sizeof(struct posting));
+    if (slots == NULL) {
+        perror("calloc");
+        slots = old;
+        nb_slots = old_slots;
+        return -1;
+    }
+    for (uint64_t i = 0; i < old_slots; i++) {
+        if (old[i].last != 0)
+            *slot_find(old[i].hash) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+
+/**
+ * @brief Append a varint to a posting list
+ *
+ * @param post The posting list
+ * @param v The value
+ * @return int 0 on success, -1 on allocation failure
+ */
+static int posting_varint(struct posting *post, uint64_t v)
+{
+    do {
+        uint32_t used = post->len % CHUNK_LEN;
+        if (used == 0) { // Last chunk full, or no chunk yet
+            if (nb_chunks == cap_chunks) {
+                uint32_t cap = cap_chunks ? 2 * cap_chunks : 4096;
+                struct chunk *grown = realloc(chunks,
+                                              cap * sizeof(struct chunk));
+                if (grown == NULL) {
+                    perror("realloc");
+                    return -1;
+                }
+                chunks = grown;
+                cap_chunks = cap;
+                if (nb_chunks == 0)
+                    nb_chunks = 1;
+            }
+            uint32_t c = nb_chunks++;
+            chunks[c].next = 0;
+            if (post->len == 0)
+                post->head = c;
+            else
+                chunks[post->tail].next = c;
+            post->tail = c;
+        }
+        chunks[post->tail].data[used] = (v & 0x7f) | (v >= 0x80 ? 0x80 : 0);
+        post->len++;
+        v >>= 7;
+    } while (v);
+    return 0;
+}
+
+
+/**
+ * @brief List the current block in the posting list of a key
+ *
+ * @param hash The key
+ * @return int 0 on success, -1 on allocation failure
+ */
+static int posting_add(uint64_t hash)
+{
+    if (2 * (nb_keys + 1) > nb_slots && slots_grow() < 0)
+        return -1;
+    struct posting *post = slot_find(hash);
+    uint32_t block = nb_blocks - 1;
+    if (post->last == 0) {
+        post->hash = hash;
+        post->len = 0;
+        nb_keys++;
+    } else if (post->last == block + 1) {
+        return 0; // Already listed
+    }
+    uint64_t delta = post->last ? block - (post->last - 1) : block;
+    if (posting_varint(post, delta) < 0)
+        return -1;
+    post->last = block + 1;
+    return 0;
+}
+
+
+/**
+ * @brief Start indexing a capture file
+ */
+void capindex_begin(void)
+{
+    index_reset();
+}
+
+
+/**
+ * @brief Index a packet
+ *
+ * @param offset The offset of the pcap record of the packet in the file
+ * @param ts The time of the packet (ns)
+ * @param packet The frame
+ * @param caplen The captured size of the frame
+ * @return int 0 on success, -1 on allocation failure
+ */
+int capindex_add(uint64_t offset, uint64_t ts, const u_char *packet,
+                 uint32_t caplen)
+{
+    if (nb_packets % INDEX_BLOCK_PACKETS == 0) {
+        if (nb_blocks == cap_blocks) {
+            uint64_t cap = cap_blocks ? 2 * cap_blocks : 1024;
+            struct index_block *grown = realloc(blocks,
+                                                cap * sizeof(*blocks));
+            if (grown == NULL) {
+                perror("realloc");
+                return -1;
+            }
+            blocks = grown;
+            cap_blocks = cap;
+        }
+        struct index_block first = {offset, ts, ts, 0};
+        blocks[nb_blocks++] = first;
+    }
+    struct index_block *block = &blocks[nb_blocks - 1];
+    if (ts < block->min)
+        block->min = ts;
+    if (ts > block->max)
+        block->max = ts;
+    block->packets++;
+    nb_packets++;
+
+    struct flow_key key, norm;
+    if (packet_key(packet, caplen, &key) < 0)
+        return 0;
+    flow_key_normalize(&key, &norm);
+    if (posting_add(host_hash(key.family, key.saddr)) < 0 ||
+        posting_add(host_hash(key.family, key.daddr)) < 0 ||
+        posting_add(flow_hash(&norm)) < 0)
+        return -1;
+    return 0;
+}
+
+
+/**
+ * @brief Compare two keys by hash
+ *
+ * @param a The first key
+ * @param b The second key
+ * @return int <0, 0 or >0 as for qsort
+ */
+static int key_cmp(const void *a, const void *b)
+{
+    const struct index_key *x = a, *y = b;
+    return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+
+/**
+ * @brief Write the index being built
+ *
+ * @param file The index file
+ * @param size The size of the capture file
+ * @return int 0 on success, -1 on error
+ */
+static int index_write(FILE *file, uint64_t size)
+{
+    struct bytes table = {NULL, 0, 0};
+    struct index_key *keys = malloc((nb_keys ? nb_keys : 1) *
+                                    sizeof(struct index_key));
+    int ret = -1;
+    if (keys == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    uint64_t offset = 0, min = 0;
+    for (uint64_t i = 0; i < nb_blocks; i++) {
+        int64_t skew = blocks[i].min - min;
+        uint64_t zigzag = (uint64_t)skew << 1 ^ (uint64_t)(skew >> 63);
+        if (bytes_varint(&table, blocks[i].offset - offset) < 0 ||
+            bytes_varint(&table, blocks[i].packets) < 0 ||
+            bytes_varint(&table, zigzag) < 0 ||
+            bytes_varint(&table, blocks[i].max - blocks[i].min) < 0)
+            goto out;
+        offset = blocks[i].offset;
+        min = blocks[i].min;
+    }
+    uint64_t pad = -table.len & 7; // Keys aligned on 8 bytes
+
+    // Slot of the key in postings, until sorted
+    uint64_t n = 0;
+    for (uint64_t i = 0; i < nb_slots; i++) {
+        if (slots[i].last != 0) {
+            keys[n].hash = slots[i].hash;
+            keys[n++].postings = i;
+        }
+    }
+    qsort(keys, n, sizeof(struct index_key), key_cmp);
+    uint64_t postings_len = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t len = slots[keys[i].postings].len;
+        keys[i].postings = postings_len;
+        postings_len += len;
+    }
+
+    struct index_header header = {
+        .magic = INDEX_MAGIC, // Not NUL terminated
+        .version = INDEX_VERSION,
+        .capture_size = size,
+        .nb_blocks = nb_blocks,
+        .nb_keys = n,
+        .blocks_len = table.len + pad,
+        .postings_len = postings_len};
+    static const u_char zeros[8];
+    if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+        (table.len && fwrite(table.data, 1, table.len, file) != table.len) ||
+        fwrite(zeros, 1, pad, file) != pad ||
+        fwrite(keys, sizeof(struct index_key), n, file) != n)
+        goto out;
+    for (uint64_t i = 0; i < n; i++) {
+        const struct posting *post = slot_find(keys[i].hash);
+        uint32_t left = post->len;
+        for (uint32_t c = post->head; left > 0; c = chunks[c].next) {
+            uint32_t len = left < CHUNK_LEN ? left : CHUNK_LEN;
+            if (fwrite(chunks[c].data, 1, len, file) != len)
+                goto out;
+            left -= len;
+        }
+    }
+    ret = 0;
+
+out:
+    free(table.data);
+    free(keys);
+    return ret;
+}
+
+
+/**
+ * @brief Write the index of a capture file
+ *
+ * The index replaces <capture>.idx once complete.
+ *
+ * @param capture The capture file
+ * @param size The size of the capture file
+ * @return int 0 on success, -1 on error
+ */
+int capindex_end(const char *capture, uint64_t size)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s" INDEX_SUFFIX, capture) >=
+            (int)sizeof(path) ||
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        fprintf(stderr, "File name too long: %s\n", capture);
+        index_reset();
+        return -1;
+    }
+
+    FILE *file = fopen(tmp, "w");
+    if (file == NULL) {
+        perror(tmp);
+        index_reset();
+        return -1;
+    }
+    int ret = index_write(file, size);
+    if (ret < 0)
+        perror(tmp);
+    if (fclose(file) != 0 && ret == 0) {
+        perror(tmp);
+        ret = -1;
+    }
+    if (ret == 0 && rename(tmp, path) < 0) {
+        perror(path);
+        ret = -1;
+    }
+    if (ret < 0)
+        unlink(tmp);
+    index_reset();
+    return ret;
+}
+
+
+/**
+ * @brief Read a 32 bits field of a capture
+ *
+ * @param capture The capture
+ * @param p The field
+ * @return uint32_t The field, in host order
+ */
+static uint32_t capture_u32(const struct capture *capture, const u_char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return capture->swapped ? __builtin_bswap32(v) : v;
+}
+
+
+/**
+ * @brief Map a capture file in memory
+ *
+ * @param path The capture file
+ * @param capture The capture
+ * @return int 0 on success, -1 on error
+ */
+static int capture_open(const char *path, struct capture *capture)
+{
+    memset(capture, 0, sizeof(*capture));
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size < PCAP_HEADER_LEN) {
+        fprintf(stderr, "%s: not a regular pcap file\n", path);
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(path);
+        return -1;
+    }
+    capture->map = map;
+    capture->size = st.st_size;
+
+    uint32_t magic;
+    memcpy(&magic, capture->map, sizeof(magic));
+    capture->swapped = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+    magic = capture_u32(capture, capture->map);
+    capture->nano = magic == 0xa1b23c4d;
+    if (magic != 0xa1b2c3d4 && magic != 0xa1b23c4d) {
+        fprintf(stderr, "%s: not a pcap file\n", path);
+        munmap((void *)capture->map, capture->size);
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Read the header of a record
+ *
+ * @param capture The capture
+ * @param pos The offset of the record
+ * @param end The end of the records
+ * @param ts The time of the packet (ns)
+ * @param caplen The captured size of the packet
+ * @return int 0 on success, -1 if the record is truncated
+ */
+static int record_read(const struct capture *capture, uint64_t pos,
+                       uint64_t end, uint64_t *ts, uint32_t *caplen)
+{
+    if (end - pos < RECORD_HEADER_LEN)
+        return -1;
+    const u_char *p = capture->map + pos;
+    uint32_t frac = capture_u32(capture, p + 4);
+    *ts = capture_u32(capture, p) * 1000000000ULL +
+          (capture->nano ? frac : frac * 1000ULL);
+    *caplen = capture_u32(capture, p + 8);
+    return *caplen <= end - pos - RECORD_HEADER_LEN ? 0 : -1;
+}
+
+
+/**
+ * @brief Index a capture file
+ *
+ * Implement the index command. The file must be a pcap file.
+ *
+ * @param path The capture file
+ * @return int 0 on success, -1 on error
+ */
+int capindex_build(const char *path)
+{
+    struct capture capture;
+    if (capture_open(path, &capture) < 0)
+        return -1;
+    madvise((void *)capture.map, capture.size, MADV_SEQUENTIAL);
+
+    capindex_begin();
+    uint64_t ts;
+    uint32_t caplen;
+    int ret = 0;
+    for (uint64_t pos = PCAP_HEADER_LEN; pos < capture.size;
+         pos += RECORD_HEADER_LEN + caplen) {
+        if (record_read(&capture, pos, capture.size, &ts, &caplen) < 0) {
+            fprintf(stderr, "%s: truncated record at offset %lu, indexed up "
+                            "to it\n", path, (unsigned long)pos);
+            break;
+        }
+        if (capindex_add(pos, ts, capture.map + pos + RECORD_HEADER_LEN,
+                         caplen) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+    munmap((void *)capture.map, capture.size);
+
+    if (ret < 0) {
+        index_reset();
+        return -1;
+    }
+    uint64_t packets = nb_packets, indexed = nb_blocks, keys = nb_keys;
+    if (capindex_end(path, capture.size) < 0)
+        return -1;
+    printf("%s: %lu packets in %lu blocks, %lu hosts and conversations "
+           "indexed\n", path, (unsigned long)packets, (unsigned long)indexed,
+           (unsigned long)keys);
+    return 0;
+}
+
+
+/**
+ * @brief Set the host of a query
+ *
+ * @param query The query
+ * @param addr The IPv4 or IPv6 address
+ * @return int 0 on success, -1 if the address is malformed
+ */
+int capindex_query_host(struct capindex_query *query, const char *addr)
+{
+    memset(query->host, 0, sizeof(query->host));
+    if (inet_pton(AF_INET, addr, query->host) == 1)
+        query->host_family = AF_INET;
+    else if (inet_pton(AF_INET6, addr, query->host) == 1)
+        query->host_family = AF_INET6;
+    else
+        return -1;
+    query->has_host = 1;
+    return 0;
+}
+
+
+/**
+ * @brief Parse a number
+ *
+ * @param str The number
+ * @param max The largest number allowed
+ * @param n The number
+ * @return int 0 on success, -1 if the number is malformed or too large
+ */
+static int parse_number(const char *str, unsigned long max, unsigned long *n)
+{
+    char *end;
+    if (*str < '0' || *str > '9')
+        return -1;
+    *n = strtoul(str, &end, 10);
+    return *end == '\0' && *n <= max ? 0 : -1;
+}
+
+
+/**
+ * @brief Set the conversation of a query
+ *
+ * The conversation is written proto,address,port,address,port, the protocol
+ * being a name or a number, in either direction.
+ *
+ * @param query The query
+ * @param spec The conversation
+ * @return int 0 on success, -1 if the conversation is malformed
+ */
+int capindex_query_flow(struct capindex_query *query, const char *spec)
+{
+    static const struct {
+        const char *name;
+        uint8_t proto;
+    } names[] = {{"icmp", IPPROTO_ICMP}, {"tcp", IPPROTO_TCP},
+                 {"udp", IPPROTO_UDP},   {"icmp6", IPPROTO_ICMPV6},
+                 {"sctp", IPPROTO_SCTP}};
+    char *copy = strdup(spec);
+    if (copy == NULL) {
+        perror("strdup");
+        return -1;
+    }
+    char *fields[5];
+    int nb_fields = 0;
+    char *save = NULL;
+    for (char *field = strtok_r(copy, ",", &save); field;
+         field = strtok_r(NULL, ",", &save)) {
+        if (nb_fields == 5) {
+            free(copy);
+            return -1;
+        }
+        fields[nb_fields++] = field;
+    }
+
+    struct flow_key key;
+    memset(&key, 0, sizeof(key));
+    unsigned long proto, sport, dport;
+    int ok = nb_fields == 5 && parse_number(fields[2], 65535, &sport) == 0 &&
+             parse_number(fields[4], 65535, &dport) == 0;
+    if (ok && parse_number(fields[0], 255, &proto) < 0) {
+        ok = 0;
+        for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++) {
+            if (strcmp(fields[0], names[i].name) == 0) {
+                proto = names[i].proto;
+                ok = 1;
+            }
+        }
+    }
+    if (ok && inet_pton(AF_INET, fields[1], key.saddr) == 1 &&
+        inet_pton(AF_INET, fields[3], key.daddr) == 1)
+        key.family = AF_INET;
+    else if (ok && inet_pton(AF_INET6, fields[1], key.saddr) == 1 &&
+             inet_pton(AF_INET6, fields[3], key.daddr) == 1)
+        key.family = AF_INET6;
+    else
+        ok = 0;
+    free(copy);
+    if (!ok)
+        return -1;
+
+    key.proto = proto;
+    key.sport = sport;
+    key.dport = dport;
+    flow_key_normalize(&key, &query->flow);
+    query->has_flow = 1;
+    return 0;
+}
+
+
+/**
+ * @brief Check if a packet matches a query
+ *
+ * @param query The query
+ * @param ts The time of the packet (ns)
+ * @param packet The frame
+ * @param caplen The captured size of the frame
+ * @return int 1 if the packet matches, 0 otherwise
+ */
+static int query_match(const struct capindex_query *query, uint64_t ts,
+                       const u_char *packet, uint32_t caplen)
+{
+    if ((query->start && ts < query->start) || (query->end && ts >= query->end))
+        return 0;
+    if (!query->has_host && !query->has_flow)
+        return 1;
+
+    struct flow_key key, norm;
+    if (packet_key(packet, caplen, &key) < 0)
+        return 0;
+    if (query->has_host &&
+        (key.family != query->host_family ||
+         (memcmp(key.saddr, query->host, sizeof(query->host)) != 0 &&
+          memcmp(key.daddr, query->host, sizeof(query->host)) != 0)))
+        return 0;
+    flow_key_normalize(&key, &norm);
+    return !query->has_flow ||
+           memcmp(&norm, &query->flow, sizeof(norm)) == 0;
+}
+
+
+/**
+ * @brief Mark the blocks listed for a key
+ *
+ * @param map The index file
+ * @param header The header of the index
+ * @param hash The key
+ * @param marks The marks of the blocks
+ * @param bit The mark to set
+ * @return int 0 on success, -1 if the posting list is corrupted
+ */
+static int postings_mark(const u_char *map, const struct index_header *header,
+                         uint64_t hash, uint8_t *marks, uint8_t bit)
+{
+    const u_char *keys = map + sizeof(*header) + header->blocks_len;
+    const u_char *postings = keys + header->nb_keys * sizeof(struct index_key);
+    uint64_t lo = 0, hi = header->nb_keys;
+    struct index_key key;
+    while (lo < hi) { // First key not below the hash
+        uint64_t mid = lo + (hi - lo) / 2;
+        memcpy(&key, keys + mid * sizeof(key), sizeof(key));
+        if (key.hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == header->nb_keys)
+        return 0;
+    memcpy(&key, keys + lo * sizeof(key), sizeof(key));
+    if (key.hash != hash)
+        return 0;
+
+    uint64_t end = header->postings_len;
+    if (lo + 1 < header->nb_keys) {
+        struct index_key next;
+        memcpy(&next, keys + (lo + 1) * sizeof(next), sizeof(next));
+        end = next.postings;
+    }
+    if (key.postings > end || end > header->postings_len)
+        return -1;
+    const u_char *p = postings + key.postings;
+    uint64_t block = 0, delta;
+    for (int first = 1; p < postings + end; first = 0) {
+        if (varint_get(&p, postings + end, &delta) < 0 ||
+            (!first && delta == 0) || delta >= header->nb_blocks - block)
+            return -1;
+        block += delta;
+        marks[block] |= bit;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Add a block to the ranges read if it may match the query
+ *
+ * @param reader The reader
+ * @param need The marks of the keys of the query
+ * @param mark The marks of the block
+ * @param block The bytes of the block
+ * @param min The time of the oldest packet of the block (ns)
+ * @param max The time of the newest packet of the block (ns)
+ */
+static void block_select(struct capindex_reader *reader, uint8_t need,
+                         uint8_t mark, const struct range *block,
+                         uint64_t min, uint64_t max)
+{
+    const struct capindex_query *query = &reader->query;
+    if ((mark & need) != need || (query->start && max < query->start) ||
+        (query->end && min >= query->end))
+        return;
+    reader->blocks_read++;
+    struct range *last = reader->nb_ranges > 0 ?
+                         &reader->ranges[reader->nb_ranges - 1] : NULL;
+    if (last != NULL && last->end == block->start)
+        last->end = block->end;
+    else
+        reader->ranges[reader->nb_ranges++] = *block;
+}
+
+
+/**
+ * @brief Select the blocks of a query with the index of the capture
+ *
+ * @param reader The reader, its ranges set
+ * @return int 0 on success, -1 if there is no up to date index
+ */
+static int ranges_select(struct capindex_reader *reader)
+{
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s" INDEX_SUFFIX, reader->path) >=
+        (int)sizeof(path))
+        return -1;
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || (uint64_t)st.st_size < sizeof(struct index_header)) {
+        close(fd);
+        return -1;
+    }
+    void *mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+        return -1;
+    const u_char *map = mapped;
+
+    struct index_header header;
+    memcpy(&header, map, sizeof(header));
+    uint64_t size = st.st_size - sizeof(header);
+    const u_char *table = map + sizeof(header);
+    uint8_t *marks = NULL;
+    int ret = -1;
+    if (memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != INDEX_VERSION ||
+        header.capture_size != reader->capture.size ||
+        header.blocks_len > size || header.blocks_len % 8 != 0 ||
+        header.nb_blocks > header.blocks_len ||
+        header.nb_keys > (size - header.blocks_len) / sizeof(struct index_key) ||
+        header.postings_len != size - header.blocks_len -
+                               header.nb_keys * sizeof(struct index_key))
+        goto out;
+
+    marks = calloc(header.nb_blocks ? header.nb_blocks : 1, 1);
+    reader->ranges = calloc(header.nb_blocks ? header.nb_blocks : 1,
+                            sizeof(struct range));
+    if (marks == NULL || reader->ranges == NULL) {
+        perror("calloc");
+        goto out;
+    }
+    const struct capindex_query *query = &reader->query;
+    uint8_t need = (query->has_host ? 1 : 0) | (query->has_flow ? 2 : 0);
+    if ((query->has_host &&
+         postings_mark(map, &header,
+                       host_hash(query->host_family, query->host), marks,
+                       1) < 0) ||
+        (query->has_flow &&
+         postings_mark(map, &header, flow_hash(&query->flow), marks, 2) < 0))
+        goto out;
+
+    // A block ends where the next one starts
+    const u_char *p = table, *end = table + header.blocks_len;
+    struct range block = {0, 0};
+    uint64_t min = 0, block_min = 0, block_max = 0;
+    for (uint64_t i = 0; i < header.nb_blocks; i++) {
+        uint64_t delta, packets, skew, span;
+        if (varint_get(&p, end, &delta) < 0 ||
+            varint_get(&p, end, &packets) < 0 ||
+            varint_get(&p, end, &skew) < 0 ||
+            varint_get(&p, end, &span) < 0 || (i > 0 && delta == 0) ||
+            delta >= reader->capture.size - block.start)
+            goto out;
+        block.end = block.start + delta;
+        if (i > 0)
+            block_select(reader, need, marks[i - 1], &block, block_min,
+                         block_max);
+        block.start = block.end;
+        min += skew >> 1 ^ -(skew & 1); // Zigzag
+        block_min = min;
+        block_max = min + span;
+    }
+    if (header.nb_blocks > 0) {
+        block.end = reader->capture.size;
+        block_select(reader, need, marks[header.nb_blocks - 1], &block,
+                     block_min, block_max);
+    }
+    reader->nb_blocks = header.nb_blocks;
+    ret = 0;
+
+out:
+    if (ret < 0) {
+        free(reader->ranges);
+        reader->ranges = NULL;
+        reader->nb_ranges = 0;
+        reader->blocks_read = 0;
+    }
+    free(marks);
+    munmap(mapped, st.st_size);
+    return ret;
+}
+
+
+/**
+ * @brief Read the packets matching the query
+ *
+ * @param cookie The reader
+ * @param buf The buffer
+ * @param len The size of the buffer
+ * @return ssize_t The number of bytes read, 0 at the end
+ */
+static ssize_t reader_read(void *cookie, char *buf, size_t len)
+{
+    struct capindex_reader *reader = cookie;
+    const struct capture *capture = &reader->capture;
+    size_t done = 0;
+    while (done < len) {
+        if (reader->pending_len > 0) {
+            size_t n = reader->pending_len < len - done ? reader->pending_len :
+                                                          len - done;
+            memcpy(buf + done, reader->pending, n);
+            reader->pending += n;
+            reader->pending_len -= n;
+            done += n;
+            continue;
+        }
+        if (reader->pos >= reader->end) {
+            if (reader->next_range == reader->nb_ranges)
+                break;
+            const struct range *range = &reader->ranges[reader->next_range++];
+            reader->pos = range->start;
+            reader->end = range->end;
+            // Read ahead the whole run, on page boundaries
+            uint64_t page = range->start & ~(uint64_t)4095;
+            madvise((void *)(capture->map + page), range->end - page,
+                    MADV_WILLNEED);
+            continue;
+        }
+
+        uint64_t ts;
+        uint32_t caplen;
+        if (record_read(capture, reader->pos, reader->end, &ts, &caplen) < 0) {
+            fprintf(stderr, "%s: truncated record at offset %lu\n",
+                    reader->path, (unsigned long)reader->pos);
+            reader->next_range = reader->nb_ranges;
+            reader->pos = reader->end;
+            break;
+        }
+        const u_char *record = capture->map + reader->pos;
+        reader->pos += RECORD_HEADER_LEN + caplen;
+        reader->nb_read++;
+        if (query_match(&reader->query, ts, record + RECORD_HEADER_LEN,
+                        caplen)) {
+            reader->nb_matched++;
+            reader->pending = record;
+            reader->pending_len = RECORD_HEADER_LEN + caplen;
+        }
+    }
+    return done;
+}
+
+
+/**
+ * @brief Free a reader
+ *
+ * @param reader The reader
+ */
+static void reader_free(struct capindex_reader *reader)
+{
+    if (reader->capture.map != NULL)
+        munmap((void *)reader->capture.map, reader->capture.size);
+    free(reader->ranges);
+    free(reader->path);
+    free(reader);
+}
+
+
+/**
+ * @brief Close the stream, print what was read on stderr
+ *
+ * @param cookie The reader
+ * @return int 0
+ */
+static int reader_close(void *cookie)
+{
+    struct capindex_reader *reader = cookie;
+    if (reader->indexed)
+        fprintf(stderr, "Index: %lu of %lu blocks read, ",
+                (unsigned long)reader->blocks_read,
+                (unsigned long)reader->nb_blocks);
+    else
+        fprintf(stderr, "Index: whole file read, ");
+    fprintf(stderr, "%lu of %lu packets read matched\n",
+            (unsigned long)reader->nb_matched, (unsigned long)reader->nb_read);
+    reader_free(reader);
+    return 0;
+}
+
+
+/**
+ * @brief Open the packets of a capture file matching a query
+ *
+ * The stream gives the header of the capture, then the records of the
+ * packets matching the query. Without an up to date index, the whole file is
+ * read. The file must be a regular pcap file.
+ *
+ * @param path The capture file
+ * @param query The query
+ * @return FILE* The stream, NULL on error
+ */
+FILE *capindex_fopen(const char *path, const struct capindex_query *query)
+{
+    struct capindex_reader *reader = calloc(1, sizeof(struct capindex_reader));
+    if (reader == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    reader->query = *query;
+    reader->path = strdup(path);
+    if (reader->path == NULL) {
+        perror("strdup");
+        goto fail;
+    }
+    if (capture_open(path, &reader->capture) < 0)
+        goto fail;
+    madvise((void *)reader->capture.map, reader->capture.size, MADV_RANDOM);
+
+    reader->indexed = ranges_select(reader) == 0;
+    if (!reader->indexed) {
+        fprintf(stderr, "%s" INDEX_SUFFIX " missing or out of date, reading "
+                        "the whole file\n", path);
+        reader->ranges = malloc(sizeof(struct range));
+        if (reader->ranges == NULL) {
+            perror("malloc");
+            goto fail;
+        }
+        reader->ranges[0].start = PCAP_HEADER_LEN;
+        reader->ranges[0].end = reader->capture.size;
+        reader->nb_ranges = 1;
+    }
+    reader->pending = reader->capture.map;
+    reader->pending_len = PCAP_HEADER_LEN;
+
+    cookie_io_functions_t functions = {
+        .read = reader_read, .write = NULL, .seek = NULL,
+        .close = reader_close};
+    FILE *stream = fopencookie(reader, "r", functions);
+    if (stream == NULL) {
+        perror("fopencookie");
+        goto fail;
+    }
+    return stream;
+
+fail:
+    reader_free(reader);
+    return NULL;
+}
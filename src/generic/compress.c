@@ -0,0 +1,989 @@
+/**
+ * @file compress.c
+ * @brief Compressed captures definition
+ *
+ * This file contains the definition of the compression of the capture files.
+ * A compressed file owns a ring of jobs, each holding a block and its frame.
+ * The capture thread fills the block of the next job and queues it to the
+ * pool once full, then writes the frames of the oldest jobs once compressed:
+ * the frames stay in order while up to one job per slot of the ring is being
+ * compressed. The capture thread only waits for the pool when every job of
+ * the ring is queued.
+ *
+ * A compressed capture is mapped in memory and split in frames by the thread
+ * reading it, each frame being queued to the pool as a job that decompresses
+ * it. libpcap reads the decompressed bytes of the oldest job through a stream.
+ * A frame whose decompressed size is unknown or larger than COMPRESS_BLOCK_LEN,
+ * as written by the zstd and lz4 tools in one frame for the whole file, is
+ * decompressed in order by the reading thread.
+ *
+ * @see compress.h
+ * @see compress_append
+ * @see compress_fopen
+ */
+
+#define _GNU_SOURCE // fopencookie
+
+// General libraries
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+// Local header files
+#include "compress.h"
+
+#define ZSTD_MAGIC 0xfd2fb528 /**< First bytes of a zstd frame */
+#define LZ4_MAGIC 0x184d2204 /**< First bytes of a lz4 frame */
+#define LZ4_SKIPPABLE 0x184d2a50 /**< First bytes of a lz4 skippable frame */
+
+/**
+ * @brief State of a job
+ */
+enum job_state {
+    JOB_FREE = 0,
+    JOB_QUEUED,             /**< Queued to the pool or being run */
+    JOB_DONE
+};
+
+/**
+ * @brief Block to compress or frame to decompress
+ */
+struct compress_job {
+    int codec;              /**< Format (enum compress_codec) */
+    int level;              /**< Compression level, 0 to decompress */
+    int decompress;         /**< 1 to decompress the frame */
+    u_char *block;          /**< COMPRESS_BLOCK_LEN bytes to compress */
+    const u_char *src;      /**< Input */
+    size_t src_len;
+    u_char *dst;            /**< Output */
+    size_t dst_cap;
+    size_t dst_len;
+    int state;              /**< enum job_state */
+    int failed;             /**< 1 if the input could not be processed */
+    struct compress_job *next; /**< Next job queued */
+};
+
+/**
+ * @brief File written compressed
+ */
+struct compress_file {
+    struct aio_file *out;
+    int codec;
+    int level;
+    struct compress_job *jobs;
+    unsigned nb_jobs;
+    unsigned filled;        /**< Jobs queued to the pool */
+    unsigned written;       /**< Jobs whose frame is written */
+    size_t fill_len;        /**< Bytes of the block being filled */
+    int failed;             /**< 1 if a block could not be compressed */
+};
+
+/**
+ * @brief Compressed capture being read
+ */
+struct compress_reader {
+    int codec;
+    int fd;
+    const u_char *map;      /**< The file, NULL if empty */
+    size_t size;
+    size_t next;            /**< Offset of the next frame to queue */
+    struct compress_job *jobs;
+    unsigned nb_jobs;
+    unsigned issued;        /**< Jobs queued to the pool */
+    unsigned consumed;      /**< Jobs read */
+    size_t pos;             /**< Bytes read of the oldest job */
+    int streaming;          /**< 1 while a frame is decompressed in order */
+    int corrupt;            /**< 1 if the frame at next is corrupted */
+    char *path;
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx *zstd;
+#endif
+#ifdef HAVE_LZ4
+    LZ4F_dctx *lz4;
+#endif
+};
+
+/**
+ * @brief Contexts of a thread of the pool
+ */
+struct worker_ctx {
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zstd_c;
+    ZSTD_DCtx *zstd_d;
+#endif
+#ifdef HAVE_LZ4
+    LZ4F_dctx *lz4_d;
+#endif
+    int unused;
+};
+
+static int wanted = 0;                  /**< Threads requested, 0 for all */
+static pthread_t *workers = NULL;
+static int nb_workers = 0;              /**< Threads started */
+static int stopping = 0;                /**< 1 to stop the threads */
+static struct compress_job *queue = NULL; /**< Jobs to run, oldest first */
+static struct compress_job *queue_tail = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+
+
+/**
+ * @brief Read a little endian 32 bits integer
+ *
+ * @param p The bytes
+ * @return uint32_t The integer
+ */
+static uint32_t le32(const u_char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+
+#ifdef HAVE_LZ4
+/**
+ * @brief Fill the preferences of a lz4 frame
+ *
+ * @param prefs The preferences
+ * @param len The bytes of the block
+ * @param level The compression level
+ */
+static void lz4_prefs(LZ4F_preferences_t *prefs, size_t len, int level)
+{
+    memset(prefs, 0, sizeof(*prefs));
+    prefs->frameInfo.blockSizeID = LZ4F_max1MB;
+    prefs->frameInfo.blockMode = LZ4F_blockIndependent;
+    prefs->frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+    prefs->frameInfo.contentSize = len;
+    prefs->compressionLevel = level;
+}
+#endif
+
+
+/**
+ * @brief Compress a block or decompress a frame
+ *
+ * @param job The job
+ * @param ctx The contexts of the thread
+ */
+static void run(struct compress_job *job, struct worker_ctx *ctx)
+{
+    (void)ctx;
+    job->dst_len = 0;
+#ifdef HAVE_ZSTD
+    if (job->codec == COMPRESS_ZSTD && !job->decompress) {
+        if (ctx->zstd_c == NULL && (ctx->zstd_c = ZSTD_createCCtx()) == NULL)
+            goto fail;
+        ZSTD_CCtx_setParameter(ctx->zstd_c, ZSTD_c_compressionLevel,
+                               job->level);
+        ZSTD_CCtx_setParameter(ctx->zstd_c, ZSTD_c_checksumFlag, 1);
+        size_t ret = ZSTD_compress2(ctx->zstd_c, job->dst, job->dst_cap,
+                                    job->src, job->src_len);
+        if (ZSTD_isError(ret))
+            goto fail;
+        job->dst_len = ret;
+        return;
+    }
+    if (job->codec == COMPRESS_ZSTD) {
+        if (ctx->zstd_d == NULL && (ctx->zstd_d = ZSTD_createDCtx()) == NULL)
+            goto fail;
+        ZSTD_DCtx_reset(ctx->zstd_d, ZSTD_reset_session_only);
+        ZSTD_inBuffer in = {job->src, job->src_len, 0};
+        ZSTD_outBuffer out = {job->dst, job->dst_cap, 0};
+        for (;;) {
+            size_t in_pos = in.pos, out_pos = out.pos;
+            size_t ret = ZSTD_decompressStream(ctx->zstd_d, &out, &in);
+            job->dst_len = out.pos;
+            if (ZSTD_isError(ret))
+                goto fail;
+            if (ret == 0) // End of the frame
+                return;
+            if (in.pos == in_pos && out.pos == out_pos)
+                goto fail; // Truncated, or larger than its content size
+        }
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (job->codec == COMPRESS_LZ4 && !job->decompress) {
+        LZ4F_preferences_t prefs;
+        lz4_prefs(&prefs, job->src_len, job->level);
+        size_t ret = LZ4F_compressFrame(job->dst, job->dst_cap, job->src,
+                                        job->src_len, &prefs);
+        if (LZ4F_isError(ret))
+            goto fail;
+        job->dst_len = ret;
+        return;
+    }
+    if (job->codec == COMPRESS_LZ4) {
+        if (ctx->lz4_d == NULL &&
+            LZ4F_isError(LZ4F_createDecompressionContext(&ctx->lz4_d,
+                                                         LZ4F_VERSION)))
+            goto fail;
+        size_t pos = 0;
+        for (;;) {
+            size_t out = job->dst_cap - job->dst_len;
+            size_t in = job->src_len - pos;
+            size_t ret = LZ4F_decompress(ctx->lz4_d, job->dst + job->dst_len,
+                                         &out, job->src + pos, &in, NULL);
+            job->dst_len += out;
+            pos += in;
+            if (LZ4F_isError(ret) || (ret != 0 && in == 0 && out == 0)) {
+                // Truncated, or larger than its content size
+                LZ4F_resetDecompressionContext(ctx->lz4_d);
+                goto fail;
+            }
+            if (ret == 0) // End of the frame
+                return;
+        }
+    }
+#endif
+    job->failed = 1; // Format not supported by this build
+    return;
+#if defined(HAVE_ZSTD) || defined(HAVE_LZ4)
+fail:
+    job->failed = 1;
+#endif
+}
+
+
+/**
+ * @brief Thread of the pool
+ *
+ * Run the jobs queued until the pool is stopped.
+ *
+ * @param arg Unused
+ * @return void* NULL
+ */
+static void *worker(void *arg)
+{
+    (void)arg;
+    struct worker_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (queue == NULL && !stopping)
+            pthread_cond_wait(&work, &lock);
+        if (queue == NULL)
+            break;
+        struct compress_job *job = queue;
+        queue = job->next;
+        pthread_mutex_unlock(&lock);
+
+        run(job, &ctx);
+
+        pthread_mutex_lock(&lock);
+        __atomic_store_n(&job->state, JOB_DONE, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&finished);
+    }
+    pthread_mutex_unlock(&lock);
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(ctx.zstd_c);
+    ZSTD_freeDCtx(ctx.zstd_d);
+#endif
+#ifdef HAVE_LZ4
+    LZ4F_freeDecompressionContext(ctx.lz4_d);
+#endif
+    return NULL;
+}
+
+
+/**
+ * @brief Start the threads of the pool if not started yet
+ *
+ * @return int 0 on success, -1 if no thread could be started
+ */
+static int pool_start(void)
+{
+    if (nb_workers > 0)
+        return 0;
+    long n = wanted;
+    if (n <= 0)
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n <= 0)
+        n = 1;
+    workers = calloc(n, sizeof(pthread_t));
+    if (workers == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    // The signals, SIGINT among them, are left to the capture thread
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    stopping = 0;
+    int err = 0;
+    while (nb_workers < n &&
+           (err = pthread_create(&workers[nb_workers], NULL, worker,
+                                 NULL)) == 0)
+        nb_workers++;
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (nb_workers == 0) {
+        fprintf(stderr, "Could not start the compression threads: %s\n",
+                strerror(err));
+        free(workers);
+        workers = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Queue a job to the pool
+ *
+ * @param job The job
+ */
+static void pool_queue(struct compress_job *job)
+{
+    job->failed = 0;
+    job->next = NULL;
+    pthread_mutex_lock(&lock);
+    job->state = JOB_QUEUED;
+    if (queue == NULL)
+        queue = job;
+    else
+        queue_tail->next = job;
+    queue_tail = job;
+    pthread_cond_signal(&work);
+    pthread_mutex_unlock(&lock);
+}
+
+
+/**
+ * @brief Wait for a job to be run
+ *
+ * @param job The job, queued
+ */
+static void pool_wait(struct compress_job *job)
+{
+    if (__atomic_load_n(&job->state, __ATOMIC_ACQUIRE) == JOB_DONE)
+        return;
+    pthread_mutex_lock(&lock);
+    while (__atomic_load_n(&job->state, __ATOMIC_ACQUIRE) != JOB_DONE)
+        pthread_cond_wait(&finished, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+
+/**
+ * @brief Free the jobs of a file
+ *
+ * @param jobs The jobs, none queued
+ * @param nb_jobs The number of jobs
+ */
+static void jobs_free(struct compress_job *jobs, unsigned nb_jobs)
+{
+    for (unsigned i = 0; i < nb_jobs; i++) {
+        free(jobs[i].block);
+        free(jobs[i].dst);
+    }
+    free(jobs);
+}
+
+
+/**
+ * @brief Allocate the jobs of a file
+ *
+ * Two jobs per thread, so that the threads have a job queued while the
+ * oldest ones are read or written.
+ *
+ * @param nb_jobs The number of jobs allocated
+ * @param block 1 to allocate a block to compress per job
+ * @param dst_cap The size of the output of a job
+ * @return struct compress_job* The jobs, NULL on allocation failure
+ */
+static struct compress_job *jobs_alloc(unsigned *nb_jobs, int block,
+                                       size_t dst_cap)
+{
+    unsigned n = 2 * nb_workers + 2;
+    struct compress_job *jobs = calloc(n, sizeof(struct compress_job));
+    if (jobs == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    for (unsigned i = 0; i < n; i++) {
+        jobs[i].block = block ? malloc(COMPRESS_BLOCK_LEN) : NULL;
+        jobs[i].dst = malloc(dst_cap);
+        jobs[i].dst_cap = dst_cap;
+        if ((block && jobs[i].block == NULL) || jobs[i].dst == NULL) {
+            perror("malloc");
+            jobs_free(jobs, i + 1);
+            return NULL;
+        }
+    }
+    *nb_jobs = n;
+    return jobs;
+}
+
+
+/**
+ * @brief Check if a format is supported by this build
+ *
+ * @param codec The format (enum compress_codec)
+ * @return int 1 if supported, 0 otherwise
+ */
+int compress_supported(int codec)
+{
+    switch (codec) {
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD:
+        return 1;
+#endif
+#ifdef HAVE_LZ4
+    case COMPRESS_LZ4:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+
+/**
+ * @brief Set the number of compression threads
+ *
+ * The threads are started at the first compressed file.
+ *
+ * @param threads The number of threads, 0 for one per processor
+ */
+void compress_init(int threads)
+{
+    wanted = threads;
+}
+
+
+/**
+ * @brief Start compressing the bytes written to a file
+ *
+ * @param out The file the frames are written to
+ * @param codec The format (enum compress_codec)
+ * @param level The compression level
+ * @return struct compress_file* The compressed file, NULL on error
+ */
+struct compress_file *compress_attach(struct aio_file *out, int codec,
+                                      int level)
+{
+    size_t bound = 0;
+#ifdef HAVE_ZSTD
+    if (codec == COMPRESS_ZSTD)
+        bound = ZSTD_compressBound(COMPRESS_BLOCK_LEN);
+#endif
+#ifdef HAVE_LZ4
+    if (codec == COMPRESS_LZ4) {
+        LZ4F_preferences_t prefs;
+        lz4_prefs(&prefs, COMPRESS_BLOCK_LEN, level);
+        bound = LZ4F_compressFrameBound(COMPRESS_BLOCK_LEN, &prefs);
+    }
+#endif
+    if (bound == 0) {
+        fprintf(stderr, "Compression not supported by this build\n");
+        return NULL;
+    }
+    if (pool_start() < 0)
+        return NULL;
+
+    struct compress_file *file = calloc(1, sizeof(struct compress_file));
+    if (file == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    file->out = out;
+    file->codec = codec;
+    file->level = level;
+    file->jobs = jobs_alloc(&file->nb_jobs, 1, bound);
+    if (file->jobs == NULL) {
+        free(file);
+        return NULL;
+    }
+    return file;
+}
+
+
+/**
+ * @brief Write the frame of the oldest job
+ *
+ * @param file The compressed file
+ * @param wait 1 to wait for the job to be run, 0 to return if it isn't
+ * @return int 0 if written, 1 if not run yet, -1 if it failed
+ */
+static int write_frame(struct compress_file *file, int wait)
+{
+    struct compress_job *job = &file->jobs[file->written % file->nb_jobs];
+    if (wait)
+        pool_wait(job);
+    else if (__atomic_load_n(&job->state, __ATOMIC_ACQUIRE) != JOB_DONE)
+        return 1;
+    file->written++;
+    job->state = JOB_FREE;
+    if (job->failed || file->failed) {
+        file->failed = 1;
+        return -1;
+    }
+    aio_append(file->out, job->dst, job->dst_len);
+    return 0;
+}
+
+
+/**
+ * @brief Queue the block being filled to the pool
+ *
+ * @param file The compressed file
+ */
+static void queue_block(struct compress_file *file)
+{
+    struct compress_job *job = &file->jobs[file->filled % file->nb_jobs];
+    job->codec = file->codec;
+    job->level = file->level;
+    job->decompress = 0;
+    job->src = job->block;
+    job->src_len = file->fill_len;
+    pool_queue(job);
+    file->filled++;
+    file->fill_len = 0;
+}
+
+
+/**
+ * @brief Compress bytes
+ *
+ * The bytes are gathered in a block, compressed once full. The frames
+ * compressed are written to the file, in order.
+ *
+ * @param file The compressed file
+ * @param data The bytes
+ * @param len The number of bytes
+ * @return int 0 on success, -1 if a block could not be compressed
+ */
+int compress_append(struct compress_file *file, const void *data, size_t len)
+{
+    const u_char *p = data;
+    while (len > 0) {
+        // The job of the block to fill is the oldest one if all are queued
+        if (file->fill_len == 0 && file->filled - file->written ==
+                                   file->nb_jobs &&
+            write_frame(file, 1) < 0)
+            return -1;
+        struct compress_job *job = &file->jobs[file->filled % file->nb_jobs];
+        size_t n = COMPRESS_BLOCK_LEN - file->fill_len;
+        if (n > len)
+            n = len;
+        memcpy(job->block + file->fill_len, p, n);
+        file->fill_len += n;
+        p += n;
+        len -= n;
+        if (file->fill_len == COMPRESS_BLOCK_LEN)
+            queue_block(file);
+    }
+
+    int ret = 0;
+    while (file->written < file->filled && (ret = write_frame(file, 0)) == 0)
+        ;
+    return ret < 0 ? -1 : 0;
+}
+
+
+/**
+ * @brief Stop compressing the bytes written to a file
+ *
+ * Compress the last block and write the frames left to the file.
+ *
+ * @param file The compressed file
+ * @return int 0 on success, -1 if a block could not be compressed
+ */
+int compress_detach(struct compress_file *file)
+{
+    if (file->fill_len > 0)
+        queue_block(file);
+    while (file->written < file->filled)
+        write_frame(file, 1); // Every job is waited for before the free
+    int ret = file->failed ? -1 : 0;
+    if (ret < 0)
+        fprintf(stderr, "A block could not be compressed\n");
+    jobs_free(file->jobs, file->nb_jobs);
+    free(file);
+    return ret;
+}
+
+
+/**
+ * @brief Find the frame at the next offset of a capture
+ *
+ * @param reader The capture
+ * @param len The bytes of the frame
+ * @param content The bytes decompressed, 0 if unknown or larger than the
+ * output of a job
+ * @return int 0 on success, -1 if the frame is corrupted
+ */
+static int frame_find(struct compress_reader *reader, size_t *len,
+                      size_t *content)
+{
+    const u_char *p = reader->map + reader->next;
+    size_t left = reader->size - reader->next;
+    *content = 0;
+#ifdef HAVE_ZSTD
+    if (reader->codec == COMPRESS_ZSTD) {
+        // The size of a large frame would need to go through all its blocks
+        unsigned long long n = ZSTD_getFrameContentSize(p, left);
+        if (n == ZSTD_CONTENTSIZE_ERROR)
+            return -1;
+        if (n == ZSTD_CONTENTSIZE_UNKNOWN || n > COMPRESS_BLOCK_LEN)
+            return 0;
+        *len = ZSTD_findFrameCompressedSize(p, left);
+        if (ZSTD_isError(*len))
+            return -1;
+        *content = n ? n : 1; // Skippable frame
+        return 0;
+    }
+#endif
+    if (left < 4)
+        return -1;
+    uint32_t magic = le32(p);
+    if ((magic & 0xfffffff0) == LZ4_SKIPPABLE) {
+        if (left < 8)
+            return -1;
+        *len = 8 + (size_t)le32(p + 4);
+        return *len <= left ? 0 : -1;
+    }
+    if (magic != LZ4_MAGIC || left < 7)
+        return -1;
+    u_char flags = p[4];
+    if (!(flags & 0x08)) // No content size
+        return 0;
+    // Magic, FLG, BD, content size, dictionary ID if any, header checksum
+    size_t off = 4 + 2 + 8 + (flags & 0x01 ? 4 : 0) + 1;
+    if (left < off)
+        return -1;
+    uint64_t n = le32(p + 6) | (uint64_t)le32(p + 10) << 32;
+    if (n > COMPRESS_BLOCK_LEN)
+        return 0;
+    for (;;) { // Blocks until the end mark
+        if (off + 4 > left)
+            return -1;
+        uint32_t block = le32(p + off);
+        off += 4;
+        if (block == 0)
+            break;
+        off += (block & 0x7fffffff) + (flags & 0x10 ? 4 : 0);
+    }
+    off += flags & 0x04 ? 4 : 0;
+    if (off > left)
+        return -1;
+    *len = off;
+    *content = n ? n : 1;
+    return 0;
+}
+
+
+/**
+ * @brief Queue the next frames of a capture to the pool
+ *
+ * Stop at a frame to decompress in order, or at a corrupted frame.
+ *
+ * @param reader The capture
+ */
+static void frames_queue(struct compress_reader *reader)
+{
+    while (!reader->streaming && !reader->corrupt &&
+           reader->next < reader->size &&
+           reader->issued - reader->consumed < reader->nb_jobs) {
+        size_t len, content;
+        if (frame_find(reader, &len, &content) < 0) {
+            reader->corrupt = 1;
+            break;
+        }
+        if (content == 0) // Too large, decompressed in order
+            break;
+        struct compress_job *job =
+            &reader->jobs[reader->issued % reader->nb_jobs];
+        job->codec = reader->codec;
+        job->level = 0;
+        job->decompress = 1;
+        job->src = reader->map + reader->next;
+        job->src_len = len;
+        pool_queue(job);
+        reader->issued++;
+        reader->next += len;
+    }
+}
+
+
+/**
+ * @brief Decompress the frame at the next offset in order
+ *
+ * @param reader The capture
+ * @param buf The buffer
+ * @param len The size of the buffer
+ * @return ssize_t The bytes decompressed, -1 if the frame is corrupted
+ */
+static ssize_t frame_stream(struct compress_reader *reader, char *buf,
+                            size_t len)
+{
+    const u_char *p = reader->map + reader->next;
+    size_t left = reader->size - reader->next;
+#ifdef HAVE_ZSTD
+    if (reader->codec == COMPRESS_ZSTD) {
+        if (reader->zstd == NULL && (reader->zstd = ZSTD_createDCtx()) == NULL)
+            return -1;
+        if (!reader->streaming)
+            ZSTD_DCtx_reset(reader->zstd, ZSTD_reset_session_only);
+        reader->streaming = 1;
+        ZSTD_inBuffer in = {p, left, 0};
+        ZSTD_outBuffer out = {buf, len, 0};
+        size_t ret = ZSTD_decompressStream(reader->zstd, &out, &in);
+        reader->next += in.pos;
+        if (ZSTD_isError(ret) || (ret != 0 && reader->next == reader->size &&
+                                  out.pos < out.size))
+            return -1;
+        if (ret == 0)
+            reader->streaming = 0;
+        return out.pos;
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (reader->codec == COMPRESS_LZ4) {
+        if (reader->lz4 == NULL &&
+            LZ4F_isError(LZ4F_createDecompressionContext(&reader->lz4,
+                                                         LZ4F_VERSION)))
+            return -1;
+        reader->streaming = 1;
+        size_t out = len, in = left;
+        size_t ret = LZ4F_decompress(reader->lz4, buf, &out, p, &in, NULL);
+        reader->next += in;
+        if (LZ4F_isError(ret) || (ret != 0 && reader->next == reader->size &&
+                                  out < len))
+            return -1;
+        if (ret == 0)
+            reader->streaming = 0;
+        return out;
+    }
+#endif
+    (void)p;
+    (void)left;
+    (void)buf;
+    (void)len;
+    return -1;
+}
+
+
+/**
+ * @brief Read function of the compressed captures
+ *
+ * @param cookie The capture
+ * @param buf The buffer
+ * @param len The size of the buffer
+ * @return ssize_t The bytes read, 0 at the end, -1 on error
+ */
+static ssize_t reader_read(void *cookie, char *buf, size_t len)
+{
+    struct compress_reader *reader = cookie;
+    size_t offset;
+    for (;;) {
+        frames_queue(reader);
+        if (reader->consumed < reader->issued) {
+            struct compress_job *job =
+                &reader->jobs[reader->consumed % reader->nb_jobs];
+            pool_wait(job);
+            offset = job->src - reader->map;
+            if (job->failed)
+                break;
+            size_t n = job->dst_len - reader->pos;
+            if (n > len)
+                n = len;
+            memcpy(buf, job->dst + reader->pos, n);
+            reader->pos += n;
+            if (reader->pos == job->dst_len) {
+                job->state = JOB_FREE;
+                reader->consumed++;
+                reader->pos = 0;
+            }
+            if (n > 0)
+                return n;
+            continue;
+        }
+        offset = reader->next;
+        if (reader->corrupt)
+            break;
+        if (reader->next == reader->size)
+            return 0;
+        ssize_t n = frame_stream(reader, buf, len);
+        if (n < 0)
+            break;
+        if (n > 0)
+            return n;
+    }
+    fprintf(stderr, "%s: corrupted frame at offset %zu\n", reader->path,
+            offset);
+    errno = EIO;
+    return -1;
+}
+
+
+/**
+ * @brief Free a compressed capture
+ *
+ * @param reader The capture
+ */
+static void reader_free(struct compress_reader *reader)
+{
+    while (reader->consumed < reader->issued) // Jobs still referenced
+        pool_wait(&reader->jobs[reader->consumed++ % reader->nb_jobs]);
+    jobs_free(reader->jobs, reader->nb_jobs);
+    if (reader->map != NULL)
+        munmap((void *)reader->map, reader->size);
+    close(reader->fd);
+#ifdef HAVE_ZSTD
+    ZSTD_freeDCtx(reader->zstd);
+#endif
+#ifdef HAVE_LZ4
+    LZ4F_freeDecompressionContext(reader->lz4);
+#endif
+    free(reader->path);
+    free(reader);
+}
+
+
+/**
+ * @brief Close function of the compressed captures
+ *
+ * @param cookie The capture
+ * @return int 0
+ */
+static int reader_close(void *cookie)
+{
+    reader_free(cookie);
+    return 0;
+}
+
+
+/**
+ * @brief Find the format of a capture file
+ *
+ * @param path The file, "-" for stdin
+ * @return int The format (enum compress_codec), COMPRESS_NONE if the file
+ * is not compressed or can't be read
+ */
+int compress_probe(const char *path)
+{
+    if (strcmp(path, "-") == 0)
+        return COMPRESS_NONE;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return COMPRESS_NONE; // Reported by libpcap
+    u_char magic[4];
+    ssize_t n = read(fd, magic, sizeof(magic));
+    close(fd);
+    if (n != sizeof(magic))
+        return COMPRESS_NONE;
+    if (le32(magic) == ZSTD_MAGIC)
+        return COMPRESS_ZSTD;
+    if (le32(magic) == LZ4_MAGIC)
+        return COMPRESS_LZ4;
+    return COMPRESS_NONE;
+}
+
+
+/**
+ * @brief Open a compressed capture file for reading
+ *
+ * The stream gives the bytes decompressed. The file must be a regular file.
+ *
+ * @param path The file
+ * @param codec The format (enum compress_codec)
+ * @return FILE* The stream, NULL on error
+ */
+FILE *compress_fopen(const char *path, int codec)
+{
+    if (!compress_supported(codec)) {
+        fprintf(stderr, "%s: compressed with %s, not supported by this "
+                        "build\n",
+                path, codec == COMPRESS_ZSTD ? "zstd" : "lz4");
+        return NULL;
+    }
+    if (pool_start() < 0)
+        return NULL;
+    struct compress_reader *reader = calloc(1, sizeof(struct compress_reader));
+    if (reader == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    reader->codec = codec;
+    reader->path = strdup(path);
+    reader->fd = open(path, O_RDONLY);
+    struct stat st;
+    if (reader->fd < 0 || fstat(reader->fd, &st) < 0) {
+        perror(path);
+        goto fail;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s: a compressed capture must be a regular file\n",
+                path);
+        goto fail;
+    }
+    reader->size = st.st_size;
+    if (reader->size > 0) {
+        void *map = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE,
+                         reader->fd, 0);
+        if (map == MAP_FAILED) {
+            perror(path);
+            goto fail;
+        }
+        madvise(map, reader->size, MADV_SEQUENTIAL);
+        reader->map = map;
+    }
+    reader->jobs = jobs_alloc(&reader->nb_jobs, 0, COMPRESS_BLOCK_LEN);
+    if (reader->path == NULL || reader->jobs == NULL)
+        goto fail;
+
+    cookie_io_functions_t functions = {
+        .read = reader_read, .write = NULL, .seek = NULL,
+        .close = reader_close};
+    FILE *stream = fopencookie(reader, "r", functions);
+    if (stream == NULL) {
+        perror("fopencookie");
+        goto fail;
+    }
+    return stream;
+
+fail:
+    if (reader->fd >= 0)
+        close(reader->fd);
+    if (reader->map != NULL)
+        munmap((void *)reader->map, reader->size);
+    if (reader->jobs != NULL)
+        jobs_free(reader->jobs, reader->nb_jobs);
+    free(reader->path);
+    free(reader);
+    return NULL;
+}
+
+
+/**
+ * @brief Stop the compression threads
+ */
+void compress_free(void)
+{
+    if (nb_workers == 0)
+        return;
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_broadcast(&work);
+    pthread_mutex_unlock(&lock);
+    for (int i = 0; i < nb_workers; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    workers = NULL;
+    nb_workers = 0;
+}
@@ -0,0 +1,1296 @@
+/**
+ * @file dfilter.c
+ * @brief Display filter definition
+ *
+ * This file contains the compiler and the evaluator of the display filter.
+ *
+ * The expression is parsed into a tree whose constant parts are folded as it
+ * is built: impossible comparisons become false, "not" and the boolean
+ * operators absorb the constants. The tree is then flattened into a program
+ * of tests, each one with a jump target for true and one for false, so that
+ * "and", "or" and "not" cost no instruction. The glob patterns are reduced to
+ * prefix, suffix or substring tests when they allow it.
+ *
+ * The evaluator loads the fields of the packet once, then follows the jumps:
+ * every test is a field load and a comparison, whatever the field. The
+ * fields of the headers are first read from the raw frame, as the prefilter
+ * does: when they decide the filter, the output of the dissectors goes
+ * straight to the capture output or is discarded. Only the packets whose
+ * match depends on the application fields are held back until dissected.
+ *
+ * @see dfilter.h
+ * @see dfilter_compile
+ * @see dfilter_end
+ */
+
+#define _GNU_SOURCE // fopencookie
+
+// General libraries
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Local header files
+#include "dfilter.h"
+#include "ethernet.h"
+#include "flow.h"
+#include "packet.h"
+
+#define DFILTER_MAX_NODES 512 /**< Nodes of the parsed expression */
+#define DFILTER_POOL_LEN 4096 /**< Bytes of string operands */
+#define DF_ACCEPT 0xffff /**< Jump target accepting the packet */
+#define DF_REJECT 0xfffe /**< Jump target rejecting the packet */
+#define DF_ALL ((1u << DF_MAX) - 1) /**< Every field */
+#define DF_LATE (1u << DF_APP | (DF_ALL & ~0u << DF_FIRST_STR)) /**< Fields given by the dissection only */
+
+/**
+ * @brief Tests of a compiled filter
+ */
+enum dfilter_op {
+    OP_PRESENT = 0, /**< The field is set */
+    OP_EQ,          /**< Numeric field equal to k */
+    OP_GT,          /**< Numeric field greater than k */
+    OP_LT,          /**< Numeric field lower than k */
+    OP_NET,         /**< Address in the network addr/prefix */
+    OP_STR_EQ,      /**< String field equal to the operand */
+    OP_PREFIX,      /**< String field starting with the operand */
+    OP_SUFFIX,      /**< String field ending with the operand */
+    OP_CONTAINS,    /**< String field holding the operand */
+    OP_GLOB         /**< String field matching the pattern */
+};
+
+/**
+ * @brief Kinds of fields
+ */
+enum field_kind {
+    KIND_NUM = 0,   /**< Unsigned integer */
+    KIND_ADDR,      /**< IPv4 or IPv6 address */
+    KIND_STR        /**< Case insensitive string */
+};
+
+/**
+ * @brief Test of a compiled filter
+ */
+struct dfilter_insn {
+    uint8_t op;         /**< enum dfilter_op */
+    uint8_t field;      /**< enum dfilter_field */
+    uint8_t family;     /**< 4 or 6, for OP_NET */
+    uint8_t prefix;     /**< Prefix length, for OP_NET */
+    uint16_t next[2];   /**< Next test if false, if true */
+    uint16_t len;       /**< Length of the string operand */
+    uint64_t k;         /**< Numeric operand */
+    uint8_t addr[16];   /**< Network, for OP_NET */
+    const char *str;    /**< String operand, lower case */
+};
+
+/**
+ * @brief Field names
+ *
+ * A field with a second field (ip.addr, port) matches if any of both does.
+ */
+static const struct {
+    const char *name;
+    uint8_t field;
+    uint8_t either;     /**< Second field, same as field if none */
+    uint8_t kind;       /**< enum field_kind */
+    uint64_t max;       /**< Largest value of a numeric field */
+} fields[] = {
+    {"frame.len", DF_FRAME_LEN, DF_FRAME_LEN, KIND_NUM, UINT32_MAX},
+    {"vlan", DF_VLAN, DF_VLAN, KIND_NUM, 4095},
+    {"ip.version", DF_IP_VERSION, DF_IP_VERSION, KIND_NUM, 6},
+    {"ip.proto", DF_IP_PROTO, DF_IP_PROTO, KIND_NUM, 255},
+    {"ip.ttl", DF_IP_TTL, DF_IP_TTL, KIND_NUM, 255},
+    {"src.port", DF_SRC_PORT, DF_SRC_PORT, KIND_NUM, 65535},
+    {"dst.port", DF_DST_PORT, DF_DST_PORT, KIND_NUM, 65535},
+    {"port", DF_SRC_PORT, DF_DST_PORT, KIND_NUM, 65535},
+    {"ip.src", DF_IP_SRC, DF_IP_SRC, KIND_ADDR, 0},
+    {"ip.dst", DF_IP_DST, DF_IP_DST, KIND_ADDR, 0},
+    {"ip.addr", DF_IP_SRC, DF_IP_DST, KIND_ADDR, 0},
+    {"dns.qname", DF_DNS_QNAME, DF_DNS_QNAME, KIND_STR, 0},
+    {"http.host", DF_HTTP_HOST, DF_HTTP_HOST, KIND_STR, 0},
+    {"tls.sni", DF_TLS_SNI, DF_TLS_SNI, KIND_STR, 0}};
+
+/**
+ * @brief Protocol names, shorthands for a field equal to a value
+ */
+static const struct {
+    const char *name;
+    uint8_t field;
+    uint64_t value;
+} keywords[] = {
+    {"ip", DF_IP_VERSION, 4},        {"ip6", DF_IP_VERSION, 6},
+    {"icmp", DF_IP_PROTO, 1},        {"igmp", DF_IP_PROTO, 2},
+    {"tcp", DF_IP_PROTO, 6},         {"udp", DF_IP_PROTO, 17},
+    {"icmp6", DF_IP_PROTO, 58},      {"http", DF_APP, APP_HTTP},
+    {"tls", DF_APP, APP_TLS},        {"smtp", DF_APP, APP_SMTP},
+    {"ftp", DF_APP, APP_FTP},        {"ftp-data", DF_APP, APP_FTP_DATA},
+    {"pop", DF_APP, APP_POP},        {"imap", DF_APP, APP_IMAP},
+    {"dns", DF_APP, APP_DNS},        {"telnet", DF_APP, APP_TELNET},
+    {"bootp", DF_APP, APP_BOOTP},    {"dhcpv6", DF_APP, APP_DHCPV6}};
+
+/**
+ * @brief tcpdump primitives, names of fields
+ */
+static const struct {
+    const char *name;
+    const char *field;
+} aliases[] = {
+    {"host", "ip.addr"},      {"net", "ip.addr"},
+    {"src host", "ip.src"},   {"src net", "ip.src"},
+    {"dst host", "ip.dst"},   {"dst net", "ip.dst"},
+    {"src port", "src.port"}, {"dst port", "dst.port"}};
+
+/**
+ * @brief Tokens of the expression
+ */
+enum token {
+    T_END = 0, T_WORD, T_STRING, T_LPAREN, T_RPAREN, T_AND, T_OR, T_NOT,
+    T_EQ, T_NE, T_LT, T_LE, T_GT, T_GE, T_MATCH, T_ERROR
+};
+
+/**
+ * @brief Nodes of the parsed expression
+ */
+enum node_type { N_TRUE = 0, N_FALSE, N_TEST, N_AND, N_OR, N_NOT };
+
+/**
+ * @brief Node of the parsed expression
+ */
+struct node {
+    uint8_t type;               /**< enum node_type */
+    struct dfilter_insn test;   /**< Test of a N_TEST node */
+    struct node *left;
+    struct node *right;
+};
+
+/**
+ * @brief State of the parser
+ */
+struct parser {
+    const char *expr;           /**< Whole expression */
+    const char *p;              /**< Next character */
+    const char *start;          /**< Start of the current token */
+    int tok;                    /**< Current token (enum token) */
+    char text[DFILTER_STR_LEN]; /**< Text of a word or a string */
+    const char *error;          /**< First error, NULL if none */
+};
+
+static struct node nodes[DFILTER_MAX_NODES]; /**< Nodes of the expression being compiled */
+static int nb_nodes = 0;
+
+static char pool[DFILTER_POOL_LEN]; /**< String operands */
+static size_t pool_len = 0;
+
+static struct dfilter_insn prog[DFILTER_MAX_INSNS]; /**< Compiled filter */
+static int nb_insns = 0;
+static int entry = DF_ACCEPT; /**< First test, or DF_ACCEPT/DF_REJECT */
+static int active = 0;
+static uint32_t wanted = 0; /**< Fields read by the filter */
+
+static uint64_t num[DF_IP_SRC]; /**< Numeric fields of the packet */
+static char strs[DF_MAX - DF_FIRST_STR][DFILTER_STR_LEN]; /**< String fields of the packet */
+static uint16_t strs_len[DF_MAX - DF_FIRST_STR];
+static uint8_t addrs[2][16]; /**< Source and destination of the packet */
+static uint32_t present = 0; /**< Fields set for the packet */
+static int early = -1; /**< Match decided by the headers, -1 if undecided */
+
+static FILE *out = NULL; /**< Output of a packet held back */
+static char *out_buf = NULL;
+static size_t out_size = 0;
+static FILE *discard = NULL; /**< Output of a rejected packet */
+
+
+/**
+ * @brief Read the next token
+ *
+ * @param ps The parser
+ */
+static void next_token(struct parser *ps)
+{
+    while (isspace((unsigned char)*ps->p))
+        ps->p++;
+    ps->start = ps->p;
+    char c = *ps->p;
+
+    if (c == '\0') {
+        ps->tok = T_END;
+        return;
+    }
+    if (isalnum((unsigned char)c) || c == ':' || c == '_') {
+        size_t n = 0;
+        while (isalnum((unsigned char)*ps->p) || strchr(".:_-/", *ps->p)) {
+            if (*ps->p == '\0')
+                break;
+            if (n + 1 < sizeof(ps->text))
+                ps->text[n++] = *ps->p;
+            ps->p++;
+        }
+        ps->text[n] = '\0';
+        if (strcmp(ps->text, "and") == 0)
+            ps->tok = T_AND;
+        else if (strcmp(ps->text, "or") == 0)
+            ps->tok = T_OR;
+        else if (strcmp(ps->text, "not") == 0)
+            ps->tok = T_NOT;
+        else
+            ps->tok = T_WORD;
+        return;
+    }
+    if (c == '"') {
+        size_t n = 0;
+        for (ps->p++; *ps->p != '"'; ps->p++) {
+            if (*ps->p == '\\' && ps->p[1] != '\0')
+                ps->p++;
+            if (*ps->p == '\0') {
+                ps->tok = T_ERROR;
+                return;
+            }
+            if (n + 1 < sizeof(ps->text))
+                ps->text[n++] = *ps->p;
+        }
+        ps->p++;
+        ps->text[n] = '\0';
+        ps->tok = T_STRING;
+        return;
+    }
+
+    static const struct {
+        const char *s;
+        int tok;
+    } ops[] = {{"&&", T_AND}, {"||", T_OR}, {"==", T_EQ}, {"!=", T_NE},
+               {"<=", T_LE},  {">=", T_GE}, {"(", T_LPAREN}, {")", T_RPAREN},
+               {"!", T_NOT},  {"=", T_EQ},  {"<", T_LT},  {">", T_GT},
+               {"~", T_MATCH}};
+    for (size_t i = 0; i < sizeof(ops) / sizeof(*ops); i++) {
+        size_t len = strlen(ops[i].s);
+        if (strncmp(ps->p, ops[i].s, len) == 0) {
+            ps->p += len;
+            ps->tok = ops[i].tok;
+            return;
+        }
+    }
+    ps->tok = T_ERROR;
+}
+
+
+/**
+ * @brief Record the first error of the parser
+ *
+ * @param ps The parser
+ * @param msg The error
+ * @return struct node* NULL
+ */
+static struct node *fail(struct parser *ps, const char *msg)
+{
+    if (ps->error == NULL) {
+        ps->error = msg;
+        fprintf(stderr, "Bad display filter - %s at offset %ld: %s\n", msg,
+                (long)(ps->start - ps->expr), ps->start);
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief Allocate a node
+ *
+ * @param ps The parser
+ * @param type The type of the node (enum node_type)
+ * @return struct node* The node, NULL if the expression is too long
+ */
+static struct node *new_node(struct parser *ps, int type)
+{
+    if (nb_nodes == DFILTER_MAX_NODES)
+        return fail(ps, "expression too long");
+    struct node *n = &nodes[nb_nodes++];
+    memset(n, 0, sizeof(*n));
+    n->type = type;
+    return n;
+}
+
+
+/**
+ * @brief Build a "not" node, folding the constants
+ *
+ * @param ps The parser
+ * @param a The operand
+ * @return struct node* The node, NULL on error
+ */
+static struct node *mk_not(struct parser *ps, struct node *a)
+{
+    if (a == NULL)
+        return NULL;
+    if (a->type == N_TRUE || a->type == N_FALSE) {
+        a->type = a->type == N_TRUE ? N_FALSE : N_TRUE;
+        return a;
+    }
+    if (a->type == N_NOT)
+        return a->left;
+    struct node *n = new_node(ps, N_NOT);
+    if (n)
+        n->left = a;
+    return n;
+}
+
+
+/**
+ * @brief Build an "and" or an "or" node, folding the constants
+ *
+ * @param ps The parser
+ * @param type N_AND or N_OR
+ * @param a The left operand
+ * @param b The right operand
+ * @return struct node* The node, NULL on error
+ */
+static struct node *mk_bool(struct parser *ps, int type, struct node *a,
+                            struct node *b)
+{
+    if (a == NULL || b == NULL)
+        return NULL;
+    int absorb = type == N_AND ? N_FALSE : N_TRUE;
+    int neutral = type == N_AND ? N_TRUE : N_FALSE;
+    if (a->type == absorb || b->type == neutral)
+        return a;
+    if (b->type == absorb || a->type == neutral)
+        return b;
+    struct node *n = new_node(ps, type);
+    if (n) {
+        n->left = a;
+        n->right = b;
+    }
+    return n;
+}
+
+
+/**
+ * @brief Build a test node
+ *
+ * @param ps The parser
+ * @param op The test (enum dfilter_op)
+ * @param field The field (enum dfilter_field)
+ * @return struct node* The node, NULL on error
+ */
+static struct node *mk_test(struct parser *ps, int op, int field)
+{
+    struct node *n = new_node(ps, N_TEST);
+    if (n) {
+        n->test.op = op;
+        n->test.field = field;
+    }
+    return n;
+}
+
+
+/**
+ * @brief Keep a string operand
+ *
+ * @param ps The parser
+ * @param s The operand
+ * @param len The length of the operand
+ * @return const char* The lower case copy, NULL if the pool is full
+ */
+static const char *pool_add(struct parser *ps, const char *s, size_t len)
+{
+    if (pool_len + len + 1 > sizeof(pool)) {
+        fail(ps, "too many strings");
+        return NULL;
+    }
+    char *copy = pool + pool_len;
+    for (size_t i = 0; i < len; i++)
+        copy[i] = tolower((unsigned char)s[i]);
+    copy[len] = '\0';
+    pool_len += len + 1;
+    return copy;
+}
+
+
+/**
+ * @brief Build the comparison of a numeric field
+ *
+ * The comparisons no value of the field can satisfy are folded to false.
+ * "!=", "<=" and ">=" are the negations of "==", ">" and "<".
+ *
+ * @param ps The parser
+ * @param f The index of the field in fields
+ * @param field The field (enum dfilter_field)
+ * @param tok The operator (enum token)
+ * @param value The text of the value
+ * @return struct node* The node, NULL on error
+ */
+static struct node *num_test(struct parser *ps, int f, int field, int tok,
+                             const char *value)
+{
+    char *end;
+    uint64_t k = strtoull(value, &end, 0);
+    if (*value < '0' || *value > '9' || *end != '\0')
+        return fail(ps, "number expected");
+
+    int op, negate = 0;
+    switch (tok) {
+    case T_EQ: op = OP_EQ; break;
+    case T_NE: op = OP_EQ; negate = 1; break;
+    case T_GT: op = OP_GT; break;
+    case T_LE: op = OP_GT; negate = 1; break;
+    case T_LT: op = OP_LT; break;
+    case T_GE: op = OP_LT; negate = 1; break;
+    default: return fail(ps, "bad operator for a number");
+    }
+
+    struct node *n;
+    if ((op == OP_EQ && k > fields[f].max) ||
+        (op == OP_GT && k >= fields[f].max) || (op == OP_LT && k == 0)) {
+        n = new_node(ps, N_FALSE);
+    } else {
+        n = mk_test(ps, op, field);
+        if (n)
+            n->test.k = k;
+    }
+    return negate ? mk_not(ps, n) : n;
+}
+
+
+/**
+ * @brief Build the comparison of an address field
+ *
+ * @param ps The parser
+ * @param field The field (enum dfilter_field)
+ * @param tok The operator (enum token)
+ * @param value The address, with an optional prefix length
+ * @return struct node* The node, NULL on error
+ */
+static struct node *addr_test(struct parser *ps, int field, int tok,
+                              const char *value)
+{
+    if (tok != T_EQ && tok != T_NE)
+        return fail(ps, "bad operator for an address");
+
+    char host[INET6_ADDRSTRLEN];
+    const char *slash = strchr(value, '/');
+    size_t len = slash ? (size_t)(slash - value) : strlen(value);
+    if (len >= sizeof(host))
+        return fail(ps, "address expected");
+    memcpy(host, value, len);
+    host[len] = '\0';
+
+    struct node *n = mk_test(ps, OP_NET, field);
+    if (n == NULL)
+        return NULL;
+    int bits;
+    if (inet_pton(AF_INET, host, n->test.addr) == 1) {
+        n->test.family = 4;
+        bits = 32;
+    } else if (inet_pton(AF_INET6, host, n->test.addr) == 1) {
+        n->test.family = 6;
+        bits = 128;
+    } else {
+        return fail(ps, "address expected");
+    }
+
+    int prefix = bits;
+    if (slash) {
+        char *end;
+        prefix = strtol(slash + 1, &end, 10);
+        if (slash[1] < '0' || slash[1] > '9' || *end != '\0' || prefix > bits)
+            return fail(ps, "bad prefix length");
+    }
+    n->test.prefix = prefix;
+    for (int i = prefix; i < bits; i++) // Clear the host part
+        n->test.addr[i / 8] &= ~(0x80 >> (i % 8));
+    return tok == T_NE ? mk_not(ps, n) : n;
+}
+
+
+/**
+ * @brief Build the comparison of a string field
+ *
+ * A "~" pattern made of a text with a leading or trailing "*" (or both) is
+ * tested as a suffix, a prefix or a substring. Only the other patterns are
+ * matched as globs.
+ *
+ * @param ps The parser
+ * @param field The field (enum dfilter_field)
+ * @param tok The operator (enum token)
+ * @param value The string or pattern
+ * @return struct node* The node, NULL on error
+ */
+static struct node *str_test(struct parser *ps, int field, int tok,
+                             const char *value)
+{
+    if (tok != T_EQ && tok != T_NE && tok != T_MATCH)
+        return fail(ps, "bad operator for a string");
+
+    size_t len = strlen(value);
+    int op = OP_STR_EQ;
+    if (tok == T_MATCH) {
+        size_t lead = 0, trail = 0;
+        while (value[lead] == '*')
+            lead++;
+        while (trail < len - lead && value[len - 1 - trail] == '*')
+            trail++;
+        const char *inner = value + lead;
+        size_t inner_len = len - lead - trail;
+        if (memchr(inner, '*', inner_len) || memchr(inner, '?', inner_len)) {
+            op = OP_GLOB;
+        } else if (inner_len == 0) {
+            return mk_test(ps, OP_PRESENT, field);
+        } else {
+            op = lead ? (trail ? OP_CONTAINS : OP_SUFFIX) :
+                        (trail ? OP_PREFIX : OP_STR_EQ);
+            value = inner;
+            len = inner_len;
+        }
+    }
+
+    struct node *n = mk_test(ps, op, field);
+    if (n == NULL)
+        return NULL;
+    n->test.str = pool_add(ps, value, len);
+    n->test.len = len;
+    if (n->test.str == NULL)
+        return NULL;
+    return tok == T_NE ? mk_not(ps, n) : n;
+}
+
+
+/**
+ * @brief Parse a test: a field, a comparison or a protocol name
+ *
+ * A value right after a field, as in the tcpdump primitives "port 80" or
+ * "src host 10.0.0.1", is compared for equality.
+ *
+ * @param ps The parser, on a word
+ * @return struct node* The node, NULL on error
+ */
+static struct node *parse_test(struct parser *ps)
+{
+    char name[DFILTER_STR_LEN];
+    snprintf(name, sizeof(name), "%s", ps->text);
+
+    if (strcmp(name, "true") == 0 || strcmp(name, "false") == 0) {
+        next_token(ps);
+        return new_node(ps, name[0] == 't' ? N_TRUE : N_FALSE);
+    }
+    for (size_t i = 0; i < sizeof(keywords) / sizeof(*keywords); i++) {
+        if (strcmp(name, keywords[i].name) == 0) {
+            next_token(ps);
+            struct node *n = mk_test(ps, OP_EQ, keywords[i].field);
+            if (n)
+                n->test.k = keywords[i].value;
+            return n;
+        }
+    }
+
+    // tcpdump primitives: [src|dst] host, net or port
+    if (strcmp(name, "src") == 0 || strcmp(name, "dst") == 0) {
+        next_token(ps);
+        size_t len = strlen(ps->text);
+        if (ps->tok != T_WORD || len + 5 > sizeof(name))
+            return fail(ps, "host, net or port expected");
+        name[3] = ' ';
+        memcpy(name + 4, ps->text, len + 1);
+    }
+    for (size_t i = 0; i < sizeof(aliases) / sizeof(*aliases); i++) {
+        if (strcmp(name, aliases[i].name) == 0)
+            snprintf(name, sizeof(name), "%s", aliases[i].field);
+    }
+
+    int f = -1;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(*fields); i++) {
+        if (strcmp(name, fields[i].name) == 0)
+            f = i;
+    }
+    if (f < 0)
+        return fail(ps, "unknown field");
+
+    next_token(ps);
+    int tok = ps->tok;
+    if (tok == T_WORD || tok == T_STRING) { // "port 80" as in tcpdump
+        tok = T_EQ;
+    } else if (tok >= T_EQ && tok <= T_MATCH) {
+        next_token(ps);
+        if (ps->tok != T_WORD && ps->tok != T_STRING)
+            return fail(ps, "value expected");
+    } else { // A lone field tests its presence
+        return mk_test(ps, OP_PRESENT, fields[f].field);
+    }
+    char value[DFILTER_STR_LEN];
+    snprintf(value, sizeof(value), "%s", ps->text);
+
+    // ip.addr and port: one of both fields, "!=" being the negation of "=="
+    int either = fields[f].either != fields[f].field;
+    int eq = tok == T_NE ? T_EQ : tok;
+    struct node *a = NULL, *b = NULL;
+    for (int i = 0; i <= either; i++) {
+        int field = i ? fields[f].either : fields[f].field;
+        struct node *n;
+        if (fields[f].kind == KIND_NUM)
+            n = num_test(ps, f, field, either ? eq : tok, value);
+        else if (fields[f].kind == KIND_ADDR)
+            n = addr_test(ps, field, either ? eq : tok, value);
+        else
+            n = str_test(ps, field, tok, value);
+        if (i == 0)
+            a = n;
+        else
+            b = n;
+    }
+    if (either) {
+        a = mk_bool(ps, N_OR, a, b);
+        if (tok == T_NE)
+            a = mk_not(ps, a);
+    }
+    if (a)
+        next_token(ps);
+    return a;
+}
+
+
+static struct node *parse_or(struct parser *ps);
+
+
+/**
+ * @brief Parse a negation, a parenthesized expression or a test
+ *
+ * @param ps The parser
+ * @return struct node* The node, NULL on error
+ */
+static struct node *parse_unary(struct parser *ps)
+{
+    switch (ps->tok) {
+    case T_NOT:
+        next_token(ps);
+        return mk_not(ps, parse_unary(ps));
+    case T_LPAREN: {
+        next_token(ps);
+        struct node *n = parse_or(ps);
+        if (n == NULL)
+            return NULL;
+        if (ps->tok != T_RPAREN)
+            return fail(ps, "')' expected");
+        next_token(ps);
+        return n;
+    }
+    case T_WORD:
+        return parse_test(ps);
+    case T_END:
+        return fail(ps, "unexpected end");
+    default:
+        return fail(ps, "syntax error");
+    }
+}
+
+
+/**
+ * @brief Parse a conjunction
+ *
+ * @param ps The parser
+ * @return struct node* The node, NULL on error
+ */
+static struct node *parse_and(struct parser *ps)
+{
+    struct node *n = parse_unary(ps);
+    while (n && ps->tok == T_AND) {
+        next_token(ps);
+        n = mk_bool(ps, N_AND, n, parse_unary(ps));
+    }
+    return n;
+}
+
+
+/**
+ * @brief Parse a disjunction
+ *
+ * @param ps The parser
+ * @return struct node* The node, NULL on error
+ */
+static struct node *parse_or(struct parser *ps)
+{
+    struct node *n = parse_and(ps);
+    while (n && ps->tok == T_OR) {
+        next_token(ps);
+        n = mk_bool(ps, N_OR, n, parse_and(ps));
+    }
+    return n;
+}
+
+
+/**
+ * @brief Flatten a tree into tests
+ *
+ * The tests are emitted backwards, the targets being known: the right operand
+ * of "and" and "or" first, then the left one jumping to it. "not" swaps the
+ * targets.
+ *
+ * @param n The tree
+ * @param t The target if the tree is true
+ * @param f The target if the tree is false
+ * @return int The first test of the tree, a target, or -1 if too long
+ */
+static int emit(const struct node *n, int t, int f)
+{
+    int right;
+    switch (n->type) {
+    case N_TRUE:
+        return t;
+    case N_FALSE:
+        return f;
+    case N_NOT:
+        return emit(n->left, f, t);
+    case N_AND:
+        right = emit(n->right, t, f);
+        return right < 0 ? -1 : emit(n->left, right, f);
+    case N_OR:
+        right = emit(n->right, t, f);
+        return right < 0 ? -1 : emit(n->left, t, right);
+    default:
+        if (nb_insns == DFILTER_MAX_INSNS)
+            return -1;
+        prog[nb_insns] = n->test;
+        prog[nb_insns].next[1] = t;
+        prog[nb_insns].next[0] = f;
+        return nb_insns++;
+    }
+}
+
+
+/**
+ * @brief Write to the output of a rejected packet
+ *
+ * @param cookie Unused
+ * @param buf The data, dropped
+ * @param size The size of the data
+ * @return ssize_t The size of the data
+ */
+static ssize_t discard_write(void *cookie, const char *buf, size_t size)
+{
+    (void)cookie;
+    (void)buf;
+    return size;
+}
+
+
+/**
+ * @brief Compile a display filter
+ *
+ * The errors are printed on stderr.
+ *
+ * @param expr The filter expression
+ * @return int 0 on success, -1 if the expression is malformed
+ */
+int dfilter_compile(const char *expr)
+{
+    struct parser ps = {expr, expr, expr, T_END, "", NULL};
+    nb_nodes = 0;
+    pool_len = 0;
+    nb_insns = 0;
+
+    next_token(&ps);
+    struct node *root = parse_or(&ps);
+    if (root && ps.tok != T_END)
+        root = fail(&ps, "operator expected");
+    if (root == NULL)
+        return -1;
+
+    entry = emit(root, DF_ACCEPT, DF_REJECT);
+    if (entry < 0) {
+        fprintf(stderr, "Bad display filter - more than %d tests\n",
+                DFILTER_MAX_INSNS);
+        return -1;
+    }
+
+    // Emitted backwards: reverse to run the tests in order
+    for (int i = 0; i < nb_insns / 2; i++) {
+        struct dfilter_insn tmp = prog[i];
+        prog[i] = prog[nb_insns - 1 - i];
+        prog[nb_insns - 1 - i] = tmp;
+    }
+    wanted = 0;
+    for (int i = 0; i < nb_insns; i++) {
+        for (int j = 0; j < 2; j++) {
+            if (prog[i].next[j] < DF_REJECT)
+                prog[i].next[j] = nb_insns - 1 - prog[i].next[j];
+        }
+        wanted |= 1u << prog[i].field;
+    }
+    if (entry < DF_REJECT)
+        entry = nb_insns - 1 - entry;
+
+    if (out == NULL) {
+        out = open_memstream(&out_buf, &out_size);
+        if (out == NULL) {
+            perror("open_memstream");
+            return -1;
+        }
+    }
+    if (discard == NULL) {
+        cookie_io_functions_t functions = {
+            .read = NULL, .write = discard_write, .seek = NULL,
+            .close = NULL};
+        discard = fopencookie(NULL, "w", functions);
+        if (discard == NULL) {
+            perror("fopencookie");
+            return -1;
+        }
+    }
+    active = 1;
+    return 0;
+}
+
+
+/**
+ * @brief Get the name of a field
+ *
+ * @param field The field (enum dfilter_field)
+ * @return const char* The name of the field
+ */
+static const char *field_name(int field)
+{
+    for (size_t i = 0; i < sizeof(fields) / sizeof(*fields); i++) {
+        if (fields[i].field == field)
+            return fields[i].name;
+    }
+    return "app";
+}
+
+
+/**
+ * @brief Print a jump target
+ *
+ * @param target The target
+ */
+static void print_target(int target)
+{
+    if (target == DF_ACCEPT)
+        printf(" accept");
+    else if (target == DF_REJECT)
+        printf(" reject");
+    else
+        printf(" %03d", target);
+}
+
+
+/**
+ * @brief Print a compiled display filter
+ *
+ * One line per test, with its jump targets.
+ */
+void dfilter_dump(void)
+{
+    static const char *ops[] = {"present", "==", ">", "<", "in", "==",
+                                "starts with", "ends with", "contains",
+                                "matches"};
+    char addr[INET6_ADDRSTRLEN];
+
+    if (entry >= DF_REJECT) {
+        printf("(000) %s\n", entry == DF_ACCEPT ? "accept" : "reject");
+        return;
+    }
+    for (int i = 0; i < nb_insns; i++) {
+        const struct dfilter_insn *ins = &prog[i];
+        printf("(%03d) %s %s", i, field_name(ins->field), ops[ins->op]);
+        if (ins->op >= OP_EQ && ins->op <= OP_LT)
+            printf(" %lu", (unsigned long)ins->k);
+        else if (ins->op == OP_NET)
+            printf(" %s/%u",
+                   inet_ntop(ins->family == 4 ? AF_INET : AF_INET6,
+                             ins->addr, addr, sizeof(addr)),
+                   ins->prefix);
+        else if (ins->op >= OP_STR_EQ)
+            printf(" \"%s\"", ins->str);
+        printf("\tjt");
+        print_target(ins->next[1]);
+        printf(" jf");
+        print_target(ins->next[0]);
+        printf("\n");
+    }
+}
+
+
+/**
+ * @brief Check if a display filter is set
+ *
+ * @return int 1 if a display filter is compiled, 0 otherwise
+ */
+int dfilter_active(void)
+{
+    return active;
+}
+
+
+/**
+ * @brief Check if the display filter reads a field
+ *
+ * The dissectors skip the decoding of fields no filter needs, or that the
+ * headers of the packet already made useless.
+ *
+ * @param field The field (enum dfilter_field)
+ * @return int 1 if the filter reads the field, 0 otherwise
+ */
+int dfilter_wants(int field)
+{
+    return early < 0 && ((wanted >> field) & 1);
+}
+
+
+/**
+ * @brief Set a string field of the current packet
+ *
+ * The value is copied, and truncated to DFILTER_STR_LEN - 1 characters.
+ *
+ * @param field The field (enum dfilter_field)
+ * @param value The value
+ */
+void dfilter_set(int field, const char *value)
+{
+    if (!dfilter_wants(field) || field < DF_FIRST_STR)
+        return;
+    char *dst = strs[field - DF_FIRST_STR];
+    size_t len = 0;
+    for (; value[len] != '\0' && len + 1 < DFILTER_STR_LEN; len++)
+        dst[len] = tolower((unsigned char)value[len]);
+    dst[len] = '\0';
+    strs_len[field - DF_FIRST_STR] = len;
+    present |= 1u << field;
+}
+
+
+/**
+ * @brief Check if an address is in a network
+ *
+ * @param addr The address
+ * @param net The network
+ * @param prefix The prefix length of the network
+ * @return int 1 if the address is in the network, 0 otherwise
+ */
+static int in_network(const uint8_t *addr, const uint8_t *net, int prefix)
+{
+    if (memcmp(addr, net, prefix / 8) != 0)
+        return 0;
+    if (prefix % 8 == 0)
+        return 1;
+    uint8_t mask = 0xff << (8 - prefix % 8);
+    return (addr[prefix / 8] & mask) == net[prefix / 8];
+}
+
+
+/**
+ * @brief Match a glob pattern
+ *
+ * "*" matches any characters, "?" a single one.
+ *
+ * @param p The pattern
+ * @param s The string
+ * @return int 1 if the string matches, 0 otherwise
+ */
+static int glob_match(const char *p, const char *s)
+{
+    const char *star = NULL, *back = NULL;
+    while (*s) {
+        if (*p == '?' || (*p == *s && *p != '*')) {
+            p++;
+            s++;
+        } else if (*p == '*') {
+            star = p++;
+            back = s;
+        } else if (star) {
+            p = star + 1;
+            s = ++back;
+        } else {
+            return 0;
+        }
+    }
+    while (*p == '*')
+        p++;
+    return *p == '\0';
+}
+
+
+/**
+ * @brief Run a test
+ *
+ * A test on a field the packet doesn't have is false.
+ *
+ * @param ins The test
+ * @return int 1 if the test is true, 0 otherwise
+ */
+static int run_test(const struct dfilter_insn *ins)
+{
+    if (!((present >> ins->field) & 1))
+        return 0;
+    const char *s = "";
+    size_t len = 0;
+    if (ins->field >= DF_FIRST_STR) {
+        s = strs[ins->field - DF_FIRST_STR];
+        len = strs_len[ins->field - DF_FIRST_STR];
+    }
+
+    switch (ins->op) {
+    case OP_EQ:
+        return num[ins->field] == ins->k;
+    case OP_GT:
+        return num[ins->field] > ins->k;
+    case OP_LT:
+        return num[ins->field] < ins->k;
+    case OP_NET:
+        return num[DF_IP_VERSION] == ins->family &&
+               in_network(addrs[ins->field == DF_IP_DST], ins->addr,
+                          ins->prefix);
+    case OP_STR_EQ:
+        return len == ins->len && memcmp(s, ins->str, len) == 0;
+    case OP_PREFIX:
+        return len >= ins->len && memcmp(s, ins->str, ins->len) == 0;
+    case OP_SUFFIX:
+        return len >= ins->len &&
+               memcmp(s + len - ins->len, ins->str, ins->len) == 0;
+    case OP_CONTAINS:
+        return strstr(s, ins->str) != NULL;
+    case OP_GLOB:
+        return glob_match(ins->str, s);
+    default:
+        return 1;
+    }
+}
+
+
+/**
+ * @brief Load the numeric fields of the current packet
+ *
+ * @param len The length of the frame on the wire
+ */
+static void load_fields(uint32_t len)
+{
+    const struct flow_key *key = &current_packet.key;
+    num[DF_FRAME_LEN] = len;
+    num[DF_VLAN] = current_packet.vlan;
+    present |= 1u << DF_FRAME_LEN | 1u << DF_VLAN;
+    if (key->family == AF_INET || key->family == AF_INET6) {
+        num[DF_IP_VERSION] = key->family == AF_INET ? 4 : 6;
+        num[DF_IP_PROTO] = key->proto;
+        num[DF_IP_TTL] = current_packet.ttl;
+        memcpy(addrs[0], key->saddr, 16);
+        memcpy(addrs[1], key->daddr, 16);
+        present |= 1u << DF_IP_VERSION | 1u << DF_IP_PROTO |
+                   1u << DF_IP_TTL | 1u << DF_IP_SRC | 1u << DF_IP_DST;
+    }
+    if (key->proto == IPPROTO_TCP || key->proto == IPPROTO_UDP) {
+        num[DF_SRC_PORT] = key->sport;
+        num[DF_DST_PORT] = key->dport;
+        present |= 1u << DF_SRC_PORT | 1u << DF_DST_PORT;
+    }
+    if (current_packet.flow && current_packet.flow->app > APP_NONE) {
+        num[DF_APP] = current_packet.flow->app;
+        present |= 1u << DF_APP;
+    }
+}
+
+
+/**
+ * @brief Load the fields of the headers of a frame
+ *
+ * The headers are read from the raw frame as the dissectors read them. A
+ * field is known if the dissection can only give it the same value: the
+ * application and string fields of TCP and UDP, and the fields of a tunneled
+ * or truncated packet, are left to the dissection.
+ *
+ * @param packet The frame
+ * @param caplen The captured size of the frame
+ * @param len The length of the frame on the wire
+ * @return uint32_t The known fields
+ */
+static uint32_t load_headers(const u_char *packet, uint32_t caplen,
+                             uint32_t len)
+{
+    num[DF_FRAME_LEN] = len;
+    num[DF_VLAN] = 0;
+    present = 1u << DF_FRAME_LEN | 1u << DF_VLAN;
+    if (caplen < sizeof(struct ether_header))
+        return DF_ALL; // Not dissected
+
+    uint32_t off = sizeof(struct ether_header);
+    uint16_t type = packet[12] << 8 | packet[13];
+    while (type == ETHERTYPE_VLAN || type == ETHERTYPE_QINQ) {
+        if (caplen < off + VLAN_TAG_LEN)
+            return DF_ALL; // Dropped by the Ethernet layer
+        num[DF_VLAN] = (packet[off] << 8 | packet[off + 1]) & 0x0fff;
+        type = packet[off + 2] << 8 | packet[off + 3];
+        off += VLAN_TAG_LEN;
+    }
+
+    uint32_t known = 1u << DF_FRAME_LEN | 1u << DF_VLAN;
+    uint32_t l4;
+    long size;
+    if (type == ETHERTYPE_IP) {
+        const struct ip *ip = (const struct ip *)(packet + off);
+        if (caplen < off + sizeof(struct ip) || ip->ip_p == IPPROTO_IPV6)
+            return known;
+        num[DF_IP_VERSION] = 4;
+        num[DF_IP_PROTO] = ip->ip_p;
+        num[DF_IP_TTL] = ip->ip_ttl;
+        memset(addrs, 0, sizeof(addrs));
+        memcpy(addrs[0], &ip->ip_src, 4);
+        memcpy(addrs[1], &ip->ip_dst, 4);
+        l4 = off + ip->ip_hl * 4;
+        size = be16toh(ip->ip_len) - ip->ip_hl * 4;
+    } else if (type == ETHERTYPE_IPV6) {
+        const struct ip6_hdr *ip6 = (const struct ip6_hdr *)(packet + off);
+        if (caplen < off + sizeof(struct ip6_hdr))
+            return known;
+        num[DF_IP_VERSION] = 6;
+        num[DF_IP_TTL] = ip6->ip6_hlim;
+        memcpy(addrs[0], &ip6->ip6_src, 16);
+        memcpy(addrs[1], &ip6->ip6_dst, 16);
+        uint8_t next = ip6->ip6_nxt;
+        int plen = be16toh(ip6->ip6_plen);
+        l4 = off + sizeof(struct ip6_hdr);
+        while (next == IPPROTO_HOPOPTS || next == IPPROTO_DSTOPTS ||
+               next == IPPROTO_ROUTING) {
+            if (plen < 8 || caplen < l4 + 8) {
+                next = 0; // Dropped by the IPv6 layer
+                break;
+            }
+            int ext = (packet[l4 + 1] + 1) * 8;
+            if (plen < ext) {
+                next = 0; // Dropped by the IPv6 layer
+                break;
+            }
+            next = packet[l4];
+            l4 += ext;
+            plen -= ext;
+        }
+        num[DF_IP_PROTO] = next;
+        size = plen;
+    } else {
+        return DF_ALL; // No IP field
+    }
+    present |= 1u << DF_IP_VERSION | 1u << DF_IP_PROTO | 1u << DF_IP_TTL |
+               1u << DF_IP_SRC | 1u << DF_IP_DST;
+    known |= 1u << DF_IP_VERSION | 1u << DF_IP_PROTO | 1u << DF_IP_TTL |
+             1u << DF_IP_SRC | 1u << DF_IP_DST;
+
+    if (num[DF_IP_PROTO] != IPPROTO_TCP && num[DF_IP_PROTO] != IPPROTO_UDP)
+        return DF_ALL; // No port, no flow
+    // The transport layers only see the captured bytes of the payload
+    if (size > (long)caplen - (long)l4)
+        size = (long)caplen - (long)l4;
+    if (size < (num[DF_IP_PROTO] == IPPROTO_TCP ? 20 : 8))
+        return known;
+    num[DF_SRC_PORT] = packet[l4] << 8 | packet[l4 + 1];
+    num[DF_DST_PORT] = packet[l4 + 2] << 8 | packet[l4 + 3];
+    present |= 1u << DF_SRC_PORT | 1u << DF_DST_PORT;
+    return DF_ALL & ~DF_LATE;
+}
+
+
+/**
+ * @brief Run the filter on the known fields of a packet
+ *
+ * A test on an unknown field follows both of its jumps. As the jumps only go
+ * forward, a single pass over the program finds every outcome.
+ *
+ * @param known The known fields
+ * @return int 1 if the packet matches, 0 if not, -1 if undecided
+ */
+static int run_known(uint32_t known)
+{
+    if (entry >= DF_REJECT)
+        return entry == DF_ACCEPT;
+    uint8_t reached[DFILTER_MAX_INSNS] = {0};
+    int accept = 0, reject = 0;
+    reached[entry] = 1;
+    for (int pc = entry; pc < nb_insns; pc++) {
+        if (!reached[pc])
+            continue;
+        int lo = 0, hi = 1;
+        if ((known >> prog[pc].field) & 1)
+            lo = hi = run_test(&prog[pc]);
+        for (int res = lo; res <= hi; res++) {
+            int next = prog[pc].next[res];
+            if (next == DF_ACCEPT)
+                accept = 1;
+            else if (next == DF_REJECT)
+                reject = 1;
+            else
+                reached[next] = 1;
+        }
+    }
+    return accept && reject ? -1 : accept;
+}
+
+
+/**
+ * @brief Start the dissection of a packet
+ *
+ * The filter is run on the headers of the frame. If they decide it, the
+ * output of the dissectors goes to the stream, or is discarded. Otherwise it
+ * is held back until the packet is matched by dfilter_end.
+ *
+ * @param packet The frame
+ * @param caplen The captured size of the frame
+ * @param len The length of the frame on the wire
+ * @param stream The output of the capture
+ * @return FILE* The output of the dissectors
+ */
+FILE *dfilter_begin(const u_char *packet, uint32_t caplen, uint32_t len,
+                    FILE *stream)
+{
+    if (!active)
+        return stream;
+    early = run_known(load_headers(packet, caplen, len));
+    if (early >= 0)
+        return early ? stream : discard;
+    present = 0; // Loaded again after the dissection
+    rewind(out);
+    return out;
+}
+
+
+/**
+ * @brief End the dissection of a packet
+ *
+ * Run the filter on the fields of a packet held back and print its output if
+ * it matches.
+ *
+ * @param len The length of the frame on the wire
+ * @param stream The output of the capture
+ * @return int 1 if the packet matches, 0 otherwise
+ */
+int dfilter_end(uint32_t len, FILE *stream)
+{
+    if (!active)
+        return 1;
+    if (early >= 0)
+        return early;
+    fflush(out);
+    long size = ftell(out);
+
+    load_fields(len);
+    int pc = entry;
+    while (pc < DF_REJECT)
+        pc = prog[pc].next[run_test(&prog[pc])];
+
+    if (pc == DF_ACCEPT && size > 0)
+        fwrite(out_buf, 1, size, stream);
+    return pc == DF_ACCEPT;
+}
+
+
+/**
+ * @brief Free the display filter
+ */
+void dfilter_free(void)
+{
+    if (out)
+        fclose(out);
+    if (discard)
+        fclose(discard);
+    free(out_buf);
+    out = NULL;
+    out_buf = NULL;
+    discard = NULL;
+    active = 0;
+}
@@ -0,0 +1,215 @@
+/**
+ * @file dpi.c
+ * @brief Application protocol classification
+ *
+ * This file contains the definition of the heuristic classifier. The well-known
+ * ports only give a hint: the signature checks of every application layer are
+ * run on the first payload bytes of a flow, so that HTTP on 8080 or TLS on 8443
+ * are recognized as well.
+ *
+ * @see dpi.h
+ * @see dpi_classify
+ */
+
+#define _GNU_SOURCE /* strcasestr */
+
+// General libraries
+#include <netinet/in.h>
+#include <string.h>
+
+// Local header files
+#include "dpi.h"
+#include "bootp.h"
+#include "dhcpv6.h"
+#include "dns.h"
+#include "ftp.h"
+#include "http.h"
+#include "imap.h"
+#include "pop.h"
+#include "smtp.h"
+#include "telnet.h"
+#include "tls.h"
+
+#define APP_BIT(app) (1u << (app)) /**< Bit of an application in a mask */
+#define DPI_BANNER_LEN 128 /**< Bytes of the first line searched for keywords */
+
+/**
+ * @brief Applications with a signature check over TCP
+ */
+#define TCP_SIGNED_APPS                                                    \
+    (APP_BIT(APP_HTTP) | APP_BIT(APP_TLS) | APP_BIT(APP_SMTP) |            \
+     APP_BIT(APP_FTP) | APP_BIT(APP_POP) | APP_BIT(APP_IMAP) |             \
+     APP_BIT(APP_TELNET))
+
+/**
+ * @brief Applications with a signature check over UDP
+ */
+#define UDP_SIGNED_APPS                                                    \
+    (APP_BIT(APP_DNS) | APP_BIT(APP_BOOTP) | APP_BIT(APP_DHCPV6))
+
+/**
+ * @brief Well-known ports
+ */
+static const struct {
+    uint8_t proto;
+    uint16_t port;
+    uint8_t app;
+} port_hints[] = {
+    {IPPROTO_TCP, 20, APP_FTP},   {IPPROTO_TCP, 21, APP_FTP},
+    {IPPROTO_TCP, 23, APP_TELNET}, {IPPROTO_TCP, 25, APP_SMTP},
+    {IPPROTO_TCP, 53, APP_DNS},   {IPPROTO_TCP, 80, APP_HTTP},
+    {IPPROTO_TCP, 110, APP_POP},  {IPPROTO_TCP, 143, APP_IMAP},
+    {IPPROTO_TCP, 443, APP_TLS},  {IPPROTO_TCP, 465, APP_TLS},
+    {IPPROTO_TCP, 587, APP_SMTP}, {IPPROTO_TCP, 993, APP_TLS},
+    {IPPROTO_TCP, 995, APP_TLS},  {IPPROTO_UDP, 53, APP_DNS},
+    {IPPROTO_UDP, 67, APP_BOOTP}, {IPPROTO_UDP, 68, APP_BOOTP},
+    {IPPROTO_UDP, 546, APP_DHCPV6}, {IPPROTO_UDP, 547, APP_DHCPV6},
+}; /**< Application usually found behind a port */
+
+
+/**
+ * @brief Get the application usually found on the ports of a flow
+ *
+ * @param key The flow key
+ * @return int The application protocol, APP_UNKNOWN if none
+ */
+static int port_hint(const struct flow_key *key)
+{
+    for (size_t i = 0; i < sizeof(port_hints) / sizeof(port_hints[0]); i++) {
+        if (port_hints[i].proto == key->proto &&
+            (port_hints[i].port == key->sport ||
+             port_hints[i].port == key->dport)) {
+            return port_hints[i].app;
+        }
+    }
+    return APP_UNKNOWN;
+}
+
+
+/**
+ * @brief Run the signature checks on a payload
+ *
+ * The text checks only look at the first bytes of the payload. They are run on
+ * a NUL padded copy so that they never read past a short payload.
+ *
+ * @param proto The transport protocol
+ * @param payload The payload
+ * @param len The captured length of the payload
+ * @return unsigned int Mask of the matching applications
+ */
+static unsigned int signatures(uint8_t proto, const u_char *payload, int len)
+{
+    unsigned int mask = 0;
+
+    if (proto == IPPROTO_UDP) {
+        if (is_dns(payload, len))
+            mask |= APP_BIT(APP_DNS);
+        if (is_bootp(payload, len))
+            mask |= APP_BIT(APP_BOOTP);
+        if (is_dhcpv6(payload, len))
+            mask |= APP_BIT(APP_DHCPV6);
+        return mask;
+    }
+
+    u_char probe[DPI_PROBE_LEN + 1] = {0};
+    memcpy(probe, payload, len < DPI_PROBE_LEN ? len : DPI_PROBE_LEN);
+
+    if (is_tls(payload, len))
+        mask |= APP_BIT(APP_TLS);
+    if (is_telnet(payload, len))
+        mask |= APP_BIT(APP_TELNET);
+    if (is_http(probe))
+        mask |= APP_BIT(APP_HTTP);
+    if (is_smtp(probe))
+        mask |= APP_BIT(APP_SMTP);
+    if (is_ftp(probe))
+        mask |= APP_BIT(APP_FTP);
+    if (is_pop(probe))
+        mask |= APP_BIT(APP_POP);
+    if (is_imap(payload, len))
+        mask |= APP_BIT(APP_IMAP);
+    return mask;
+}
+
+
+/**
+ * @brief Look for the protocol name in the first line of a payload
+ *
+ * Servers usually name their protocol in their greeting (e.g. "220 mx ESMTP"),
+ * which tells apart the text protocols sharing commands or reply codes.
+ *
+ * @param payload The payload
+ * @param len The length of the payload
+ * @return int The application protocol named, APP_UNKNOWN if none
+ */
+static int banner_hint(const u_char *payload, int len)
+{
+    char line[DPI_BANNER_LEN + 1];
+    int n = 0;
+    while (n < len && n < DPI_BANNER_LEN && payload[n] != '\r' &&
+           payload[n] != '\n') {
+        line[n] = payload[n] ? payload[n] : ' ';
+        n++;
+    }
+    line[n] = '\0';
+
+    if (strcasestr(line, "SMTP"))
+        return APP_SMTP;
+    if (strcasestr(line, "FTP"))
+        return APP_FTP;
+    if (strcasestr(line, "POP"))
+        return APP_POP;
+    if (strcasestr(line, "IMAP"))
+        return APP_IMAP;
+    return APP_UNKNOWN;
+}
+
+
+/**
+ * @brief Classify a flow
+ *
+ * Run the application signature checks on the payload of a flow that has no
+ * verdict yet. The verdict is cached in the flow so that later packets skip
+ * the classification.
+ *
+ * @param flow The flow of the packet
+ * @param payload The transport payload
+ * @param len The length of the payload
+ * @return int The application protocol of the flow (enum app_proto)
+ *
+ * @note When no verdict is found after DPI_MAX_TRIES payload packets, the flow
+ * falls back to its well-known port, if any.
+ */
+int dpi_classify(struct flow *flow, const u_char *payload, int len)
+{
+    if (flow->app != APP_UNKNOWN)
+        return flow->app;
+    if (len <= 0)
+        return APP_UNKNOWN;
+
+    unsigned int signed_apps = flow->key.proto == IPPROTO_UDP ?
+                                   UDP_SIGNED_APPS :
+                                   TCP_SIGNED_APPS;
+    unsigned int candidates = signatures(flow->key.proto, payload, len);
+    int hint = port_hint(&flow->key);
+    int app = APP_UNKNOWN;
+
+    if (candidates == 0) {
+        // Nothing to check the port against
+        if (hint != APP_UNKNOWN && !(signed_apps & APP_BIT(hint)))
+            app = hint;
+    } else if (hint != APP_UNKNOWN && (candidates & APP_BIT(hint))) {
+        app = hint;
+    } else if ((candidates & (candidates - 1)) == 0) {
+        app = __builtin_ctz(candidates);
+    } else {
+        int banner = banner_hint(payload, len);
+        if (banner != APP_UNKNOWN && (candidates & APP_BIT(banner)))
+            app = banner;
+    }
+
+    if (app == APP_UNKNOWN && ++flow->tries >= DPI_MAX_TRIES)
+        app = hint != APP_UNKNOWN ? hint : APP_NONE;
+    flow->app = app;
+    return app;
+}
@@ -0,0 +1,245 @@
+/**
+ * @file expect.c
+ * @brief Expected flows definition
+ *
+ * This file contains the definition of the expectation table. Expectations
+ * are kept in a chained hash table indexed by their destination endpoint, so
+ * that a SYN is matched with a single bucket walk. Stale expectations are
+ * dropped while walking the buckets, and by a sweep of the whole table every
+ * second of capture time.
+ *
+ * @see expect.h
+ * @see expect_match
+ */
+
+// General libraries
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <string.h>
+
+// Local header files
+#include "expect.h"
+#include "hash.h"
+#include "packet.h"
+
+#define EXPECT_BUCKETS 1024 /**< Number of buckets, must be a power of 2 */
+#define EXPECT_SWEEP_PERIOD 1000000000ULL /**< Time between two sweeps (ns) */
+
+/**
+ * @brief Expected flow
+ */
+struct expect {
+    uint8_t family;
+    uint8_t proto;
+    uint16_t port;      /**< Destination port, in host order */
+    uint8_t addr[16];   /**< Destination address, in network order */
+    uint8_t app;        /**< Application of the flow (enum app_proto) */
+    uint64_t ts;        /**< Registration time (ns) */
+    void *data;         /**< Dissector state given to the flow */
+    void (*free_data)(void *data); /**< Release the dissector state */
+    struct expect *next; /**< Next expectation in the same bucket */
+};
+
+static struct expect *expect_table[EXPECT_BUCKETS]; /**< Expectation buckets */
+static int nb_expects; /**< Expectations pending */
+static uint64_t next_sweep; /**< Capture time of the next sweep (ns) */
+
+
+/**
+ * @brief Hash an endpoint
+ *
+ * FNV-1a hash of the address, port and protocol.
+ *
+ * @param proto The transport protocol
+ * @param addr The address
+ * @param port The port
+ * @return uint32_t The bucket of the endpoint
+ */
+static uint32_t hash_endpoint(uint8_t proto, const uint8_t *addr,
+                              uint16_t port)
+{
+    uint32_t h = fnv1a32(FNV32_OFFSET, addr, 16);
+    h = fnv1a32(fnv1a32(h, &port, sizeof(port)), &proto, 1);
+    return h & (EXPECT_BUCKETS - 1);
+}
+
+
+/**
+ * @brief Release an expectation
+ *
+ * @param exp The expectation
+ */
+static void expect_free(struct expect *exp)
+{
+    if (exp->free_data != NULL)
+        exp->free_data(exp->data);
+    free(exp);
+    nb_expects--;
+}
+
+
+/**
+ * @brief Find an expectation
+ *
+ * Stale expectations of the bucket are released on the way.
+ *
+ * @param family The address family
+ * @param proto The transport protocol
+ * @param addr The destination address
+ * @param port The destination port
+ * @return struct expect** The link pointing to the expectation, or to the
+ * end of the bucket if not found
+ */
+static struct expect **expect_find(uint8_t family, uint8_t proto,
+                                   const uint8_t *addr, uint16_t port)
+{
+    struct expect **link =
+        &expect_table[hash_endpoint(proto, addr, port)];
+    while (*link != NULL) {
+        struct expect *exp = *link;
+        if (current_packet.ts - exp->ts > EXPECT_TIMEOUT) {
+            *link = exp->next;
+            expect_free(exp);
+            continue;
+        }
+        if (exp->family == family && exp->proto == proto &&
+            exp->port == port && memcmp(exp->addr, addr, 16) == 0)
+            return link;
+        link = &exp->next;
+    }
+    return link;
+}
+
+
+/**
+ * @brief Register an expected flow
+ *
+ * The flow is expected towards the given endpoint. An older expectation for
+ * the same endpoint is replaced.
+ *
+ * @param family AF_INET or AF_INET6
+ * @param proto IPPROTO_TCP or IPPROTO_UDP
+ * @param addr The destination address, in network order
+ * @param port The destination port, in host order
+ * @param app The application of the expected flow (enum app_proto)
+ * @param data The dissector state given to the flow
+ * @param free_data Release the dissector state, may be NULL
+ * @return int 0 on success, -1 if the table is full or on allocation failure
+ */
+int expect_add(uint8_t family, uint8_t proto, const uint8_t *addr,
+               uint16_t port, uint8_t app, void *data,
+               void (*free_data)(void *data))
+{
+    uint8_t full[16] = {0};
+    memcpy(full, addr, family == AF_INET6 ? 16 : 4);
+
+    struct expect **link = expect_find(family, proto, full, port);
+    if (*link != NULL) { // Renegotiated
+        struct expect *old = *link;
+        *link = old->next;
+        expect_free(old);
+    }
+
+    if (nb_expects >= EXPECT_MAX_ENTRIES)
+        return -1;
+    struct expect *exp = calloc(1, sizeof(struct expect));
+    if (exp == NULL)
+        return -1;
+    nb_expects++;
+    exp->family = family;
+    exp->proto = proto;
+    exp->port = port;
+    memcpy(exp->addr, full, sizeof(exp->addr));
+    exp->app = app;
+    exp->ts = current_packet.ts;
+    exp->data = data;
+    exp->free_data = free_data;
+
+    uint32_t bucket = hash_endpoint(proto, full, port);
+    exp->next = expect_table[bucket];
+    expect_table[bucket] = exp;
+    return 0;
+}
+
+
+/**
+ * @brief Match a new flow against the expectations
+ *
+ * If the destination of the packet is expected, the flow gets the
+ * application and the dissector state of the expectation, which is removed.
+ *
+ * @param flow The flow of the packet, without a verdict yet
+ * @param key The flow key as seen on the wire
+ * @return int 1 if the flow was expected, 0 otherwise
+ */
+int expect_match(struct flow *flow, const struct flow_key *key)
+{
+    if (flow->app != APP_UNKNOWN)
+        return 0;
+
+    struct expect **link =
+        expect_find(key->family, key->proto, key->daddr, key->dport);
+    struct expect *exp = *link;
+    if (exp == NULL)
+        return 0;
+    *link = exp->next;
+
+    if (flow->free_data != NULL)
+        flow->free_data(flow->data);
+    flow->app = exp->app;
+    flow->data = exp->data;
+    flow->free_data = exp->free_data;
+    free(exp);
+    nb_expects--;
+    return 1;
+}
+
+
+/**
+ * @brief Advance the clock of the expectation table
+ *
+ * Called before every packet, release the expectations older than
+ * EXPECT_TIMEOUT about once per second of capture time.
+ *
+ * @param now The capture time of the packet (ns)
+ */
+void expect_tick(uint64_t now)
+{
+    if (now < next_sweep)
+        return;
+    next_sweep = now + EXPECT_SWEEP_PERIOD;
+    if (nb_expects == 0)
+        return;
+    for (int i = 0; i < EXPECT_BUCKETS; i++) {
+        struct expect **link = &expect_table[i];
+        while (*link != NULL) {
+            struct expect *exp = *link;
+            if (now > exp->ts + EXPECT_TIMEOUT) {
+                *link = exp->next;
+                expect_free(exp);
+            } else {
+                link = &exp->next;
+            }
+        }
+    }
+}
+
+
+/**
+ * @brief Free the expectation table
+ *
+ * Release every pending expectation.
+ */
+void expect_table_free(void)
+{
+    for (int i = 0; i < EXPECT_BUCKETS; i++) {
+        struct expect *exp = expect_table[i];
+        while (exp != NULL) {
+            struct expect *next = exp->next;
+            expect_free(exp);
+            exp = next;
+        }
+        expect_table[i] = NULL;
+    }
+    next_sweep = 0;
+}
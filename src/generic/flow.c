@@ -0,0 +1,499 @@
+/**
+ * @file flow.c
+ * @brief Flow table definition
+ *
+ * This file contains the definition of the flow table. Flows are indexed by
+ * the CRC32c of their normalized key in an open addressing table. Every slot
+ * has a control byte holding 7 bits of the hash, so that a probe compares the
+ * 16 control bytes of a group at once and only reads the flows whose bits
+ * match. The flows themselves are allocated apart: the table can grow without
+ * moving them, and the pointers kept by the dissectors stay valid.
+ *
+ * @see flow.h
+ * @see flow_lookup
+ */
+
+// General libraries
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// Local header files
+#include "flow.h"
+
+#define FLOW_GROUP 16 /**< Slots probed at once */
+#define FLOW_MIN_SLOTS 4096 /**< Initial number of slots, a power of 2 */
+#define CTRL_EMPTY 0x80 /**< Control byte of a free slot */
+#define CTRL_DELETED 0xfe /**< Control byte of a released slot */
+#define FLOW_SWEEP_PERIOD 1000000000ULL /**< Time between two sweeps (ns) */
+#define FLOW_CLOSED_TIMEOUT 5000000000ULL /**< Time kept after a FIN or RST (ns) */
+#define FLOW_IDLE_DEFAULT 15000000000ULL /**< Idle timeout until set (ns) */
+#define FLOW_ACTIVE_DEFAULT 1800000000000ULL /**< Active timeout until set (ns) */
+#define TCP_FIN 0x01
+#define TCP_RST 0x04
+
+static uint8_t *ctrl = NULL;        /**< Control bytes, 7 bits of the hash */
+static struct flow **slots = NULL;  /**< Flows */
+static size_t nb_slots = 0;         /**< Number of slots, a power of 2 */
+static size_t used = 0;             /**< Slots holding a flow */
+static size_t deleted = 0;          /**< Slots released since the last rehash */
+
+static uint64_t flow_now = 0;       /**< Capture time of the current packet (ns) */
+static uint64_t next_sweep = 0;     /**< Capture time of the next sweep (ns) */
+static uint64_t idle_timeout = FLOW_IDLE_DEFAULT;     /**< Idle timeout (ns) */
+static uint64_t active_timeout = FLOW_ACTIVE_DEFAULT; /**< Active timeout (ns) */
+static flow_expire_fn expire_handler = NULL;
+
+static uint32_t crc32c_table[256];  /**< CRC32c of every byte */
+static uint32_t (*hash_key)(const struct flow_key *key) = NULL;
+
+
+/**
+ * @brief Normalize a flow key
+ *
+ * Order the endpoints so that both directions of a conversation give the
+ * same key.
+ *
+ * @param key The key as seen on the wire
+ * @param norm The normalized key
+ * @return int 1 if the endpoints were swapped, 0 otherwise
+ */
+int flow_key_normalize(const struct flow_key *key, struct flow_key *norm)
+{
+    int cmp = memcmp(key->saddr, key->daddr, sizeof(key->saddr));
+    if (cmp == 0)
+        cmp = (int)key->sport - (int)key->dport;
+
+    memset(norm, 0, sizeof(*norm));
+    norm->family = key->family;
+    norm->proto = key->proto;
+    if (cmp <= 0) {
+        memcpy(norm->saddr, key->saddr, sizeof(norm->saddr));
+        memcpy(norm->daddr, key->daddr, sizeof(norm->daddr));
+        norm->sport = key->sport;
+        norm->dport = key->dport;
+    } else {
+        memcpy(norm->saddr, key->daddr, sizeof(norm->saddr));
+        memcpy(norm->daddr, key->saddr, sizeof(norm->daddr));
+        norm->sport = key->dport;
+        norm->dport = key->sport;
+    }
+    return cmp > 0;
+}
+
+
+/**
+ * @brief Hash a flow key in software
+ *
+ * CRC32c (Castagnoli) of a normalized key, one byte at a time.
+ *
+ * @param key The normalized key
+ * @return uint32_t The hash
+ */
+static uint32_t hash_key_soft(const struct flow_key *key)
+{
+    const uint8_t *p = (const uint8_t *)key;
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i < sizeof(*key); i++)
+        crc = crc32c_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+
+#if defined(__x86_64__)
+/**
+ * @brief Hash a flow key with the SSE4.2 instruction
+ *
+ * Same CRC32c as hash_key_soft, 8 bytes at a time.
+ *
+ * @param key The normalized key
+ * @return uint32_t The hash
+ */
+__attribute__((target("sse4.2")))
+static uint32_t hash_key_sse42(const struct flow_key *key)
+{
+    const uint8_t *p = (const uint8_t *)key;
+    uint64_t crc = 0xffffffff;
+    size_t i = 0;
+    for (; i + 8 <= sizeof(*key); i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, sizeof(word));
+        crc = _mm_crc32_u64(crc, word);
+    }
+    for (; i < sizeof(*key); i++)
+        crc = _mm_crc32_u8((uint32_t)crc, p[i]);
+    return ~(uint32_t)crc;
+}
+#endif
+
+
+/**
+ * @brief Choose the hash function
+ *
+ * The CRC32c instruction is used when the processor has it.
+ */
+static void hash_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        crc32c_table[i] = crc;
+    }
+    hash_key = hash_key_soft;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        hash_key = hash_key_sse42;
+#endif
+}
+
+
+/**
+ * @brief Find the control bytes of a group equal to a value
+ *
+ * @param group The 16 control bytes of the group, aligned on 16 bytes
+ * @param value The value
+ * @return uint32_t Bit i set if the control byte i is equal to the value
+ */
+static inline uint32_t group_match(const uint8_t *group, uint8_t value)
+{
+#if defined(__SSE2__)
+    __m128i bytes = _mm_load_si128((const __m128i *)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(value)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < FLOW_GROUP; i++)
+        mask |= (uint32_t)(group[i] == value) << i;
+    return mask;
+#endif
+}
+
+
+/**
+ * @brief Find a free slot for a hash
+ *
+ * The groups are probed in triangular order, which visits every group of a
+ * power of 2 table.
+ *
+ * @param hash The hash
+ * @return size_t The first free or released slot
+ */
+static size_t find_free(uint32_t hash)
+{
+    size_t mask = nb_slots / FLOW_GROUP - 1;
+    size_t group = (hash >> 7) & mask;
+    for (size_t probe = 1;; probe++) {
+        const uint8_t *bytes = ctrl + group * FLOW_GROUP;
+        uint32_t avail = group_match(bytes, CTRL_EMPTY) |
+                         group_match(bytes, CTRL_DELETED);
+        if (avail)
+            return group * FLOW_GROUP + __builtin_ctz(avail);
+        group = (group + probe) & mask;
+    }
+}
+
+
+/**
+ * @brief Resize the table
+ *
+ * Every flow is inserted again, the released slots are dropped.
+ *
+ * @param size The new number of slots, a power of 2
+ * @return int 0 on success, -1 on allocation failure
+ */
+static int rehash(size_t size)
+{
+    uint8_t *old_ctrl = ctrl;
+    struct flow **old_slots = slots;
+    size_t old_size = nb_slots;
+
+    uint8_t *new_ctrl = aligned_alloc(FLOW_GROUP, size);
+    struct flow **new_slots = malloc(size * sizeof(struct flow *));
+    if (new_ctrl == NULL || new_slots == NULL) {
+        free(new_ctrl);
+        free(new_slots);
+        return -1;
+    }
+    memset(new_ctrl, CTRL_EMPTY, size);
+    ctrl = new_ctrl;
+    slots = new_slots;
+    nb_slots = size;
+    deleted = 0;
+
+    for (size_t i = 0; i < old_size; i++) {
+        if (old_ctrl[i] & CTRL_EMPTY)
+            continue;
+        struct flow *flow = old_slots[i];
+        size_t slot = find_free(flow->hash);
+        ctrl[slot] = flow->hash & 0x7f;
+        slots[slot] = flow;
+    }
+    free(old_ctrl);
+    free(old_slots);
+    return 0;
+}
+
+
+/**
+ * @brief Release the slot of a flow
+ *
+ * @param slot The slot
+ */
+static void remove_slot(size_t slot)
+{
+    struct flow *flow = slots[slot];
+    if (flow->free_data != NULL)
+        flow->free_data(flow->data);
+    free(flow);
+    ctrl[slot] = CTRL_DELETED;
+    used--;
+    deleted++;
+}
+
+
+/**
+ * @brief Find the flow of a normalized key
+ *
+ * @param norm The normalized key
+ * @param hash The hash of the key
+ * @return struct flow* The flow, NULL if there is none
+ */
+static struct flow *find_flow(const struct flow_key *norm, uint32_t hash)
+{
+    if (ctrl == NULL)
+        return NULL;
+    uint8_t tag = hash & 0x7f;
+    size_t mask = nb_slots / FLOW_GROUP - 1;
+    size_t group = (hash >> 7) & mask;
+    for (size_t probe = 1;; probe++) {
+        const uint8_t *bytes = ctrl + group * FLOW_GROUP;
+        for (uint32_t match = group_match(bytes, tag); match;
+             match &= match - 1) {
+            struct flow *flow = slots[group * FLOW_GROUP + __builtin_ctz(match)];
+            if (flow->hash == hash &&
+                memcmp(&flow->key, norm, sizeof(*norm)) == 0)
+                return flow;
+        }
+        if (group_match(bytes, CTRL_EMPTY))
+            return NULL; // The key would have been inserted here
+        group = (group + probe) & mask;
+    }
+}
+
+
+struct flow *flow_find(const struct flow_key *key, uint8_t *dir)
+{
+    struct flow_key norm;
+    int swapped = flow_key_normalize(key, &norm);
+
+    if (hash_key == NULL)
+        hash_init();
+    struct flow *flow = find_flow(&norm, hash_key(&norm));
+    if (flow != NULL && dir != NULL)
+        *dir = swapped == flow->swapped ? FLOW_DIR_ORIG : FLOW_DIR_REPLY;
+    return flow;
+}
+
+
+/**
+ * @brief Look up a flow
+ *
+ * Find the flow matching the key in either direction, create it if needed.
+ *
+ * @param key The flow key as seen on the wire
+ * @param dir Where to store the direction of the packet (FLOW_DIR_*), may be NULL
+ * @return struct flow* The flow, NULL on allocation failure
+ */
+struct flow *flow_lookup(const struct flow_key *key, uint8_t *dir)
+{
+    struct flow_key norm;
+    int swapped = flow_key_normalize(key, &norm);
+
+    if (hash_key == NULL)
+        hash_init();
+    // Keep at least 1/8 of the slots free so that every probe ends
+    if (ctrl == NULL || (used + deleted + 1) * 8 > nb_slots * 7) {
+        size_t size = nb_slots ? nb_slots : FLOW_MIN_SLOTS;
+        if ((used + 1) * 16 > size * 7)
+            size *= 2;
+        if (rehash(size) < 0)
+            return NULL;
+    }
+
+    uint32_t hash = hash_key(&norm);
+    struct flow *found = find_flow(&norm, hash);
+    if (found != NULL) {
+        if (dir != NULL)
+            *dir = swapped == found->swapped ? FLOW_DIR_ORIG : FLOW_DIR_REPLY;
+        return found;
+    }
+
+    struct flow *flow = calloc(1, sizeof(struct flow));
+    if (flow == NULL)
+        return NULL;
+    flow->key = norm;
+    flow->swapped = swapped;
+    flow->hash = hash;
+    flow->first = flow->last = flow_now;
+    if (dir != NULL)
+        *dir = FLOW_DIR_ORIG;
+
+    size_t slot = find_free(hash);
+    if (ctrl[slot] == CTRL_DELETED)
+        deleted--;
+    ctrl[slot] = hash & 0x7f;
+    slots[slot] = flow;
+    used++;
+    return flow;
+}
+
+
+/**
+ * @brief Account a packet in its flow
+ *
+ * @param flow The flow
+ * @param dir The direction of the packet (FLOW_DIR_*)
+ * @param bytes The size of the IP packet
+ * @param tcp_flags The TCP flags of the packet, 0 for other protocols
+ */
+void flow_count(struct flow *flow, uint8_t dir, uint32_t bytes,
+                uint8_t tcp_flags)
+{
+    if (flow->packets[FLOW_DIR_ORIG] + flow->packets[FLOW_DIR_REPLY] == 0)
+        flow->first = flow_now;
+    flow->last = flow_now;
+    flow->packets[dir]++;
+    flow->bytes[dir] += bytes;
+    flow->tcp_flags[dir] |= tcp_flags;
+}
+
+
+/**
+ * @brief Set the expiry of the flows
+ *
+ * Without handler, the idle and closed flows are still released.
+ *
+ * @param idle Idle timeout (ns)
+ * @param active Active timeout (ns), a record is cut every active timeout
+ * @param handler Called on every expired flow, and on every flow left at the
+ * end of the capture, NULL if none
+ */
+void flow_expire_set(uint64_t idle, uint64_t active, flow_expire_fn handler)
+{
+    idle_timeout = idle;
+    active_timeout = active;
+    expire_handler = handler;
+}
+
+
+/**
+ * @brief Check if a TCP flow is closed
+ *
+ * @param flow The flow
+ * @return int 1 after a RST or a FIN in both directions, 0 otherwise
+ */
+static int flow_closed(const struct flow *flow)
+{
+    uint8_t flags = flow->tcp_flags[FLOW_DIR_ORIG] |
+                    flow->tcp_flags[FLOW_DIR_REPLY];
+    return (flags & TCP_RST) ||
+           (flow->tcp_flags[FLOW_DIR_ORIG] & flow->tcp_flags[FLOW_DIR_REPLY] &
+            TCP_FIN);
+}
+
+
+/**
+ * @brief Expire the flows
+ *
+ * The idle and closed flows are given to the handler, if any, and released.
+ * The flows older than the active timeout are given to the handler, then their
+ * counters start again.
+ */
+static void flow_sweep(void)
+{
+    for (size_t i = 0; i < nb_slots; i++) {
+        if (ctrl[i] & CTRL_EMPTY)
+            continue;
+        struct flow *flow = slots[i];
+        int counted = flow->packets[FLOW_DIR_ORIG] +
+                      flow->packets[FLOW_DIR_REPLY] > 0;
+        uint64_t idle = flow_now - flow->last;
+        if (idle >= idle_timeout ||
+            (flow_closed(flow) && idle >= FLOW_CLOSED_TIMEOUT)) {
+            if (counted && expire_handler != NULL)
+                expire_handler(flow, idle >= idle_timeout ? FLOW_END_IDLE :
+                                                            FLOW_END_CLOSED);
+            remove_slot(i);
+        } else if (counted && expire_handler != NULL &&
+                   flow_now - flow->first >= active_timeout) {
+            expire_handler(flow, FLOW_END_ACTIVE);
+            memset(flow->packets, 0, sizeof(flow->packets));
+            memset(flow->bytes, 0, sizeof(flow->bytes));
+            memset(flow->tcp_flags, 0, sizeof(flow->tcp_flags));
+        }
+    }
+}
+
+
+/**
+ * @brief Advance the clock of the flow table
+ *
+ * Called before every packet, expire the flows about once per second of
+ * capture time.
+ *
+ * @param now The capture time of the packet (ns)
+ */
+void flow_tick(uint64_t now)
+{
+    if (now > flow_now)
+        flow_now = now;
+    if (flow_now < next_sweep)
+        return;
+    if (next_sweep != 0 && ctrl != NULL)
+        flow_sweep();
+    next_sweep = flow_now + FLOW_SWEEP_PERIOD;
+}
+
+
+/**
+ * @brief Call a function on every flow
+ *
+ * @param fn The function, called with the flow and arg
+ * @param arg The argument given to fn
+ */
+void flow_table_walk(void (*fn)(struct flow *flow, void *arg), void *arg)
+{
+    for (size_t i = 0; i < nb_slots; i++)
+        if (!(ctrl[i] & CTRL_EMPTY))
+            fn(slots[i], arg);
+}
+
+
+/**
+ * @brief Free the flow table
+ *
+ * Release every flow of the table, after giving it to the expiry handler.
+ */
+void flow_table_free(void)
+{
+    for (size_t i = 0; i < nb_slots; i++) {
+        if (ctrl[i] & CTRL_EMPTY)
+            continue;
+        struct flow *flow = slots[i];
+        if (expire_handler != NULL &&
+            flow->packets[FLOW_DIR_ORIG] + flow->packets[FLOW_DIR_REPLY] > 0)
+            expire_handler(flow, flow_closed(flow) ? FLOW_END_CLOSED :
+                                                     FLOW_END_FORCED);
+        remove_slot(i);
+    }
+    free(ctrl);
+    free(slots);
+    ctrl = NULL;
+    slots = NULL;
+    nb_slots = used = deleted = 0;
+}
@@ -0,0 +1,373 @@
+/**
+ * @file flowexport.c
+ * @brief Flow export definition
+ *
+ * This file contains the definition of the flow export. The IPFIX records
+ * are gathered in messages of up to IPFIX_MSG_LEN bytes, the first message
+ * holding the templates of the IPv4 and IPv6 records. The JSON records are
+ * written one per line.
+ *
+ * @see flowexport.h
+ * @see flow_export_record
+ */
+
+// General libraries
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+// Local header files
+#include "aio.h"
+#include "flowexport.h"
+#include "format.h"
+
+#define IPFIX_VERSION 10
+#define IPFIX_MSG_LEN 65535 /**< Largest IPFIX message */
+#define IPFIX_HDR_LEN 16 /**< Size of the message header */
+#define IPFIX_SET_HDR_LEN 4 /**< Size of a set header */
+#define IPFIX_RECORD_MAX 128 /**< Largest data record */
+#define IPFIX_TEMPLATE_SET 2 /**< Set ID of the template sets */
+#define IPFIX_TEMPLATE_V4 256 /**< Template of the IPv4 records */
+#define IPFIX_TEMPLATE_V6 257 /**< Template of the IPv6 records */
+#define IPFIX_REVERSE 0x8000 /**< Enterprise bit of the reverse elements */
+#define IPFIX_REVERSE_PEN 29305 /**< Enterprise number of the reverse elements */
+#define IPFIX_VARLEN 0xffff /**< Length of a variable length element */
+
+/**
+ * @brief Information element of a template
+ */
+struct ipfix_field {
+    uint16_t id;        /**< Element ID, IPFIX_REVERSE for a reverse element */
+    uint16_t len;       /**< Length, IPFIX_VARLEN if variable */
+};
+
+/**
+ * @brief Elements of a record, the addresses are added by the template
+ */
+static const struct ipfix_field fields[] = {
+    {152, 8},                   /**< flowStartMilliseconds */
+    {153, 8},                   /**< flowEndMilliseconds */
+    {7, 2},                     /**< sourceTransportPort */
+    {11, 2},                    /**< destinationTransportPort */
+    {4, 1},                     /**< protocolIdentifier */
+    {136, 1},                   /**< flowEndReason */
+    {6, 2},                     /**< tcpControlBits */
+    {6 | IPFIX_REVERSE, 2},     /**< reverseTcpControlBits */
+    {2, 8},                     /**< packetDeltaCount */
+    {1, 8},                     /**< octetDeltaCount */
+    {2 | IPFIX_REVERSE, 8},     /**< reversePacketDeltaCount */
+    {1 | IPFIX_REVERSE, 8},     /**< reverseOctetDeltaCount */
+    {96, IPFIX_VARLEN}          /**< applicationName */
+};
+
+/**
+ * @brief Names of the applications (enum app_proto)
+ */
+static const char *app_names[APP_MAX] = {
+    [APP_HTTP] = "http",   [APP_TLS] = "tls",         [APP_SMTP] = "smtp",
+    [APP_FTP] = "ftp",     [APP_POP] = "pop",         [APP_IMAP] = "imap",
+    [APP_DNS] = "dns",     [APP_TELNET] = "telnet",   [APP_BOOTP] = "bootp",
+    [APP_DHCPV6] = "dhcpv6", [APP_FTP_DATA] = "ftp-data"};
+
+/**
+ * @brief Names of the reasons (enum flow_end)
+ */
+static const char *end_names[] = {"", "idle", "active", "closed", "forced"};
+
+static FILE *output = NULL;
+static const char *output_path = NULL;
+static int output_format = FLOW_FORMAT_JSON;
+static unsigned long nb_records = 0; /**< Records exported */
+
+static uint8_t msg[IPFIX_MSG_LEN]; /**< IPFIX message being filled */
+static size_t msg_len = 0;          /**< Bytes of the message, 0 if none */
+static size_t set_start = 0;        /**< Offset of the open set, 0 if none */
+static uint16_t set_id = 0;         /**< Template of the open set */
+static uint32_t msg_time = 0;       /**< Export time of the message (s) */
+static uint32_t sequence = 0;       /**< Data records sent before the message */
+static int templates_sent = 0;
+
+
+/**
+ * @brief Write a 16 bits integer in network order
+ *
+ * @param p The destination
+ * @param v The value
+ * @return uint8_t* The byte after the value
+ */
+static uint8_t *put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+    return p + 2;
+}
+
+
+/**
+ * @brief Write a 32 bits integer in network order
+ *
+ * @param p The destination
+ * @param v The value
+ * @return uint8_t* The byte after the value
+ */
+static uint8_t *put32(uint8_t *p, uint32_t v)
+{
+    return put16(put16(p, v >> 16), v);
+}
+
+
+/**
+ * @brief Write a 64 bits integer in network order
+ *
+ * @param p The destination
+ * @param v The value
+ * @return uint8_t* The byte after the value
+ */
+static uint8_t *put64(uint8_t *p, uint64_t v)
+{
+    return put32(put32(p, v >> 32), v);
+}
+
+
+/**
+ * @brief Close the open set of the message
+ */
+static void ipfix_close_set(void)
+{
+    if (set_start == 0)
+        return;
+    put16(msg + set_start + 2, msg_len - set_start);
+    set_start = 0;
+}
+
+
+/**
+ * @brief Write the message being filled
+ */
+static void ipfix_flush(void)
+{
+    if (msg_len == 0)
+        return;
+    ipfix_close_set();
+    uint8_t *p = put16(msg, IPFIX_VERSION);
+    p = put16(p, msg_len);
+    p = put32(p, msg_time);
+    p = put32(p, sequence);
+    put32(p, 0); // Observation domain
+    if (fwrite(msg, 1, msg_len, output) != msg_len)
+        perror("fwrite");
+    sequence = nb_records;
+    msg_len = 0;
+}
+
+
+/**
+ * @brief Open a set in the message
+ *
+ * @param id The set ID
+ */
+static void ipfix_open_set(uint16_t id)
+{
+    if (msg_len == 0)
+        msg_len = IPFIX_HDR_LEN;
+    ipfix_close_set();
+    set_start = msg_len;
+    set_id = id;
+    put16(msg + msg_len, id);
+    msg_len += IPFIX_SET_HDR_LEN;
+}
+
+
+/**
+ * @brief Add a template record to the open set
+ *
+ * @param id The template ID
+ * @param addr_len The length of the addresses, 4 or 16
+ */
+static void ipfix_template(uint16_t id, uint16_t addr_len)
+{
+    int count = sizeof(fields) / sizeof(*fields) + 2;
+    uint8_t *p = put16(msg + msg_len, id);
+    p = put16(p, count);
+    p = put16(p, addr_len == 4 ? 8 : 27); // source{IPv4,IPv6}Address
+    p = put16(p, addr_len);
+    p = put16(p, addr_len == 4 ? 12 : 28); // destination{IPv4,IPv6}Address
+    p = put16(p, addr_len);
+    for (size_t i = 0; i < sizeof(fields) / sizeof(*fields); i++) {
+        p = put16(p, fields[i].id);
+        p = put16(p, fields[i].len);
+        if (fields[i].id & IPFIX_REVERSE)
+            p = put32(p, IPFIX_REVERSE_PEN);
+    }
+    msg_len = p - msg;
+}
+
+
+/**
+ * @brief Add an IPFIX data record to the message
+ *
+ * @param flow The flow
+ * @param reason Why the record ends (enum flow_end)
+ * @param rev 1 if the initiator is the destination of the key
+ */
+static void ipfix_record(const struct flow *flow, int reason, int rev)
+{
+    if (!templates_sent) {
+        ipfix_open_set(IPFIX_TEMPLATE_SET);
+        ipfix_template(IPFIX_TEMPLATE_V4, 4);
+        ipfix_template(IPFIX_TEMPLATE_V6, 16);
+        templates_sent = 1;
+    }
+    if (msg_len + IPFIX_RECORD_MAX > IPFIX_MSG_LEN)
+        ipfix_flush();
+    uint16_t id = flow->key.family == AF_INET ? IPFIX_TEMPLATE_V4 :
+                                                IPFIX_TEMPLATE_V6;
+    if (set_start == 0 || set_id != id)
+        ipfix_open_set(id);
+
+    int addr_len = flow->key.family == AF_INET ? 4 : 16;
+    const char *app = app_names[flow->app] ? app_names[flow->app] : "";
+    uint8_t *p = msg + msg_len;
+    memcpy(p, rev ? flow->key.daddr : flow->key.saddr, addr_len);
+    p += addr_len;
+    memcpy(p, rev ? flow->key.saddr : flow->key.daddr, addr_len);
+    p += addr_len;
+    p = put64(p, flow->first / 1000000);
+    p = put64(p, flow->last / 1000000);
+    p = put16(p, rev ? flow->key.dport : flow->key.sport);
+    p = put16(p, rev ? flow->key.sport : flow->key.dport);
+    *p++ = flow->key.proto;
+    *p++ = reason;
+    p = put16(p, flow->tcp_flags[FLOW_DIR_ORIG]);
+    p = put16(p, flow->tcp_flags[FLOW_DIR_REPLY]);
+    p = put64(p, flow->packets[FLOW_DIR_ORIG]);
+    p = put64(p, flow->bytes[FLOW_DIR_ORIG]);
+    p = put64(p, flow->packets[FLOW_DIR_REPLY]);
+    p = put64(p, flow->bytes[FLOW_DIR_REPLY]);
+    *p = strlen(app);
+    memcpy(p + 1, app, *p);
+    msg_len = p + 1 + *p - msg;
+    if (flow->last / 1000000000 > msg_time)
+        msg_time = flow->last / 1000000000;
+}
+
+
+/**
+ * @brief Format TCP flags
+ *
+ * @param flags The flags
+ * @param buf The destination, at least 9 bytes
+ * @return char* The destination
+ */
+static char *format_flags(uint8_t flags, char *buf)
+{
+    static const char letters[] = "FSRPAUEC";
+    int len = 0;
+    for (int i = 0; i < 8; i++)
+        if (flags & (1 << i))
+            buf[len++] = letters[i];
+    buf[len] = '\0';
+    return buf;
+}
+
+
+/**
+ * @brief Write a JSON record
+ *
+ * @param flow The flow
+ * @param reason Why the record ends (enum flow_end)
+ * @param rev 1 if the initiator is the destination of the key
+ */
+static void json_record(const struct flow *flow, int reason, int rev)
+{
+    char src[IPV6_STR_LEN], dst[IPV6_STR_LEN];
+    char *(*format)(const uint8_t *, char *) =
+        flow->key.family == AF_INET ? format_ipv4 : format_ipv6;
+    format(rev ? flow->key.daddr : flow->key.saddr, src);
+    format(rev ? flow->key.saddr : flow->key.daddr, dst);
+
+    fprintf(output,
+            "{\"start\":%lu.%09lu,\"end\":%lu.%09lu,\"proto\":%u,"
+            "\"src\":\"%s\",\"sport\":%u,\"dst\":\"%s\",\"dport\":%u,"
+            "\"packets\":%lu,\"bytes\":%lu,\"rev_packets\":%lu,"
+            "\"rev_bytes\":%lu",
+            (unsigned long)(flow->first / 1000000000),
+            (unsigned long)(flow->first % 1000000000),
+            (unsigned long)(flow->last / 1000000000),
+            (unsigned long)(flow->last % 1000000000), flow->key.proto, src,
+            rev ? flow->key.dport : flow->key.sport, dst,
+            rev ? flow->key.sport : flow->key.dport,
+            (unsigned long)flow->packets[FLOW_DIR_ORIG],
+            (unsigned long)flow->bytes[FLOW_DIR_ORIG],
+            (unsigned long)flow->packets[FLOW_DIR_REPLY],
+            (unsigned long)flow->bytes[FLOW_DIR_REPLY]);
+    if (flow->key.proto == IPPROTO_TCP) {
+        char flags[9], rev_flags[9];
+        fprintf(output, ",\"flags\":\"%s\",\"rev_flags\":\"%s\"",
+                format_flags(flow->tcp_flags[FLOW_DIR_ORIG], flags),
+                format_flags(flow->tcp_flags[FLOW_DIR_REPLY], rev_flags));
+    }
+    if (app_names[flow->app])
+        fprintf(output, ",\"app\":\"%s\"", app_names[flow->app]);
+    fprintf(output, ",\"end_reason\":\"%s\"}\n", end_names[reason]);
+}
+
+
+/**
+ * @brief Open the export file
+ *
+ * @param path The file, truncated if it exists
+ * @param format The format of the records (enum flow_format)
+ * @return int 0 on success, -1 on error
+ */
+int flow_export_open(const char *path, int format)
+{
+    output = aio_fopen(path);
+    if (output == NULL) {
+        perror(path);
+        return -1;
+    }
+    output_path = path;
+    output_format = format;
+    return 0;
+}
+
+
+/**
+ * @brief Export a flow record
+ *
+ * The initiator of the flow is the source of the record, the packets and
+ * bytes of the other direction are the reverse counters.
+ *
+ * @param flow The flow
+ * @param reason Why the record ends (enum flow_end)
+ */
+void flow_export_record(const struct flow *flow, int reason)
+{
+    if (output == NULL)
+        return;
+    if (output_format == FLOW_FORMAT_IPFIX)
+        ipfix_record(flow, reason, flow->swapped);
+    else
+        json_record(flow, reason, flow->swapped);
+    nb_records++;
+}
+
+
+/**
+ * @brief Close the export file
+ *
+ * Write the pending records and print how many were exported.
+ */
+void flow_export_close(void)
+{
+    if (output == NULL)
+        return;
+    ipfix_flush();
+    if (fclose(output) != 0)
+        perror(output_path);
+    output = NULL;
+    printf("Flow export: %lu records written to %s\n", nb_records,
+           output_path);
+}
@@ -0,0 +1,137 @@
+/**
+ * @file format.c
+ * @brief Address formatters definition
+ *
+ * This file contains the definition of the address formatters shared by the
+ * layers. The MAC and IPv4 formatters are written by hand: they run for
+ * every frame and snprintf is several times slower.
+ *
+ * @see format.h
+ */
+
+// General libraries
+#include <arpa/inet.h>
+#include <string.h>
+
+// Local header files
+#include "format.h"
+
+static const char hex_digits[] = "0123456789ABCDEF"; /**< Uppercase digits */
+
+
+/**
+ * @brief Format a hardware address of any length
+ *
+ * @param addr The address
+ * @param len The length of the address, only the first HADDR_MAX_LEN bytes
+ * are formatted
+ * @param buf The destination, at least HADDR_STR_LEN bytes
+ * @return char* The destination
+ */
+char *format_haddr(const uint8_t *addr, int len, char *buf)
+{
+    if (len > HADDR_MAX_LEN)
+        len = HADDR_MAX_LEN;
+
+    char *p = buf;
+    for (int i = 0; i < len; i++) {
+        if (i)
+            *p++ = ':';
+        *p++ = hex_digits[addr[i] >> 4];
+        *p++ = hex_digits[addr[i] & 0xf];
+    }
+    *p = '\0';
+    return buf;
+}
+
+
+/**
+ * @brief Format a MAC address
+ *
+ * @param mac The 6 bytes of the address
+ * @param buf The destination, at least MAC_STR_LEN bytes
+ * @return char* The destination
+ */
+char *format_mac(const uint8_t *mac, char *buf)
+{
+    return format_haddr(mac, 6, buf);
+}
+
+
+/**
+ * @brief Format an IPv4 address
+ *
+ * @param addr The 4 bytes of the address, in network order
+ * @param buf The destination, at least IPV4_STR_LEN bytes
+ * @return char* The destination
+ */
+char *format_ipv4(const uint8_t *addr, char *buf)
+{
+    char *p = buf;
+    for (int i = 0; i < 4; i++) {
+        uint8_t b = addr[i];
+        if (i)
+            *p++ = '.';
+        if (b >= 100)
+            *p++ = '0' + b / 100;
+        if (b >= 10)
+            *p++ = '0' + b / 10 % 10;
+        *p++ = '0' + b % 10;
+    }
+    *p = '\0';
+    return buf;
+}
+
+
+/**
+ * @brief Format an IPv6 address
+ *
+ * @param addr The 16 bytes of the address, in network order
+ * @param buf The destination, at least IPV6_STR_LEN bytes
+ * @return char* The destination
+ */
+char *format_ipv6(const uint8_t *addr, char *buf)
+{
+    if (inet_ntop(AF_INET6, addr, buf, IPV6_STR_LEN) == NULL)
+        strcpy(buf, "?");
+    return buf;
+}
+
+
+/**
+ * @brief Format an IPv4 or IPv6 address
+ *
+ * @param family AF_INET or AF_INET6
+ * @param addr The address, in network order
+ * @param buf The destination, at least IPV6_STR_LEN bytes
+ * @return char* The destination
+ */
+char *format_addr(uint8_t family, const uint8_t *addr, char *buf)
+{
+    return family == AF_INET6 ? format_ipv6(addr, buf) :
+                                format_ipv4(addr, buf);
+}
+
+
+/**
+ * @brief Format a line of a text protocol
+ *
+ * The line ending is dropped, the non printable characters become dots and
+ * a line longer than LINE_PRINT_LEN characters is cut and ends with "...".
+ *
+ * @param line The line
+ * @param len The length of the line
+ * @param buf The destination, at least LINE_STR_LEN bytes
+ * @return char* The destination
+ */
+char *format_line(const u_char *line, size_t len, char *buf)
+{
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        len--;
+
+    size_t n = len < LINE_PRINT_LEN ? len : LINE_PRINT_LEN;
+    for (size_t i = 0; i < n; i++)
+        buf[i] = (line[i] >= 32 && line[i] <= 126) ? line[i] : '.';
+    strcpy(buf + n, len > n ? "..." : "");
+    return buf;
+}
@@ -0,0 +1,53 @@
+/**
+ * @file hash.c
+ * @brief Byte hash definition
+ *
+ * This file contains the definition of the FNV-1a hashes used by the hash
+ * tables of the layers.
+ *
+ * @see hash.h
+ */
+
+// Local header files
+#include "hash.h"
+
+#define FNV32_PRIME 16777619u /**< FNV-1a 32 bits prime */
+#define FNV64_PRIME 1099511628211ULL /**< FNV-1a 64 bits prime */
+
+
+/**
+ * @brief Hash bytes with the 32 bits FNV-1a
+ *
+ * @param h The hash of the previous fields, FNV32_OFFSET for the first one
+ * @param data The bytes
+ * @param len The number of bytes
+ * @return uint32_t The hash
+ */
+uint32_t fnv1a32(uint32_t h, const void *data, size_t len)
+{
+    const uint8_t *b = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= b[i];
+        h *= FNV32_PRIME;
+    }
+    return h;
+}
+
+
+/**
+ * @brief Hash bytes with the 64 bits FNV-1a
+ *
+ * @param h The hash of the previous fields, FNV64_OFFSET for the first one
+ * @param data The bytes
+ * @param len The number of bytes
+ * @return uint64_t The hash
+ */
+uint64_t fnv1a64(uint64_t h, const void *data, size_t len)
+{
+    const uint8_t *b = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= b[i];
+        h *= FNV64_PRIME;
+    }
+    return h;
+}
@@ -22,6 +22,62 @@
  */
 int helper_function(void)
 {
-    printf("Usage: dumpstalker [ -i interface ] [ -o output ] [ -v verbose ] expression\n");
+    printf("Usage: dumpstalker [ -i interface ] [ -o output ] [ -v verbose ] [ -t... ] [ -u ] [ -Y filter ] expression\n");
+    printf("  -t      no timestamp, -tt epoch, -ttt delta from the previous packet,\n");
+    printf("          -tttt date and time, -ttttt delta from the first packet\n");
+    printf("  -u      date and time in UTC\n");
+    printf("  -j type, --time-stamp-type=type\n");
+    printf("          timestamp source of a live capture (host, adapter...)\n");
+    printf("  --time-stamp-precision=micro|nano, --nano\n");
+    printf("          digits printed after the second\n");
+    printf("  --arp-watch\n");
+    printf("          report ARP storms, address conflicts and flips instead of\n");
+    printf("          decoding every packet\n");
+    printf("  --groups-at=seconds[.fraction]\n");
+    printf("          print the listeners of every multicast group at this time,\n");
+    printf("          given in seconds since the Epoch as printed by -tt\n");
+    printf("  -Y filter, --display-filter=filter\n");
+    printf("          print only the packets whose decoded fields match the\n");
+    printf("          filter, e.g. 'dns.qname ~ \"*.example.com\"'\n");
+    printf("  --display-filter-dump\n");
+    printf("          print the compiled display filter and exit\n");
+    printf("  --prefilter=host=addr,port=n,proto=name,vlan=n,...\n");
+    printf("          decode only the packets of these hosts, ports, protocols\n");
+    printf("          and VLANs, the others are dropped before any dissector\n");
+    printf("  -C size, -G seconds, --file-packets=count\n");
+    printf("          with -w, start a new file every size million bytes,\n");
+    printf("          every seconds (the name goes through strftime) or every\n");
+    printf("          count packets\n");
+    printf("  -W files\n");
+    printf("          with -C, -G or --file-packets, reuse a ring of files\n");
+    printf("  --direct-io\n");
+    printf("          with -w, write the files with O_DIRECT\n");
+    printf("  --compress=zstd|lz4[,level]\n");
+    printf("          with -w, compress the files in independent frames, read\n");
+    printf("          back by -r in parallel\n");
+    printf("  --compress-threads=n\n");
+    printf("          threads compressing and decompressing the captures, one\n");
+    printf("          per processor by default\n");
+    printf("  --index\n");
+    printf("          with -w, write the index of every file next to it\n");
+    printf("  --time-range=start,end, --host=addr,\n");
+    printf("  --flow=proto,addr,port,addr,port\n");
+    printf("          with -r, read only the packets in this time range, of\n");
+    printf("          this host or of this conversation, with the index if any\n");
+    printf("  netstalker index file...\n");
+    printf("          write the index of existing capture files\n");
+    printf("  --print\n");
+    printf("          with -w, also decode the packets, in another thread that\n");
+    printf("          samples them on a live capture if it falls behind\n");
+    printf("  --async-io\n");
+    printf("          write the capture files, the decoded packets and the\n");
+    printf("          flow records with io_uring, without blocking the capture\n");
+    printf("  --flow-export=file\n");
+    printf("          write a record of every flow to the file when it expires\n");
+    printf("  --flow-format=json|ipfix\n");
+    printf("          format of the flow records, json by default\n");
+    printf("  --flow-timeout=idle[,active]\n");
+    printf("          release the flows idle for this many seconds, and cut a\n");
+    printf("          record of the longer flows every active seconds (15,1800)\n");
     return 0;
 }
\ No newline at end of file
@@ -12,7 +12,9 @@
  */
 
 // General libraries
+#include <arpa/inet.h>
 #include <pcap.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,9 +22,29 @@
 #include <time.h>
 
 // Local header files
+#include "aio.h"
+#include "arpwatch.h"
+#include "bootp.h"
+#include "capindex.h"
+#include "compress.h"
+#include "dfilter.h"
+#include "dhcpv6.h"
+#include "echo.h"
 #include "ethernet.h"
+#include "expect.h"
+#include "flow.h"
+#include "flowexport.h"
+#include "icmperr.h"
+#include "mcast.h"
+#include "ndp.h"
+#include "packet.h"
 #include "parser.h"
+#include "prefilter.h"
+#include "stats.h"
+#include "tee.h"
+#include "timestamp.h"
 #include "types.h"
+#include "writer.h"
 
 #define PCAP_SNAPLEN 65535 /**< Maximum number of bytes to capture per packet */
 
@@ -130,49 +152,215 @@ char *dlt_format(int dlt)
 #define NB_COLORS 6
 static long unsigned int compteur = 0;
 static char *colors[NB_COLORS] = {"\033[1;31m", "\033[1;32m", "\033[1;33m", "\033[1;34m", "\033[1;35m", "\033[1;36m"};
+struct packet_info current_packet;
+static pcap_t *capture = NULL; /**< Handle stopped by the SIGINT handler */
+static int nano_precision = 0; /**< 1 if the timestamps are in nanoseconds */
+
+
+/**
+ * @brief Stop the capture
+ * 
+ * Break the loop so that the statistics are printed before exiting.
+ * 
+ * @param sig The signal number
+ */
+static void stop_capture(int sig)
+{
+    (void)sig;
+    if (capture)
+        pcap_breakloop(capture);
+}
 
 /**
  * @brief Analyze a packet
  * 
  * This function analyzes a packet.
  * 
- * @param args The arguments
+ * @param args The output stream
  * @param header The packet header
  * @param packet The packet
  * 
+ * @see prefilter_match
+ * @see dfilter_begin
  * @see cast_ethernet
  */
 void packet_analyzer(u_char *args, const struct pcap_pkthdr *header,
                      const u_char *packet)
 {
-    if (args) {
-        ;
-    }
-    printf("%s", colors[++compteur % NB_COLORS]);
-
-    printf("┌───────────────────────────────────────────────┐\n");
-    printf("│\t\tPacket n°%ld\t\t\t│\n", compteur);
-    printf("└───────────────────────────────────────────────┘\n");
+    FILE *stream = (FILE *)args;
+    compteur++; // Frame number, dropped frames included
+    if (!prefilter_match(packet, header->caplen))
+        return;
     struct timeval tv = header->ts;
     time_t sec = tv.tv_sec;
-    suseconds_t usec = tv.tv_usec;
+    // tv_usec holds nanoseconds when the handle has the nano precision
+    uint32_t nsec = nano_precision ? tv.tv_usec : tv.tv_usec * 1000;
+    memset(&current_packet, 0, sizeof(current_packet));
+    current_packet.ts = (uint64_t)sec * 1000000000 + nsec;
+    current_packet.end = packet + header->caplen;
+    // Output held back or discarded depending on the display filter
+    FILE *out = dfilter_begin(packet, header->caplen, header->len, stream);
+    current_packet.out = out;
+    fprintf(out, "%s", colors[compteur % NB_COLORS]);
+
+    fprintf(out, "┌───────────────────────────────────────────────┐\n");
+    fprintf(out, "│\t\tPacket n°%ld\t\t\t│\n", compteur);
+    fprintf(out, "└───────────────────────────────────────────────┘\n");
+    const char *time_str = timestamp_format(sec, nsec);
+    if (time_str)
+        fprintf(out, "%s\n", time_str);
+    mcast_tick(current_packet.ts);
+    echo_tick(current_packet.ts);
+    expect_tick(current_packet.ts);
+    flow_tick(current_packet.ts);
+    cast_ethernet(packet, header->caplen);
+    fprintf(out, "\033[0m\n");
+    dfilter_end(header->len, stream);
+}
+
+
+/**
+ * @brief Write a packet to the capture file
+ * 
+ * The capture stops if the packet can't be written.
+ * 
+ * @param args The arguments
+ * @param header The packet header
+ * @param packet The packet
+ * 
+ * @see writer_write
+ */
+static void dump_packet(u_char *args, const struct pcap_pkthdr *header,
+                        const u_char *packet)
+{
+    (void)args;
+    if (writer_write(header, packet) < 0)
+        pcap_breakloop(capture);
+}
+
 
-    struct tm *timeinfo = localtime(&sec);
-    if (timeinfo == NULL) {
-        perror("localtime");
+/**
+ * @brief Decode a packet in the decoder thread of the tee mode
+ * 
+ * @param frame The number of the packet in the capture
+ * @param header The packet header
+ * @param packet The packet
+ * 
+ * @see packet_analyzer
+ */
+static void tee_analyzer(uint64_t frame, const struct pcap_pkthdr *header,
+                         const u_char *packet)
+{
+    compteur = frame - 1; // The packets left out keep their number
+    packet_analyzer((u_char *)stdout, header, packet);
+}
+
+
+/**
+ * @brief Write a packet to the capture file and hand it to the decoder
+ * 
+ * @param args The arguments
+ * @param header The packet header
+ * @param packet The packet
+ * 
+ * @see dump_packet
+ * @see tee_push
+ */
+static void tee_packet(u_char *args, const struct pcap_pkthdr *header,
+                       const u_char *packet)
+{
+    dump_packet(args, header, packet);
+    tee_push(header, packet);
+}
+
+
+/**
+ * @brief Analyze an ARP frame in ARP analysis mode
+ * 
+ * Nothing is printed per frame, the frames other than ARP and RARP are
+ * ignored.
+ * 
+ * @param args The arguments
+ * @param header The packet header
+ * @param packet The packet
+ * 
+ * @see arp_watch
+ */
+static void arp_analyzer(u_char *args, const struct pcap_pkthdr *header,
+                         const u_char *packet)
+{
+    (void)args;
+    const struct ether_header *ethernet = (const struct ether_header *)packet;
+    struct arp_info info;
+    if (header->caplen < sizeof(struct ether_header) ||
+        (ethernet->ether_type != htons(ETHERTYPE_ARP) &&
+         ethernet->ether_type != htons(ETHERTYPE_REVARP)) ||
+        arp_parse(packet + sizeof(struct ether_header),
+                  header->caplen - sizeof(struct ether_header), &info) < 0)
         return;
-    }
 
-    char time_str[64];
-    if (strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", timeinfo) ==
-        0) {
-        fprintf(stderr, "strftime failed\n");
+    uint32_t nsec = nano_precision ? header->ts.tv_usec :
+                                     header->ts.tv_usec * 1000;
+    arp_watch(&info, (uint64_t)header->ts.tv_sec * 1000000000 + nsec);
+}
+
+
+/**
+ * @brief Print the packets dropped by the kernel
+ * 
+ * Printed on stderr after a live capture, to compare the synchronous and
+ * asynchronous writes.
+ * 
+ * @param handle The handle
+ */
+static void print_drops(pcap_t *handle)
+{
+    struct pcap_stat stats;
+    if (pcap_stats(handle, &stats) < 0)
         return;
+    fprintf(stderr, "%u packets received by filter\n", stats.ps_recv);
+    fprintf(stderr, "%u packets dropped by kernel\n", stats.ps_drop);
+}
+
+
+/**
+ * @brief Open a device in live mode
+ * 
+ * The timestamps are requested in nanoseconds, libpcap falls back to
+ * microseconds if the device can't provide them.
+ * 
+ * @param args The arguments
+ * @param errbuf The error buffer
+ * @return pcap_t* The handle, NULL on error
+ */
+static pcap_t *open_live(const struct arguments *args, char *errbuf)
+{
+    pcap_t *handle = pcap_create(args->interface, errbuf);
+    if (handle == NULL)
+        return NULL;
+
+    pcap_set_snaplen(handle, PCAP_SNAPLEN);
+    pcap_set_promisc(handle, 1);
+    pcap_set_timeout(handle, 1000);
+    if (args->tstamp_type) {
+        int type = pcap_tstamp_type_name_to_val(args->tstamp_type);
+        if (type < 0 || pcap_set_tstamp_type(handle, type) != 0)
+            fprintf(stderr, "Timestamp type %s not supported, using default\n",
+                    args->tstamp_type);
     }
+    pcap_set_tstamp_precision(handle, PCAP_TSTAMP_PRECISION_NANO);
 
-    printf("%s.%06ld\n", time_str, (long)usec);
-    cast_ethernet(packet);
-    printf("\033[0m\n");
+    int status = pcap_activate(handle);
+    if (status < 0) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s",
+                 status == PCAP_ERROR ? pcap_geterr(handle) :
+                                        pcap_statustostr(status));
+        pcap_close(handle);
+        return NULL;
+    } else if (status > 0) {
+        fprintf(stderr, "Warning: %s\n", pcap_statustostr(status));
+    }
+    return handle;
 }
 
 
@@ -185,7 +373,8 @@ void packet_analyzer(u_char *args, const struct pcap_pkthdr *header,
  * @param argc The number of arguments
  * @param argv The arguments
  * 
- * @return 0 if the function succeeded, 1 otherwise
+ * @return 0 if the function succeeded, 1 on error, 2 if the capture can't be
+ * opened or filtered
  * 
  * @see parse_args
  * @see search_devs
@@ -194,26 +383,118 @@ void packet_analyzer(u_char *args, const struct pcap_pkthdr *header,
  */
 int main(int argc, char **argv)
 {
+    int ret = 0;
+    pcap_t *handle = NULL;
     struct arguments *args = calloc(1, sizeof(struct arguments));
 
     switch (parse_args(argc, argv, args)) {
     case -1:
         fprintf(stderr, "Error parsing arguments\n");
-        free(args);
-        return (1);
+        ret = 1;
+        goto out;
     case 1:
-        free(args);
-        return 0;
+        goto out;
+    }
+
+    if (args->index_files) { // Index command
+        for (int i = 0; i < args->nb_index_files; i++) {
+            if (capindex_build(args->index_files[i]) < 0)
+                ret = 1;
+        }
+        goto out;
+    }
+
+    if (args->display_filter && dfilter_compile(args->display_filter) < 0) {
+        ret = 1;
+        goto out;
+    }
+    if (args->prefilter && prefilter_compile(args->prefilter) < 0) {
+        ret = 1;
+        goto out;
+    }
+    // In tee mode the pool only writes the capture file, so that the decoder
+    // thread never takes a buffer from it: the flow records go through stdio
+    int tee = args->fileOutput && args->print;
+    if (!tee && aio_init(args->async_io) < 0) {
+        ret = 1;
+        goto out;
+    }
+    if (args->flow_export &&
+        flow_export_open(args->flow_export, args->flow_format) < 0) {
+        ret = 1;
+        goto out;
+    }
+    flow_expire_set(args->flow_idle * 1000000000ULL,
+                    args->flow_active * 1000000000ULL,
+                    args->flow_export ? flow_export_record : NULL);
+    if (tee && aio_init(args->async_io) < 0) {
+        ret = 1;
+        goto out;
+    }
+    if (args->dfilter_dump) {
+        dfilter_dump();
+        goto out;
     }
 
     char errbuf[PCAP_ERRBUF_SIZE];
-    pcap_t *handle;
-    pcap_dumper_t *dumper;
-    if (args->fileInput) { // Open the file in offline mode
-        handle = pcap_open_offline(args->fileInput, errbuf);
+    compress_init(args->compress_threads);
+    int codec = args->fileInput ? compress_probe(args->fileInput) :
+                                  COMPRESS_NONE;
+    int query = args->range_start || args->range_end || args->host ||
+                args->flow;
+    if (query) { // Only the blocks that may match are read
+        struct capindex_query selected = {.start = args->range_start,
+                                          .end = args->range_end};
+        if (codec != COMPRESS_NONE) {
+            fprintf(stderr, "--time-range, --host and --flow need an "
+                            "uncompressed capture\n");
+            ret = 1;
+            goto out;
+        }
+        if (args->host && capindex_query_host(&selected, args->host) < 0) {
+            fprintf(stderr, "Bad host %s\n", args->host);
+            ret = 1;
+            goto out;
+        }
+        if (args->flow && capindex_query_flow(&selected, args->flow) < 0) {
+            fprintf(stderr, "Bad flow %s\n", args->flow);
+            ret = 1;
+            goto out;
+        }
+        FILE *file = capindex_fopen(args->fileInput, &selected);
+        if (file == NULL) {
+            ret = 1;
+            goto out;
+        }
+        handle = pcap_fopen_offline_with_tstamp_precision(
+            file, PCAP_TSTAMP_PRECISION_NANO, errbuf);
         if (handle == NULL) {
+            fclose(file);
             fprintf(stderr, "Error opening input file: %s\n", errbuf);
-            return (1);
+            ret = 1;
+            goto out;
+        }
+    } else if (codec != COMPRESS_NONE) { // Decompressed ahead by the threads
+        FILE *file = compress_fopen(args->fileInput, codec);
+        if (file == NULL) {
+            ret = 1;
+            goto out;
+        }
+        handle = pcap_fopen_offline_with_tstamp_precision(
+            file, PCAP_TSTAMP_PRECISION_NANO, errbuf);
+        if (handle == NULL) {
+            fclose(file);
+            fprintf(stderr, "Error opening input file: %s\n", errbuf);
+            ret = 1;
+            goto out;
+        }
+    } else if (args->fileInput) { // Open the file in offline mode
+        handle = pcap_open_offline_with_tstamp_precision(
+            args->fileInput, PCAP_TSTAMP_PRECISION_NANO, errbuf);
+        if (handle == NULL) {
+            fprintf(stderr, "Error opening input file: %s\n", errbuf);
+            ret = 1;
+            goto out;
         }
     } else { // First search for the device. Then open the device in live mode.
         if (args->interface[0] == '\0') { // If no interface is provided by user, ask for one
@@ -221,38 +502,39 @@ int main(int argc, char **argv)
             pcap_if_t *dev = NULL;
             if (search_devs(errbuf, &alldevs, &dev, args->interface) < 0) {
                 fprintf(stderr, "Error searching devs\n");
-                free(args);
-                return (2);
+                ret = 2;
+                goto out;
             }
             // Free the list of devices
             pcap_freealldevs(alldevs);
-            handle =
-                pcap_open_live(args->interface, PCAP_SNAPLEN, 1, 1000, errbuf);
+            handle = open_live(args, errbuf);
             if (handle == NULL) {
                 fprintf(stderr, "Couldn't open device %s: %s\n",
                         args->interface, errbuf);
-                free(args);
-                return (2);
+                ret = 2;
+                goto out;
             }
         } else { // If an interface is provided by user, open it in live mode
-            handle =
-                pcap_open_live(args->interface, PCAP_SNAPLEN, 1, 1000, errbuf);
+            handle = open_live(args, errbuf);
             if (handle == NULL) {
                 fprintf(stderr, "Couldn't open device %s: %s\n",
                         args->interface, errbuf);
-                free(args);
-                return (2);
+                ret = 2;
+                goto out;
             }
         }
     }
 
+    nano_precision =
+        pcap_get_tstamp_precision(handle) == PCAP_TSTAMP_PRECISION_NANO;
+
     // Check if the device provides Ethernet headers
     if (pcap_datalink(handle) != DLT_EN10MB) {
         fprintf(stderr,
                 "Device %s doesn't provide Ethernet headers - not supported\n",
                 args->interface);
-        free(args);
-        return (2);
+        ret = 2;
+        goto out;
     }
 
     // Print the device information if one have been opened in live mode
@@ -262,6 +544,9 @@ int main(int argc, char **argv)
                args->interface, dlt, PCAP_SNAPLEN);
     }
 
+    if (args->arp_watch && args->filter == NULL)
+        args->filter = "arp or rarp"; // Let the kernel drop the other frames
+
     struct bpf_program filter;
     bpf_u_int32 subnet_mask, ip = 0;
 
@@ -277,33 +562,110 @@ int main(int argc, char **argv)
     // Compile the filter
     if (pcap_compile(handle, &filter, args->filter, 0, ip) == -1) {
         fprintf(stderr, "Bad filter - %s\n", pcap_geterr(handle));
-        return (2);
+        ret = 2;
+        goto out;
     }
 
     // Set the filter
     if (pcap_setfilter(handle, &filter) == -1) {
         fprintf(stderr, "Error setting filter - %s\n", pcap_geterr(handle));
-        return (2);
+        pcap_freecode(&filter);
+        ret = 2;
+        goto out;
     }
+    pcap_freecode(&filter);
 
-    if (args->fileOutput) { // If an output file is provided, open it in write mode. Then start the loop
-        dumper = pcap_dump_open(handle, args->fileOutput);
-        if (dumper == NULL) {
-            fprintf(stderr, "Error opening output file: %s\n",
-                    pcap_geterr(handle));
-            return (1);
+    if (args->fileOutput) { // If an output file is provided, open it in write mode
+        struct writer_options options = {
+            .path = args->fileOutput,
+            .file_size = args->file_size,
+            .seconds = args->rotate_seconds,
+            .packets = args->file_packets,
+            .files = args->file_count,
+            .direct = args->direct_io,
+            .codec = args->compress,
+            .level = args->compress_level,
+            .index = args->index};
+        if (writer_open(&options, pcap_datalink(handle),
+                        pcap_snapshot(handle), nano_precision) < 0) {
+            fprintf(stderr, "Error opening output file\n");
+            ret = 1;
+            goto out;
+        }
+    }
+    capture = handle;
+    signal(SIGINT, stop_capture); // The buffered packets are written
+    if (args->fileOutput && !tee) { // Then start the loop
+        pcap_loop(handle, args->count, dump_packet, NULL);
+    } else { // Decode the packets, and write them too in tee mode
+        timestamp_init(args->tstamp, args->precision);
+        current_packet.out = stdout; // Events closed by the reports
+        if (args->arp_watch) {
+            pcap_loop(handle, args->count, arp_analyzer, NULL);
+            arp_watch_report(0);
+        } else {
+            mcast_snapshot_at(args->groups_at);
+            // The decoded packets are written with io_uring if enabled, the
+            // pool being left to the capture file in tee mode
+            FILE *stream = aio_async() && !tee ? aio_fdopen(STDOUT_FILENO) :
+                                                 NULL;
+            if (stream != NULL)
+                fflush(stdout);
+            if (!tee) {
+                pcap_loop(handle, args->count, packet_analyzer,
+                          (u_char *)(stream != NULL ? stream : stdout));
+            } else {
+                // A file is read as fast as it is decoded, nothing is left out
+                if (tee_start(tee_analyzer, args->fileInput != NULL) < 0) {
+                    ret = 1;
+                    goto out;
+                }
+                pcap_loop(handle, args->count, tee_packet, NULL);
+                tee_stop();
+            }
+            if (stream != NULL)
+                fclose(stream);
+            current_packet.out = stdout;
+            mcast_report(); // Measures the pending leaves, before the stats
+            stats_print();
+            icmp_errors_report();
+            echo_report();
+            arp_watch_report(1);
+            ndp_report();
+            prefilter_report();
         }
-        pcap_loop(handle, args->count, pcap_dump, (u_char *)dumper);
-        pcap_dump_close(dumper);
-    } else { // If no output file is provided, start the loop
-        pcap_loop(handle, args->count, packet_analyzer, NULL);
     }
+    if (args->fileOutput && writer_close() < 0) {
+        ret = 1;
+        goto out;
+    }
+    if (!args->fileInput)
+        print_drops(handle);
+
+out:
+    // Close the handle, and the capture file left open by an error
+    if (handle != NULL)
+        pcap_close(handle);
+    writer_close();
 
-    // Close the handle
-    pcap_close(handle);
+    // Free the flows, the flows left are exported
+    flow_table_free();
+    flow_export_close();
+    expect_table_free();
+    bootp_leases_free();
+    dhcpv6_clients_free();
+    arp_watch_free();
+    echo_free();
+    ndp_free();
+    mcast_free();
+    dfilter_free();
+    if (ret == 0)
+        aio_report();
+    aio_free();
+    compress_free();
 
     // Free args
     free(args);
 
-    return 0;
+    return ret;
 }
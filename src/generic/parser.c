@@ -8,8 +8,188 @@
  */
 
 #include "parser.h"
+#include "compress.h"
+#include "flowexport.h"
 #include "helper.h"
+#include "timestamp.h"
 #include "stdio.h"
+#include <string.h>
+
+#define OPT_PRECISION 256 /**< --time-stamp-precision */
+#define OPT_NANO 257 /**< --nano */
+#define OPT_ARP_WATCH 258 /**< --arp-watch */
+#define OPT_GROUPS_AT 259 /**< --groups-at */
+#define OPT_DFILTER_DUMP 260 /**< --display-filter-dump */
+#define OPT_PREFILTER 261 /**< --prefilter */
+#define OPT_FLOW_EXPORT 262 /**< --flow-export */
+#define OPT_FLOW_FORMAT 263 /**< --flow-format */
+#define OPT_FLOW_TIMEOUT 264 /**< --flow-timeout */
+#define OPT_FILE_PACKETS 265 /**< --file-packets */
+#define OPT_DIRECT_IO 266 /**< --direct-io */
+#define OPT_ASYNC_IO 267 /**< --async-io */
+#define OPT_PRINT 268 /**< --print */
+#define OPT_COMPRESS 269 /**< --compress */
+#define OPT_COMPRESS_THREADS 270 /**< --compress-threads */
+#define OPT_INDEX 271 /**< --index */
+#define OPT_TIME_RANGE 272 /**< --time-range */
+#define OPT_HOST 273 /**< --host */
+#define OPT_FLOW 274 /**< --flow */
+#define FLOW_IDLE_TIMEOUT 15 /**< Default idle timeout of the flows (s) */
+#define FLOW_ACTIVE_TIMEOUT 1800 /**< Default active timeout of the flows (s) */
+
+static const struct option long_options[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"time-stamp-type", required_argument, NULL, 'j'},
+    {"time-stamp-precision", required_argument, NULL, OPT_PRECISION},
+    {"nano", no_argument, NULL, OPT_NANO},
+    {"arp-watch", no_argument, NULL, OPT_ARP_WATCH},
+    {"groups-at", required_argument, NULL, OPT_GROUPS_AT},
+    {"display-filter", required_argument, NULL, 'Y'},
+    {"display-filter-dump", no_argument, NULL, OPT_DFILTER_DUMP},
+    {"prefilter", required_argument, NULL, OPT_PREFILTER},
+    {"flow-export", required_argument, NULL, OPT_FLOW_EXPORT},
+    {"flow-format", required_argument, NULL, OPT_FLOW_FORMAT},
+    {"flow-timeout", required_argument, NULL, OPT_FLOW_TIMEOUT},
+    {"file-packets", required_argument, NULL, OPT_FILE_PACKETS},
+    {"direct-io", no_argument, NULL, OPT_DIRECT_IO},
+    {"async-io", no_argument, NULL, OPT_ASYNC_IO},
+    {"print", no_argument, NULL, OPT_PRINT},
+    {"compress", required_argument, NULL, OPT_COMPRESS},
+    {"compress-threads", required_argument, NULL, OPT_COMPRESS_THREADS},
+    {"index", no_argument, NULL, OPT_INDEX},
+    {"time-range", required_argument, NULL, OPT_TIME_RANGE},
+    {"host", required_argument, NULL, OPT_HOST},
+    {"flow", required_argument, NULL, OPT_FLOW},
+    {NULL, 0, NULL, 0}}; /**< Long options, named as in tcpdump */
+
+/**
+ * @brief Parse a time given in seconds since the Epoch
+ *
+ * The time is written as with -tt: seconds, then up to 9 digits of fraction.
+ *
+ * @param str The time
+ * @param ns The time (ns)
+ * @return int 0 on success, -1 if the time is malformed
+ */
+static int parse_epoch(const char *str, uint64_t *ns)
+{
+    char *end;
+    if (*str < '0' || *str > '9')
+        return -1;
+    *ns = strtoull(str, &end, 10) * 1000000000;
+    if (*end == '.') {
+        uint64_t unit = 100000000;
+        for (end++; *end >= '0' && *end <= '9' && unit > 0; end++) {
+            *ns += (*end - '0') * unit;
+            unit /= 10;
+        }
+    }
+    return *end == '\0' && *ns > 0 ? 0 : -1;
+}
+
+
+/**
+ * @brief Parse a positive number
+ *
+ * @param str The number
+ * @param n The number
+ * @return int 0 on success, -1 if the number is malformed or 0
+ */
+static int parse_number(const char *str, uint64_t *n)
+{
+    char *end;
+    if (*str < '0' || *str > '9')
+        return -1;
+    *n = strtoull(str, &end, 10);
+    return *end == '\0' && *n > 0 ? 0 : -1;
+}
+
+
+/**
+ * @brief Parse the timeouts of the flows
+ *
+ * The timeouts are written idle[,active], in seconds.
+ *
+ * @param str The timeouts
+ * @param args Arguments structure
+ * @return int 0 on success, -1 if the timeouts are malformed
+ */
+static int parse_timeouts(const char *str, struct arguments *args)
+{
+    char *end;
+    if (*str < '0' || *str > '9')
+        return -1;
+    args->flow_idle = strtoul(str, &end, 10);
+    if (*end == ',') {
+        str = end + 1;
+        if (*str < '0' || *str > '9')
+            return -1;
+        args->flow_active = strtoul(str, &end, 10);
+    }
+    return *end == '\0' && args->flow_idle > 0 && args->flow_active > 0 ? 0 :
+                                                                          -1;
+}
+
+
+/**
+ * @brief Parse the time range of a query
+ *
+ * The range is written start,end in seconds since the Epoch, as with -tt.
+ * Either bound may be left out, the end is excluded.
+ *
+ * @param str The range
+ * @param args Arguments structure
+ * @return int 0 on success, -1 if the range is malformed
+ */
+static int parse_range(const char *str, struct arguments *args)
+{
+    const char *comma = strchr(str, ',');
+    char start[32];
+    if (comma == NULL || (size_t)(comma - str) >= sizeof(start))
+        return -1;
+    snprintf(start, sizeof(start), "%.*s", (int)(comma - str), str);
+    if ((start[0] && parse_epoch(start, &args->range_start) < 0) ||
+        (comma[1] && parse_epoch(comma + 1, &args->range_end) < 0))
+        return -1;
+    return (start[0] || comma[1]) &&
+           (!args->range_end || args->range_start < args->range_end) ? 0 : -1;
+}
+
+
+/**
+ * @brief Parse the compression of the capture files
+ *
+ * The compression is written zstd[,level] or lz4[,level].
+ *
+ * @param str The compression
+ * @param args Arguments structure
+ * @return int 0 on success, -1 if the compression is malformed
+ */
+static int parse_compress(const char *str, struct arguments *args)
+{
+    const char *level = strchr(str, ',');
+    size_t len = level ? (size_t)(level - str) : strlen(str);
+    int max;
+    if (len == 4 && strncmp(str, "zstd", len) == 0) {
+        args->compress = COMPRESS_ZSTD;
+        args->compress_level = 3;
+        max = 22;
+    } else if (len == 3 && strncmp(str, "lz4", len) == 0) {
+        args->compress = COMPRESS_LZ4;
+        args->compress_level = 1;
+        max = 12;
+    } else {
+        return -1;
+    }
+    if (level) {
+        uint64_t n;
+        if (parse_number(level + 1, &n) < 0 || n > (uint64_t)max)
+            return -1;
+        args->compress_level = n;
+    }
+    return 0;
+}
+
 
 /**
  * @brief Parser function
@@ -26,7 +206,21 @@
 int parse_args(int argc, char **argv, struct arguments* args)
 {
     int opt;
-    while ((opt = getopt(argc, argv, "i:w:r:v::c:h")) != -1) {
+    uint64_t n;
+    if (argc > 1 && strcmp(argv[1], "index") == 0) { // Index command
+        if (argc == 2) {
+            fprintf(stderr, "index needs capture files\n");
+            return -1;
+        }
+        args->index_files = argv + 2;
+        args->nb_index_files = argc - 2;
+        return 0;
+    }
+    args->precision = TS_PRECISION_MICRO;
+    args->flow_idle = FLOW_IDLE_TIMEOUT;
+    args->flow_active = FLOW_ACTIVE_TIMEOUT;
+    while ((opt = getopt_long(argc, argv, "i:w:r:v::c:tuj:Y:C:G:W:h", long_options,
+                              NULL)) != -1) {
         switch (opt) {
         case 'i':           // Interface
             snprintf(args->interface, 16, "%s", optarg);
@@ -46,6 +240,137 @@ int parse_args(int argc, char **argv, struct arguments* args)
         case 'c':           // Number of packets to capture
             args->count = atoi(optarg);
             break;
+        case 't':           // Timestamp mode, repeatable
+            if (args->tstamp == TS_LOCAL)
+                args->tstamp = TS_NONE;
+            else if (args->tstamp < TS_RELATIVE)
+                args->tstamp++;
+            break;
+        case 'u':           // UTC timestamps
+            args->tstamp = TS_UTC;
+            break;
+        case 'j':           // Timestamp type of a live capture
+            args->tstamp_type = optarg;
+            break;
+        case OPT_PRECISION: // Printed timestamp precision
+            if (strcmp(optarg, "nano") == 0) {
+                args->precision = TS_PRECISION_NANO;
+            } else if (strcmp(optarg, "micro") == 0) {
+                args->precision = TS_PRECISION_MICRO;
+            } else {
+                fprintf(stderr, "Unknown timestamp precision %s\n", optarg);
+                return -1;
+            }
+            break;
+        case OPT_NANO:      // Same as --time-stamp-precision=nano
+            args->precision = TS_PRECISION_NANO;
+            break;
+        case OPT_ARP_WATCH: // ARP analysis mode
+            args->arp_watch = 1;
+            break;
+        case OPT_GROUPS_AT: // Multicast listener snapshot
+            if (parse_epoch(optarg, &args->groups_at) < 0) {
+                fprintf(stderr, "Bad snapshot time %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'Y':           // Display filter
+            args->display_filter = optarg;
+            break;
+        case OPT_DFILTER_DUMP: // Print the compiled display filter
+            args->dfilter_dump = 1;
+            break;
+        case OPT_PREFILTER: // Packets decoded
+            args->prefilter = optarg;
+            break;
+        case OPT_FLOW_EXPORT: // File of the flow records
+            args->flow_export = optarg;
+            break;
+        case OPT_FLOW_FORMAT: // Format of the flow records
+            if (strcmp(optarg, "json") == 0) {
+                args->flow_format = FLOW_FORMAT_JSON;
+            } else if (strcmp(optarg, "ipfix") == 0) {
+                args->flow_format = FLOW_FORMAT_IPFIX;
+            } else {
+                fprintf(stderr, "Unknown flow format %s\n", optarg);
+                return -1;
+            }
+            break;
+        case OPT_FLOW_TIMEOUT: // Expiry of the flows
+            if (parse_timeouts(optarg, args) < 0) {
+                fprintf(stderr, "Bad flow timeouts %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'C':           // Millions of bytes per capture file
+            if (parse_number(optarg, &n) < 0 || n > UINT64_MAX / 1000000) {
+                fprintf(stderr, "Bad file size %s\n", optarg);
+                return -1;
+            }
+            args->file_size = n * 1000000;
+            break;
+        case 'G':           // Seconds per capture file
+            if (parse_number(optarg, &n) < 0 || n > UINT32_MAX) {
+                fprintf(stderr, "Bad rotation time %s\n", optarg);
+                return -1;
+            }
+            args->rotate_seconds = n;
+            break;
+        case 'W':           // Capture files of the ring
+            if (parse_number(optarg, &n) < 0 || n > UINT32_MAX) {
+                fprintf(stderr, "Bad file count %s\n", optarg);
+                return -1;
+            }
+            args->file_count = n;
+            break;
+        case OPT_FILE_PACKETS: // Packets per capture file
+            if (parse_number(optarg, &args->file_packets) < 0) {
+                fprintf(stderr, "Bad packet count %s\n", optarg);
+                return -1;
+            }
+            break;
+        case OPT_DIRECT_IO: // Capture files written with O_DIRECT
+            args->direct_io = 1;
+            break;
+        case OPT_ASYNC_IO:  // Writes through io_uring
+            args->async_io = 1;
+            break;
+        case OPT_PRINT:     // Packets decoded while written with -w
+            args->print = 1;
+            break;
+        case OPT_COMPRESS:  // Compression of the capture files
+            if (parse_compress(optarg, args) < 0) {
+                fprintf(stderr, "Bad compression %s\n", optarg);
+                return -1;
+            }
+            if (!compress_supported(args->compress)) {
+                fprintf(stderr, "%s compression not supported by this "
+                                "build\n", optarg);
+                return -1;
+            }
+            break;
+        case OPT_COMPRESS_THREADS: // Threads compressing and decompressing
+            if (parse_number(optarg, &n) < 0 || n > 1024) {
+                fprintf(stderr, "Bad thread count %s\n", optarg);
+                return -1;
+            }
+            args->compress_threads = n;
+            break;
+        case OPT_INDEX:     // Index of the capture files
+            args->index = 1;
+            break;
+        case OPT_TIME_RANGE: // Packets read in a time range
+            if (parse_range(optarg, args) < 0) {
+                fprintf(stderr, "Bad time range %s\n", optarg);
+                return -1;
+            }
+            break;
+        case OPT_HOST:      // Packets read of a host
+            args->host = optarg;
+            break;
+        case OPT_FLOW:      // Packets read of a conversation
+            args->flow = optarg;
+            break;
         case 'h':           // Help
             helper_function();
             return 1;
@@ -59,5 +384,57 @@ int parse_args(int argc, char **argv, struct arguments* args)
         args->filter = argv[optind];
     }
 
+    if (args->print &&
+        (args->fileOutput == NULL || strcmp(args->fileOutput, "-") == 0 ||
+         args->arp_watch)) {
+        fprintf(stderr, "--print needs -w with a file name, and can't be "
+                        "used with --arp-watch\n");
+        return -1;
+    }
+    int decoded = !args->arp_watch && (args->fileOutput == NULL || args->print);
+    if ((args->display_filter || args->prefilter) && !decoded) {
+        fprintf(stderr, "The display filter and the prefilter need decoded "
+                        "packets, they can't be used with -w without --print "
+                        "or with --arp-watch\n");
+        return -1;
+    }
+    if (args->flow_export && !decoded) {
+        fprintf(stderr, "The flow export needs decoded packets, it can't be "
+                        "used with -w without --print or with --arp-watch\n");
+        return -1;
+    }
+    if (args->compress && args->fileOutput == NULL) {
+        fprintf(stderr, "--compress needs -w\n");
+        return -1;
+    }
+    if (args->index && (args->fileOutput == NULL ||
+                        strcmp(args->fileOutput, "-") == 0 || args->compress)) {
+        fprintf(stderr, "--index needs -w with a file name, and can't be "
+                        "used with --compress\n");
+        return -1;
+    }
+    if ((args->range_start || args->range_end || args->host || args->flow) &&
+        (args->fileInput == NULL || strcmp(args->fileInput, "-") == 0)) {
+        fprintf(stderr, "--time-range, --host and --flow need -r with a file "
+                        "name\n");
+        return -1;
+    }
+    if ((args->file_size || args->rotate_seconds || args->file_packets ||
+         args->file_count || args->direct_io) &&
+        (args->fileOutput == NULL || strcmp(args->fileOutput, "-") == 0)) {
+        fprintf(stderr, "-C, -G, -W, --file-packets and --direct-io need -w "
+                        "with a file name\n");
+        return -1;
+    }
+    if (args->file_count && !args->file_size && !args->rotate_seconds &&
+        !args->file_packets) {
+        fprintf(stderr, "-W needs -C, -G or --file-packets\n");
+        return -1;
+    }
+    if (args->dfilter_dump && args->display_filter == NULL) {
+        fprintf(stderr, "--display-filter-dump needs a display filter\n");
+        return -1;
+    }
+
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,331 @@
+/**
+ * @file prefilter.c
+ * @brief Prefilter definition
+ *
+ * This file contains the definition of the prefilter. The ports, protocols
+ * and VLANs are bitmaps, the hosts an open addressing hash set: a packet
+ * costs a few loads whatever the number of items.
+ *
+ * Only the headers at fixed offsets are read: the VLAN tags, the IPv4 header,
+ * the IPv6 header and its hop-by-hop, destination and routing headers. The
+ * fragments after the first one have no ports, they skip the port test.
+ *
+ * @see prefilter.h
+ * @see prefilter_compile
+ * @see prefilter_match
+ */
+
+// General libraries
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Local header files
+#include "ethernet.h"
+#include "flow.h"
+#include "hash.h"
+#include "prefilter.h"
+
+#define HOST_SLOTS (2 * PREFILTER_MAX_HOSTS) /**< Slots of the host set, a power of 2 */
+#define PORT_MIN_HDR 4 /**< Bytes of a TCP or UDP header holding the ports */
+
+/**
+ * @brief Slot of the host set
+ */
+struct host_slot {
+    uint8_t family;     /**< AF_INET or AF_INET6, 0 if free */
+    uint8_t addr[16];   /**< Address, IPv4 in the first 4 bytes */
+};
+
+static struct host_slot hosts[HOST_SLOTS]; /**< Wanted hosts */
+static int nb_hosts = 0;
+static uint8_t ports[65536 / 8]; /**< Wanted ports */
+static int nb_ports = 0;
+static uint8_t protos[256 / 8]; /**< Wanted IP protocols */
+static int nb_protos = 0;
+static uint8_t vlans[4096 / 8]; /**< Wanted VLANs */
+static int nb_vlans = 0;
+static int active = 0;
+static unsigned long kept = 0; /**< Packets decoded */
+static unsigned long dropped = 0; /**< Packets dropped */
+
+
+/**
+ * @brief Test a bit of a bitmap
+ *
+ * @param map The bitmap
+ * @param bit The bit
+ * @return int 1 if the bit is set, 0 otherwise
+ */
+static inline int bit_test(const uint8_t *map, unsigned bit)
+{
+    return (map[bit >> 3] >> (bit & 7)) & 1;
+}
+
+
+/**
+ * @brief Hash an address
+ *
+ * @param family AF_INET or AF_INET6
+ * @param addr The address
+ * @return uint32_t The FNV-1a hash of the address
+ */
+static uint32_t host_hash(uint8_t family, const uint8_t *addr)
+{
+    return fnv1a32(FNV32_OFFSET, addr, family == AF_INET ? 4 : 16);
+}
+
+
+/**
+ * @brief Find the slot of an address in the host set
+ *
+ * @param family AF_INET or AF_INET6
+ * @param addr The address
+ * @return struct host_slot* The slot of the address, or the free slot where
+ * to insert it
+ */
+static struct host_slot *host_slot(uint8_t family, const uint8_t *addr)
+{
+    int len = family == AF_INET ? 4 : 16;
+    uint32_t i = host_hash(family, addr) & (HOST_SLOTS - 1);
+    while (hosts[i].family != 0 &&
+           (hosts[i].family != family || memcmp(hosts[i].addr, addr, len))) {
+        i = (i + 1) & (HOST_SLOTS - 1);
+    }
+    return &hosts[i];
+}
+
+
+/**
+ * @brief Add an item to the prefilter
+ *
+ * @param item The item, kind=value
+ * @return int 0 on success, -1 if the item is malformed
+ */
+static int add_item(char *item)
+{
+    char *value = strchr(item, '=');
+    if (value == NULL)
+        return -1;
+    *value++ = '\0';
+    char *end;
+    unsigned long n = strtoul(value, &end, 10);
+    int number = *value >= '0' && *value <= '9' && *end == '\0';
+
+    if (strcmp(item, "host") == 0) {
+        uint8_t addr[16] = {0};
+        uint8_t family = AF_INET;
+        if (inet_pton(AF_INET, value, addr) != 1) {
+            family = AF_INET6;
+            if (inet_pton(AF_INET6, value, addr) != 1)
+                return -1;
+        }
+        struct host_slot *slot = host_slot(family, addr);
+        if (slot->family == 0) {
+            if (nb_hosts == PREFILTER_MAX_HOSTS)
+                return -1;
+            slot->family = family;
+            memcpy(slot->addr, addr, sizeof(addr));
+            nb_hosts++;
+        }
+    } else if (strcmp(item, "port") == 0 && number && n <= 65535) {
+        ports[n >> 3] |= 1 << (n & 7);
+        nb_ports++;
+    } else if (strcmp(item, "vlan") == 0 && number && n <= 4095) {
+        vlans[n >> 3] |= 1 << (n & 7);
+        nb_vlans++;
+    } else if (strcmp(item, "proto") == 0) {
+        static const struct {
+            const char *name;
+            uint8_t proto;
+        } names[] = {{"icmp", IPPROTO_ICMP}, {"igmp", IPPROTO_IGMP},
+                     {"tcp", IPPROTO_TCP},   {"udp", IPPROTO_UDP},
+                     {"icmp6", IPPROTO_ICMPV6}, {"sctp", IPPROTO_SCTP}};
+        int found = number && n <= 255;
+        for (size_t i = 0; !found && i < sizeof(names) / sizeof(*names); i++) {
+            if (strcmp(value, names[i].name) == 0) {
+                n = names[i].proto;
+                found = 1;
+            }
+        }
+        if (!found)
+            return -1;
+        protos[n >> 3] |= 1 << (n & 7);
+        nb_protos++;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Compile the prefilter
+ *
+ * The specification is a comma separated list of host=address,
+ * port=number, proto=name|number and vlan=number items. A packet is kept if
+ * it matches one item of every kind given. The errors are printed on stderr.
+ *
+ * @param spec The specification
+ * @return int 0 on success, -1 if the specification is malformed
+ */
+int prefilter_compile(const char *spec)
+{
+    char *copy = strdup(spec);
+    if (copy == NULL) {
+        perror("strdup");
+        return -1;
+    }
+    int ret = 0;
+    char *save = NULL;
+    for (char *item = strtok_r(copy, ",", &save); item;
+         item = strtok_r(NULL, ",", &save)) {
+        char shown[64];
+        snprintf(shown, sizeof(shown), "%s", item);
+        if (add_item(item) < 0) {
+            fprintf(stderr, "Bad prefilter item %s\n", shown);
+            ret = -1;
+            break;
+        }
+    }
+    free(copy);
+    active = ret == 0 && (nb_hosts || nb_ports || nb_protos || nb_vlans);
+    return ret;
+}
+
+
+/**
+ * @brief Read the flow key of a frame
+ *
+ * @param packet The frame
+ * @param caplen The captured size of the frame
+ * @param key The flow key, ports left untouched if absent
+ * @param vlan The inner VLAN, as kept by the Ethernet layer, 0 if untagged
+ * @param has_ports Set to 1 if the ports were read
+ * @return int 0 if the frame is IP, -1 otherwise
+ */
+int prefilter_key(const u_char *packet, uint32_t caplen, struct flow_key *key,
+                  uint16_t *vlan, int *has_ports)
+{
+    uint32_t off = sizeof(struct ether_header);
+    if (caplen < off)
+        return -1;
+    uint16_t type = packet[12] << 8 | packet[13];
+    while (type == ETHERTYPE_VLAN || type == ETHERTYPE_QINQ) {
+        if (caplen < off + VLAN_TAG_LEN)
+            return -1;
+        *vlan = (packet[off] << 8 | packet[off + 1]) & 0x0fff;
+        type = packet[off + 2] << 8 | packet[off + 3];
+        off += VLAN_TAG_LEN;
+    }
+
+    uint32_t l4;
+    int first_fragment = 1;
+    if (type == ETHERTYPE_IP) {
+        const struct ip *ip = (const struct ip *)(packet + off);
+        if (caplen < off + sizeof(struct ip) || ip->ip_hl < 5 ||
+            caplen < off + ip->ip_hl * 4)
+            return -1;
+        key->family = AF_INET;
+        key->proto = ip->ip_p;
+        memcpy(key->saddr, &ip->ip_src, 4);
+        memcpy(key->daddr, &ip->ip_dst, 4);
+        first_fragment = (ntohs(ip->ip_off) & IP_OFFMASK) == 0;
+        l4 = off + ip->ip_hl * 4;
+    } else if (type == ETHERTYPE_IPV6) {
+        const struct ip6_hdr *ip6 = (const struct ip6_hdr *)(packet + off);
+        if (caplen < off + sizeof(struct ip6_hdr))
+            return -1;
+        key->family = AF_INET6;
+        memcpy(key->saddr, &ip6->ip6_src, 16);
+        memcpy(key->daddr, &ip6->ip6_dst, 16);
+        uint8_t next = ip6->ip6_nxt;
+        off += sizeof(struct ip6_hdr);
+        while (next == IPPROTO_HOPOPTS || next == IPPROTO_DSTOPTS ||
+               next == IPPROTO_ROUTING) {
+            if (caplen < off + 8)
+                break;
+            next = packet[off];
+            off += (packet[off + 1] + 1) * 8;
+        }
+        if (next == IPPROTO_FRAGMENT && caplen >= off + 8) {
+            first_fragment = ((packet[off + 2] << 8 | packet[off + 3]) &
+                              0xfff8) == 0;
+            next = packet[off];
+            off += 8;
+        }
+        key->proto = next;
+        l4 = off;
+    } else {
+        return -1;
+    }
+
+    *has_ports = 0;
+    if ((key->proto == IPPROTO_TCP || key->proto == IPPROTO_UDP ||
+         key->proto == IPPROTO_SCTP) && first_fragment &&
+        l4 + PORT_MIN_HDR <= caplen) {
+        key->sport = packet[l4] << 8 | packet[l4 + 1];
+        key->dport = packet[l4 + 2] << 8 | packet[l4 + 3];
+        *has_ports = 1;
+    } else if (!first_fragment) {
+        *has_ports = -1; // Unknown, the port test is skipped
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Check if a packet passes the prefilter
+ *
+ * Always true when no prefilter is set. A frame that is not IP, ARP for
+ * instance, is only tested against the VLANs: it is dropped if the prefilter
+ * has a host, port or protocol term.
+ *
+ * @param packet The frame
+ * @param caplen The captured size of the frame
+ * @return int 1 if the packet is to be decoded, 0 if dropped
+ */
+int prefilter_match(const u_char *packet, uint32_t caplen)
+{
+    if (!active)
+        return 1;
+
+    struct flow_key key;
+    uint16_t vlan = 0;
+    int has_ports = 0;
+    key.sport = key.dport = 0;
+    int is_ip = prefilter_key(packet, caplen, &key, &vlan, &has_ports) == 0;
+
+    int pass = nb_vlans == 0 || bit_test(vlans, vlan);
+    if (pass && !is_ip) // No address, protocol or port to test
+        pass = nb_protos == 0 && nb_ports == 0 && nb_hosts == 0;
+    if (pass && nb_protos)
+        pass = bit_test(protos, key.proto);
+    if (pass && nb_ports && has_ports >= 0)
+        pass = has_ports && (bit_test(ports, key.sport) ||
+                             bit_test(ports, key.dport));
+    if (pass && nb_hosts)
+        pass = host_slot(key.family, key.saddr)->family != 0 ||
+               host_slot(key.family, key.daddr)->family != 0;
+
+    if (pass)
+        kept++;
+    else
+        dropped++;
+    return pass;
+}
+
+
+/**
+ * @brief Print the number of packets dropped by the prefilter
+ */
+void prefilter_report(void)
+{
+    if (!active)
+        return;
+    printf("Prefilter: %lu packets decoded, %lu dropped\n", kept, dropped);
+}
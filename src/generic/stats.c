@@ -0,0 +1,127 @@
+/**
+ * @file stats.c
+ * @brief Statistics definition
+ *
+ * This file contains the definition of the latency histograms. Every dissector
+ * measuring a request/response delay adds its samples to a named histogram, so
+ * that all the latencies are reported the same way.
+ *
+ * @see stats.h
+ * @see latency_add
+ * @see stats_print
+ */
+
+// General libraries
+#include <stdio.h>
+#include <string.h>
+
+// Local header files
+#include "stats.h"
+
+#define STATS_MAX 32 /**< Maximum number of histograms */
+
+static struct latency_stats latencies[STATS_MAX]; /**< Registered histograms */
+static int nb_latencies = 0; /**< Number of registered histograms */
+
+
+/**
+ * @brief Get a latency histogram
+ *
+ * Find the histogram with the given name, create it if needed.
+ *
+ * @param name The name of the histogram, must outlive the capture
+ * @return struct latency_stats* The histogram, NULL if too many histograms
+ */
+struct latency_stats *latency_stats_get(const char *name)
+{
+    for (int i = 0; i < nb_latencies; i++) {
+        if (strcmp(latencies[i].name, name) == 0)
+            return &latencies[i];
+    }
+    if (nb_latencies == STATS_MAX)
+        return NULL;
+
+    struct latency_stats *stats = &latencies[nb_latencies++];
+    memset(stats, 0, sizeof(*stats));
+    stats->name = name;
+    return stats;
+}
+
+
+/**
+ * @brief Add a sample to a latency histogram
+ *
+ * @param stats The histogram, may be NULL
+ * @param ns The duration in nanoseconds
+ */
+void latency_add(struct latency_stats *stats, uint64_t ns)
+{
+    if (stats == NULL)
+        return;
+
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= LATENCY_BUCKETS)
+        bucket = LATENCY_BUCKETS - 1;
+
+    if (stats->count == 0 || ns < stats->min)
+        stats->min = ns;
+    if (ns > stats->max)
+        stats->max = ns;
+    stats->count++;
+    stats->sum += ns;
+    stats->buckets[bucket]++;
+}
+
+
+/**
+ * @brief Format a duration
+ *
+ * @param ns The duration in nanoseconds
+ * @param buf The destination
+ * @param size The size of the destination
+ * @return char* The destination
+ */
+char *format_duration(uint64_t ns, char *buf, size_t size)
+{
+    if (ns < 1000)
+        snprintf(buf, size, "%lu ns", (unsigned long)ns);
+    else if (ns < 1000000)
+        snprintf(buf, size, "%.3f us", ns / 1e3);
+    else if (ns < 1000000000)
+        snprintf(buf, size, "%.3f ms", ns / 1e6);
+    else
+        snprintf(buf, size, "%.3f s", ns / 1e9);
+    return buf;
+}
+
+
+/**
+ * @brief Print the statistics
+ *
+ * Print every histogram that received samples.
+ */
+void stats_print(void)
+{
+    for (int i = 0; i < nb_latencies; i++) {
+        const struct latency_stats *stats = &latencies[i];
+        if (stats->count == 0)
+            continue;
+
+        char min[32], avg[32], max[32];
+        printf("%s: %lu samples, min %s, avg %s, max %s\n", stats->name,
+               (unsigned long)stats->count,
+               format_duration(stats->min, min, sizeof(min)),
+               format_duration(stats->sum / stats->count, avg, sizeof(avg)),
+               format_duration(stats->max, max, sizeof(max)));
+
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            if (stats->buckets[b] == 0)
+                continue;
+            char low[32], high[32];
+            printf("\t[%10s, %10s) %lu\n",
+                   format_duration(b ? 1ULL << b : 0, low, sizeof(low)),
+                   format_duration(1ULL << (b + 1), high, sizeof(high)),
+                   (unsigned long)stats->buckets[b]);
+        }
+    }
+}
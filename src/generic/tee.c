@@ -0,0 +1,239 @@
+/**
+ * @file tee.c
+ * @brief Tee mode definition
+ *
+ * This file contains the definition of the tee mode. The ring is written by
+ * the capture thread and read by the decoder thread only, so their positions
+ * are enough to share it without a lock: the capture thread copies a packet
+ * after the head and publishes the new head, the decoder decodes it in place
+ * and publishes the new tail. The copy is needed since libpcap reuses its
+ * buffer once the callback returns, the decoder makes none. A thread only
+ * takes the lock to sleep, when the ring is empty or full, and the capture
+ * thread of a capture file is woken up once a quarter of the ring is free
+ * rather than at every packet decoded.
+ *
+ * On a live capture, the capture thread never waits. The fuller the ring,
+ * the fewer packets are decoded: every packet below half of the ring, one in
+ * 2 below three quarters, one in 4 below seven eighths and one in 8 above, a
+ * packet being left out anyway if it doesn't fit.
+ *
+ * @see tee.h
+ * @see tee_push
+ */
+
+// General libraries
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Local header files
+#include "tee.h"
+
+/**
+ * @brief Record of a packet in the ring, followed by the packet
+ */
+struct tee_record {
+    struct pcap_pkthdr header;
+    uint64_t frame;         /**< Number of the packet in the capture */
+    uint32_t size;          /**< Bytes of the record and packet, 0 to wrap */
+    uint32_t padding;
+};
+
+#define TEE_ALIGN(n) (((n) + 7) & ~(size_t)7) /**< Records aligned on 8 bytes */
+#define TEE_RESUME (TEE_RING_LEN / 4) /**< Free bytes waking the capture up */
+
+static u_char *ring = NULL;
+static uint64_t head = 0;               /**< Bytes written, capture thread */
+static uint64_t tail = 0;               /**< Bytes read, decoder thread */
+static int lossless = 0;                /**< 1 to wait when the ring is full */
+static int done = 0;                    /**< 1 once the capture is over */
+static int reader_waiting = 0;          /**< 1 if the decoder sleeps */
+static int writer_waiting = 0;          /**< 1 if the capture thread sleeps */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t readable = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t writable = PTHREAD_COND_INITIALIZER;
+static pthread_t thread;
+static tee_handler decode = NULL;
+static uint64_t nb_frames = 0;          /**< Packets handed to tee_push */
+static uint64_t nb_skipped = 0;         /**< Packets left out */
+
+
+/**
+ * @brief Wake a thread up if it sleeps
+ *
+ * @param waiting The flag of the thread
+ * @param cond The condition it waits on
+ */
+static void wake(int *waiting, pthread_cond_t *cond)
+{
+    if (!__atomic_load_n(waiting, __ATOMIC_SEQ_CST))
+        return;
+    pthread_mutex_lock(&lock);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&lock);
+}
+
+
+/**
+ * @brief Decoder thread
+ *
+ * Decode the packets of the ring until the capture is over and the ring is
+ * empty.
+ *
+ * @param arg Unused
+ * @return void* NULL
+ */
+static void *decoder(void *arg)
+{
+    (void)arg;
+    uint64_t pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    for (;;) {
+        if (pos == __atomic_load_n(&head, __ATOMIC_ACQUIRE)) {
+            pthread_mutex_lock(&lock);
+            __atomic_store_n(&reader_waiting, 1, __ATOMIC_SEQ_CST);
+            while (pos == __atomic_load_n(&head, __ATOMIC_SEQ_CST) && !done)
+                pthread_cond_wait(&readable, &lock);
+            __atomic_store_n(&reader_waiting, 0, __ATOMIC_SEQ_CST);
+            int empty = pos == __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+            pthread_mutex_unlock(&lock);
+            if (empty) // And the capture is over
+                break;
+            continue;
+        }
+
+        size_t offset = pos % TEE_RING_LEN;
+        size_t contiguous = TEE_RING_LEN - offset;
+        const struct tee_record *record =
+            (const struct tee_record *)(ring + offset);
+        if (contiguous < sizeof(struct tee_record) || record->size == 0) {
+            pos += contiguous; // Next record at the start of the ring
+            continue;
+        }
+        decode(record->frame, &record->header, (const u_char *)(record + 1));
+        pos += record->size;
+        __atomic_store_n(&tail, pos, __ATOMIC_SEQ_CST);
+        if (TEE_RING_LEN - (__atomic_load_n(&head, __ATOMIC_ACQUIRE) - pos) >=
+            TEE_RESUME)
+            wake(&writer_waiting, &writable);
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief Start the decoder thread
+ *
+ * @param handler The function decoding the packets
+ * @param wait 1 to wait for the decoder when the ring is full, for a
+ * capture file, 0 to sample the packets decoded, for a live capture
+ * @return int 0 on success, -1 on error
+ */
+int tee_start(tee_handler handler, int wait)
+{
+    ring = malloc(TEE_RING_LEN);
+    if (ring == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    decode = handler;
+    lossless = wait;
+    head = tail = 0;
+    done = 0;
+    nb_frames = nb_skipped = 0;
+
+    // The signals, SIGINT among them, are left to the capture thread
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    int err = pthread_create(&thread, NULL, decoder, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (err != 0) {
+        fprintf(stderr, "Could not start the decoder: %s\n", strerror(err));
+        free(ring);
+        ring = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Hand a packet to the decoder thread
+ *
+ * The packet is copied in the ring, unless it is left out by the sampling.
+ *
+ * @param header The header of the packet
+ * @param packet The packet
+ */
+void tee_push(const struct pcap_pkthdr *header, const u_char *packet)
+{
+    uint64_t frame = ++nb_frames;
+    size_t size = TEE_ALIGN(sizeof(struct tee_record) + header->caplen);
+    size_t offset = head % TEE_RING_LEN;
+    size_t contiguous = TEE_RING_LEN - offset;
+    size_t needed = contiguous < size ? contiguous + size : size;
+
+    if (lossless) {
+        if (TEE_RING_LEN - (head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE)) <
+            needed) {
+            pthread_mutex_lock(&lock);
+            __atomic_store_n(&writer_waiting, 1, __ATOMIC_SEQ_CST);
+            // Packets are smaller than TEE_RESUME
+            while (TEE_RING_LEN - (head - __atomic_load_n(&tail,
+                                                          __ATOMIC_SEQ_CST)) <
+                   TEE_RESUME)
+                pthread_cond_wait(&writable, &lock);
+            __atomic_store_n(&writer_waiting, 0, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&lock);
+        }
+    } else {
+        uint64_t fill = head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+        unsigned stride = fill < TEE_RING_LEN / 2 ? 1 :
+                          fill < TEE_RING_LEN / 4 * 3 ? 2 :
+                          fill < TEE_RING_LEN / 8 * 7 ? 4 : 8;
+        if (frame % stride != 0 || TEE_RING_LEN - fill < needed) {
+            nb_skipped++;
+            return;
+        }
+    }
+
+    uint64_t pos = head;
+    if (contiguous < size) { // Wrap, the end of the ring is skipped
+        if (contiguous >= sizeof(struct tee_record))
+            ((struct tee_record *)(ring + offset))->size = 0;
+        pos += contiguous;
+        offset = 0;
+    }
+    struct tee_record *record = (struct tee_record *)(ring + offset);
+    record->header = *header;
+    record->frame = frame;
+    record->size = size;
+    memcpy(record + 1, packet, header->caplen);
+    __atomic_store_n(&head, pos + size, __ATOMIC_SEQ_CST);
+    wake(&reader_waiting, &readable);
+}
+
+
+/**
+ * @brief Stop the decoder thread
+ *
+ * Wait for the packets of the ring to be decoded, then print the number of
+ * packets decoded and left out on stderr.
+ */
+void tee_stop(void)
+{
+    pthread_mutex_lock(&lock);
+    done = 1;
+    pthread_cond_signal(&readable);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+    free(ring);
+    ring = NULL;
+
+    fprintf(stderr, "Tee: %lu packets decoded, %lu left out while the "
+                    "decoder was behind\n",
+            (unsigned long)(nb_frames - nb_skipped),
+            (unsigned long)nb_skipped);
+}
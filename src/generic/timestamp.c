@@ -0,0 +1,144 @@
+/**
+ * @file timestamp.c
+ * @brief Timestamp formatter definition
+ *
+ * This file contains the definition of the timestamp formatter. The date and
+ * time of the current second are formatted once and cached: for the next
+ * packets of the same second, only the fraction digits are rewritten.
+ *
+ * @see timestamp.h
+ * @see timestamp_format
+ */
+
+// General libraries
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Local header files
+#include "timestamp.h"
+
+#define TS_MAX_LEN 64 /**< Size of the formatted timestamp */
+
+/**
+ * @brief State of the formatter
+ */
+static struct {
+    int mode;                   /**< enum ts_mode */
+    int digits;                 /**< Digits after the second */
+    uint32_t divisor;           /**< Nanoseconds per last printed digit */
+    int64_t cached_sec;         /**< Second of the cached prefix, -1 if none */
+    size_t prefix_len;          /**< Length of the cached prefix, dot included */
+    char buf[TS_MAX_LEN];       /**< Cached prefix followed by the fraction */
+    uint8_t started;            /**< 1 once a packet was formatted */
+    uint64_t first;             /**< First timestamp (ns) */
+    uint64_t prev;              /**< Previous timestamp (ns) */
+} ts = {TS_LOCAL, TS_PRECISION_MICRO, 1000, -1, 0, {0}, 0, 0, 0};
+
+
+/**
+ * @brief Write the fraction of a second
+ *
+ * @param dst The destination, at least ts.digits bytes
+ * @param nsec The nanoseconds within the second
+ */
+static void put_fraction(char *dst, uint32_t nsec)
+{
+    uint32_t frac = nsec / ts.divisor;
+    for (int i = ts.digits - 1; i >= 0; i--) {
+        dst[i] = '0' + frac % 10;
+        frac /= 10;
+    }
+    dst[ts.digits] = '\0';
+}
+
+
+/**
+ * @brief Format a duration as seconds and fraction
+ *
+ * @param ns The duration in nanoseconds
+ * @return const char* The formatted duration
+ */
+static const char *format_seconds(uint64_t ns)
+{
+    int len = snprintf(ts.buf, sizeof(ts.buf), "%lu.",
+                       (unsigned long)(ns / 1000000000));
+    put_fraction(ts.buf + len, ns % 1000000000);
+    return ts.buf;
+}
+
+
+/**
+ * @brief Set up the timestamp formatter
+ *
+ * @param mode The timestamp mode (enum ts_mode)
+ * @param digits The number of digits after the second (TS_PRECISION_*)
+ */
+void timestamp_init(int mode, int digits)
+{
+    ts.mode = mode;
+    ts.digits = digits == TS_PRECISION_NANO ? TS_PRECISION_NANO :
+                                              TS_PRECISION_MICRO;
+    ts.divisor = ts.digits == TS_PRECISION_NANO ? 1 : 1000;
+    ts.cached_sec = -1;
+    ts.started = 0;
+}
+
+
+/**
+ * @brief Format a capture timestamp
+ *
+ * In the date modes, localtime_r and strftime are only called when the second
+ * changes.
+ *
+ * @param sec The seconds since the Epoch
+ * @param nsec The nanoseconds within the second
+ * @return const char* The formatted timestamp, valid until the next call,
+ * NULL in TS_NONE mode
+ */
+const char *timestamp_format(uint64_t sec, uint32_t nsec)
+{
+    uint64_t now = sec * 1000000000 + nsec;
+    uint64_t prev = ts.started ? ts.prev : now;
+    if (!ts.started) {
+        ts.first = now;
+        ts.started = 1;
+    }
+    ts.prev = now;
+
+    switch (ts.mode) {
+    case TS_NONE:
+        return NULL;
+    case TS_DELTA:
+        ts.cached_sec = -1;
+        return format_seconds(now >= prev ? now - prev : 0);
+    case TS_RELATIVE:
+        ts.cached_sec = -1;
+        return format_seconds(now >= ts.first ? now - ts.first : 0);
+    }
+
+    if ((int64_t)sec != ts.cached_sec) {
+        time_t t = sec;
+        struct tm tm;
+        if (ts.mode == TS_EPOCH) {
+            ts.prefix_len = snprintf(ts.buf, sizeof(ts.buf), "%lu.",
+                                     (unsigned long)sec);
+        } else {
+            if ((ts.mode == TS_UTC ? gmtime_r(&t, &tm) :
+                                     localtime_r(&t, &tm)) == NULL) {
+                perror("localtime");
+                return "";
+            }
+            ts.prefix_len =
+                strftime(ts.buf, sizeof(ts.buf), "%Y-%m-%d %H:%M:%S.", &tm);
+            if (ts.prefix_len == 0) {
+                fprintf(stderr, "strftime failed\n");
+                return "";
+            }
+        }
+        ts.cached_sec = sec;
+    }
+
+    put_fraction(ts.buf + ts.prefix_len, nsec);
+    return ts.buf;
+}
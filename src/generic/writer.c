@@ -0,0 +1,313 @@
+/**
+ * @file writer.c
+ * @brief Capture writer definition
+ *
+ * This file contains the definition of the capture writer. The pcap records
+ * are copied in the buffers of the asynchronous writer, AIO_BUF_LEN bytes
+ * aligned on AIO_ALIGN, each written in one system call or io_uring request
+ * when full: the capture loop never waits on stdio, and a file opened with
+ * O_DIRECT only sees aligned writes. The last partial buffer of a file is
+ * written after O_DIRECT is cleared. When compressing, the records go through
+ * the compression threads first, and the frames are written to the buffers.
+ * With --index, every file gets its index once closed.
+ *
+ * The files are named as tcpdump does: the name goes through strftime when
+ * rotating by time, and a number is appended when rotating by size or
+ * packets, or when the files form a ring.
+ *
+ * @see writer.h
+ * @see writer_write
+ */
+
+#define _GNU_SOURCE // O_DIRECT
+
+// General libraries
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Local header files
+#include "aio.h"
+#include "capindex.h"
+#include "compress.h"
+#include "writer.h"
+
+#define PCAP_MAGIC 0xa1b2c3d4 /**< Magic of a file with microseconds */
+#define PCAP_MAGIC_NANO 0xa1b23c4d /**< Magic of a file with nanoseconds */
+
+/**
+ * @brief Header of a pcap file
+ */
+struct pcap_file_header_v24 {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+/**
+ * @brief Header of a pcap record
+ */
+struct pcap_record_header {
+    uint32_t ts_sec;
+    uint32_t ts_frac;   /**< Microseconds or nanoseconds */
+    uint32_t caplen;
+    uint32_t len;
+};
+
+static struct writer_options opts;
+static struct pcap_file_header_v24 file_header;
+static int fd = -1;                 /**< Current file, -1 if none */
+static struct aio_file *out = NULL; /**< Writes of the current file */
+static struct compress_file *packed = NULL; /**< Compression, NULL if none */
+static char name[PATH_MAX];         /**< Name of the current file */
+static uint64_t file_bytes = 0;     /**< Bytes of the current file */
+static uint64_t file_packets = 0;   /**< Packets of the current file */
+static time_t file_start = 0;       /**< Time of the first packet of the file */
+static uint32_t file_index = 0;     /**< Number of the current file */
+
+
+/**
+ * @brief Format the name of a file
+ *
+ * @param index The number of the file
+ * @param start The time of the first packet of the file
+ * @return int 0 on success, -1 if the name is too long
+ */
+static int file_name(uint32_t index, time_t start)
+{
+    char base[PATH_MAX];
+    if (opts.seconds) {
+        struct tm tm;
+        localtime_r(&start, &tm);
+        if (strftime(base, sizeof(base), opts.path, &tm) == 0)
+            return -1;
+    } else {
+        snprintf(base, sizeof(base), "%s", opts.path);
+    }
+
+    int numbered = opts.file_size || opts.packets || opts.files ||
+                   (opts.seconds && strchr(opts.path, '%') == NULL);
+    int len;
+    if (numbered && opts.files) {
+        int width = 1;
+        for (uint32_t n = opts.files - 1; n >= 10; n /= 10)
+            width++;
+        len = snprintf(name, sizeof(name), "%s%0*u", base, width,
+                       index % opts.files);
+    } else if (numbered && index > 0) {
+        len = snprintf(name, sizeof(name), "%s%u", base, index);
+    } else {
+        len = snprintf(name, sizeof(name), "%s", base);
+    }
+    return len < (int)sizeof(name) ? 0 : -1;
+}
+
+
+/**
+ * @brief Append bytes to the current file
+ *
+ * @param data The bytes
+ * @param len The number of bytes
+ * @return int 0 on success, -1 if a previous write failed
+ */
+static int append(const void *data, size_t len)
+{
+    if (out->error != 0) {
+        errno = out->error;
+        perror(name);
+        return -1;
+    }
+    if (packed == NULL) {
+        aio_append(out, data, len);
+    } else if (compress_append(packed, data, len) < 0) {
+        fprintf(stderr, "%s: a block could not be compressed\n", name);
+        return -1;
+    }
+    file_bytes += len;
+    return 0;
+}
+
+
+/**
+ * @brief Open the next file and write its header
+ *
+ * @param start The time of the first packet of the file
+ * @return int 0 on success, -1 on error
+ */
+static int open_file(time_t start)
+{
+    file_start = start;
+    file_bytes = 0;
+    file_packets = 0;
+    if (strcmp(opts.path, "-") == 0) {
+        snprintf(name, sizeof(name), "stdout");
+        fd = STDOUT_FILENO;
+    } else if (file_name(file_index, start) < 0) {
+        fprintf(stderr, "File name too long: %s\n", opts.path);
+        return -1;
+    } else {
+        int flags = O_WRONLY | O_CREAT | O_TRUNC;
+        fd = open(name, flags | (opts.direct ? O_DIRECT : 0), 0644);
+        if (fd < 0 && opts.direct && errno == EINVAL) {
+            fprintf(stderr, "%s: O_DIRECT not supported, writing through "
+                            "the page cache\n", name);
+            opts.direct = 0;
+            fd = open(name, flags, 0644);
+        }
+        if (fd < 0) {
+            perror(name);
+            return -1;
+        }
+    }
+    out = aio_attach(fd);
+    if (out != NULL && opts.codec &&
+        (packed = compress_attach(out, opts.codec, opts.level)) == NULL) {
+        aio_detach(out);
+        out = NULL;
+    }
+    if (out == NULL) {
+        if (fd != STDOUT_FILENO)
+            close(fd);
+        fd = -1;
+        return -1;
+    }
+    if (opts.index)
+        capindex_begin();
+    return append(&file_header, sizeof(file_header));
+}
+
+
+/**
+ * @brief Close the current file
+ *
+ * @return int 0 on success, -1 on error
+ */
+static int close_file(void)
+{
+    int ret = 0;
+    if (packed != NULL && compress_detach(packed) < 0)
+        ret = -1;
+    packed = NULL;
+    if (opts.direct && out->fill != NULL && out->fill->len % AIO_ALIGN != 0) {
+        int flags = fcntl(fd, F_GETFL);
+        if (aio_drain(out) < 0 || flags < 0 ||
+            fcntl(fd, F_SETFL, flags & ~O_DIRECT) < 0) {
+            perror(name);
+            ret = -1;
+        }
+    }
+    if (aio_detach(out) < 0) {
+        perror(name);
+        ret = -1;
+    }
+    out = NULL;
+    if (fd != STDOUT_FILENO && close(fd) < 0) {
+        perror(name);
+        ret = -1;
+    }
+    fd = -1;
+    if (opts.index && capindex_end(name, file_bytes) < 0)
+        ret = -1;
+    return ret;
+}
+
+
+/**
+ * @brief Open the capture writer
+ *
+ * When rotating by time, the first file is opened at the first packet.
+ *
+ * @param options The options, the path must stay valid until writer_close
+ * @param linktype The link type of the capture (DLT_*)
+ * @param snaplen The snapshot length of the capture
+ * @param nano 1 if the timestamps are in nanoseconds
+ * @return int 0 on success, -1 on error
+ */
+int writer_open(const struct writer_options *options, int linktype,
+                int snaplen, int nano)
+{
+    opts = *options;
+    file_index = 0;
+
+    file_header.magic = nano ? PCAP_MAGIC_NANO : PCAP_MAGIC;
+    file_header.version_major = 2;
+    file_header.version_minor = 4;
+    file_header.thiszone = 0;
+    file_header.sigfigs = 0;
+    file_header.snaplen = snaplen;
+    file_header.linktype = linktype;
+    // Named after its first packet when rotating by time
+    return opts.seconds ? 0 : open_file(0);
+}
+
+
+/**
+ * @brief Write a packet
+ *
+ * Switch to the next file first if the current one is full.
+ *
+ * @param header The header of the packet
+ * @param packet The packet
+ * @return int 0 on success, -1 on error
+ */
+int writer_write(const struct pcap_pkthdr *header, const u_char *packet)
+{
+    struct pcap_record_header record = {
+        .ts_sec = header->ts.tv_sec,
+        .ts_frac = header->ts.tv_usec, // Nanoseconds with the nano precision
+        .caplen = header->caplen,
+        .len = header->len};
+    uint64_t size = sizeof(record) + header->caplen;
+
+    if (fd < 0) {
+        if (open_file(header->ts.tv_sec) < 0)
+            return -1;
+    } else if (strcmp(opts.path, "-") != 0 && file_packets > 0 &&
+               ((opts.file_size && file_bytes + size > opts.file_size) ||
+                (opts.packets && file_packets >= opts.packets) ||
+                (opts.seconds &&
+                 header->ts.tv_sec - file_start >= (time_t)opts.seconds))) {
+        file_index++;
+        if (close_file() < 0 || open_file(header->ts.tv_sec) < 0)
+            return -1;
+    }
+
+    if (opts.index) {
+        uint64_t ns = file_header.magic == PCAP_MAGIC_NANO ?
+                      record.ts_frac : record.ts_frac * 1000ULL;
+        if (capindex_add(file_bytes, record.ts_sec * 1000000000ULL + ns,
+                         packet, header->caplen) < 0)
+            return -1;
+    }
+    if (append(&record, sizeof(record)) < 0 ||
+        append(packet, header->caplen) < 0)
+        return -1;
+    file_packets++;
+    return 0;
+}
+
+
+/**
+ * @brief Close the capture writer
+ *
+ * Write the buffered packets and close the current file.
+ *
+ * @return int 0 on success, -1 on error
+ */
+int writer_close(void)
+{
+    int ret = 0;
+    if (fd >= 0)
+        ret = close_file();
+    return ret;
+}
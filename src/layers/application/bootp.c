@@ -5,257 +5,567 @@
  * @ingroup application
  * 
  * This file contains the functions to cast the BOOTP header from a packet.
+ * DHCP options are decoded from a table indexed by their code, and the leases
+ * are tracked per client hardware address, for DHCP_MAX_LEASES clients at most.
  * 
  * @see bootp.h
  * @see cast_bootp
  */
 
 // Global libraries
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 // Local header files
 #include "bootp.h"
+#include "format.h"
+#include "hash.h"
+#include "packet.h"
+#include "stats.h"
 
 #define DHCP_MCOOKIE 0x63825363 /**< DHCP magic cookie */
 #define VENDOR_OFF 236 /**< Vendor specific information offset */
+#define LEASE_BUCKETS 256 /**< Number of buckets, must be a power of 2 */
 
+/**
+ * @brief DHCP message types (option 53)
+ */
+enum dhcp_msg {
+    DHCP_DISCOVER = 1,
+    DHCP_OFFER,
+    DHCP_REQUEST,
+    DHCP_DECLINE,
+    DHCP_ACK,
+    DHCP_NAK,
+    DHCP_RELEASE,
+    DHCP_INFORM
+};
 
 /**
- * @brief Format hardware address
- * 
- * Format hardware address from BOOTP header.
- * 
- * @param bootp BOOTP header
- * @return char* Formatted hardware address
- * 
- * @note This function doesn't check for all errors.
- * @note The returned string must be freed by the caller
+ * @brief Lease of a client
+ *
+ * Address leased to a client hardware address, and timestamps of the
+ * exchange in progress.
+ */
+struct dhcp_lease {
+    uint8_t chaddr[16];     /**< Client hardware address */
+    uint8_t hlen;           /**< Length of the hardware address */
+    uint32_t xid;           /**< Transaction of the exchange in progress */
+    uint32_t ip;            /**< Leased address, in network order, 0 if none */
+    uint32_t lease_time;    /**< Lease time in seconds */
+    uint64_t discover;      /**< First DISCOVER of the transaction (ns) */
+    uint64_t offer;         /**< First OFFER of the transaction (ns) */
+    uint64_t request;       /**< First REQUEST of the transaction (ns) */
+    struct dhcp_lease *next; /**< Next lease in the same bucket */
+};
+
+static struct dhcp_lease *leases[LEASE_BUCKETS]; /**< Lease buckets */
+static int nb_leases; /**< Clients tracked */
+
+
+/**
+ * @brief Kinds of DHCP option values
+ */
+enum dhcp_kind {
+    KIND_HEX = 0,       /**< Unknown layout, printed in hexadecimal */
+    KIND_IPV4,          /**< One IPv4 address */
+    KIND_IPV4_LIST,     /**< List of IPv4 addresses */
+    KIND_U8,
+    KIND_U16,
+    KIND_U32,
+    KIND_S32,           /**< Signed 32 bits (time offset) */
+    KIND_STRING,        /**< Text, not NUL terminated */
+    KIND_MSG_TYPE,      /**< DHCP message type */
+    KIND_PARAM_LIST,    /**< List of option codes */
+    KIND_CLIENT_ID,     /**< Hardware type followed by an identifier */
+    KIND_OVERLOAD       /**< Option overload */
+};
+
+/**
+ * @brief DHCP option description
+ */
+struct dhcp_option {
+    const char *name;
+    uint8_t kind;       /**< enum dhcp_kind */
+};
+
+/**
+ * @brief Known DHCP options, indexed by their code (RFC 2132)
+ */
+static const struct dhcp_option dhcp_options[256] = {
+    [1] = {"SUBNET MASK", KIND_IPV4},
+    [2] = {"TIME OFFSET", KIND_S32},
+    [3] = {"ROUTER", KIND_IPV4_LIST},
+    [4] = {"TIME SERVER", KIND_IPV4_LIST},
+    [6] = {"DNS", KIND_IPV4_LIST},
+    [12] = {"HOST NAME", KIND_STRING},
+    [15] = {"DOMAIN NAME", KIND_STRING},
+    [26] = {"INTERFACE MTU", KIND_U16},
+    [28] = {"BROADCAST ADDRESS", KIND_IPV4},
+    [31] = {"PERFORM ROUTER DISCOVERY", KIND_U8},
+    [33] = {"STATIC ROUTE", KIND_IPV4_LIST},
+    [42] = {"NETWORK TIME PROTOCOL SERVERS", KIND_IPV4_LIST},
+    [43] = {"VENDOR SPECIFIC INFORMATION", KIND_HEX},
+    [44] = {"NETBIOS OVER TCP/IP NAME SERVER", KIND_IPV4_LIST},
+    [46] = {"NETBIOS OVER TCP/IP NODE TYPE", KIND_U8},
+    [47] = {"NETBIOS OVER TCP/IP SCOPE", KIND_STRING},
+    [50] = {"REQUESTED IP ADDRESS", KIND_IPV4},
+    [51] = {"LEASE TIME", KIND_U32},
+    [52] = {"OPTION OVERLOAD", KIND_OVERLOAD},
+    [53] = {"MESSAGE TYPE", KIND_MSG_TYPE},
+    [54] = {"SERVER IDENTIFIER", KIND_IPV4},
+    [55] = {"PARAMETER REQUEST LIST", KIND_PARAM_LIST},
+    [56] = {"MESSAGE", KIND_STRING},
+    [57] = {"MAXIMUM MESSAGE SIZE", KIND_U16},
+    [58] = {"RENEWAL TIME VALUE", KIND_U32},
+    [59] = {"REBINDING TIME VALUE", KIND_U32},
+    [60] = {"VENDOR CLASS IDENTIFIER", KIND_STRING},
+    [61] = {"CLIENT IDENTIFIER", KIND_CLIENT_ID},
+    [66] = {"TFTP SERVER NAME", KIND_STRING},
+    [67] = {"BOOTFILE NAME", KIND_STRING},
+    [81] = {"CLIENT FQDN", KIND_HEX},
+    [82] = {"RELAY AGENT INFORMATION", KIND_HEX},
+    [90] = {"AUTHENTICATION", KIND_HEX},
+    [119] = {"DOMAIN SEARCH", KIND_HEX},
+    [121] = {"CLASSLESS STATIC ROUTE", KIND_HEX},
+    [249] = {"PRIVATE CLASSLESS STATIC ROUTE", KIND_HEX},
+};
+
+/**
+ * @brief Minimum length of the values, indexed by enum dhcp_kind
+ */
+static const uint8_t kind_min_len[] = {
+    [KIND_HEX] = 0,       [KIND_IPV4] = 4,      [KIND_IPV4_LIST] = 4,
+    [KIND_U8] = 1,        [KIND_U16] = 2,       [KIND_U32] = 4,
+    [KIND_S32] = 4,       [KIND_STRING] = 0,    [KIND_MSG_TYPE] = 1,
+    [KIND_PARAM_LIST] = 0, [KIND_CLIENT_ID] = 1, [KIND_OVERLOAD] = 1};
+
+const char *dhcp_msg_type[] = {"UNKNOWN", "DISCOVER", "OFFER",   "REQUEST",
+                               "DECLINE", "ACK",      "NAK",     "RELEASE",
+                               "INFORM"}; /**< DHCP message types */
+
+/**
+ * @brief DHCP options needed by the lease tracker
  */
-char *format_haddr(const struct bootphdr *bootp)
+struct dhcp_info {
+    uint8_t msg_type;       /**< Option 53, 0 if absent */
+    uint8_t overload;       /**< Option 52, 0 if absent */
+    uint32_t lease_time;    /**< Option 51, 0 if absent */
+};
+
+
+/**
+ * @brief Print a text value
+ *
+ * Non printable characters are printed as dots, the value stops at its
+ * length or at the first NUL byte.
+ *
+ * @param V Value
+ * @param L Length
+ */
+static void print_string(const uint8_t *V, int L)
 {
-    switch (bootp->bh_htype) {
-    case 1: {
-        char *res = malloc(3 * 6 * sizeof(char));
-        if (res == NULL)
-            return NULL;
-        sprintf(res, "%02X:%02X:%02X:%02X:%02X:%02X", bootp->bh_chaddr[0],
-                bootp->bh_chaddr[1], bootp->bh_chaddr[2], bootp->bh_chaddr[3],
-                bootp->bh_chaddr[4], bootp->bh_chaddr[5]);
-        return res;
-    }
-    default:
-        fprintf(stderr, "Unsupported hardware type 0x%x\n", bootp->bh_htype);
-        return NULL;
-    }
+    for (int i = 0; i < L && V[i] != '\0'; i++)
+        fputc(V[i] >= 32 && V[i] <= 126 ? V[i] : '.', current_packet.out);
 }
 
+
 /**
  * @brief Analyze DHCP TLV
  * 
- * Analyze DHCP TLV.
+ * Print an option according to its kind. The value is never read past L.
  * 
  * @param T Type
  * @param L Length
  * @param V Value
+ * @param info Options needed by the lease tracker
  */
-void dhcp_tlv_analyze(uint8_t T, uint8_t L, uint8_t *V)
+static void dhcp_tlv_analyze(uint8_t T, uint8_t L, const uint8_t *V,
+                             struct dhcp_info *info)
 {
-    switch (T) {
-    case 1:
-        printf("\t- SUBNET MASK: %u.%u.%u.%u\n", V[0], V[1], V[2], V[3]);
-        break;
-    case 2:
-        printf("\t- TIME OFFSET: %s\n", V);
-        break;
-    case 3:
-        printf("\t- ROUTER: %u.%u.%u.%u\n", V[0], V[1], V[2], V[3]);
+    const struct dhcp_option *opt = &dhcp_options[T];
+    uint8_t kind = opt->kind;
+    char addr[IPV4_STR_LEN];
+
+    if (opt->name)
+        fprintf(current_packet.out, "\t- %s: ", opt->name);
+    else
+        fprintf(current_packet.out, "\t- OPTION %u: ", T);
+    if (L < kind_min_len[kind]) {
+        fprintf(current_packet.out, "MALFORMED (%u bytes)\n", L);
+        return;
+    }
+
+    switch (kind) {
+    case KIND_IPV4:
+        fprintf(current_packet.out, "%s\n", format_ipv4(V, addr));
         break;
-    case 6:
-        printf("\t- DNS: %u.%u.%u.%u\n", V[0], V[1], V[2], V[3]);
+    case KIND_IPV4_LIST:
+        for (int i = 0; i + 4 <= L; i += 4)
+            fprintf(current_packet.out,
+                    "%s%s", i ? ", " : "", format_ipv4(V + i, addr));
+        fprintf(current_packet.out, "\n");
         break;
-    case 12:
-        printf("\t- HOST NAME: %s\n", V);
+    case KIND_U8:
+        fprintf(current_packet.out, "%u\n", V[0]);
         break;
-    case 15:
-        printf("\t- DOMAIN NAME: %s\n", V);
+    case KIND_U16:
+        fprintf(current_packet.out, "%u\n", V[0] << 8 | V[1]);
         break;
-    case 28:
-        printf("\t- BROADCAST ADDRESS: %s\n", V);
+    case KIND_U32: {
+        uint32_t val = (uint32_t)V[0] << 24 | V[1] << 16 | V[2] << 8 | V[3];
+        fprintf(current_packet.out, "%u\n", val);
+        if (T == 51)
+            info->lease_time = val;
         break;
-    case 44:
-        printf("\t- NETBIOS OVER TCP/IP NAME SERVER: %s\n", V);
+    }
+    case KIND_S32:
+        fprintf(current_packet.out, "%d\n",
+                (int32_t)((uint32_t)V[0] << 24 | V[1] << 16 | V[2] << 8 |
+                          V[3]));
         break;
-    case 47:
-        printf("\t- NETBIOS OVER TCP/IP SCOPE: %s\n", V);
+    case KIND_STRING:
+        print_string(V, L);
+        fprintf(current_packet.out, "\n");
         break;
-    case 50:
-        printf("\t- REQUESTED IP ADDRESS: %u.%u.%u.%u\n", V[0], V[1], V[2], V[3]);
+    case KIND_MSG_TYPE:
+        fprintf(current_packet.out,
+                "%s\n", V[0] <= 8 ? dhcp_msg_type[V[0]] : "UNKNOWN");
+        info->msg_type = V[0];
         break;
-    case 51:
-        printf("\t- LEASE TIME: %d\n", be32toh(*(uint32_t *)V));
+    case KIND_PARAM_LIST:
+        fprintf(current_packet.out, "\n");
+        for (int i = 0; i < L; i++) {
+            if (dhcp_options[V[i]].name)
+                fprintf(current_packet.out,
+                        "\t\t(%u)\t%s\n", V[i], dhcp_options[V[i]].name);
+            else
+                fprintf(current_packet.out, "\t\t(%u)\tUNKNOWN\n", V[i]);
+        }
         break;
-    case 53: {
-        printf("\t- MESSAGE TYPE: ");
-        switch (V[0]) {
-        case 1:
-            printf("DISCOVER\n");
-            break;
-        case 2:
-            printf("OFFER\n");
-            break;
-        case 3:
-            printf("REQUEST\n");
-            break;
-        case 5:
-            printf("ACK\n");
-            break;
-        case 7:
-            printf("RELEASE\n");
+    case KIND_CLIENT_ID:
+        if (V[0] == 1 && L == 7) {
+            char mac[MAC_STR_LEN];
+            fprintf(current_packet.out, "%s\n", format_mac(V + 1, mac));
             break;
-        default:
-            printf("UNKNOWN\n");
         }
+        // FALLTHROUGH
+    case KIND_HEX:
+        for (int i = 0; i < L; i++)
+            fprintf(current_packet.out, "%02X", V[i]);
+        fprintf(current_packet.out, "\n");
         break;
-    }
-    case 54:
-        printf("\t- SERVER IDENTIFIER: %u.%u.%u.%u\n", V[0], V[1], V[2], V[3]);
-        break;
-    case 55: {
-        printf("\t- PARAMETER REQUEST LIST: \n");
-        for (int i = 0; i < L; i++) {
-            switch(V[i]) {
-                case 1:
-                    printf("\t\t(1)\tSUBNET MASK\n");
-                    break;
-                case 2:
-                    printf("\t\t(2)\tTIME OFFSET\n");
-                    break;
-                case 3:
-                    printf("\t\t(3)\tROUTER\n");
-                    break;
-                case 6:
-                    printf("\t\t(6)\tDNS\n");
-                    break;
-                case 12:
-                    printf("\t\t(12)\tHOST NAME\n");
-                    break;
-                case 15:
-                    printf("\t\t(15)\tDOMAIN NAME\n");
-                    break;
-                case 42:
-                    printf("\t\t(42)\tNETWORK TIME PROTOCOL SERVERS\n");
-                    break;
-                case 44:
-                    printf("\t\t(44)\tNETBIOS OVER TCP/IP NAME SERVER\n");
-                    break;
-                case 47:
-                    printf("\t\t(47)\tNETBIOS OVER TCP/IP SCOPE\n");
-                    break;
-                case 51:
-                    printf("\t\t(51)\tLEASE TIME\n");
-                    break;
-                case 54:
-                    printf("\t\t(54)\tSERVER IDENTIFIER\n");
-                    break;
-                default:
-                    printf("\t\tPARAMETER NOT IMPLEMENTED YET %d\n", V[i]);
-            }
-        }
+    case KIND_OVERLOAD:
+        info->overload = V[0];
+        fprintf(current_packet.out,
+                "%s\n", V[0] == 1 ? "FILE" : V[0] == 2 ? "SNAME" :
+                        V[0] == 3 ? "FILE AND SNAME" : "UNKNOWN");
         break;
     }
-    case 58: 
-        printf("\t- REBINDING TIME VALUE: %d\n", be32toh(*(uint32_t*)V));
-        break;
-    case 61: {
-        printf("\t- CLIENT IDENTIFIER: ");
-        uint8_t htype = (uint8_t)V[0];
-        if (htype == 1) {
-            printf("%02X:%02X:%02X:%02X:%02X:%02X\n", V[1], V[2], V[3], V[4],
-                   V[5], V[6]);
-        } else {
-            printf("UNKNOWN HTYPE\n");
+}
+
+
+/**
+ * @brief Walk DHCP options
+ * 
+ * Walk an option area: the vendor area, or the sname/file fields when they
+ * are overloaded. Every option is checked against the end of the area.
+ * 
+ * @param packet Pointer to the first option
+ * @param len Length of the area
+ * @param info Options needed by the lease tracker
+ * @return int 0 if the END option was found, -1 otherwise
+ */
+static int walk_options(const u_char *packet, int len, struct dhcp_info *info)
+{
+    int off = 0;
+    while (off < len) {
+        uint8_t T = packet[off];
+        if (T == 0) { // Pad
+            off++;
+            continue;
         }
-        break;
-    }
+        if (T == 255) // End of options
+            return 0;
+        if (off + 2 > len || off + 2 + packet[off + 1] > len) {
+            fprintf(current_packet.out, "\t- OPTION %u: TRUNCATED\n", T);
+            return -1;
+        }
+        uint8_t L = packet[off + 1];
+        dhcp_tlv_analyze(T, L, packet + off + 2, info);
+        off += 2 + L;
     }
+    fprintf(current_packet.out, "\t- NO END OPTION\n");
+    return -1;
 }
 
+
 /**
  * @brief Walk vendor specific information
  * 
- * Walk vendor specific information.
+ * Walk the options of a DHCP message, then the sname and file fields when
+ * option 52 overloads them.
+ * 
+ * @param bootp BOOTP header
+ * @param data_size Size of the message
+ * @param info Options needed by the lease tracker
+ */
+static void walk_vendor(const struct bootphdr *bootp, int data_size,
+                        struct dhcp_info *info)
+{
+    const u_char *packet = (const u_char *)bootp;
+    fprintf(current_packet.out, "OPTIONS:\n");
+    walk_options(packet + VENDOR_OFF + 4, data_size - VENDOR_OFF - 4, info);
+
+    // RFC 2131: the file field is walked before the sname field
+    if (info->overload & 1) {
+        fprintf(current_packet.out, "OPTIONS IN FILE:\n");
+        walk_options(bootp->bh_file, sizeof(bootp->bh_file), info);
+    } else if (bootp->bh_file[0]) {
+        fprintf(current_packet.out, "\t- BOOT FILE: ");
+        print_string(bootp->bh_file, sizeof(bootp->bh_file));
+        fprintf(current_packet.out, "\n");
+    }
+    if (info->overload & 2) {
+        fprintf(current_packet.out, "OPTIONS IN SNAME:\n");
+        walk_options(bootp->bh_sname, sizeof(bootp->bh_sname), info);
+    } else if (bootp->bh_sname[0]) {
+        fprintf(current_packet.out, "\t- SERVER NAME: ");
+        print_string(bootp->bh_sname, sizeof(bootp->bh_sname));
+        fprintf(current_packet.out, "\n");
+    }
+}
+
+
+/**
+ * @brief Check if a packet is a BOOTP/DHCP message
+ * 
+ * The message must be long enough to hold the vendor magic cookie.
  * 
  * @param packet Pointer to the packet
- * @param magic_cookie Magic cookie
+ * @param data_size Size of the data
+ * @return int 1 if the packet is a BOOTP message, 0 otherwise
  */
-void walk_vendor(const u_char *packet, uint32_t magic_cookie)
+int is_bootp(const u_char *packet, int data_size)
 {
-    printf("OPTIONS:\n");
-    int off = 0;
-    while (1) {
-        uint8_t T;
-        T = *(uint8_t *)(packet + off);
-        if (T == 0x00) { // End of options
+    if (data_size > current_packet.end - packet)
+        data_size = current_packet.end - packet;
+    if (data_size < VENDOR_OFF + 4) {
+        return 0;
+    }
+    const struct bootphdr *bootp;
+    bootp = (struct bootphdr *)packet;
+    if ((bootp->bh_op != 1 && bootp->bh_op != 2) || bootp->bh_hlen > 16) {
+        return 0;
+    }
+    return be32toh(*(uint32_t *)(packet + VENDOR_OFF)) == DHCP_MCOOKIE;
+}
+
+
+/**
+ * @brief Hash a client hardware address
+ * 
+ * @param bootp BOOTP header
+ * @return uint32_t The bucket of the client
+ */
+static uint32_t hash_chaddr(const struct bootphdr *bootp)
+{
+    return fnv1a32(FNV32_OFFSET, bootp->bh_chaddr, bootp->bh_hlen) &
+           (LEASE_BUCKETS - 1);
+}
+
+
+/**
+ * @brief Get the lease of a client
+ * 
+ * @param bootp BOOTP header
+ * @return struct dhcp_lease* The lease, created if needed, NULL on error or
+ * if the table is full
+ */
+static struct dhcp_lease *lease_get(const struct bootphdr *bootp)
+{
+    uint32_t bucket = hash_chaddr(bootp);
+    for (struct dhcp_lease *lease = leases[bucket]; lease != NULL;
+         lease = lease->next) {
+        if (lease->hlen == bootp->bh_hlen &&
+            memcmp(lease->chaddr, bootp->bh_chaddr, bootp->bh_hlen) == 0)
+            return lease;
+    }
+
+    if (nb_leases >= DHCP_MAX_LEASES)
+        return NULL;
+    struct dhcp_lease *lease = calloc(1, sizeof(struct dhcp_lease));
+    if (lease == NULL) {
+        fprintf(stderr, "malloc\n");
+        return NULL;
+    }
+    lease->hlen = bootp->bh_hlen;
+    memcpy(lease->chaddr, bootp->bh_chaddr, bootp->bh_hlen);
+    lease->next = leases[bucket];
+    leases[bucket] = lease;
+    nb_leases++;
+    return lease;
+}
+
+
+/**
+ * @brief Track the lease of a client
+ * 
+ * Follow the DISCOVER/OFFER/REQUEST/ACK exchange of a client and measure the
+ * delays of the server.
+ * 
+ * @param bootp BOOTP header
+ * @param info Options of the message
+ */
+static void track_lease(const struct bootphdr *bootp,
+                        const struct dhcp_info *info)
+{
+    if (info->msg_type == 0 || bootp->bh_hlen > sizeof(bootp->bh_chaddr))
+        return;
+    struct dhcp_lease *lease = lease_get(bootp);
+    if (lease == NULL)
+        return;
+
+    uint64_t now = current_packet.ts;
+    int same_xid = lease->xid == bootp->bh_xid;
+    char delay[32];
+
+    switch (info->msg_type) {
+    case DHCP_DISCOVER:
+        if (!same_xid || lease->discover == 0) { // Retries keep the first one
+            lease->xid = bootp->bh_xid;
+            lease->discover = now;
+            lease->offer = 0;
+            lease->request = 0;
+        }
+        break;
+    case DHCP_OFFER:
+        if (same_xid && lease->discover && lease->offer == 0) {
+            lease->offer = now;
+            latency_add(latency_stats_get("DHCP DISCOVER to OFFER"),
+                        now - lease->discover);
+            fprintf(current_packet.out, "\t- OFFERED AFTER %s\n",
+                    format_duration(now - lease->discover, delay,
+                                    sizeof(delay)));
+        }
+        break;
+    case DHCP_REQUEST:
+        if (!same_xid && lease->offer == 0) { // Renewal, without DISCOVER
+            lease->discover = 0;
+            lease->request = 0;
+        }
+        lease->xid = bootp->bh_xid; // Some clients change it after OFFER
+        if (lease->request == 0)
+            lease->request = now;
+        break;
+    case DHCP_ACK:
+        if (bootp->bh_yiaddr == 0) // Reply to an INFORM
             break;
+        memcpy(&lease->ip, &bootp->bh_yiaddr, sizeof(lease->ip));
+        lease->lease_time = info->lease_time;
+        char addr[IPV4_STR_LEN];
+        fprintf(current_packet.out, "\t- LEASE: %s FOR %us",
+                format_ipv4((const uint8_t *)&lease->ip, addr),
+                lease->lease_time);
+        if (same_xid && lease->request) {
+            latency_add(latency_stats_get("DHCP REQUEST to ACK"),
+                        now - lease->request);
+            fprintf(current_packet.out, ", ACKED AFTER %s",
+                    format_duration(now - lease->request, delay,
+                                    sizeof(delay)));
         }
-        off++;
-        uint8_t L;
-        L = *(uint8_t *)(packet + off);
-        off++;
-        uint8_t *V = malloc(L * sizeof(uint8_t));
-        if (V == NULL) {
-            continue;
+        if (same_xid && lease->discover) {
+            latency_add(latency_stats_get("DHCP DORA"),
+                        now - lease->discover);
+            fprintf(current_packet.out, ", DORA IN %s",
+                    format_duration(now - lease->discover, delay,
+                                    sizeof(delay)));
         }
-        memcpy(V, packet + off, L);
+        fprintf(current_packet.out, "\n");
+        lease->discover = 0;
+        lease->offer = 0;
+        lease->request = 0;
+        break;
+    case DHCP_NAK:
+        fprintf(current_packet.out, "\t- LEASE REFUSED\n");
+        lease->discover = 0;
+        lease->offer = 0;
+        lease->request = 0;
+        break;
+    case DHCP_RELEASE:
+        lease->ip = 0;
+        break;
+    }
+}
 
-        off += L;
-        switch (magic_cookie) {
-        case DHCP_MCOOKIE:
-            dhcp_tlv_analyze(T, L, V);
-            break;
+
+/**
+ * @brief Free the lease table
+ * 
+ * Release the leases of every client.
+ */
+void bootp_leases_free(void)
+{
+    for (int i = 0; i < LEASE_BUCKETS; i++) {
+        struct dhcp_lease *lease = leases[i];
+        while (lease != NULL) {
+            struct dhcp_lease *next = lease->next;
+            free(lease);
+            lease = next;
         }
-        free(V);
+        leases[i] = NULL;
     }
+    nb_leases = 0;
 }
 
 
 /**
  * @brief Cast BOOTP header
  * 
- * Get BOOTP header from packet.
+ * Get BOOTP header from packet, decode the DHCP options and track the lease
+ * of the client.
  * 
  * @param packet Pointer to the packet
- * @return int 0 on success
+ * @param data_size Size of the message
+ * @return int 0 on success, -1 on error
  * 
  * @see bootp.h
  */
-int cast_bootp(const u_char *packet)
+int cast_bootp(const u_char *packet, int data_size)
 {
+    if (data_size > current_packet.end - packet)
+        data_size = current_packet.end - packet; // Only the captured options
+    if (data_size < VENDOR_OFF) {
+        fprintf(current_packet.out,
+                "Truncated BOOTP message, %d bytes\n", data_size);
+        return -1;
+    }
     const struct bootphdr *bootp;
     bootp = (struct bootphdr *)packet;
-    if (bootp->bh_op == 1 || bootp->bh_op == 2) {
-        switch (be32toh(*(uint32_t *)(packet + VENDOR_OFF))) {
-        case DHCP_MCOOKIE:
-            printf("BOOTP/DHCP ");
-            break;
-        default:
-            printf("BOOTP ");
-        }
-        switch (bootp->bh_op) {
-        case 1: {
-            char *chaddr = format_haddr(bootp);
-            printf("REQUEST from %s\n", chaddr ? chaddr : "");
-            free(chaddr);
-            break;
-        }
-        case 2:
-            printf("REPLY\n");
-            break;
-        }
+    if (bootp->bh_op != 1 && bootp->bh_op != 2) {
+        return -1;
+    }
 
-        walk_vendor(packet + VENDOR_OFF + 4,
-                    be32toh(*(uint32_t *)(packet + VENDOR_OFF)));
+    int dhcp = data_size >= VENDOR_OFF + 4 &&
+               be32toh(*(uint32_t *)(packet + VENDOR_OFF)) == DHCP_MCOOKIE;
+    fprintf(current_packet.out, dhcp ? "BOOTP/DHCP " : "BOOTP ");
+    switch (bootp->bh_op) {
+    case 1: {
+        char chaddr[HADDR_STR_LEN];
+        fprintf(current_packet.out, "REQUEST from %s\n",
+                format_haddr(bootp->bh_chaddr, bootp->bh_hlen, chaddr));
+        break;
+    }
+    case 2:
+        fprintf(current_packet.out, "REPLY\n");
+        break;
+    }
+
+    if (dhcp) {
+        struct dhcp_info info = {0};
+        walk_vendor(bootp, data_size, &info);
+        track_lease(bootp, &info);
     }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,608 @@
+/**
+ * @file dhcpv6.c
+ * @brief DHCPv6 Protocol Implementation File
+ * @ingroup application
+ *
+ * This file contains the implementation of the DHCPv6 layer. Options are
+ * decoded from a table indexed by their code, relayed messages are unwrapped
+ * recursively, and the transactions of every client are followed to measure
+ * the delays of the servers.
+ *
+ * @see dhcpv6.h
+ * @see cast_dhcpv6
+ */
+
+// Global libraries
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Local header files
+#include "dhcpv6.h"
+#include "hash.h"
+#include "packet.h"
+#include "stats.h"
+
+#define DHCPV6_MAX_DEPTH 8 /**< Nested relay messages and options decoded */
+#define DUID_MAX_LEN 130 /**< Longest DUID (RFC 8415) */
+#define CLIENT_BUCKETS 256 /**< Number of buckets, must be a power of 2 */
+#define DHCPV6_PROBE_OPTIONS 16 /**< Options checked by is_dhcpv6 at most */
+
+/**
+ * @brief DHCPv6 message types
+ */
+enum dhcpv6_msg {
+    D6_SOLICIT = 1,
+    D6_ADVERTISE,
+    D6_REQUEST,
+    D6_CONFIRM,
+    D6_RENEW,
+    D6_REBIND,
+    D6_REPLY,
+    D6_RELEASE,
+    D6_DECLINE,
+    D6_RECONFIGURE,
+    D6_INFORMATION_REQUEST,
+    D6_RELAY_FORW,
+    D6_RELAY_REPL,
+    D6_MSG_MAX
+};
+
+const char *dhcpv6_msg_type[D6_MSG_MAX] = {
+    "UNKNOWN", "SOLICIT",     "ADVERTISE", "REQUEST",
+    "CONFIRM", "RENEW",       "REBIND",    "REPLY",
+    "RELEASE", "DECLINE",     "RECONFIGURE", "INFORMATION-REQUEST",
+    "RELAY-FORW", "RELAY-REPL"}; /**< DHCPv6 message types */
+
+/**
+ * @brief Histograms of the delay between a message and its REPLY
+ */
+static const char *reply_stats[D6_MSG_MAX] = {
+    [D6_SOLICIT] = "DHCPv6 SOLICIT to REPLY (rapid commit)",
+    [D6_REQUEST] = "DHCPv6 REQUEST to REPLY",
+    [D6_CONFIRM] = "DHCPv6 CONFIRM to REPLY",
+    [D6_RENEW] = "DHCPv6 RENEW to REPLY",
+    [D6_REBIND] = "DHCPv6 REBIND to REPLY",
+    [D6_RELEASE] = "DHCPv6 RELEASE to REPLY",
+    [D6_DECLINE] = "DHCPv6 DECLINE to REPLY",
+    [D6_INFORMATION_REQUEST] = "DHCPv6 INFORMATION-REQUEST to REPLY",
+};
+
+/**
+ * @brief Kinds of DHCPv6 option values
+ */
+enum dhcpv6_kind {
+    KIND_HEX = 0,       /**< Unknown layout, printed in hexadecimal */
+    KIND_EMPTY,         /**< No value */
+    KIND_DUID,
+    KIND_IA,            /**< IAID, T1, T2 and options */
+    KIND_IA_TA,         /**< IAID and options */
+    KIND_IAADDR,        /**< Address, lifetimes and options */
+    KIND_IAPREFIX,      /**< Lifetimes, prefix and options */
+    KIND_ORO,           /**< List of option codes */
+    KIND_U8,
+    KIND_ELAPSED,       /**< Hundredths of a second */
+    KIND_RELAY_MSG,     /**< Nested DHCPv6 message */
+    KIND_STATUS,        /**< Status code and message */
+    KIND_IPV6_LIST,     /**< List of IPv6 addresses */
+    KIND_DOMAIN_LIST,   /**< List of domain names */
+    KIND_STRING
+};
+
+/**
+ * @brief DHCPv6 option description
+ */
+struct dhcpv6_option {
+    const char *name;
+    uint8_t kind;       /**< enum dhcpv6_kind */
+};
+
+/**
+ * @brief Known DHCPv6 options, indexed by their code (RFC 8415, RFC 3646)
+ */
+static const struct dhcpv6_option dhcpv6_options[] = {
+    [1] = {"CLIENT ID", KIND_DUID},
+    [2] = {"SERVER ID", KIND_DUID},
+    [3] = {"IA_NA", KIND_IA},
+    [4] = {"IA_TA", KIND_IA_TA},
+    [5] = {"IA ADDRESS", KIND_IAADDR},
+    [6] = {"OPTION REQUEST", KIND_ORO},
+    [7] = {"PREFERENCE", KIND_U8},
+    [8] = {"ELAPSED TIME", KIND_ELAPSED},
+    [9] = {"RELAY MESSAGE", KIND_RELAY_MSG},
+    [11] = {"AUTHENTICATION", KIND_HEX},
+    [12] = {"SERVER UNICAST", KIND_IPV6_LIST},
+    [13] = {"STATUS CODE", KIND_STATUS},
+    [14] = {"RAPID COMMIT", KIND_EMPTY},
+    [15] = {"USER CLASS", KIND_HEX},
+    [16] = {"VENDOR CLASS", KIND_HEX},
+    [17] = {"VENDOR OPTS", KIND_HEX},
+    [18] = {"INTERFACE ID", KIND_HEX},
+    [19] = {"RECONFIGURE MESSAGE", KIND_U8},
+    [20] = {"RECONFIGURE ACCEPT", KIND_EMPTY},
+    [23] = {"DNS SERVERS", KIND_IPV6_LIST},
+    [24] = {"DOMAIN LIST", KIND_DOMAIN_LIST},
+    [25] = {"IA_PD", KIND_IA},
+    [26] = {"IA PREFIX", KIND_IAPREFIX},
+    [31] = {"SNTP SERVERS", KIND_IPV6_LIST},
+    [32] = {"INFORMATION REFRESH TIME", KIND_HEX},
+    [39] = {"CLIENT FQDN", KIND_HEX},
+    [56] = {"NTP SERVER", KIND_HEX},
+    [82] = {"SOL MAX RT", KIND_HEX},
+}; /**< Options without a name are printed with their code */
+
+/**
+ * @brief Minimum length of the values, indexed by enum dhcpv6_kind
+ */
+static const uint8_t kind_min_len[] = {
+    [KIND_HEX] = 0,      [KIND_EMPTY] = 0,     [KIND_DUID] = 2,
+    [KIND_IA] = 12,      [KIND_IA_TA] = 4,     [KIND_IAADDR] = 24,
+    [KIND_IAPREFIX] = 25, [KIND_ORO] = 0,      [KIND_U8] = 1,
+    [KIND_ELAPSED] = 2,  [KIND_RELAY_MSG] = 1, [KIND_STATUS] = 2,
+    [KIND_IPV6_LIST] = 16, [KIND_DOMAIN_LIST] = 0, [KIND_STRING] = 0};
+
+/**
+ * @brief Options of a message needed by the transaction tracker
+ */
+struct dhcpv6_info {
+    const uint8_t *duid;    /**< Client DUID, NULL if absent */
+    int duid_len;
+    int status;             /**< Status code, -1 if absent */
+};
+
+/**
+ * @brief Transaction in progress of a client
+ */
+struct dhcpv6_client {
+    uint8_t duid[DUID_MAX_LEN];
+    uint8_t duid_len;
+    uint32_t xid;           /**< Transaction in progress */
+    uint8_t type;           /**< Message which started the transaction */
+    uint8_t advertised;     /**< 1 once the SOLICIT got an ADVERTISE */
+    uint64_t ts;            /**< First message of the transaction (ns) */
+    uint64_t solicit;       /**< SOLICIT which started the exchange (ns) */
+    struct dhcpv6_client *next; /**< Next client in the same bucket */
+};
+
+static struct dhcpv6_client *clients[CLIENT_BUCKETS]; /**< Client buckets */
+
+static const char tabs[] = "\t\t\t\t\t\t\t\t\t\t\t\t"; /**< Indentation */
+
+static int walk_options(const u_char *packet, int len, int depth,
+                        struct dhcpv6_info *info);
+static int decode_message(const u_char *packet, int data_size, int depth);
+
+
+/**
+ * @brief Read a 32 bits big endian value
+ *
+ * @param p The bytes
+ * @return uint32_t The value
+ */
+static uint32_t get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+
+/**
+ * @brief Print an IPv6 address
+ *
+ * @param addr The address, in network order
+ */
+static void print_ipv6(const uint8_t *addr)
+{
+    char str[INET6_ADDRSTRLEN];
+    if (inet_ntop(AF_INET6, addr, str, sizeof(str)) == NULL)
+        fprintf(current_packet.out, "?");
+    else
+        fprintf(current_packet.out, "%s", str);
+}
+
+
+/**
+ * @brief Print a list of DNS encoded domain names
+ *
+ * @param V Value
+ * @param L Length
+ */
+static void print_domains(const uint8_t *V, int L)
+{
+    int off = 0, first = 1;
+    while (off < L) {
+        fprintf(current_packet.out, "%s", first ? "" : ", ");
+        first = 0;
+        while (off < L && V[off] != 0) {
+            int len = V[off++];
+            for (int i = 0; i < len && off < L; i++, off++)
+                fputc(V[off] >= 32 && V[off] <= 126 ? V[off] : '.',
+                      current_packet.out);
+            fputc('.', current_packet.out);
+        }
+        off++; // Root label
+    }
+    fprintf(current_packet.out, "\n");
+}
+
+
+/**
+ * @brief Analyze a DHCPv6 option
+ *
+ * Print an option according to its kind. The value is never read past L.
+ *
+ * @param T Type
+ * @param L Length
+ * @param V Value
+ * @param depth Nesting level
+ * @param info Options needed by the transaction tracker
+ */
+static void option_analyze(uint16_t T, uint16_t L, const uint8_t *V,
+                           int depth, struct dhcpv6_info *info)
+{
+    const struct dhcpv6_option *opt = NULL;
+    if (T < sizeof(dhcpv6_options) / sizeof(dhcpv6_options[0]))
+        opt = &dhcpv6_options[T];
+    uint8_t kind = opt ? opt->kind : KIND_HEX;
+
+    fprintf(current_packet.out, "%.*s- ", depth + 1, tabs);
+    if (opt && opt->name)
+        fprintf(current_packet.out, "%s: ", opt->name);
+    else
+        fprintf(current_packet.out, "OPTION %u: ", T);
+    if (L < kind_min_len[kind]) {
+        fprintf(current_packet.out, "MALFORMED (%u bytes)\n", L);
+        return;
+    }
+
+    switch (kind) {
+    case KIND_EMPTY:
+        fprintf(current_packet.out, "\n");
+        break;
+    case KIND_DUID:
+        if (T == 1) {
+            info->duid = V;
+            info->duid_len = L;
+        }
+        fprintf(current_packet.out, "TYPE %u, ", V[0] << 8 | V[1]);
+        for (int i = 2; i < L; i++)
+            fprintf(current_packet.out, "%02X", V[i]);
+        fprintf(current_packet.out, "\n");
+        break;
+    case KIND_IA:
+        fprintf(current_packet.out,
+                "IAID 0x%08X, T1 %u, T2 %u\n", get32(V), get32(V + 4),
+                get32(V + 8));
+        walk_options(V + 12, L - 12, depth + 1, info);
+        break;
+    case KIND_IA_TA:
+        fprintf(current_packet.out, "IAID 0x%08X\n", get32(V));
+        walk_options(V + 4, L - 4, depth + 1, info);
+        break;
+    case KIND_IAADDR:
+        print_ipv6(V);
+        fprintf(current_packet.out,
+                ", PREFERRED %u, VALID %u\n", get32(V + 16), get32(V + 20));
+        walk_options(V + 24, L - 24, depth + 1, info);
+        break;
+    case KIND_IAPREFIX:
+        print_ipv6(V + 9);
+        fprintf(current_packet.out,
+                "/%u, PREFERRED %u, VALID %u\n", V[8], get32(V), get32(V + 4));
+        walk_options(V + 25, L - 25, depth + 1, info);
+        break;
+    case KIND_ORO:
+        for (int i = 0; i + 2 <= L; i += 2)
+            fprintf(current_packet.out,
+                    "%s%u", i ? ", " : "", V[i] << 8 | V[i + 1]);
+        fprintf(current_packet.out, "\n");
+        break;
+    case KIND_U8:
+        fprintf(current_packet.out, "%u\n", V[0]);
+        break;
+    case KIND_ELAPSED: {
+        unsigned int cs = V[0] << 8 | V[1];
+        fprintf(current_packet.out, "%u.%02us\n", cs / 100, cs % 100);
+        break;
+    }
+    case KIND_RELAY_MSG:
+        fprintf(current_packet.out, "\n");
+        decode_message(V, L, depth + 1);
+        break;
+    case KIND_STATUS:
+        info->status = V[0] << 8 | V[1];
+        fprintf(current_packet.out, "%d ", info->status);
+        for (int i = 2; i < L; i++)
+            fputc(V[i] >= 32 && V[i] <= 126 ? V[i] : '.', current_packet.out);
+        fprintf(current_packet.out, "\n");
+        break;
+    case KIND_IPV6_LIST:
+        for (int i = 0; i + 16 <= L; i += 16) {
+            fprintf(current_packet.out, "%s", i ? ", " : "");
+            print_ipv6(V + i);
+        }
+        fprintf(current_packet.out, "\n");
+        break;
+    case KIND_DOMAIN_LIST:
+        print_domains(V, L);
+        break;
+    case KIND_STRING:
+        for (int i = 0; i < L; i++)
+            fputc(V[i] >= 32 && V[i] <= 126 ? V[i] : '.', current_packet.out);
+        fprintf(current_packet.out, "\n");
+        break;
+    default:
+        for (int i = 0; i < L; i++)
+            fprintf(current_packet.out, "%02X", V[i]);
+        fprintf(current_packet.out, "\n");
+    }
+}
+
+
+/**
+ * @brief Walk DHCPv6 options
+ *
+ * Every option is checked against the end of the area.
+ *
+ * @param packet Pointer to the first option
+ * @param len Length of the area
+ * @param depth Nesting level
+ * @param info Options needed by the transaction tracker
+ * @return int 0 on success, -1 if an option is truncated
+ */
+static int walk_options(const u_char *packet, int len, int depth,
+                        struct dhcpv6_info *info)
+{
+    if (depth > DHCPV6_MAX_DEPTH) {
+        fprintf(current_packet.out,
+                "%.*s- TOO MANY NESTED OPTIONS\n", depth + 1, tabs);
+        return -1;
+    }
+
+    int off = 0;
+    while (off + 4 <= len) {
+        uint16_t T = packet[off] << 8 | packet[off + 1];
+        uint16_t L = packet[off + 2] << 8 | packet[off + 3];
+        if (off + 4 + L > len) {
+            fprintf(current_packet.out,
+                    "%.*s- OPTION %u: TRUNCATED\n", depth + 1, tabs, T);
+            return -1;
+        }
+        option_analyze(T, L, packet + off + 4, depth, info);
+        off += 4 + L;
+    }
+    if (off != len) {
+        fprintf(current_packet.out,
+                "%.*s- TRAILING %d BYTES\n", depth + 1, tabs, len - off);
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Get the transaction state of a client
+ *
+ * @param info Options of the message, with the client DUID
+ * @return struct dhcpv6_client* The client, created if needed, NULL on error
+ */
+static struct dhcpv6_client *client_get(const struct dhcpv6_info *info)
+{
+    uint32_t h = fnv1a32(FNV32_OFFSET, info->duid, info->duid_len);
+    uint32_t bucket = h & (CLIENT_BUCKETS - 1);
+
+    for (struct dhcpv6_client *client = clients[bucket]; client != NULL;
+         client = client->next) {
+        if (client->duid_len == info->duid_len &&
+            memcmp(client->duid, info->duid, info->duid_len) == 0)
+            return client;
+    }
+
+    struct dhcpv6_client *client = calloc(1, sizeof(struct dhcpv6_client));
+    if (client == NULL)
+        return NULL;
+    client->duid_len = info->duid_len;
+    memcpy(client->duid, info->duid, info->duid_len);
+    client->next = clients[bucket];
+    clients[bucket] = client;
+    return client;
+}
+
+
+/**
+ * @brief Follow the transaction of a message
+ *
+ * Client messages start a transaction, retransmissions keep its first
+ * timestamp. The ADVERTISE and REPLY of the server are matched by transaction
+ * ID.
+ *
+ * @param type The message type
+ * @param xid The transaction ID
+ * @param info Options of the message
+ * @param depth Nesting level
+ */
+static void track_transaction(uint8_t type, uint32_t xid,
+                              const struct dhcpv6_info *info, int depth)
+{
+    if (info->duid == NULL || info->duid_len > DUID_MAX_LEN ||
+        type == D6_RECONFIGURE)
+        return;
+    struct dhcpv6_client *client = client_get(info);
+    if (client == NULL) {
+        fprintf(stderr, "malloc\n");
+        return;
+    }
+
+    uint64_t now = current_packet.ts;
+    int same_xid = client->ts && client->xid == xid;
+    char delay[32];
+
+    switch (type) {
+    case D6_ADVERTISE:
+        if (same_xid && client->type == D6_SOLICIT && !client->advertised) {
+            client->advertised = 1;
+            latency_add(latency_stats_get("DHCPv6 SOLICIT to ADVERTISE"),
+                        now - client->ts);
+            fprintf(current_packet.out,
+                    "%.*s- ADVERTISED AFTER %s\n", depth + 1, tabs,
+                    format_duration(now - client->ts, delay, sizeof(delay)));
+        }
+        break;
+    case D6_REPLY:
+        if (!same_xid)
+            break;
+        latency_add(latency_stats_get(reply_stats[client->type]),
+                    now - client->ts);
+        fprintf(current_packet.out, "%.*s- REPLIED AFTER %s", depth + 1, tabs,
+                format_duration(now - client->ts, delay, sizeof(delay)));
+        if (client->solicit) {
+            latency_add(latency_stats_get("DHCPv6 SOLICIT to REPLY"),
+                        now - client->solicit);
+            fprintf(current_packet.out, ", SOLICIT TO REPLY IN %s",
+                    format_duration(now - client->solicit, delay,
+                                    sizeof(delay)));
+        }
+        fprintf(current_packet.out, "\n");
+        client->ts = 0;
+        client->solicit = 0;
+        break;
+    default: // Client message
+        if (same_xid) // Retransmission
+            break;
+        client->xid = xid;
+        client->ts = now;
+        client->advertised = 0;
+        if (type == D6_SOLICIT)
+            client->solicit = now;
+        else if (type != D6_REQUEST)
+            client->solicit = 0;
+        client->type = type;
+    }
+}
+
+
+/**
+ * @brief Decode a DHCPv6 message
+ *
+ * @param packet Pointer to the message
+ * @param data_size Size of the message
+ * @param depth Nesting level
+ * @return int 0 on success, -1 on error
+ */
+static int decode_message(const u_char *packet, int data_size, int depth)
+{
+    struct dhcpv6_info info = {NULL, 0, -1};
+    uint8_t type = packet[0];
+
+    if (depth > DHCPV6_MAX_DEPTH) {
+        fprintf(current_packet.out,
+                "%.*s- TOO MANY NESTED RELAYS\n", depth, tabs);
+        return -1;
+    }
+
+    if (type == D6_RELAY_FORW || type == D6_RELAY_REPL) {
+        if (data_size < (int)sizeof(struct dhcpv6_relayhdr)) {
+            fprintf(current_packet.out,
+                    "%.*sTruncated DHCPv6 relay message\n", depth, tabs);
+            return -1;
+        }
+        const struct dhcpv6_relayhdr *relay;
+        relay = (struct dhcpv6_relayhdr *)packet;
+        fprintf(current_packet.out, "%.*sDHCPv6 %s, HOP %u, LINK ", depth, tabs,
+                type == D6_RELAY_FORW ? "RELAY-FORW" : "RELAY-REPL",
+                relay->d6r_hops);
+        print_ipv6(relay->d6r_link);
+        fprintf(current_packet.out, ", PEER ");
+        print_ipv6(relay->d6r_peer);
+        fprintf(current_packet.out, "\n");
+        return walk_options(packet + sizeof(*relay),
+                            data_size - sizeof(*relay), depth, &info);
+    }
+
+    if (data_size < (int)sizeof(struct dhcpv6hdr)) {
+        fprintf(current_packet.out,
+                "%.*sTruncated DHCPv6 message\n", depth, tabs);
+        return -1;
+    }
+    const struct dhcpv6hdr *dhcp;
+    dhcp = (struct dhcpv6hdr *)packet;
+    uint32_t xid = dhcp->d6_xid[0] << 16 | dhcp->d6_xid[1] << 8 |
+                   dhcp->d6_xid[2];
+    fprintf(current_packet.out, "%.*sDHCPv6 %s, XID 0x%06X\n", depth, tabs,
+            type < D6_MSG_MAX ? dhcpv6_msg_type[type] : "UNKNOWN", xid);
+    int ret = walk_options(packet + sizeof(*dhcp),
+                           data_size - sizeof(*dhcp), depth, &info);
+    if (type > 0 && type < D6_RELAY_FORW)
+        track_transaction(type, xid, &info, depth);
+    return ret;
+}
+
+
+/**
+ * @brief Check if a packet is a DHCPv6 message
+ *
+ * The message type must be known and the first options must be well formed
+ * TLVs, the last one checked ending at the end of the message when there are
+ * less than DHCPV6_PROBE_OPTIONS.
+ *
+ * @param packet Pointer to the packet
+ * @param data_size Size of the data
+ * @return int 1 if the packet is a DHCPv6 message, 0 otherwise
+ */
+int is_dhcpv6(const u_char *packet, int data_size)
+{
+    if (data_size < (int)sizeof(struct dhcpv6hdr) || packet[0] == 0 ||
+        packet[0] >= D6_MSG_MAX)
+        return 0;
+    int off = packet[0] == D6_RELAY_FORW || packet[0] == D6_RELAY_REPL ?
+              (int)sizeof(struct dhcpv6_relayhdr) :
+              (int)sizeof(struct dhcpv6hdr);
+    int n = 0;
+    for (; n < DHCPV6_PROBE_OPTIONS && off + 4 <= data_size; n++) {
+        uint16_t T = packet[off] << 8 | packet[off + 1];
+        uint16_t L = packet[off + 2] << 8 | packet[off + 3];
+        if (T == 0 || off + 4 + L > data_size)
+            return 0;
+        off += 4 + L;
+    }
+    return n > 0 && (n == DHCPV6_PROBE_OPTIONS || off == data_size);
+}
+
+
+/**
+ * @brief Cast DHCPv6 header
+ *
+ * Decode a DHCPv6 message, unwrap the relayed messages and measure the delays
+ * of the server per transaction.
+ *
+ * @param packet Pointer to the message
+ * @param data_size Size of the message
+ * @return int 0 on success, -1 on error
+ */
+int cast_dhcpv6(const u_char *packet, int data_size)
+{
+    if (data_size < 1) {
+        fprintf(current_packet.out, "Truncated DHCPv6 message\n");
+        return -1;
+    }
+    return decode_message(packet, data_size, 0);
+}
+
+
+/**
+ * @brief Free the DHCPv6 transactions
+ *
+ * Release the state of every client.
+ */
+void dhcpv6_clients_free(void)
+{
+    for (int i = 0; i < CLIENT_BUCKETS; i++) {
+        struct dhcpv6_client *client = clients[i];
+        while (client != NULL) {
+            struct dhcpv6_client *next = client->next;
+            free(client);
+            client = next;
+        }
+        clients[i] = NULL;
+    }
+}
@@ -15,7 +15,9 @@
 #include <string.h>
 
 // Local header files
+#include "dfilter.h"
 #include "dns.h"
+#include "packet.h"
 
 
 /**
@@ -23,60 +25,65 @@
  * 
  * @param packet Pointer to the packet
  * @param questions Number of questions
- * @return int Offset at the end of the question segment
+ * @param size Size of the data from the question segment
+ * @return int Offset at the end of the question segment, -1 if it is truncated
  */
-int check_question(const u_char *packet, int questions)
+int check_question(const u_char *packet, int questions, int size)
 {
-    printf("\t- %dx QUERIE(S):\n", questions);
+    fprintf(current_packet.out, "\t- %dx QUERIE(S):\n", questions);
     int off = 0;
     for (int i = 0; i < questions; i++) { // Loop over questions
         char name[256];
         int j = 0;
-        // Parse name field of the question
-        while (1) {
-            if (packet[j] == 0) {
-                break;
-            }
-            if (packet[j] >= 32 && packet[j] <= 126) {
-                name[j] = packet[j];
-            } else {
-                name[j] = '.';
+        int len = 0;
+        // Parse name field of the question, the longest names are cut
+        while (j < size && packet[j] != 0) {
+            if (len < (int)sizeof(name) - 1) {
+                if (packet[j] >= 32 && packet[j] <= 126) {
+                    name[len++] = packet[j];
+                } else {
+                    name[len++] = '.';
+                }
             }
             j++;
         }
-        name[j] = '\0';
-        printf("\t\t- NAME: %s\n", name);
+        name[len] = '\0';
         off = j + 1; // Skip the null byte
+        if (off + 4 > size) {
+            fprintf(stderr, "Truncated DNS question\n");
+            return -1;
+        }
+        fprintf(current_packet.out, "\t\t- NAME: %s\n", name);
 
         // Parse type field of the question
         uint16_t type = be16toh(*(uint16_t *)(packet + off));
         switch (type) {
         case 1:
-            printf("\t\t- TYPE: A\n");
+            fprintf(current_packet.out, "\t\t- TYPE: A\n");
             break;
         case 2:
-            printf("\t\t- TYPE: NS\n");
+            fprintf(current_packet.out, "\t\t- TYPE: NS\n");
             break;
         case 5:
-            printf("\t\t- TYPE: CNAME\n");
+            fprintf(current_packet.out, "\t\t- TYPE: CNAME\n");
             break;
         case 6:
-            printf("\t\t- TYPE: SOA\n");
+            fprintf(current_packet.out, "\t\t- TYPE: SOA\n");
             break;
         case 12:
-            printf("\t\t- TYPE: PTR\n");
+            fprintf(current_packet.out, "\t\t- TYPE: PTR\n");
             break;
         case 15:
-            printf("\t\t- TYPE: MX\n");
+            fprintf(current_packet.out, "\t\t- TYPE: MX\n");
             break;
         case 16:
-            printf("\t\t- TYPE: TXT\n");
+            fprintf(current_packet.out, "\t\t- TYPE: TXT\n");
             break;
         case 28:
-            printf("\t\t- TYPE: AAAA\n");
+            fprintf(current_packet.out, "\t\t- TYPE: AAAA\n");
             break;
         case 33:
-            printf("\t\t- TYPE: SRV\n");
+            fprintf(current_packet.out, "\t\t- TYPE: SRV\n");
             break;
         }
         off += 2; // Skip the 2 bytes of the type field
@@ -85,22 +92,22 @@ int check_question(const u_char *packet, int questions)
         uint16_t class = be16toh(*(uint16_t *)(packet + off));
         switch (class) {
         case 0:
-            printf("\t\t- CLASS: RESERVED\n");
+            fprintf(current_packet.out, "\t\t- CLASS: RESERVED\n");
             break;
         case 1:
-            printf("\t\t- CLASS: IN\n");
+            fprintf(current_packet.out, "\t\t- CLASS: IN\n");
             break;
         case 3:
-            printf("\t\t- CLASS: CH\n");
+            fprintf(current_packet.out, "\t\t- CLASS: CH\n");
             break;
         case 4:
-            printf("\t\t- CLASS: HS\n");
+            fprintf(current_packet.out, "\t\t- CLASS: HS\n");
             break;
         case 254:
-            printf("\t\t- CLASS: QCLASS NONE\n");
+            fprintf(current_packet.out, "\t\t- CLASS: QCLASS NONE\n");
             break;
         case 255:
-            printf("\t\t- CLASS: QCLASS *\n");
+            fprintf(current_packet.out, "\t\t- CLASS: QCLASS *\n");
             break;
         }
         off += 2; // Skip the 2 bytes of the class field
@@ -114,60 +121,65 @@ int check_question(const u_char *packet, int questions)
  * 
  * @param packet Pointer to the packet
  * @param answers Number of answers
- * @return int Offset at the end of the answer segment
+ * @param size Size of the data from the answer segment
+ * @return int Offset at the end of the answer segment, -1 if it is truncated
  */
-int check_answer(const u_char *packet, int answers)
+int check_answer(const u_char *packet, int answers, int size)
 {
-    printf("\t- %dx ANSWER(S):\n", answers);
+    fprintf(current_packet.out, "\t- %dx ANSWER(S):\n", answers);
     int off = 0;
     for (int i = 0; i < answers; i++) { // Loop over answers
         char name[256];
         int j = 0;
-        // Parse name field of the answer
-        while (1) {
-            if (packet[j] == 0) {
-                break;
-            }
-            if (packet[j] >= 32 && packet[j] <= 126) {
-                name[j] = packet[j];
-            } else {
-                name[j] = '.';
+        int len = 0;
+        // Parse name field of the answer, the longest names are cut
+        while (j < size && packet[j] != 0) {
+            if (len < (int)sizeof(name) - 1) {
+                if (packet[j] >= 32 && packet[j] <= 126) {
+                    name[len++] = packet[j];
+                } else {
+                    name[len++] = '.';
+                }
             }
             j++;
         }
-        name[j] = '\0';
-        printf("\t\t- NAME: %s\n", name);
+        name[len] = '\0';
         off = j + 1; // Skip the null byte
+        if (off + 10 > size) {
+            fprintf(stderr, "Truncated DNS answer\n");
+            return -1;
+        }
+        fprintf(current_packet.out, "\t\t- NAME: %s\n", name);
 
         // Parse type field of the answer
         uint16_t type = be16toh(*(uint16_t *)(packet + off));
         switch (type) {
         case 1:
-            printf("\t\t- TYPE: A\n");
+            fprintf(current_packet.out, "\t\t- TYPE: A\n");
             break;
         case 2:
-            printf("\t\t- TYPE: NS\n");
+            fprintf(current_packet.out, "\t\t- TYPE: NS\n");
             break;
         case 5:
-            printf("\t\t- TYPE: CNAME\n");
+            fprintf(current_packet.out, "\t\t- TYPE: CNAME\n");
             break;
         case 6:
-            printf("\t\t- TYPE: SOA\n");
+            fprintf(current_packet.out, "\t\t- TYPE: SOA\n");
             break;
         case 12:
-            printf("\t\t- TYPE: PTR\n");
+            fprintf(current_packet.out, "\t\t- TYPE: PTR\n");
             break;
         case 15:
-            printf("\t\t- TYPE: MX\n");
+            fprintf(current_packet.out, "\t\t- TYPE: MX\n");
             break;
         case 16:
-            printf("\t\t- TYPE: TXT\n");
+            fprintf(current_packet.out, "\t\t- TYPE: TXT\n");
             break;
         case 28:
-            printf("\t\t- TYPE: AAAA\n");
+            fprintf(current_packet.out, "\t\t- TYPE: AAAA\n");
             break;
         case 33:
-            printf("\t\t- TYPE: SRV\n");
+            fprintf(current_packet.out, "\t\t- TYPE: SRV\n");
             break;
         }
         off += 2; // Skip the 2 bytes of the type field
@@ -176,47 +188,57 @@ int check_answer(const u_char *packet, int answers)
         uint16_t class = be16toh(*(uint16_t *)(packet + off));
         switch (class) {
         case 0:
-            printf("\t\t- CLASS: RESERVED\n");
+            fprintf(current_packet.out, "\t\t- CLASS: RESERVED\n");
             break;
         case 1:
-            printf("\t\t- CLASS: IN\n");
+            fprintf(current_packet.out, "\t\t- CLASS: IN\n");
             break;
         case 3:
-            printf("\t\t- CLASS: CH\n");
+            fprintf(current_packet.out, "\t\t- CLASS: CH\n");
             break;
         case 4:
-            printf("\t\t- CLASS: HS\n");
+            fprintf(current_packet.out, "\t\t- CLASS: HS\n");
             break;
         case 254:
-            printf("\t\t- CLASS: QCLASS NONE\n");
+            fprintf(current_packet.out, "\t\t- CLASS: QCLASS NONE\n");
             break;
         case 255:
-            printf("\t\t- CLASS: QCLASS *\n");
+            fprintf(current_packet.out, "\t\t- CLASS: QCLASS *\n");
             break;
         }
         off += 2; // Skip the 2 bytes of the class field
 
         // Parse TTL field of the answer
         uint32_t ttl = be32toh(*(uint32_t *)(packet + off));
-        printf("\t\t- TTL: %d\n", ttl);
+        fprintf(current_packet.out, "\t\t- TTL: %d\n", ttl);
         off += 4; // Skip the 4 bytes of the TTL field
 
         // Parse RDLENGTH field of the answer
         int rdlength = be16toh(*(uint16_t *)(packet + off));
-        printf("\t\t- RDATA LENGTH: %d\n", rdlength);
+        fprintf(current_packet.out, "\t\t- RDATA LENGTH: %d\n", rdlength);
         off += 2; // Skip the 2 bytes of the RDLENGTH field
 
         switch (type) {
         case 1: // A
-            printf("\t\t- ADDRESS: %u.%u.%u.%u\n", packet[off], packet[off + 1],
-                   packet[off + 2], packet[off + 3]);
+            if (off + 4 > size) {
+                fprintf(stderr, "Truncated DNS answer\n");
+                return -1;
+            }
+            fprintf(current_packet.out, "\t\t- ADDRESS: %u.%u.%u.%u\n",
+                    packet[off], packet[off + 1], packet[off + 2],
+                    packet[off + 3]);
             off += 4;
             break;
         case 28: // AAAA
-            printf("\t\t- ADDRESS: %04x:%04x:%04x:%04x:%04x:%04x:%04x:%04x\n",
-                   packet[off], packet[off + 1], packet[off + 2],
-                   packet[off + 3], packet[off + 4], packet[off + 5],
-                   packet[off + 6], packet[off + 7]);
+            if (off + 16 > size) {
+                fprintf(stderr, "Truncated DNS answer\n");
+                return -1;
+            }
+            fprintf(current_packet.out,
+                    "\t\t- ADDRESS: %04x:%04x:%04x:%04x:%04x:%04x:%04x:%04x\n",
+                    packet[off], packet[off + 1], packet[off + 2],
+                    packet[off + 3], packet[off + 4], packet[off + 5],
+                    packet[off + 6], packet[off + 7]);
             off += 16;
             break;
         }
@@ -225,6 +247,66 @@ int check_answer(const u_char *packet, int answers)
 }
 
 
+/**
+ * @brief Decode the name of a question
+ *
+ * The labels are joined with dots. The names of the questions are never
+ * compressed.
+ *
+ * @param packet Pointer to the name
+ * @param size Size of the data after the name
+ * @param name Destination of the name
+ * @param name_size Size of the destination
+ * @return int 0 on success, -1 if the name is malformed or truncated
+ */
+static int qname_decode(const u_char *packet, int size, char *name,
+                        size_t name_size)
+{
+    size_t out = 0;
+    int off = 0;
+    while (off < size && packet[off] != 0) {
+        int len = packet[off++];
+        if (len >= 64 || off + len > size || out + len + 2 > name_size)
+            return -1;
+        if (out > 0)
+            name[out++] = '.';
+        memcpy(name + out, packet + off, len);
+        out += len;
+        off += len;
+    }
+    name[out] = '\0';
+    return off < size ? 0 : -1;
+}
+
+
+/**
+ * @brief Check if a packet is a DNS message
+ * 
+ * The header must hold a single question, a known opcode, and the question
+ * must start with a valid label.
+ * 
+ * @param packet Pointer to the packet
+ * @param data_size Size of the data
+ * @return int 1 if the packet is a DNS message, 0 otherwise
+ */
+int is_dns(const u_char *packet, int data_size)
+{
+    if (data_size <= 12) {
+        return 0;
+    }
+    const struct dnshdr *dns;
+    dns = (struct dnshdr *)packet;
+    uint16_t flags = be16toh(dns->dh_flags);
+    if (((flags & DH_OP) >> 11) > 5 || (flags & 0x0040)) { // Reserved bit
+        return 0;
+    }
+    if (be16toh(dns->dh_questions) != 1) {
+        return 0;
+    }
+    return packet[12] > 0 && packet[12] < 64; // First label length
+}
+
+
 /**
  * @brief Cast DNS header
  * 
@@ -232,95 +314,115 @@ int check_answer(const u_char *packet, int answers)
  * 
  * @param packet Pointer to the packet
  * @param data_size Size of the data
- * @return int 0 on success
+ * @return int 0 on success, -1 on error
  */
 int cast_dns(const u_char *packet, int data_size)
 {
-    if (data_size) { // To pass unused parameter warning
-        ;
+    if (data_size < (int)sizeof(struct dnshdr)) {
+        fprintf(stderr, "Truncated DNS header\n");
+        return -1;
     }
     const struct dnshdr *dns;
     dns = (struct dnshdr *)packet;
-    printf("\t- TRANSACTION ID: 0x%04x\n", be16toh(dns->dh_xid));
+    fprintf(current_packet.out,
+            "\t- TRANSACTION ID: 0x%04x\n", be16toh(dns->dh_xid));
 
     uint16_t flags = be16toh(dns->dh_flags);
-    printf("\t- FLAGS: 0x%04x\n", flags);
+    fprintf(current_packet.out, "\t- FLAGS: 0x%04x\n", flags);
 
     switch ((flags & DH_QR) >> 15) {
     case 0:
-        printf("\t- QR: (0) QUERY\n");
+        fprintf(current_packet.out, "\t- QR: (0) QUERY\n");
         break;
     case 1:
-        printf("\t- QR: (1) REPLY\n");
+        fprintf(current_packet.out, "\t- QR: (1) REPLY\n");
         break;
     }
     switch ((flags & DH_OP) >> 11) {
     case 0:
-        printf("\t- OP: (0) QUERY\n");
+        fprintf(current_packet.out, "\t- OP: (0) QUERY\n");
         break;
     case 1:
-        printf("\t- OP: (1) IQUERY\n");
+        fprintf(current_packet.out, "\t- OP: (1) IQUERY\n");
         break;
     case 2:
-        printf("\t- OP: (2) STATUS\n");
+        fprintf(current_packet.out, "\t- OP: (2) STATUS\n");
         break;
     }
     if (flags & DH_AA)
-        printf("\t- AA: (1) AUTHORITATIVE ANSWER\n");
+        fprintf(current_packet.out, "\t- AA: (1) AUTHORITATIVE ANSWER\n");
     if (flags & DH_TC)
-        printf("\t- TC: (1) TRUNCATED\n");
+        fprintf(current_packet.out, "\t- TC: (1) TRUNCATED\n");
     if (flags & DH_RD)
-        printf("\t- RD: (1) RECURSION DESIRED\n");
+        fprintf(current_packet.out, "\t- RD: (1) RECURSION DESIRED\n");
     if (flags & DH_RA)
-        printf("\t- RA: (1) RECURSION AVAILABLE\n");
+        fprintf(current_packet.out, "\t- RA: (1) RECURSION AVAILABLE\n");
     
     switch (flags & DH_RCODE) {
     case 0:
-        printf("\t- RCODE: (0) NO ERROR\n");
+        fprintf(current_packet.out, "\t- RCODE: (0) NO ERROR\n");
         break;
     case 1:
-        printf("\t- RCODE: (1) FORMAT ERROR\n");
+        fprintf(current_packet.out, "\t- RCODE: (1) FORMAT ERROR\n");
         break;
     case 2:
-        printf("\t- RCODE: (2) SERVER FAILURE\n");
+        fprintf(current_packet.out, "\t- RCODE: (2) SERVER FAILURE\n");
         break;
     case 3:
-        printf("\t- RCODE: (3) NAME ERROR\n");
+        fprintf(current_packet.out, "\t- RCODE: (3) NAME ERROR\n");
         break;
     case 4:
-        printf("\t- RCODE: (4) NOT IMPLEMENTED\n");
+        fprintf(current_packet.out, "\t- RCODE: (4) NOT IMPLEMENTED\n");
         break;
     case 5:
-        printf("\t- RCODE: (5) REFUSED\n");
+        fprintf(current_packet.out, "\t- RCODE: (5) REFUSED\n");
         break;
     case 6:
-        printf("\t- RCODE: (6) YXDOMAIN\n");
+        fprintf(current_packet.out, "\t- RCODE: (6) YXDOMAIN\n");
         break;
     case 7:
-        printf("\t- RCODE: (7) YXRRSET\n");
+        fprintf(current_packet.out, "\t- RCODE: (7) YXRRSET\n");
         break;
     case 8:
-        printf("\t- RCODE: (8) NOTAUTH\n");
+        fprintf(current_packet.out, "\t- RCODE: (8) NOTAUTH\n");
         break;
     case 9:
-        printf("\t- RCODE: (9) NOTZONE\n");
+        fprintf(current_packet.out, "\t- RCODE: (9) NOTZONE\n");
         break;
     }
 
+    if (data_size > 12 && dfilter_wants(DF_DNS_QNAME)) {
+        char qname[DFILTER_STR_LEN];
+        if (qname_decode(packet + 12, data_size - 12, qname,
+                         sizeof(qname)) == 0)
+            dfilter_set(DF_DNS_QNAME, qname);
+    }
+
     int off = 12; // Start after the static part of the header
+    int len;
     if (dns->dh_questions > 0) {
-        off += check_question(packet + off, be16toh(dns->dh_questions));
+        len = check_question(packet + off, be16toh(dns->dh_questions),
+                             data_size - off);
+        if (len < 0)
+            return -1;
+        off += len;
     }
     if (dns->dh_answers > 0) {
-        off += check_answer(packet + off, be16toh(dns->dh_answers));
+        len = check_answer(packet + off, be16toh(dns->dh_answers),
+                           data_size - off);
+        if (len < 0)
+            return -1;
+        off += len;
     }
     if (dns->dh_autorityRRs > 0) {
-        printf("\t- %dx AUTHORITY RRs:\n", dns->dh_autorityRRs);
-        printf("\t\t- NOT IMPLEMENTED YET\n");
+        fprintf(current_packet.out,
+                "\t- %dx AUTHORITY RRs:\n", dns->dh_autorityRRs);
+        fprintf(current_packet.out, "\t\t- NOT IMPLEMENTED YET\n");
     }
     if (dns->dh_additionalRRs > 0) {
-        printf("\t- %dx ADDITIONAL RRs:\n", dns->dh_additionalRRs);
-        printf("\t\t- NOT IMPLEMENTED YET\n");
+        fprintf(current_packet.out,
+                "\t- %dx ADDITIONAL RRs:\n", dns->dh_additionalRRs);
+        fprintf(current_packet.out, "\t\t- NOT IMPLEMENTED YET\n");
     }
     return 0;
 }
\ No newline at end of file
@@ -4,15 +4,53 @@
  * @brief FTP Protocol Header File
  * 
  * This file contains the definition of the FTP layer.
- * It provides functions to check if a packet is an FTP packet.
+ * It provides functions to check if a packet is an FTP packet, and to follow
+ * the data connections negotiated on the control connection.
  * 
  * @see ftp.h
  * @see is_ftp
+ * @see cast_ftp
  */
 
 #include "ftp.h"
+#include <arpa/inet.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+
+#include "expect.h"
+#include "packet.h"
+#include "stats.h"
+
+#define FTP_MAX_LINE 256 /**< Longest control line parsed */
+#define FTP_MAX_FILE 128 /**< Longest transfer name kept */
+
+/**
+ * @brief FTP control session
+ *
+ * Shared by the control flow and its data flows, released with the last one.
+ */
+struct ftp_session {
+    int refs;                   /**< Flows using the session */
+    unsigned int id;            /**< Number of the session in the capture */
+    char file[FTP_MAX_FILE];    /**< Last transfer command (e.g. RETR a.txt) */
+};
+
+/**
+ * @brief FTP data transfer
+ */
+struct ftp_transfer {
+    struct ftp_session *session; /**< Control session of the transfer */
+    char file[FTP_MAX_FILE];    /**< Transfer command */
+    uint64_t bytes;             /**< Payload bytes transferred */
+    uint64_t start;             /**< First payload (ns) */
+    uint64_t end;               /**< Last payload (ns) */
+    uint8_t done;               /**< 1 once the throughput is printed */
+};
+
+static unsigned int nb_sessions = 0; /**< Control sessions seen */
 
 const char *ftp_command[] = {
     "ABOR", "ACCT", "ADAT", "ALLO", "APPE", "AUTH", "AVBL", "CCC",  "CDUP",
@@ -52,7 +90,7 @@ static int is_command(const u_char *packet)
  */
 static int is_return_code(const u_char *packet)
 {
-    char buf[4];
+    char buf[4] = {0};
     strncpy(buf, (char *)packet, 3);
     int code = atoi(buf);
     if ((code >= 100 && code <= 159) || (code >= 200 && code <= 259) ||
@@ -79,4 +117,308 @@ int is_ftp(const u_char *packet)
     } else {
         return 0;
     }
-}
\ No newline at end of file
+}
+
+
+/**
+ * @brief Release a reference to an FTP session
+ *
+ * @param data The FTP session
+ */
+static void ftp_session_free(void *data)
+{
+    struct ftp_session *session = data;
+    if (--session->refs == 0)
+        free(session);
+}
+
+
+/**
+ * @brief Get the FTP session of the current control flow
+ *
+ * @return struct ftp_session* The FTP session, NULL on error
+ */
+static struct ftp_session *ftp_session_get(void)
+{
+    struct flow *flow = current_packet.flow;
+    if (flow == NULL)
+        return NULL;
+    if (flow->free_data == ftp_session_free)
+        return flow->data;
+
+    struct ftp_session *session = calloc(1, sizeof(struct ftp_session));
+    if (session == NULL)
+        return NULL;
+    session->refs = 1;
+    session->id = ++nb_sessions;
+    if (flow->free_data != NULL)
+        flow->free_data(flow->data);
+    flow->data = session;
+    flow->free_data = ftp_session_free;
+    return session;
+}
+
+
+/**
+ * @brief Release an FTP transfer
+ *
+ * @param data The FTP transfer
+ */
+static void ftp_transfer_free(void *data)
+{
+    struct ftp_transfer *transfer = data;
+    ftp_session_free(transfer->session);
+    free(transfer);
+}
+
+
+/**
+ * @brief Expect a data connection
+ *
+ * Register the endpoint announced on the control connection. The data flow
+ * will be attributed to the session from its first SYN.
+ *
+ * @param session The FTP session
+ * @param family AF_INET or AF_INET6
+ * @param addr The announced address, in network order
+ * @param port The announced port
+ */
+static void expect_data(struct ftp_session *session, int family,
+                        const uint8_t *addr, uint16_t port)
+{
+    struct ftp_transfer *transfer = calloc(1, sizeof(struct ftp_transfer));
+    if (transfer == NULL) {
+        fprintf(stderr, "malloc\n");
+        return;
+    }
+    transfer->session = session;
+    session->refs++;
+    if (expect_add(family, IPPROTO_TCP, addr, port, APP_FTP_DATA, transfer,
+                   ftp_transfer_free) < 0) {
+        ftp_transfer_free(transfer);
+        return;
+    }
+
+    char str[INET6_ADDRSTRLEN];
+    if (inet_ntop(family, addr, str, sizeof(str)) != NULL)
+        fprintf(current_packet.out,
+                "Expecting data connection to %s port %u\n", str, port);
+}
+
+
+/**
+ * @brief Parse a PORT argument or a PASV reply
+ *
+ * @param str The six numbers h1,h2,h3,h4,p1,p2
+ * @param addr The address, in network order
+ * @param port The port
+ * @return int 0 on success, -1 if malformed
+ */
+static int parse_hostport(const char *str, uint8_t addr[4], uint16_t *port)
+{
+    unsigned int n[6];
+    if (sscanf(str, "%u,%u,%u,%u,%u,%u", &n[0], &n[1], &n[2], &n[3], &n[4],
+               &n[5]) != 6)
+        return -1;
+    for (int i = 0; i < 6; i++) {
+        if (n[i] > 255)
+            return -1;
+    }
+    for (int i = 0; i < 4; i++)
+        addr[i] = n[i];
+    *port = n[4] << 8 | n[5];
+    return 0;
+}
+
+
+/**
+ * @brief Parse a port between delimiters
+ *
+ * @param str The port followed by the delimiter
+ * @param delim The delimiter
+ * @param port The port
+ * @return int 0 on success, -1 if malformed
+ */
+static int parse_port(const char *str, char delim, uint16_t *port)
+{
+    char *end;
+    unsigned long n = strtoul(str, &end, 10);
+    if (end == str || *end != delim || n == 0 || n > 65535)
+        return -1;
+    *port = n;
+    return 0;
+}
+
+
+/**
+ * @brief Handle a command of the client
+ *
+ * @param session The FTP session
+ * @param line The command, NUL terminated without CRLF
+ */
+static void ftp_command_line(struct ftp_session *session, const char *line)
+{
+    uint8_t addr[16] = {0};
+    uint16_t port;
+
+    if (strncasecmp(line, "PORT ", 5) == 0) {
+        if (parse_hostport(line + 5, addr, &port) == 0)
+            expect_data(session, AF_INET, addr, port);
+    } else if (strncasecmp(line, "EPRT ", 5) == 0 && line[5] != '\0') {
+        // EPRT |family|address|port|
+        char delim = line[5], str[INET6_ADDRSTRLEN];
+        const char *af = line + 6;
+        const char *host = strchr(af, delim);
+        const char *sep = host ? strchr(host + 1, delim) : NULL;
+        if (sep == NULL || (size_t)(sep - host - 1) >= sizeof(str))
+            return;
+        memcpy(str, host + 1, sep - host - 1);
+        str[sep - host - 1] = '\0';
+        int family = *af == '2' ? AF_INET6 : AF_INET;
+        if (inet_pton(family, str, addr) == 1 &&
+            parse_port(sep + 1, delim, &port) == 0)
+            expect_data(session, family, addr, port);
+    } else if (strncasecmp(line, "RETR ", 5) == 0 ||
+               strncasecmp(line, "STOR ", 5) == 0 ||
+               strncasecmp(line, "STOU", 4) == 0 ||
+               strncasecmp(line, "APPE ", 5) == 0 ||
+               strncasecmp(line, "LIST", 4) == 0 ||
+               strncasecmp(line, "NLST", 4) == 0 ||
+               strncasecmp(line, "MLSD", 4) == 0) {
+        snprintf(session->file, sizeof(session->file), "%s", line);
+    }
+}
+
+
+/**
+ * @brief Handle a reply of the server
+ *
+ * @param session The FTP session
+ * @param line The reply, NUL terminated without CRLF
+ */
+static void ftp_reply_line(struct ftp_session *session, const char *line)
+{
+    uint8_t addr[16] = {0};
+    uint16_t port;
+
+    if (strncmp(line, "227 ", 4) == 0) {
+        // 227 Entering Passive Mode (h1,h2,h3,h4,p1,p2)
+        const char *args = line + 4;
+        while (*args != '\0' && (*args < '0' || *args > '9'))
+            args++;
+        if (parse_hostport(args, addr, &port) == 0)
+            expect_data(session, AF_INET, addr, port);
+    } else if (strncmp(line, "229 ", 4) == 0) {
+        // 229 Entering Extended Passive Mode (|||port|)
+        const char *args = strchr(line, '(');
+        if (args == NULL || args[1] == '\0' || args[2] != args[1] ||
+            args[3] != args[1])
+            return;
+        if (parse_port(args + 4, args[1], &port) == 0)
+            expect_data(session, current_packet.key.family,
+                        current_packet.key.saddr, port);
+    }
+}
+
+
+/**
+ * @brief Handle an FTP control segment
+ *
+ * This function looks for the data connections negotiated by the commands
+ * PORT and EPRT and by the replies to PASV and EPSV, and registers them in
+ * the expectation table.
+ *
+ * @param packet The TCP payload
+ * @param data_size The size of the payload
+ * @return int 0 if the segment is well handled, -1 otherwise
+ */
+int cast_ftp(const u_char *packet, int data_size)
+{
+    struct ftp_session *session = ftp_session_get();
+    if (session == NULL)
+        return -1;
+
+    int off = 0;
+    while (off < data_size) {
+        const u_char *nl = memchr(packet + off, '\n', data_size - off);
+        int len = nl ? nl - (packet + off) : data_size - off;
+        int next = off + len + 1;
+        if (len > 0 && packet[off + len - 1] == '\r')
+            len--;
+
+        char line[FTP_MAX_LINE];
+        if (len >= FTP_MAX_LINE)
+            len = FTP_MAX_LINE - 1;
+        memcpy(line, packet + off, len);
+        line[len] = '\0';
+
+        if (len >= 4 && is_return_code(packet + off))
+            ftp_reply_line(session, line);
+        else
+            ftp_command_line(session, line);
+        off = next;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Handle an FTP data segment
+ *
+ * @param packet The TCP payload
+ * @param data_size The size of the payload
+ * @return int 0 if the segment is well handled, -1 otherwise
+ */
+int cast_ftp_data(const u_char *packet, int data_size)
+{
+    (void)packet;
+    struct flow *flow = current_packet.flow;
+    if (flow == NULL || flow->free_data != ftp_transfer_free)
+        return -1;
+
+    struct ftp_transfer *transfer = flow->data;
+    if (transfer->bytes == 0) {
+        snprintf(transfer->file, sizeof(transfer->file), "%s",
+                 transfer->session->file);
+        transfer->start = current_packet.ts;
+    }
+    transfer->bytes += data_size;
+    transfer->end = current_packet.ts;
+    fprintf(current_packet.out,
+            "Session n°%u, %s: %d bytes\n", transfer->session->id,
+            transfer->file[0] ? transfer->file : "unknown transfer", data_size);
+    return 0;
+}
+
+
+/**
+ * @brief End an FTP data transfer
+ *
+ * Print the throughput of the transfer, once, when its flow is closed.
+ */
+void ftp_data_close(void)
+{
+    struct flow *flow = current_packet.flow;
+    if (flow == NULL || flow->free_data != ftp_transfer_free)
+        return;
+
+    struct ftp_transfer *transfer = flow->data;
+    if (transfer->done)
+        return;
+    transfer->done = 1;
+    if (transfer->bytes == 0)
+        snprintf(transfer->file, sizeof(transfer->file), "%s",
+                 transfer->session->file);
+
+    uint64_t ns = transfer->end - transfer->start;
+    char duration[32];
+    fprintf(current_packet.out,
+            "FTP transfer, session n°%u, %s: %lu bytes in %s",
+            transfer->session->id,
+            transfer->file[0] ? transfer->file : "unknown transfer",
+            (unsigned long)transfer->bytes,
+            format_duration(ns, duration, sizeof(duration)));
+    if (ns > 0)
+        fprintf(current_packet.out, ", %.1f kB/s", transfer->bytes * 1e6 / ns);
+    fprintf(current_packet.out, "\n");
+}
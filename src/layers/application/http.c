@@ -8,12 +8,15 @@
  * 
  * @see http.h
  * @see is_http
+ * @see http_fields
  */
 
 // Global libraries
 #include <string.h>
+#include <strings.h>
 
 // Local header files
+#include "dfilter.h"
 #include "http.h"
 
 const char *http_command[] = {"GET", "POST",    "HEAD",
@@ -77,4 +80,44 @@ int is_http(const u_char *packet)
     else {
         return 0;
     }
-}
\ No newline at end of file
+}
+
+
+/**
+ * @brief Give the fields of an HTTP request to the display filter
+ *
+ * The Host header is looked for up to the end of the headers.
+ *
+ * @param packet The packet, null terminated
+ * @param data_size The size of the packet
+ */
+void http_fields(const u_char *packet, int data_size)
+{
+    if (!dfilter_wants(DF_HTTP_HOST) || !is_command(packet))
+        return;
+
+    const u_char *p = packet, *end = packet + data_size;
+    while (p < end) {
+        const u_char *nl = memchr(p, '\n', end - p);
+        if (nl == NULL)
+            return;
+        p = nl + 1;
+        if (p < end && (*p == '\r' || *p == '\n')) // End of the headers
+            return;
+        if (end - p < 5 || strncasecmp((const char *)p, "Host:", 5) != 0)
+            continue;
+
+        char host[DFILTER_STR_LEN];
+        size_t len = 0;
+        for (p += 5; p < end && (*p == ' ' || *p == '\t'); p++)
+            ;
+        while (p + len < end && p[len] != '\r' && p[len] != '\n' &&
+               len + 1 < sizeof(host)) {
+            host[len] = p[len];
+            len++;
+        }
+        host[len] = '\0';
+        dfilter_set(DF_HTTP_HOST, host);
+        return;
+    }
+}
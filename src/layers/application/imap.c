@@ -0,0 +1,341 @@
+/**
+ * @file imap.c
+ * @brief IMAP Protocol Implementation File
+ * @ingroup application
+ *
+ * This file contains the implementation of the IMAP layer. Each direction of
+ * a session is reassembled and split in lines. A line ending with a literal
+ * announcement ({N} or {N+}) is followed by N bytes of data which are skipped
+ * by length without being buffered nor scanned.
+ *
+ * @see imap.h
+ * @see cast_imap
+ */
+
+// Global libraries
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Local header files
+#include "format.h"
+#include "imap.h"
+#include "packet.h"
+#include "stats.h"
+#include "stream.h"
+
+#define IMAP_PORT 143 /**< IMAP well-known port */
+#define IMAP_MAX_LINE 8192 /**< Longest line waiting for its end */
+#define IMAP_MAX_PENDING 16 /**< Commands waiting for their response */
+
+const char *imap_command[] = {
+    "CAPABILITY", "NOOP",   "LOGOUT",    "STARTTLS", "AUTHENTICATE",
+    "LOGIN",      "SELECT", "EXAMINE",   "CREATE",   "DELETE",
+    "RENAME",     "SUBSCRIBE", "UNSUBSCRIBE", "LIST", "LSUB",
+    "STATUS",     "APPEND", "CHECK",     "CLOSE",    "EXPUNGE",
+    "SEARCH",     "FETCH",  "STORE",     "COPY",     "UID",
+    "IDLE",       "NAMESPACE", "ENABLE", "ID",       "MOVE"}; /**< List of IMAP commands */
+
+const char *imap_greeting[] = {"* OK", "* PREAUTH", "* BYE"}; /**< List of IMAP greetings */
+
+/**
+ * @brief Command waiting for its tagged response
+ */
+struct imap_command {
+    char tag[32];
+    char name[16];
+    uint64_t ts;        /**< Capture time of the command (ns) */
+};
+
+/**
+ * @brief State of an IMAP session
+ */
+struct imap_session {
+    struct stream dir[2];   /**< Indexed by FLOW_DIR_* */
+    int8_t client_dir;      /**< Direction of the commands, -1 if unknown */
+    uint8_t broken;         /**< Stream lost, nothing more to parse */
+    int nb_pending;
+    struct imap_command pending[IMAP_MAX_PENDING];
+};
+
+
+/**
+ * @brief Release the state of an IMAP session
+ *
+ * @param data The IMAP session
+ */
+static void imap_session_free(void *data)
+{
+    struct imap_session *imap = data;
+    stream_free(&imap->dir[0]);
+    stream_free(&imap->dir[1]);
+    free(imap);
+}
+
+
+/**
+ * @brief Get the IMAP state of the current flow
+ *
+ * @return struct imap_session* The IMAP session, NULL on error
+ */
+static struct imap_session *imap_session_get(void)
+{
+    struct flow *flow = current_packet.flow;
+    if (flow == NULL)
+        return NULL;
+    if (flow->free_data == imap_session_free)
+        return flow->data;
+
+    struct imap_session *imap = calloc(1, sizeof(struct imap_session));
+    if (imap == NULL)
+        return NULL;
+    imap->client_dir = -1;
+    if (flow->free_data != NULL)
+        flow->free_data(flow->data);
+    flow->data = imap;
+    flow->free_data = imap_session_free;
+    return imap;
+}
+
+
+/**
+ * @brief Get the first word of a line
+ *
+ * @param line The line
+ * @param len The length of the line
+ * @param word The destination, NUL terminated
+ * @param size The size of the destination
+ * @param upper 1 to convert the word to upper case
+ * @return size_t Offset of the character following the word
+ */
+static size_t first_word(const u_char *line, size_t len, char *word,
+                         size_t size, int upper)
+{
+    size_t i = 0, n = 0;
+    while (i < len && line[i] != ' ' && line[i] != '\r' && line[i] != '\n') {
+        if (n + 1 < size)
+            word[n++] = upper ? toupper(line[i]) : line[i];
+        i++;
+    }
+    word[n] = '\0';
+    return i;
+}
+
+
+/**
+ * @brief Get the size of the literal announced at the end of a line
+ *
+ * @param line The line, CRLF included
+ * @param len The length of the line
+ * @return size_t The size of the literal, 0 if none
+ */
+static size_t literal_size(const u_char *line, size_t len)
+{
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        len--;
+    if (len < 3 || line[len - 1] != '}')
+        return 0;
+
+    size_t end = len - 1;
+    if (line[end - 1] == '+') // LITERAL+
+        end--;
+    size_t start = end;
+    while (start > 0 && isdigit(line[start - 1]))
+        start--;
+    if (start == end || start == 0 || line[start - 1] != '{' ||
+        end - start > 9)
+        return 0;
+
+    size_t size = 0;
+    for (size_t i = start; i < end; i++)
+        size = size * 10 + (line[i] - '0');
+    return size;
+}
+
+
+/**
+ * @brief Handle a command line
+ *
+ * Tagged commands are kept until their response.
+ *
+ * @param imap The IMAP session
+ * @param line The line
+ * @param len The length of the line
+ */
+static void command_line(struct imap_session *imap, const u_char *line,
+                         size_t len)
+{
+    struct imap_command cmd;
+    size_t off = first_word(line, len, cmd.tag, sizeof(cmd.tag), 0);
+    if (off >= len || line[off] != ' ')
+        return; // Literal data or continuation (e.g. DONE)
+    first_word(line + off + 1, len - off - 1, cmd.name, sizeof(cmd.name),
+               1);
+    if (cmd.name[0] == '\0')
+        return;
+    cmd.ts = current_packet.ts;
+
+    if (imap->nb_pending == IMAP_MAX_PENDING) { // Forget the oldest command
+        memmove(&imap->pending[0], &imap->pending[1],
+                (IMAP_MAX_PENDING - 1) * sizeof(struct imap_command));
+        imap->nb_pending--;
+    }
+    imap->pending[imap->nb_pending++] = cmd;
+}
+
+
+/**
+ * @brief Handle a response line
+ *
+ * A tagged response completes the command with the same tag.
+ *
+ * @param imap The IMAP session
+ * @param line The line
+ * @param len The length of the line
+ */
+static void response_line(struct imap_session *imap, const u_char *line,
+                          size_t len)
+{
+    char tag[32], status[8];
+    size_t off = first_word(line, len, tag, sizeof(tag), 0);
+    if (strcmp(tag, "*") == 0 || strcmp(tag, "+") == 0 || off >= len)
+        return;
+    first_word(line + off + 1, len - off - 1, status, sizeof(status), 1);
+
+    for (int i = 0; i < imap->nb_pending; i++) {
+        if (strcmp(imap->pending[i].tag, tag) != 0)
+            continue;
+
+        uint64_t ns = current_packet.ts - imap->pending[i].ts;
+        char delay[32];
+        fprintf(current_packet.out,
+                "\t- %s %s: %s in %s\n", tag, imap->pending[i].name, status,
+                format_duration(ns, delay, sizeof(delay)));
+        latency_add(latency_stats_get("IMAP response time"), ns);
+
+        memmove(&imap->pending[i], &imap->pending[i + 1],
+                (imap->nb_pending - i - 1) * sizeof(struct imap_command));
+        imap->nb_pending--;
+        return;
+    }
+}
+
+
+/**
+ * @brief Check if a packet is an IMAP packet
+ *
+ * A server greeting, or a tag followed by an IMAP command.
+ *
+ * @param packet The packet to check
+ * @param data_size The size of the data
+ * @return int 1 if the packet is an IMAP packet, 0 otherwise
+ */
+int is_imap(const u_char *packet, int data_size)
+{
+    if (data_size > current_packet.end - packet)
+        data_size = current_packet.end - packet; // Only the captured bytes
+    for (int i = 0; i < 3; i++) {
+        int len = strlen(imap_greeting[i]);
+        if (data_size >= len &&
+            strncmp((char *)packet, imap_greeting[i], len) == 0) {
+            return 1;
+        }
+    }
+
+    char tag[32], name[16];
+    size_t off = first_word(packet, data_size, tag, sizeof(tag), 0);
+    if (tag[0] == '\0' || off >= (size_t)data_size || packet[off] != ' ')
+        return 0;
+    size_t end = first_word(packet + off + 1, data_size - off - 1, name,
+                            sizeof(name), 1);
+    if (off + 1 + end >= (size_t)data_size) // Command not terminated
+        return 0;
+    for (size_t i = 0; i < sizeof(imap_command) / sizeof(imap_command[0]);
+         i++) {
+        if (strcmp(name, imap_command[i]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Handle an IMAP segment
+ *
+ * This function splits the session in command and response lines, skips the
+ * literals by their length and measures the delay between a tagged command
+ * and its tagged response.
+ *
+ * @param packet The TCP payload
+ * @param data_size The size of the payload
+ * @param seq The TCP sequence number of the payload
+ * @return int 0 if the segment is well handled, -1 otherwise
+ */
+int cast_imap(const u_char *packet, int data_size, uint32_t seq)
+{
+    char text[LINE_STR_LEN];
+    struct imap_session *imap = imap_session_get();
+    if (imap == NULL) {
+        fprintf(stderr, "malloc\n");
+        return -1;
+    }
+    if (imap->broken) {
+        fprintf(current_packet.out,
+                "IMAP stream incomplete, %d bytes not decoded\n", data_size);
+        return -1;
+    }
+
+    int dir = current_packet.dir;
+    if (imap->client_dir < 0) {
+        if (current_packet.key.dport == IMAP_PORT)
+            imap->client_dir = dir;
+        else if (current_packet.key.sport == IMAP_PORT ||
+                 (data_size > 0 && (packet[0] == '*' || packet[0] == '+')))
+            imap->client_dir = !dir;
+        else
+            imap->client_dir = dir;
+    }
+    int client = dir == imap->client_dir;
+
+    struct stream *stream = &imap->dir[dir];
+    size_t skip = stream->skip;
+    if (stream_append(stream, seq, packet, data_size) < 0) {
+        fprintf(current_packet.out,
+                "IMAP stream incomplete, %d bytes not decoded\n", data_size);
+        imap->broken = 1;
+        stream_free(&imap->dir[0]);
+        stream_free(&imap->dir[1]);
+        return -1;
+    }
+    if (skip > stream->skip)
+        fprintf(current_packet.out,
+                "[%zu bytes of literal]\n", skip - stream->skip);
+
+    u_char *nl;
+    while (stream->len > 0 &&
+           (nl = memchr(stream->buf, '\n', stream->len)) != NULL) {
+        size_t len = nl - stream->buf + 1;
+        fprintf(current_packet.out, "%s: %s\n", client ? "C" : "S",
+                format_line(stream->buf, len, text));
+        if (client)
+            command_line(imap, stream->buf, len);
+        else
+            response_line(imap, stream->buf, len);
+
+        size_t literal = literal_size(stream->buf, len);
+        stream_consume(stream, len);
+        if (literal > 0) {
+            size_t now = literal < stream->len ? literal : stream->len;
+            fprintf(current_packet.out, "[%zu bytes of literal]\n", now);
+            stream_skip(stream, literal);
+        }
+    }
+
+    if (stream->len > IMAP_MAX_LINE) {
+        fprintf(current_packet.out, "%s: %s\n", client ? "C" : "S",
+                format_line(stream->buf, stream->len, text));
+        stream_consume(stream, stream->len);
+    }
+    return 0;
+}
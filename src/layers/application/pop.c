@@ -3,38 +3,131 @@
  * @file pop.c
  * @brief POP Protocol Implementation File
  * @ingroup application
- * 
+ *
  * This file contains the implementation of the POP layer.
- * 
+ * Each session follows the AUTHORIZATION/TRANSACTION/UPDATE states of
+ * RFC 1939. The multi-line responses (messages, listings, capabilities) are
+ * not rendered: they are only scanned for their terminating line.
+ *
  * @see pop.h
  * @see is_pop
+ * @see cast_pop
  */
 
 // Global libraries
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 // Local header files
+#include "format.h"
+#include "packet.h"
 #include "pop.h"
+#include "stats.h"
+#include "stream.h"
 
-const char *pop_command[] = {"USER", "PASS", "STAT", "LIST", "UIDL", "RETR",
-                             "DELE", "TOP",  "LAST", "RSET", "NOOP", "QUIT"}; /**< List of POP commands */
+#define POP_PORT 110 /**< POP3 well-known port */
+#define POP_MAX_LINE 4096 /**< Longest line waiting for its end */
+#define POP_MAX_PENDING 16 /**< Pipelined commands waiting for their response */
+#define POP_MAX_USER 64 /**< Longest user name kept */
+
+/**
+ * @brief States of a POP3 session
+ */
+enum pop_state {
+    POP_CONNECTED = 0,  /**< Waiting for the greeting */
+    POP_AUTHORIZATION,  /**< Greeting received, not logged in */
+    POP_TRANSACTION,    /**< Logged in */
+    POP_UPDATE,         /**< QUIT sent */
+    POP_TLS             /**< STLS accepted, the session is encrypted */
+};
+
+/**
+ * @brief Commands waiting for their response
+ */
+enum pop_verb {
+    VERB_OTHER = 0,
+    VERB_USER,
+    VERB_PASS,          /**< PASS, APOP or AUTH */
+    VERB_STAT,
+    VERB_LIST,          /**< LIST or UIDL without argument, multi-line */
+    VERB_RETR,
+    VERB_TOP,
+    VERB_DELE,
+    VERB_CAPA,
+    VERB_QUIT,
+    VERB_STLS
+};
+
+static const char *verb_names[] = {"command", "USER", "PASS", "STAT",
+                                   "LIST", "RETR", "TOP", "DELE", "CAPA",
+                                   "QUIT", "STLS"}; /**< Names of enum pop_verb */
+
+/**
+ * @brief Command waiting for its response
+ */
+struct pop_command {
+    uint8_t verb;       /**< enum pop_verb */
+    uint32_t arg;       /**< Message number of RETR, TOP and DELE */
+    uint64_t ts;        /**< Capture time of the command (ns) */
+};
+
+/**
+ * @brief State of a POP3 session
+ */
+struct pop_session {
+    struct stream dir[2];   /**< Indexed by FLOW_DIR_* */
+    int8_t client_dir;      /**< Direction of the commands, -1 if unknown */
+    uint8_t state;          /**< enum pop_state */
+    uint8_t broken;         /**< Stream lost, nothing more to parse */
+    uint8_t multi;          /**< 1 while the server sends a multi-line response */
+    uint8_t bol;            /**< Response scan at the beginning of a line */
+    uint8_t matched;        /**< Bytes of ".\r\n" matched at a line start */
+    uint8_t in_auth;        /**< 1 from AUTH to its final response */
+    uint64_t multi_len;     /**< Bytes of the current multi-line response */
+    uint32_t multi_lines;   /**< Lines of the current multi-line response */
+    struct pop_command multi_cmd; /**< Command of the multi-line response */
+    char user[POP_MAX_USER]; /**< User of the USER command */
+    uint32_t retrieved;     /**< Messages retrieved */
+    uint32_t deleted;       /**< Messages marked as deleted */
+    int nb_pending;
+    struct pop_command pending[POP_MAX_PENDING];
+};
+
+const char *pop_command[] = {"USER", "PASS", "APOP", "AUTH", "STAT", "LIST",
+                             "UIDL", "RETR", "DELE", "TOP",  "LAST", "RSET",
+                             "NOOP", "QUIT", "CAPA", "STLS"}; /**< List of POP commands */
 
 const char *pop_response[] = {"+OK", "-ERR"}; /**< List of POP responses */
 
 
+/**
+ * @brief Check if a word ends a keyword
+ *
+ * @param c The character after the keyword
+ * @return int 1 if the keyword is a whole word, 0 otherwise
+ */
+static int is_word_end(u_char c)
+{
+    return c == ' ' || c == '\r' || c == '\n' || c == '\0';
+}
+
+
 /**
  * @brief Check if the packet is a POP command
- * 
+ *
  * @param packet The packet
  * @return int 1 if the packet is a POP command, 0 otherwise
- * 
- * @note This function doesn't check for errors.
+ *
+ * @note The packet must be null terminated.
  */
 static int is_command(const u_char *packet)
 {
-    for (int i = 0; i < 12; i++) {
-        if (strncmp((char *)packet, pop_command[i], strlen(pop_command[i])) ==
-            0) {
+    for (size_t i = 0; i < sizeof(pop_command) / sizeof(*pop_command); i++) {
+        size_t len = strlen(pop_command[i]);
+        if (strncmp((char *)packet, pop_command[i], len) == 0 &&
+            is_word_end(packet[len])) {
             return 1;
         }
     }
@@ -43,17 +136,18 @@ static int is_command(const u_char *packet)
 
 /**
  * @brief Check if the packet is a POP response
- * 
+ *
  * @param packet The packet
  * @return int 1 if the packet is a POP response, 0 otherwise
- * 
- * @note This function doesn't check for errors.
+ *
+ * @note The packet must be null terminated.
  */
 static int is_response(const u_char *packet)
 {
     for (int i = 0; i < 2; i++) {
-        if (strncmp((char *)packet, pop_response[i], strlen(pop_response[i])) ==
-            0) {
+        size_t len = strlen(pop_response[i]);
+        if (strncmp((char *)packet, pop_response[i], len) == 0 &&
+            is_word_end(packet[len])) {
             return 1;
         }
     }
@@ -63,13 +157,14 @@ static int is_response(const u_char *packet)
 
 /**
  * @brief Check if a packet is a POP packet
- * 
- * @param packet The packet to check
+ *
+ * A POP packet starts with a whole command or status keyword.
+ *
+ * @param packet The packet to check, null terminated
  * @return 1 if the packet is a POP packet, 0 otherwise
  */
 int is_pop(const u_char *packet)
 {
-    // printf("DEBUG: %s\n", packet);
     if (is_command(packet)) {
         return 1;
     }
@@ -77,4 +172,412 @@ int is_pop(const u_char *packet)
         return 1;
     }
     return 0;
-}
\ No newline at end of file
+}
+
+
+/**
+ * @brief Release the state of a POP3 session
+ *
+ * @param data The POP3 session
+ */
+static void pop_session_free(void *data)
+{
+    struct pop_session *pop = data;
+    stream_free(&pop->dir[0]);
+    stream_free(&pop->dir[1]);
+    free(pop);
+}
+
+
+/**
+ * @brief Get the POP3 state of the current flow
+ *
+ * @return struct pop_session* The POP3 session, NULL on error
+ */
+static struct pop_session *pop_session_get(void)
+{
+    struct flow *flow = current_packet.flow;
+    if (flow == NULL)
+        return NULL;
+    if (flow->free_data == pop_session_free)
+        return flow->data;
+
+    struct pop_session *pop = calloc(1, sizeof(struct pop_session));
+    if (pop == NULL)
+        return NULL;
+    pop->client_dir = -1;
+    if (flow->free_data != NULL)
+        flow->free_data(flow->data);
+    flow->data = pop;
+    flow->free_data = pop_session_free;
+    return pop;
+}
+
+
+/**
+ * @brief Read the argument of a command
+ *
+ * @param line The line, after the keyword
+ * @param len The length of the rest of the line
+ * @param value The number, unchanged if there is none
+ * @return int 1 if the command has an argument, 0 otherwise
+ */
+static int read_arg(const u_char *line, size_t len, uint32_t *value)
+{
+    size_t i = 0;
+    while (i < len && line[i] == ' ')
+        i++;
+    if (i == len || line[i] == '\r' || line[i] == '\n')
+        return 0;
+    uint32_t n = 0;
+    while (i < len && line[i] >= '0' && line[i] <= '9')
+        n = n * 10 + (line[i++] - '0');
+    *value = n;
+    return 1;
+}
+
+
+/**
+ * @brief Queue a command until its response
+ *
+ * @param pop The POP3 session
+ * @param verb The command (enum pop_verb)
+ * @param arg The message number of the command, 0 if none
+ */
+static void push_command(struct pop_session *pop, uint8_t verb, uint32_t arg)
+{
+    if (pop->nb_pending == POP_MAX_PENDING) { // Forget the oldest command
+        memmove(&pop->pending[0], &pop->pending[1],
+                (POP_MAX_PENDING - 1) * sizeof(struct pop_command));
+        pop->nb_pending--;
+    }
+    pop->pending[pop->nb_pending].verb = verb;
+    pop->pending[pop->nb_pending].arg = arg;
+    pop->pending[pop->nb_pending].ts = current_packet.ts;
+    pop->nb_pending++;
+}
+
+
+/**
+ * @brief Check for an AUTH command starting a SASL exchange
+ *
+ * AUTH alone lists the mechanisms, AUTH followed by a mechanism is answered
+ * by challenges until its final status.
+ *
+ * @param line The line
+ * @param len The length of the line
+ * @return int 1 if the command names a mechanism, 0 otherwise
+ */
+static int is_auth_start(const u_char *line, size_t len)
+{
+    if (len < 5 || strncasecmp((char *)line, "AUTH", 4) != 0 || line[4] != ' ')
+        return 0;
+    size_t i = 5;
+    while (i < len && line[i] == ' ')
+        i++;
+    return i < len && line[i] != '\r' && line[i] != '\n';
+}
+
+
+/**
+ * @brief Handle a command line
+ *
+ * The password is not printed, nor the lines of a SASL exchange: they hold
+ * the credentials and answer challenges rather than being commands.
+ *
+ * @param pop The POP3 session
+ * @param line The line
+ * @param len The length of the line
+ */
+static void command_line(struct pop_session *pop, const u_char *line,
+                         size_t len)
+{
+    uint8_t verb = VERB_OTHER;
+    uint32_t arg = 0;
+    char text[LINE_STR_LEN];
+
+    if (pop->in_auth) {
+        fprintf(current_packet.out, "C: ****\n");
+        return;
+    }
+
+    if (len >= 4 && strncasecmp((char *)line, "USER", 4) == 0) {
+        size_t i = 4, n = 0;
+        while (i < len && line[i] == ' ')
+            i++;
+        while (i < len && line[i] != '\r' && line[i] != '\n' &&
+               n + 1 < POP_MAX_USER)
+            pop->user[n++] = line[i++];
+        pop->user[n] = '\0';
+        verb = VERB_USER;
+    } else if (len >= 4 && (strncasecmp((char *)line, "PASS", 4) == 0 ||
+                            strncasecmp((char *)line, "APOP", 4) == 0 ||
+                            strncasecmp((char *)line, "AUTH", 4) == 0)) {
+        verb = VERB_PASS;
+    } else if (len >= 4 && strncasecmp((char *)line, "STAT", 4) == 0) {
+        verb = VERB_STAT;
+    } else if (len >= 4 && (strncasecmp((char *)line, "LIST", 4) == 0 ||
+                            strncasecmp((char *)line, "UIDL", 4) == 0)) {
+        // Only the listing of every message is multi-line
+        verb = read_arg(line + 4, len - 4, &arg) ? VERB_OTHER : VERB_LIST;
+    } else if (len >= 4 && strncasecmp((char *)line, "RETR", 4) == 0) {
+        verb = VERB_RETR;
+        read_arg(line + 4, len - 4, &arg);
+    } else if (len >= 3 && strncasecmp((char *)line, "TOP", 3) == 0) {
+        verb = VERB_TOP;
+        read_arg(line + 3, len - 3, &arg);
+    } else if (len >= 4 && strncasecmp((char *)line, "DELE", 4) == 0) {
+        verb = VERB_DELE;
+        read_arg(line + 4, len - 4, &arg);
+    } else if (len >= 4 && strncasecmp((char *)line, "CAPA", 4) == 0) {
+        verb = VERB_CAPA;
+    } else if (len >= 4 && strncasecmp((char *)line, "QUIT", 4) == 0) {
+        verb = VERB_QUIT;
+    } else if (len >= 4 && strncasecmp((char *)line, "STLS", 4) == 0) {
+        verb = VERB_STLS;
+    }
+
+    if (verb == VERB_PASS)
+        fprintf(current_packet.out, "C: %.4s ****\n", line);
+    else
+        fprintf(current_packet.out, "C: %s\n", format_line(line, len, text));
+    if (is_auth_start(line, len))
+        pop->in_auth = 1;
+    push_command(pop, verb, arg);
+}
+
+
+/**
+ * @brief Handle a status line
+ *
+ * The status line completes the oldest pending command, moves the session to
+ * its next state and starts the multi-line responses.
+ *
+ * @param pop The POP3 session
+ * @param line The line
+ * @param len The length of the line
+ */
+static void status_line(struct pop_session *pop, const u_char *line,
+                        size_t len)
+{
+    int ok = len >= 3 && strncmp((char *)line, "+OK", 3) == 0;
+    if (!ok && (len < 4 || strncmp((char *)line, "-ERR", 4) != 0))
+        return; // Continuation of an AUTH exchange
+
+    if (pop->state == POP_CONNECTED) { // Greeting
+        pop->state = POP_AUTHORIZATION;
+        return;
+    }
+    if (pop->nb_pending == 0)
+        return;
+
+    struct pop_command cmd = pop->pending[0];
+    memmove(&pop->pending[0], &pop->pending[1],
+            (pop->nb_pending - 1) * sizeof(struct pop_command));
+    pop->nb_pending--;
+    latency_add(latency_stats_get("POP3 response time"),
+                current_packet.ts - cmd.ts);
+
+    switch (cmd.verb) {
+    case VERB_PASS:
+        pop->in_auth = 0;
+        if (ok) {
+            pop->state = POP_TRANSACTION;
+            fprintf(current_packet.out,
+                    "\t- Logged in as %s\n", pop->user[0] ? pop->user : "?");
+        } else {
+            fprintf(current_packet.out, "\t- Login failed for %s\n",
+                    pop->user[0] ? pop->user : "?");
+        }
+        break;
+    case VERB_STAT: {
+        unsigned long count, size;
+        if (ok && sscanf((char *)line + 3, " %lu %lu", &count, &size) == 2)
+            fprintf(current_packet.out,
+                    "\t- Mailbox: %lu messages, %lu bytes\n", count, size);
+        break;
+    }
+    case VERB_RETR:
+    case VERB_TOP:
+    case VERB_LIST:
+    case VERB_CAPA:
+        if (ok) { // The response goes on up to a line holding a single dot
+            pop->multi = 1;
+            pop->bol = 1;
+            pop->matched = 0;
+            pop->multi_len = 0;
+            pop->multi_lines = 0;
+            pop->multi_cmd = cmd;
+        }
+        break;
+    case VERB_DELE:
+        if (ok)
+            pop->deleted++;
+        break;
+    case VERB_QUIT:
+        if (pop->state == POP_TRANSACTION)
+            fprintf(current_packet.out,
+                    "\t- Session closed: %u messages retrieved, %u deleted\n",
+                    pop->retrieved, pop->deleted);
+        pop->state = POP_UPDATE;
+        break;
+    case VERB_STLS:
+        if (ok) { // The next bytes are a TLS handshake
+            pop->state = POP_TLS;
+            current_packet.flow->app = APP_TLS;
+        }
+        break;
+    }
+}
+
+
+/**
+ * @brief Scan a multi-line response
+ *
+ * Look for the terminating ".\r\n" at the beginning of a line. The scan
+ * jumps from line end to line end with memchr, and keeps its progress across
+ * segments. A stuffed dot ("..") starts an ordinary line.
+ *
+ * @param pop The POP3 session
+ * @param buf The response bytes
+ * @param len The number of bytes
+ * @return size_t The number of response bytes, terminator included
+ */
+static size_t scan_multi(struct pop_session *pop, const u_char *buf,
+                         size_t len)
+{
+    static const u_char end[] = ".\r\n";
+    size_t i = 0;
+
+    while (i < len) {
+        if (pop->bol) {
+            if (buf[i] == end[pop->matched]) {
+                i++;
+                if (++pop->matched == sizeof(end) - 1) {
+                    pop->multi = 0;
+                    return i;
+                }
+                continue;
+            }
+            pop->bol = 0;
+            pop->matched = 0;
+        }
+        const u_char *nl = memchr(buf + i, '\n', len - i);
+        if (nl == NULL)
+            return len;
+        i = nl - buf + 1;
+        pop->bol = 1;
+        pop->multi_lines++;
+    }
+    return len;
+}
+
+
+/**
+ * @brief Print the summary of a multi-line response
+ *
+ * @param pop The POP3 session
+ */
+static void multi_end(struct pop_session *pop)
+{
+    const struct pop_command *cmd = &pop->multi_cmd;
+    if (cmd->verb == VERB_RETR || cmd->verb == VERB_TOP)
+        fprintf(current_packet.out, "[%s %u: %lu bytes, %u lines, complete]\n",
+                verb_names[cmd->verb], cmd->arg,
+                (unsigned long)pop->multi_len, pop->multi_lines);
+    else
+        fprintf(current_packet.out,
+                "[%s: %u lines, complete]\n", verb_names[cmd->verb],
+                pop->multi_lines);
+    if (cmd->verb == VERB_RETR)
+        pop->retrieved++;
+}
+
+
+/**
+ * @brief Handle a POP3 segment
+ *
+ * This function splits the session in command and status lines, and follows
+ * the state of the session. The multi-line responses are skipped up to their
+ * terminating line without being printed.
+ *
+ * @param packet The TCP payload
+ * @param data_size The size of the payload
+ * @param seq The TCP sequence number of the payload
+ * @return int 0 if the segment is well handled, -1 otherwise
+ */
+int cast_pop(const u_char *packet, int data_size, uint32_t seq)
+{
+    char text[LINE_STR_LEN];
+    struct pop_session *pop = pop_session_get();
+    if (pop == NULL) {
+        fprintf(stderr, "malloc\n");
+        return -1;
+    }
+    if (pop->broken || pop->state == POP_TLS) {
+        fprintf(current_packet.out,
+                "POP3 stream not decoded, %d bytes\n", data_size);
+        return -1;
+    }
+
+    int dir = current_packet.dir;
+    if (pop->client_dir < 0) {
+        if (current_packet.key.dport == POP_PORT)
+            pop->client_dir = dir;
+        else if (current_packet.key.sport == POP_PORT ||
+                 (data_size > 0 && (packet[0] == '+' || packet[0] == '-')))
+            pop->client_dir = !dir;
+        else
+            pop->client_dir = dir;
+    }
+    int client = dir == pop->client_dir;
+
+    struct stream *stream = &pop->dir[dir];
+    if (stream_append(stream, seq, packet, data_size) < 0) {
+        fprintf(current_packet.out,
+                "POP3 stream incomplete, %d bytes not decoded\n", data_size);
+        pop->broken = 1;
+        stream_free(&pop->dir[0]);
+        stream_free(&pop->dir[1]);
+        return -1;
+    }
+
+    while (stream->len > 0) {
+        if (!client && pop->multi) {
+            size_t len = scan_multi(pop, stream->buf, stream->len);
+            pop->multi_len += len;
+            stream_consume(stream, len);
+            if (pop->multi) {
+                fprintf(current_packet.out,
+                        "[%s: %lu bytes]\n", verb_names[pop->multi_cmd.verb],
+                        (unsigned long)pop->multi_len);
+                break;
+            }
+            multi_end(pop);
+            continue;
+        }
+
+        u_char *nl = memchr(stream->buf, '\n', stream->len);
+        if (nl == NULL)
+            break;
+        size_t len = nl - stream->buf + 1;
+        if (client) {
+            command_line(pop, stream->buf, len);
+        } else {
+            fprintf(current_packet.out,
+                    "S: %s\n", format_line(stream->buf, len, text));
+            status_line(pop, stream->buf, len);
+        }
+        stream_consume(stream, len);
+    }
+
+    if (stream->len > POP_MAX_LINE) {
+        if (client && pop->in_auth)
+            fprintf(current_packet.out, "C: ****\n");
+        else
+            fprintf(current_packet.out, "%s: %s\n", client ? "C" : "S",
+                    format_line(stream->buf, stream->len, text));
+        stream_consume(stream, stream->len);
+    }
+    return 0;
+}
@@ -5,17 +5,87 @@
  * @ingroup application
  * 
  * This file contains the implementation of the SMTP protocol.
+ * Each session follows the EHLO/MAIL/RCPT/DATA/QUIT states. The message body
+ * is not rendered: it is only scanned for its terminating line.
  * 
  * @see smtp.h
  * @see is_smtp
+ * @see cast_smtp
  */
 
 // Global libraries
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 // Local header files
 #include "smtp.h"
+#include "format.h"
+#include "packet.h"
+#include "stats.h"
+#include "stream.h"
+
+#define SMTP_PORT 25 /**< SMTP well-known port */
+#define SMTP_SUBMISSION_PORT 587 /**< SMTP submission port */
+#define SMTP_MAX_LINE 4096 /**< Longest line waiting for its end */
+#define SMTP_MAX_PENDING 16 /**< Pipelined commands waiting for their reply */
+#define SMTP_MAX_ADDR 128 /**< Longest envelope address kept */
+
+/**
+ * @brief States of an SMTP session
+ */
+enum smtp_state {
+    SMTP_CONNECTED = 0, /**< Waiting for the greeting */
+    SMTP_GREETED,       /**< Greeting received */
+    SMTP_HELLO,         /**< EHLO/HELO accepted */
+    SMTP_MAIL,          /**< MAIL FROM accepted */
+    SMTP_RCPT,          /**< At least one RCPT TO accepted */
+    SMTP_QUIT,          /**< QUIT sent */
+    SMTP_TLS            /**< STARTTLS accepted, the session is encrypted */
+};
+
+/**
+ * @brief Commands waiting for their reply
+ */
+enum smtp_verb {
+    VERB_OTHER = 0,
+    VERB_HELLO,
+    VERB_MAIL,
+    VERB_RCPT,
+    VERB_DATA,
+    VERB_BODY,          /**< End of the message body */
+    VERB_RSET,
+    VERB_QUIT,
+    VERB_STARTTLS
+};
+
+/**
+ * @brief Command waiting for its reply
+ */
+struct smtp_command {
+    uint8_t verb;       /**< enum smtp_verb */
+    uint64_t ts;        /**< Capture time of the command (ns) */
+};
+
+/**
+ * @brief State of an SMTP session
+ */
+struct smtp_session {
+    struct stream dir[2];   /**< Indexed by FLOW_DIR_* */
+    int8_t client_dir;      /**< Direction of the commands, -1 if unknown */
+    uint8_t state;          /**< enum smtp_state */
+    uint8_t broken;         /**< Stream lost, nothing more to parse */
+    uint8_t body;           /**< 1 while the client sends a message body */
+    uint8_t bol;            /**< Body scan at the beginning of a line */
+    uint8_t matched;        /**< Bytes of ".\r\n" matched at a line start */
+    uint64_t body_len;      /**< Bytes of the current message body */
+    char from[SMTP_MAX_ADDR];   /**< Reverse path of the current message */
+    char rcpt[SMTP_MAX_ADDR];   /**< First recipient of the current message */
+    int nb_rcpt;            /**< Recipients accepted */
+    int nb_pending;
+    struct smtp_command pending[SMTP_MAX_PENDING];
+};
 
 const char *smtp_command[] = {"HELO", "MAIL", "RCPT", "DATA", "QUIT", "EHLO"}; /**< List of SMTP commands */
 
@@ -50,7 +120,7 @@ static int is_command(const u_char *packet)
  */
 static int is_return_code(const u_char *packet)
 {
-    char buf[4];
+    char buf[4] = {0};
     strncpy(buf, (char *)packet, 3);
     int code = atoi(buf);
     if ((code >= 200 && code <= 259) || (code >= 300 && code <= 359) ||
@@ -78,4 +148,324 @@ int is_smtp(const u_char *packet)
     else {
         return 0;
     }
-}
\ No newline at end of file
+}
+
+
+/**
+ * @brief Release the state of an SMTP session
+ *
+ * @param data The SMTP session
+ */
+static void smtp_session_free(void *data)
+{
+    struct smtp_session *smtp = data;
+    stream_free(&smtp->dir[0]);
+    stream_free(&smtp->dir[1]);
+    free(smtp);
+}
+
+
+/**
+ * @brief Get the SMTP state of the current flow
+ *
+ * @return struct smtp_session* The SMTP session, NULL on error
+ */
+static struct smtp_session *smtp_session_get(void)
+{
+    struct flow *flow = current_packet.flow;
+    if (flow == NULL)
+        return NULL;
+    if (flow->free_data == smtp_session_free)
+        return flow->data;
+
+    struct smtp_session *smtp = calloc(1, sizeof(struct smtp_session));
+    if (smtp == NULL)
+        return NULL;
+    smtp->client_dir = -1;
+    if (flow->free_data != NULL)
+        flow->free_data(flow->data);
+    flow->data = smtp;
+    flow->free_data = smtp_session_free;
+    return smtp;
+}
+
+
+/**
+ * @brief Copy the address of a MAIL FROM or RCPT TO command
+ *
+ * @param dst The destination
+ * @param line The argument of the command, after the colon
+ * @param len The length of the argument
+ */
+static void copy_path(char *dst, const u_char *line, size_t len)
+{
+    size_t i = 0, n = 0;
+    while (i < len && line[i] == ' ')
+        i++;
+    while (i < len && line[i] != ' ' && line[i] != '\r' && line[i] != '\n' &&
+           n + 1 < SMTP_MAX_ADDR)
+        dst[n++] = line[i++];
+    dst[n] = '\0';
+}
+
+
+/**
+ * @brief Queue a command until its reply
+ *
+ * @param smtp The SMTP session
+ * @param verb The command (enum smtp_verb)
+ */
+static void push_command(struct smtp_session *smtp, uint8_t verb)
+{
+    if (smtp->nb_pending == SMTP_MAX_PENDING) { // Forget the oldest command
+        memmove(&smtp->pending[0], &smtp->pending[1],
+                (SMTP_MAX_PENDING - 1) * sizeof(struct smtp_command));
+        smtp->nb_pending--;
+    }
+    smtp->pending[smtp->nb_pending].verb = verb;
+    smtp->pending[smtp->nb_pending].ts = current_packet.ts;
+    smtp->nb_pending++;
+}
+
+
+/**
+ * @brief Handle a command line
+ *
+ * @param smtp The SMTP session
+ * @param line The line
+ * @param len The length of the line
+ */
+static void command_line(struct smtp_session *smtp, const u_char *line,
+                         size_t len)
+{
+    uint8_t verb = VERB_OTHER;
+
+    if (len >= 4 && (strncasecmp((char *)line, "EHLO", 4) == 0 ||
+                     strncasecmp((char *)line, "HELO", 4) == 0)) {
+        verb = VERB_HELLO;
+    } else if (len >= 10 && strncasecmp((char *)line, "MAIL FROM:", 10) == 0) {
+        verb = VERB_MAIL;
+        copy_path(smtp->from, line + 10, len - 10);
+        smtp->rcpt[0] = '\0';
+        smtp->nb_rcpt = 0;
+    } else if (len >= 8 && strncasecmp((char *)line, "RCPT TO:", 8) == 0) {
+        verb = VERB_RCPT;
+        if (smtp->rcpt[0] == '\0')
+            copy_path(smtp->rcpt, line + 8, len - 8);
+    } else if (len >= 4 && strncasecmp((char *)line, "DATA", 4) == 0) {
+        // The body follows, either pipelined or after the 354 reply
+        verb = VERB_DATA;
+        smtp->body = 1;
+        smtp->bol = 1;
+        smtp->matched = 0;
+        smtp->body_len = 0;
+    } else if (len >= 4 && strncasecmp((char *)line, "RSET", 4) == 0) {
+        verb = VERB_RSET;
+    } else if (len >= 4 && strncasecmp((char *)line, "QUIT", 4) == 0) {
+        verb = VERB_QUIT;
+        smtp->state = SMTP_QUIT;
+    } else if (len >= 8 && strncasecmp((char *)line, "STARTTLS", 8) == 0) {
+        verb = VERB_STARTTLS;
+    }
+    push_command(smtp, verb);
+}
+
+
+/**
+ * @brief Handle a reply line
+ *
+ * The last line of a reply completes the oldest pending command and moves the
+ * session to its next state.
+ *
+ * @param smtp The SMTP session
+ * @param line The line
+ * @param len The length of the line
+ */
+static void reply_line(struct smtp_session *smtp, const u_char *line,
+                       size_t len)
+{
+    if (len < 3 || !is_return_code(line) || (len > 3 && line[3] == '-'))
+        return; // Not the last line of the reply
+    int code = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+    int ok = code >= 200 && code < 400;
+
+    if (smtp->state == SMTP_CONNECTED) { // Greeting
+        smtp->state = SMTP_GREETED;
+        return;
+    }
+    if (smtp->nb_pending == 0)
+        return;
+
+    struct smtp_command cmd = smtp->pending[0];
+    memmove(&smtp->pending[0], &smtp->pending[1],
+            (smtp->nb_pending - 1) * sizeof(struct smtp_command));
+    smtp->nb_pending--;
+    latency_add(latency_stats_get("SMTP response time"),
+                current_packet.ts - cmd.ts);
+
+    switch (cmd.verb) {
+    case VERB_HELLO:
+    case VERB_RSET:
+        if (ok)
+            smtp->state = SMTP_HELLO;
+        break;
+    case VERB_MAIL:
+        if (ok)
+            smtp->state = SMTP_MAIL;
+        break;
+    case VERB_RCPT:
+        if (ok) {
+            smtp->state = SMTP_RCPT;
+            smtp->nb_rcpt++;
+        }
+        break;
+    case VERB_DATA:
+        if (code != 354) // Body refused
+            smtp->body = 0;
+        break;
+    case VERB_BODY:
+        fprintf(current_packet.out,
+                "\t- Message from %s to %s (%d recipient%s), %lu bytes: %s (%d)\n",
+                smtp->from, smtp->rcpt[0] ? smtp->rcpt : "nobody",
+                smtp->nb_rcpt, smtp->nb_rcpt > 1 ? "s" : "",
+                (unsigned long)smtp->body_len, ok ? "accepted" : "rejected",
+                code);
+        smtp->state = SMTP_HELLO;
+        break;
+    case VERB_STARTTLS:
+        if (code == 220) { // The next bytes are a TLS handshake
+            smtp->state = SMTP_TLS;
+            current_packet.flow->app = APP_TLS;
+        }
+        break;
+    }
+}
+
+
+/**
+ * @brief Scan a message body
+ *
+ * Look for the terminating ".\r\n" at the beginning of a line. The scan
+ * jumps from line end to line end with memchr, and keeps its progress across
+ * segments.
+ *
+ * @param smtp The SMTP session
+ * @param buf The body bytes
+ * @param len The number of bytes
+ * @return size_t The number of body bytes, terminator included
+ */
+static size_t scan_body(struct smtp_session *smtp, const u_char *buf,
+                        size_t len)
+{
+    static const u_char end[] = ".\r\n";
+    size_t i = 0;
+
+    while (i < len) {
+        if (smtp->bol) {
+            if (buf[i] == end[smtp->matched]) {
+                i++;
+                if (++smtp->matched == sizeof(end) - 1) {
+                    smtp->body = 0;
+                    return i;
+                }
+                continue;
+            }
+            smtp->bol = 0;
+            smtp->matched = 0;
+        }
+        const u_char *nl = memchr(buf + i, '\n', len - i);
+        if (nl == NULL)
+            return len;
+        i = nl - buf + 1;
+        smtp->bol = 1;
+    }
+    return len;
+}
+
+
+/**
+ * @brief Handle an SMTP segment
+ *
+ * This function splits the session in command and reply lines, and follows
+ * the state of the session. The message body is skipped up to its
+ * terminating line without being printed.
+ *
+ * @param packet The TCP payload
+ * @param data_size The size of the payload
+ * @param seq The TCP sequence number of the payload
+ * @return int 0 if the segment is well handled, -1 otherwise
+ */
+int cast_smtp(const u_char *packet, int data_size, uint32_t seq)
+{
+    char text[LINE_STR_LEN];
+    struct smtp_session *smtp = smtp_session_get();
+    if (smtp == NULL) {
+        fprintf(stderr, "malloc\n");
+        return -1;
+    }
+    if (smtp->broken || smtp->state == SMTP_TLS) {
+        fprintf(current_packet.out,
+                "SMTP stream not decoded, %d bytes\n", data_size);
+        return -1;
+    }
+
+    int dir = current_packet.dir;
+    if (smtp->client_dir < 0) {
+        uint16_t dport = current_packet.key.dport;
+        uint16_t sport = current_packet.key.sport;
+        if (dport == SMTP_PORT || dport == SMTP_SUBMISSION_PORT)
+            smtp->client_dir = dir;
+        else if (sport == SMTP_PORT || sport == SMTP_SUBMISSION_PORT ||
+                 is_return_code(packet))
+            smtp->client_dir = !dir;
+        else
+            smtp->client_dir = dir;
+    }
+    int client = dir == smtp->client_dir;
+
+    struct stream *stream = &smtp->dir[dir];
+    if (stream_append(stream, seq, packet, data_size) < 0) {
+        fprintf(current_packet.out,
+                "SMTP stream incomplete, %d bytes not decoded\n", data_size);
+        smtp->broken = 1;
+        stream_free(&smtp->dir[0]);
+        stream_free(&smtp->dir[1]);
+        return -1;
+    }
+
+    while (stream->len > 0) {
+        if (client && smtp->body) {
+            size_t len = scan_body(smtp, stream->buf, stream->len);
+            smtp->body_len += len;
+            stream_consume(stream, len);
+            if (smtp->body) {
+                fprintf(current_packet.out, "[message body: %lu bytes]\n",
+                        (unsigned long)smtp->body_len);
+                break;
+            }
+            fprintf(current_packet.out, "[message body: %lu bytes, complete]\n",
+                    (unsigned long)smtp->body_len);
+            push_command(smtp, VERB_BODY);
+            continue;
+        }
+
+        u_char *nl = memchr(stream->buf, '\n', stream->len);
+        if (nl == NULL)
+            break;
+        size_t len = nl - stream->buf + 1;
+        fprintf(current_packet.out, "%s: %s\n", client ? "C" : "S",
+                format_line(stream->buf, len, text));
+        if (client)
+            command_line(smtp, stream->buf, len);
+        else
+            reply_line(smtp, stream->buf, len);
+        stream_consume(stream, len);
+    }
+
+    if (stream->len > SMTP_MAX_LINE) {
+        fprintf(current_packet.out, "%s: %s\n", client ? "C" : "S",
+                format_line(stream->buf, stream->len, text));
+        stream_consume(stream, stream->len);
+    }
+    return 0;
+}
@@ -3,33 +3,496 @@
  * @file telnet.c
  * @brief Telnet Protocol Implementation File
  * @ingroup application
- * 
+ *
  * This file contains the implementation of the Telnet layer.
- * 
+ * Each direction of a session is reassembled and walked once: the data
+ * between two IAC bytes is found with memchr, the option negotiation is
+ * decoded and stripped from the data, which is printed on its own.
+ * When the server echoes, the time between a keystroke and its echo is
+ * measured.
+ *
  * @see telnet.h
  * @see telnet_handler
- * 
- * @note NOT IMPLEMENTED YET.
  */
 
 // Global libraries
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 // Local header files
+#include "packet.h"
+#include "stats.h"
+#include "stream.h"
 #include "telnet.h"
 
+#define TELNET_PORT 23 /**< Telnet well-known port */
+#define TELNET_MAX_SB 4096 /**< Longest subnegotiation waiting for its end */
+#define TELNET_PRINT_LEN 120 /**< Bytes of data printed */
+#define TELNET_TEXT_LEN (4 * TELNET_PRINT_LEN + 1) /**< Size of the escaped data */
+#define TELNET_MAX_KEY 4 /**< Longest client data taken as a keystroke */
+#define TELNET_MAX_PENDING 32 /**< Keystrokes waiting for their echo */
+
+#define IAC 255  /**< Interpret As Command */
+#define DONT 254 /**< Refuse an option of the peer */
+#define DO 253   /**< Ask the peer to enable an option */
+#define WONT 252 /**< Refuse to enable an option */
+#define WILL 251 /**< Offer to enable an option */
+#define SB 250   /**< Subnegotiation Begin */
+#define SE 240   /**< Subnegotiation End */
+
+#define OPT_ECHO 1 /**< Echo option */
+#define OPT_TTYPE 24 /**< Terminal type option */
+#define OPT_NAWS 31 /**< Window size option */
+#define OPT_TSPEED 32 /**< Terminal speed option */
+#define OPT_XDISPLOC 35 /**< X display location option */
+#define OPT_OLD_ENVIRON 36 /**< Environment option, first version */
+#define OPT_NEW_ENVIRON 39 /**< Environment option */
+
+static const char *commands[] = {"SE", "NOP", "DM",   "BRK", "IP",
+                                 "AO", "AYT", "EC",   "EL",  "GA",
+                                 "SB", "WILL", "WONT", "DO", "DONT"}; /**< Names of the commands from SE */
+
+/**
+ * @brief Keystroke waiting for its echo
+ */
+struct telnet_key {
+    u_char c;           /**< First byte of the keystroke */
+    uint64_t ts;        /**< Capture time of the keystroke (ns) */
+};
+
+/**
+ * @brief State of a Telnet session
+ */
+struct telnet_session {
+    struct stream dir[2];   /**< Indexed by FLOW_DIR_* */
+    int8_t client_dir;      /**< Direction of the client, -1 if unknown */
+    uint8_t broken;         /**< Stream lost, nothing more to parse */
+    uint8_t echo;           /**< 1 while the server echoes the keystrokes */
+    int nb_pending;
+    struct telnet_key pending[TELNET_MAX_PENDING];
+};
+
+
+/**
+ * @brief Check if a packet is a Telnet packet
+ *
+ * Telnet sessions start with option negotiation: IAC followed by SB, WILL,
+ * WONT, DO or DONT.
+ *
+ * @param packet The packet to check
+ * @param data_size The size of the data
+ * @return int 1 if the packet starts with a Telnet command, 0 otherwise
+ */
+int is_telnet(const u_char *packet, int data_size)
+{
+    return data_size >= 2 && packet[0] == IAC && packet[1] >= SB &&
+           packet[1] < IAC;
+}
+
+
+/**
+ * @brief Get the name of an option
+ *
+ * @param opt The option
+ * @param buf The destination for the unnamed options
+ * @param size The size of the destination
+ * @return const char* The name of the option
+ */
+static const char *option_name(u_char opt, char *buf, size_t size)
+{
+    switch (opt) {
+    case 0: return "BINARY";
+    case OPT_ECHO: return "ECHO";
+    case 3: return "SUPPRESS-GO-AHEAD";
+    case 5: return "STATUS";
+    case 6: return "TIMING-MARK";
+    case OPT_TTYPE: return "TERMINAL-TYPE";
+    case OPT_NAWS: return "NAWS";
+    case OPT_TSPEED: return "TERMINAL-SPEED";
+    case 33: return "TOGGLE-FLOW-CONTROL";
+    case 34: return "LINEMODE";
+    case OPT_XDISPLOC: return "X-DISPLAY-LOCATION";
+    case OPT_OLD_ENVIRON: return "OLD-ENVIRON";
+    case 37: return "AUTHENTICATION";
+    case 38: return "ENCRYPT";
+    case OPT_NEW_ENVIRON: return "NEW-ENVIRON";
+    default:
+        snprintf(buf, size, "option %u", opt);
+        return buf;
+    }
+}
+
+
+/**
+ * @brief Release the state of a Telnet session
+ *
+ * @param data The Telnet session
+ */
+static void telnet_session_free(void *data)
+{
+    struct telnet_session *telnet = data;
+    stream_free(&telnet->dir[0]);
+    stream_free(&telnet->dir[1]);
+    free(telnet);
+}
+
+
+/**
+ * @brief Get the Telnet state of the current flow
+ *
+ * @return struct telnet_session* The Telnet session, NULL on error
+ */
+static struct telnet_session *telnet_session_get(void)
+{
+    struct flow *flow = current_packet.flow;
+    if (flow == NULL)
+        return NULL;
+    if (flow->free_data == telnet_session_free)
+        return flow->data;
+
+    struct telnet_session *telnet = calloc(1, sizeof(struct telnet_session));
+    if (telnet == NULL)
+        return NULL;
+    telnet->client_dir = -1;
+    if (flow->free_data != NULL)
+        flow->free_data(flow->data);
+    flow->data = telnet;
+    flow->free_data = telnet_session_free;
+    return telnet;
+}
+
+
+/**
+ * @brief Escape bytes for printing
+ *
+ * CR, LF and TAB are escaped like in C, the other non printable bytes are
+ * printed in hexadecimal.
+ *
+ * @param text The destination, TELNET_TEXT_LEN bytes
+ * @param text_len The number of characters already in the destination
+ * @param data The bytes
+ * @param len The number of bytes
+ * @return size_t The number of characters in the destination
+ */
+static size_t escape(char *text, size_t text_len, const u_char *data,
+                     size_t len)
+{
+    for (size_t i = 0; i < len && text_len + 4 < TELNET_TEXT_LEN; i++) {
+        u_char c = data[i];
+        if (c == '\r')
+            text_len += sprintf(text + text_len, "\\r");
+        else if (c == '\n')
+            text_len += sprintf(text + text_len, "\\n");
+        else if (c == '\t')
+            text_len += sprintf(text + text_len, "\\t");
+        else if (c < 32 || c > 126)
+            text_len += sprintf(text + text_len, "\\x%02x", c);
+        else
+            text[text_len++] = c;
+    }
+    text[text_len] = '\0';
+    return text_len;
+}
+
+
+/**
+ * @brief Print a subnegotiation
+ *
+ * The subnegotiations of the terminal and environment options are decoded,
+ * the other ones are only counted.
+ *
+ * @param sb The subnegotiation, after IAC SB, unescaped
+ * @param len The length of the subnegotiation, without IAC SE
+ */
+static void print_sb(const u_char *sb, size_t len)
+{
+    char name[16], text[TELNET_TEXT_LEN];
+    if (len == 0) {
+        fprintf(current_packet.out, "\t- SB empty\n");
+        return;
+    }
+    const char *opt = option_name(sb[0], name, sizeof(name));
+
+    switch (sb[0]) {
+    case OPT_NAWS:
+        if (len >= 5) {
+            fprintf(current_packet.out,
+                    "\t- SB %s %ux%u\n", opt, sb[1] << 8 | sb[2],
+                    sb[3] << 8 | sb[4]);
+            return;
+        }
+        break;
+    case OPT_TTYPE:
+    case OPT_TSPEED:
+    case OPT_XDISPLOC:
+        if (len >= 2 && sb[1] == 1) {
+            fprintf(current_packet.out, "\t- SB %s SEND\n", opt);
+            return;
+        }
+        if (len >= 2 && sb[1] == 0) {
+            escape(text, 0, sb + 2, len - 2);
+            fprintf(current_packet.out, "\t- SB %s IS \"%s\"\n", opt, text);
+            return;
+        }
+        break;
+    case OPT_OLD_ENVIRON:
+    case OPT_NEW_ENVIRON:
+        if (len >= 2 && sb[1] <= 2) {
+            static const char *verbs[] = {"IS", "SEND", "INFO"};
+            size_t text_len = 0;
+            text[0] = '\0';
+            // VAR (0) and USERVAR (3) start a name, VALUE (1) its value
+            for (size_t i = 2; i < len; i++) {
+                size_t end = i + 1;
+                while (end < len && sb[end] > 3)
+                    end++;
+                if (sb[i] == 1 && text_len + 1 < TELNET_TEXT_LEN)
+                    text[text_len++] = '=';
+                else if (text_len > 0 && text_len + 1 < TELNET_TEXT_LEN)
+                    text[text_len++] = ' ';
+                text_len = escape(text, text_len, sb + i + 1, end - i - 1);
+                i = end - 1;
+            }
+            fprintf(current_packet.out, "\t- SB %s %s%s%s\n", opt, verbs[sb[1]],
+                    text_len ? " " : "", text);
+            return;
+        }
+        break;
+    }
+    fprintf(current_packet.out, "\t- SB %s, %zu bytes\n", opt, len - 1);
+}
+
+
+/**
+ * @brief Handle a negotiation command
+ *
+ * Follow the ECHO option: the keystrokes are echoed by the server once it
+ * offers to or the client asks for it.
+ *
+ * @param telnet The Telnet session
+ * @param client 1 if the command comes from the client
+ * @param cmd The command (WILL, WONT, DO or DONT)
+ * @param opt The option
+ */
+static void negotiate(struct telnet_session *telnet, int client, u_char cmd,
+                      u_char opt)
+{
+    char name[16];
+    fprintf(current_packet.out, "\t- %s %s\n", commands[cmd - SE],
+            option_name(opt, name, sizeof(name)));
+    if (opt != OPT_ECHO)
+        return;
+    if (client && (cmd == DO || cmd == DONT))
+        telnet->echo = cmd == DO;
+    else if (!client && (cmd == WILL || cmd == WONT))
+        telnet->echo = cmd == WILL;
+    if (!telnet->echo)
+        telnet->nb_pending = 0;
+}
+
+
+/**
+ * @brief Match server data with the keystrokes waiting for their echo
+ *
+ * Data which is not the echo of the oldest keystroke means the keystrokes
+ * were not echoed (a password for instance): they are forgotten.
+ *
+ * @param telnet The Telnet session
+ * @param data The data sent by the server
+ * @param len The length of the data
+ * @param echoes Where to store the latencies of the echoed keystrokes (ns)
+ * @param nb_echoes The number of latencies stored, updated
+ */
+static void match_echo(struct telnet_session *telnet, const u_char *data,
+                       size_t len, uint64_t *echoes, int *nb_echoes)
+{
+    int matched = 0;
+
+    for (size_t i = 0; i < len && telnet->nb_pending > 0; i++) {
+        if (data[i] != telnet->pending[matched].c) {
+            if (matched == 0)
+                telnet->nb_pending = 0;
+            break;
+        }
+        uint64_t ns = current_packet.ts - telnet->pending[matched].ts;
+        latency_add(latency_stats_get("Telnet echo latency"), ns);
+        if (*nb_echoes < TELNET_MAX_PENDING)
+            echoes[(*nb_echoes)++] = ns;
+        if (++matched == telnet->nb_pending)
+            break;
+    }
+    if (matched > 0) {
+        telnet->nb_pending -= matched;
+        memmove(&telnet->pending[0], &telnet->pending[matched],
+                telnet->nb_pending * sizeof(struct telnet_key));
+    }
+}
+
+
+/**
+ * @brief Queue a keystroke until its echo
+ *
+ * @param telnet The Telnet session
+ * @param c The first byte of the keystroke
+ */
+static void push_key(struct telnet_session *telnet, u_char c)
+{
+    if (telnet->nb_pending == TELNET_MAX_PENDING) { // Forget the oldest key
+        memmove(&telnet->pending[0], &telnet->pending[1],
+                (TELNET_MAX_PENDING - 1) * sizeof(struct telnet_key));
+        telnet->nb_pending--;
+    }
+    telnet->pending[telnet->nb_pending].c = c;
+    telnet->pending[telnet->nb_pending].ts = current_packet.ts;
+    telnet->nb_pending++;
+}
+
+
+/**
+ * @brief Find the end of a subnegotiation
+ *
+ * @param buf The bytes after IAC SB
+ * @param len The number of bytes
+ * @return size_t The offset of the closing IAC, len if not received yet
+ */
+static size_t sb_end(const u_char *buf, size_t len)
+{
+    size_t i = 0;
+    while (i < len) {
+        const u_char *iac = memchr(buf + i, IAC, len - i);
+        if (iac == NULL)
+            return len;
+        i = iac - buf;
+        if (i + 1 == len)
+            return len;
+        if (buf[i + 1] != IAC) // IAC SE, or a command ending a broken SB
+            return i;
+        i += 2; // Escaped 255
+    }
+    return len;
+}
+
+
 /**
  * @brief Handle a Telnet packet
- * 
- * This function handles a Telnet packet.
- * 
- * @param packet The packet to handle
+ *
+ * This function decodes the commands of the segment, strips them from the
+ * data and prints the data. The echo latency of the keystrokes is measured
+ * while the server echoes.
+ *
+ * @param packet The TCP payload
+ * @param data_size The size of the payload
+ * @param seq The TCP sequence number of the payload
  * @return int 0 if the packet is well handled, -1 otherwise
  */
-int telnet_handler(const u_char *packet) {
-    if (packet) {
-        ;
+int telnet_handler(const u_char *packet, int data_size, uint32_t seq)
+{
+    struct telnet_session *telnet = telnet_session_get();
+    if (telnet == NULL) {
+        fprintf(stderr, "malloc\n");
+        return -1;
+    }
+    if (telnet->broken) {
+        fprintf(current_packet.out,
+                "Telnet stream not decoded, %d bytes\n", data_size);
+        return -1;
     }
-    printf("No handling yet\n");
+
+    int dir = current_packet.dir;
+    if (telnet->client_dir < 0) {
+        if (current_packet.key.sport == TELNET_PORT)
+            telnet->client_dir = !dir;
+        else
+            telnet->client_dir = dir;
+    }
+    int client = dir == telnet->client_dir;
+
+    struct stream *stream = &telnet->dir[dir];
+    if (stream_append(stream, seq, packet, data_size) < 0) {
+        fprintf(current_packet.out,
+                "Telnet stream incomplete, %d bytes not decoded\n", data_size);
+        telnet->broken = 1;
+        stream_free(&telnet->dir[0]);
+        stream_free(&telnet->dir[1]);
+        return -1;
+    }
+
+    const u_char *buf = stream->buf;
+    size_t len = stream->len, i = 0;
+    char text[TELNET_TEXT_LEN], dur[32];
+    size_t text_len = 0, nb_data = 0;
+    u_char first = 0;
+    uint64_t echoes[TELNET_MAX_PENDING];
+    int nb_echoes = 0;
+
+    while (i < len) {
+        const u_char *iac = memchr(buf + i, IAC, len - i);
+        size_t run = (iac ? (size_t)(iac - buf) : len) - i;
+        if (run > 0) { // Data up to the next command
+            if (nb_data == 0)
+                first = buf[i];
+            nb_data += run;
+            text_len = escape(text, text_len, buf + i, run);
+            if (!client)
+                match_echo(telnet, buf + i, run, echoes, &nb_echoes);
+            i += run;
+            continue;
+        }
+
+        if (i + 1 >= len)
+            break;
+        u_char cmd = buf[i + 1];
+        if (cmd == IAC) { // Escaped 255, part of the data
+            if (nb_data++ == 0)
+                first = IAC;
+            text_len = escape(text, text_len, buf + i, 1);
+            i += 2;
+        } else if (cmd >= WILL) {
+            if (i + 2 >= len)
+                break;
+            negotiate(telnet, client, cmd, buf[i + 2]);
+            i += 3;
+        } else if (cmd == SB) {
+            size_t end = sb_end(buf + i + 2, len - i - 2);
+            if (end == len - i - 2) {
+                if (len - i > TELNET_MAX_SB) {
+                    fprintf(current_packet.out,
+                            "\t- SB too long, %zu bytes dropped\n", len - i);
+                    i = len;
+                }
+                break;
+            }
+            // Unescape the doubled 255 of the subnegotiation
+            u_char sb[TELNET_MAX_SB];
+            size_t sb_len = 0;
+            for (size_t j = 0; j < end && sb_len < sizeof(sb); j++) {
+                sb[sb_len++] = buf[i + 2 + j];
+                if (buf[i + 2 + j] == IAC)
+                    j++;
+            }
+            print_sb(sb, sb_len);
+            i += 2 + end;
+            if (i + 1 < len && buf[i + 1] == SE)
+                i += 2;
+        } else if (cmd >= SE) {
+            fprintf(current_packet.out, "\t- %s\n", commands[cmd - SE]);
+            i += 2;
+        } else {
+            fprintf(current_packet.out, "\t- Command %u\n", cmd);
+            i += 2;
+        }
+    }
+    stream_consume(stream, i);
+
+    if (nb_data > 0)
+        fprintf(current_packet.out,
+                "%s: \"%s%s\", %zu bytes\n", client ? "C" : "S", text,
+                text_len + 4 >= TELNET_TEXT_LEN ? "..." : "", nb_data);
+    for (int k = 0; k < nb_echoes; k++)
+        fprintf(current_packet.out, "\t- Echo after %s\n",
+                format_duration(echoes[k], dur, sizeof(dur)));
+    if (client && telnet->echo && nb_data > 0 && nb_data <= TELNET_MAX_KEY)
+        push_key(telnet, first);
     return 0;
-}
\ No newline at end of file
+}
@@ -13,43 +13,25 @@
 // Global libraries
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 // Local header files
 #include "ethernet.h"
 #include "arp.h"
+#include "format.h"
 #include "ipv4.h"
 #include "ipv6.h"
-
-
-/**
- * @brief Format a MAC address
- * 
- * This function formats a MAC address in the format XX:XX:XX:XX:XX:XX.
- * 
- * @param ether_host The MAC address to format
- * @return char* The formatted MAC address
- * 
- * @note The returned string must be freed by the caller
- */
-static char *format_mac(const u_char ether_host[ETH_ALEN])
-{
-    char *res = malloc(3 * ETH_ALEN * sizeof(char));
-    if (res == NULL)
-        return NULL;
-
-    sprintf(res, "%02X:%02X:%02X:%02X:%02X:%02X", ether_host[0], ether_host[1],
-            ether_host[2], ether_host[3], ether_host[4], ether_host[5]);
-
-    return res;
-}
+#include "packet.h"
 
 
 /**
  * @brief Handle the ethertype
  * 
- * This function handles the ethertype of an Ethernet frame.
+ * This function handles the ethertype of an Ethernet frame. The 802.1Q and
+ * 802.1ad tags are skipped, the innermost VLAN is kept in current_packet.
  * 
  * @param packet The packet to handle
+ * @param size The captured size of the frame
  * @param ethernet The Ethernet frame
  * @return int 0 if the ethertype is well handled, 1 otherwise
  * 
@@ -57,35 +39,44 @@ static char *format_mac(const u_char ether_host[ETH_ALEN])
  * @see cast_ipv6
  * @see cast_arp
  */
-int ethertype_handler(const u_char *packet, const struct ether_header *ethernet)
+int ethertype_handler(const u_char *packet, uint32_t size,
+                      const struct ether_header *ethernet)
 {
-    char *mac_shost = format_mac(ethernet->ether_shost);
-    char *mac_dhost = format_mac(ethernet->ether_dhost);
-    if (mac_shost == NULL || mac_dhost == NULL) {
-        fprintf(stderr, "malloc\n");
-        return 1;
+    char mac_shost[MAC_STR_LEN], mac_dhost[MAC_STR_LEN];
+    memcpy(current_packet.src_mac, ethernet->ether_shost, ETH_ALEN);
+    fprintf(current_packet.out,
+            "LINK: %s -> %s\n", format_mac(ethernet->ether_shost, mac_shost),
+            format_mac(ethernet->ether_dhost, mac_dhost));
+
+    uint16_t type = be16toh(ethernet->ether_type);
+    uint32_t off = sizeof(struct ether_header);
+    while (type == ETHERTYPE_VLAN || type == ETHERTYPE_QINQ) {
+        if (size < off + VLAN_TAG_LEN) {
+            fprintf(stderr, "Truncated VLAN tag\n");
+            return (-1);
+        }
+        uint16_t tci = (uint16_t)(packet[off] << 8 | packet[off + 1]);
+        current_packet.vlan = tci & 0x0fff;
+        fprintf(current_packet.out,
+                "VLAN: %u, priority %u\n", tci & 0x0fff, tci >> 13);
+        type = (uint16_t)(packet[off + 2] << 8 | packet[off + 3]);
+        off += VLAN_TAG_LEN;
     }
 
-    printf("LINK: %s -> %s\n", mac_shost, mac_dhost);
-    free(mac_shost);
-    free(mac_dhost);
-    
-    switch (be16toh((ethernet->ether_type))) {
+    switch (type) {
     case ETHERTYPE_IP:
-        cast_ipv4(packet + sizeof(struct ether_header));
+        cast_ipv4(packet + off);
         break;
     case ETHERTYPE_IPV6:
-        cast_ipv6(packet + sizeof(struct ether_header));
+        cast_ipv6(packet + off);
         break;
     case ETHERTYPE_ARP:
-        cast_arp(packet + sizeof(struct ether_header));
-        break;
     case ETHERTYPE_REVARP:
-        fprintf(stderr, "No RARP handling yet.\n");
+        cast_arp(packet + off, size - off);
         break;
     default:
         fprintf(stderr, "Unknown protocol on link layer. ETHERTYPE: 0x%x\n",
-                be16toh(ethernet->ether_type));
+                type);
         return (-1);
     }
     return 0;
@@ -98,13 +89,18 @@ int ethertype_handler(const u_char *packet, const struct ether_header *ethernet)
  * This function handles an Ethernet frame.
  * 
  * @param packet The packet to handle
+ * @param size The captured size of the frame
  * @return int 0 if the packet is well handled, -1 otherwise
  * @see ethertype_handler
  */
-int cast_ethernet(const u_char *packet)
+int cast_ethernet(const u_char *packet, uint32_t size)
 {
     const struct ether_header *ethernet;
+    if (size < sizeof(struct ether_header)) {
+        fprintf(stderr, "Truncated Ethernet frame, %u bytes\n", size);
+        return -1;
+    }
     ethernet = (struct ether_header *)packet;
-    ethertype_handler(packet, ethernet);
+    ethertype_handler(packet, size, ethernet);
     return 0;
 }
@@ -4,7 +4,9 @@
  * @brief ARP layer
  * @ingroup network
  * 
- * This file contains the implementation of the ARP layer.
+ * This file contains the implementation of the ARP layer. ARP and RARP
+ * packets are parsed once into a struct arp_info pointing into the packet,
+ * which is printed without allocation and fed to the binding table.
  * 
  * @see arp.h
  * @see cast_arp
@@ -13,210 +15,166 @@
 // Global libraries
 #include <arpa/inet.h>
 #include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
 
 // Local librairies
 #include "arp.h"
+#include "arpwatch.h"
+#include "format.h"
+#include "packet.h"
 
+#define PADDR_STR_LEN HADDR_STR_LEN /**< Size of a formatted protocol address */
 
-/**
- * @brief Format an IPv4 address
- * 
- * This function formats an IPv4 address in the format A.B.C.D.
- * 
- * @param ip_addr The IPv4 address to format
- * @return char* The formatted IPv4 address
- * 
- * @note The returned string must be freed by the caller
- */
-#define STR_IPv4_ADDR_LEN 16
-static char *format_ipv4(uint32_t ip_addr)
-{ // Create an IPv4 string in the format A.B.C.D
-    char *res = malloc(STR_IPv4_ADDR_LEN * sizeof(char));
-    if (res == NULL) {
-        return NULL;
-    }
-    sprintf(res, "%u.%u.%u.%u", (ip_addr >> 24) & 0xFF, (ip_addr >> 16) & 0xFF,
-            (ip_addr >> 8) & 0xFF, (ip_addr) & 0xFF);
-
-    return res;
-}
 
 /**
- * @brief Format a MAC address
- * 
- * This function formats a MAC address in the format XX:XX:XX:XX:XX:XX.
- * 
- * @param ether_host The MAC address to format
- * @return char* The formatted MAC address
- * 
- * @note The returned string must be freed by the caller
+ * @brief Parse an ARP or RARP packet
+ *
+ * @param packet The ARP header
+ * @param size The captured size from the ARP header
+ * @param info The parsed packet
+ * @return int 0 on success, -1 if the packet is truncated
  */
-static char *format_mac(const u_char ether_host[ETH_ALEN])
-{ // Create a MAC string in the format XX:XX:XX:XX:XX:XX
-    char *res = malloc(3 * ETH_ALEN * sizeof(char));
-    if (res == NULL)
-        return NULL;
-
-    sprintf(res, "%02X:%02X:%02X:%02X:%02X:%02X", ether_host[0], ether_host[1],
-            ether_host[2], ether_host[3], ether_host[4], ether_host[5]);
-
-    return res;
+int arp_parse(const u_char *packet, uint32_t size, struct arp_info *info)
+{
+    const struct arphdr *arp = (const struct arphdr *)packet;
+    if (size < sizeof(struct arphdr) ||
+        size < sizeof(struct arphdr) + 2 * (arp->ar_hln + arp->ar_pln))
+        return -1;
+
+    info->hrd = be16toh(arp->ar_hrd);
+    info->pro = be16toh(arp->ar_pro);
+    info->op = be16toh(arp->ar_op);
+    info->hln = arp->ar_hln;
+    info->pln = arp->ar_pln;
+    info->sha = packet + sizeof(struct arphdr);
+    info->spa = info->sha + info->hln;
+    info->tha = info->spa + info->pln;
+    info->tpa = info->tha + info->hln;
+    return 0;
 }
 
 
 /**
- * @brief Get an address from an ARP packet
- * 
- * This function extracts an address from an ARP packet.
- * 
- * @param packet The packet to extract the address from
- * @param arp The ARP header
- * @param who The address to extract (1 for sender, 2 for target)
- * @param type The type of address to extract (1 for MAC, 2 for IP)
- * @return char* The extracted address
- * 
- * @note The returned string must be freed by the caller
+ * @brief Check if a packet maps an IPv4 address on Ethernet
+ *
+ * @param info The parsed packet
+ * @return int 1 if the addresses are a MAC and an IPv4 address, 0 otherwise
  */
-char *getaddr(const u_char *packet, const struct arphdr *arp, int who, int type)
+int arp_is_ether_ipv4(const struct arp_info *info)
 {
-    if (be16toh(arp->ar_pro) == ARPPTYPE_IP && arp->ar_pln == ARPPLEN_IP) {
-        int offset = sizeof(struct arphdr);
-        if (who == 1 && type == 1) {
-            return format_mac((u_char *)(packet + offset));
-        }
-        offset += arp->ar_hln;
-        if (who == 1 && type == 2) {
-            return format_ipv4(be32toh(*(uint32_t *)(packet + offset)));
-        }
-        offset += arp->ar_pln;
-        if (who == 2 && type == 1) {
-            return format_mac((u_char *)(packet + offset));
-        }
-        offset += arp->ar_hln;
-        if (who == 2 && type == 2) {
-            return format_ipv4(be32toh(*(uint32_t *)(packet + offset)));
-        }
-    }
-    return NULL;
+    return info->hrd == ARPHRD_ETHER && info->hln == ETH_ALEN &&
+           info->pro == ARPPTYPE_IP && info->pln == ARPPLEN_IP;
 }
 
+
 /**
- * @brief Get the sender address from an ARP packet (MAC or IP)
- * 
- * This function extracts the sender MAC address from an ARP packet.
- * 
- * @param packet The packet to extract the address from
- * @param arp The ARP header
- * @param type The type of address to extract (1 for MAC, 2 for IP)
- * @return char* The extracted address
- * 
- * @note The returned string must be freed by the caller
+ * @brief Format a protocol address
+ *
+ * IPv4 addresses are dotted, the other ones are printed in hexadecimal.
+ *
+ * @param info The parsed packet
+ * @param addr The address
+ * @param buf The destination, at least PADDR_STR_LEN bytes
+ * @return char* The destination
  */
-char *getsenderaddr(const u_char *packet, const struct arphdr *arp, int type)
+static char *format_paddr(const struct arp_info *info, const uint8_t *addr,
+                          char *buf)
 {
-    return getaddr(packet, arp, 1, type);
+    if (info->pro == ARPPTYPE_IP && info->pln == ARPPLEN_IP)
+        return format_ipv4(addr, buf);
+    return format_haddr(addr, info->pln, buf);
 }
 
 
 /**
- * @brief Get the target address from an ARP packet (MAC or IP)
- * 
- * This function extracts the target MAC address from an ARP packet.
- * 
- * @param packet The packet to extract the address from
- * @param arp The ARP header
- * @param type The type of address to extract (1 for MAC, 2 for IP)
- * @return char* The extracted address
- * 
- * @note The returned string must be freed by the caller
+ * @brief Check if an address is null
+ *
+ * @param addr The address
+ * @param len The length of the address
+ * @return int 1 if every byte is 0, 0 otherwise
  */
-char *gettargetaddr(const u_char *packet, const struct arphdr *arp, int type)
+static int is_null(const uint8_t *addr, int len)
 {
-    return getaddr(packet, arp, 2, type);
+    for (int i = 0; i < len; i++)
+        if (addr[i])
+            return 0;
+    return 1;
 }
 
 
 /**
- * @brief Handle an ARP packet
+ * @brief Handle an ARP or RARP packet
  * 
- * This function handles an ARP packet.
+ * This function prints an ARP or RARP packet.
  * 
- * @param packet The packet to handle
- * @param arp The ARP header
+ * @param info The parsed packet
  * @return int 0 if the packet is well handled, 1 otherwise
  */
-int arp_handler(const u_char *packet, const struct arphdr *arp)
+static int arp_handler(const struct arp_info *info)
 {
-    switch (be16toh(arp->ar_op)) { // ARP operation code
-    case ARPOP_REQUEST: { // ARP Request
-        char *TPA, *THA, *SPA, *SHA;
-        TPA = gettargetaddr(packet, arp, 2);
-        THA = gettargetaddr(packet, arp, 1);
-        SPA = getsenderaddr(packet, arp, 2);
-        SHA = getsenderaddr(packet, arp, 1);
-        if (TPA == NULL || SPA == NULL || THA == NULL) {
-            fprintf(stderr, "null addr\n");
-            return 1;
-        }
-        if ((strcmp(TPA, SPA) == 0) &&
-            (strcmp(THA, "00:00:00:00:00:00") == 0)) {
-            printf("ARP Announcement: %s is at %s\n", SPA, SHA);
-        } else if (SHA && TPA && (strcmp(SPA, "0.0.0.0") == 0) && (strcmp(THA, "00:00:00:00:00:00") == 0)) {
-            printf("ARP Probing %s\n", TPA);
-        } else {
-            printf("ARP Request: Who has %s? Tell %s\n", TPA, SPA);
-        }
-        free(THA);
-        free(TPA);
-        free(SPA);
-        free(SHA);
+    char SHA[HADDR_STR_LEN], THA[HADDR_STR_LEN];
+    char SPA[PADDR_STR_LEN], TPA[PADDR_STR_LEN];
+    format_haddr(info->sha, info->hln, SHA);
+    format_haddr(info->tha, info->hln, THA);
+    format_paddr(info, info->spa, SPA);
+    format_paddr(info, info->tpa, TPA);
+
+    // Gratuitous: the sender announces its own address to nobody
+    int gratuitous = memcmp(info->spa, info->tpa, info->pln) == 0 &&
+                     is_null(info->tha, info->hln);
+
+    switch (info->op) { // ARP operation code
+    case ARPOP_REQUEST: // ARP Request
+        if (gratuitous)
+            fprintf(current_packet.out,
+                    "ARP Announcement: %s is at %s\n", SPA, SHA);
+        else if (is_null(info->spa, info->pln) && is_null(info->tha, info->hln))
+            fprintf(current_packet.out, "ARP Probing %s\n", TPA);
+        else
+            fprintf(current_packet.out,
+                    "ARP Request: Who has %s? Tell %s\n", TPA, SPA);
         break;
-    }
-    case ARPOP_REPLY: { // ARP Reply
-        char *TPA, *THA, *SPA, *SHA;
-        TPA = gettargetaddr(packet, arp, 2);
-        THA = gettargetaddr(packet, arp, 1);
-        SPA = getsenderaddr(packet, arp, 2);
-        SHA = getsenderaddr(packet, arp, 1);
-        if (TPA == NULL || SPA == NULL || THA == NULL) {
-            fprintf(stderr, "null addr\n");
-            return 1;
-        }
-        if ((strcmp(TPA, SPA) == 0) &&
-            (strcmp(THA, "00:00:00:00:00:00") == 0)) {
-            printf("ARP Announcement for %s\n", SPA);
-        } else {
-            printf("ARP Reply: %s is at %s\n", SPA, SHA);
-        }
-        free(THA);
-        free(TPA);
-        free(SPA);
-        free(SHA);
+    case ARPOP_REPLY: // ARP Reply
+        if (gratuitous)
+            fprintf(current_packet.out, "ARP Announcement for %s\n", SPA);
+        else
+            fprintf(current_packet.out, "ARP Reply: %s is at %s\n", SPA, SHA);
+        break;
+    case ARPOP_RREQUEST: // RARP Request
+        fprintf(current_packet.out,
+                "RARP Request: Who is %s? Tell %s\n", THA, SHA);
+        break;
+    case ARPOP_RREPLY: // RARP Reply
+        fprintf(current_packet.out, "RARP Reply: %s is at %s\n", THA, TPA);
         break;
-    }
     default:
-        fprintf(stderr, "Unsupported ARP operation code 0x%02x\n",
-                be16toh(arp->ar_op));
+        fprintf(stderr, "Unsupported ARP operation code 0x%02x\n", info->op);
+        return 1;
     }
     return 0;
 }
 
 
 /**
- * @brief Handle an ARP packet
+ * @brief Handle an ARP or RARP packet
  * 
- * This function handles an ARP packet.
+ * This function handles an ARP or RARP packet and feeds the binding table.
  * 
  * @param packet The packet to handle
- * @return int 0 if the packet is well handled
+ * @param size The captured size from the ARP header
+ * @return int 0 if the packet is well handled, -1 otherwise
  * @see arp_handler
+ * @see arp_watch
  */
-int cast_arp(const u_char *packet)
+int cast_arp(const u_char *packet, uint32_t size)
 {
-    const struct arphdr *arp;
-    arp = (struct arphdr *)packet;
-    arp_handler(packet, arp);
+    struct arp_info info;
+    if (arp_parse(packet, size, &info) < 0) {
+        fprintf(stderr, "Truncated ARP packet, %u bytes\n", size);
+        return -1;
+    }
+    if (arp_handler(&info) != 0)
+        return -1;
+    arp_watch(&info, current_packet.ts);
     return 0;
-}
\ No newline at end of file
+}
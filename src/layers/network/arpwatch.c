@@ -0,0 +1,454 @@
+/**
+ * @file arpwatch.c
+ * @brief ARP analysis definition
+ * @ingroup network
+ *
+ * This file contains the definition of the ARP analysis mode. The bindings
+ * (IPv4 address to MAC) and the senders (MAC to token bucket) are kept in two
+ * open addressing tables of fixed size entries, so that a frame costs two
+ * probes and no allocation. Nothing is printed per frame: an event is printed
+ * when a storm, a conflict or a flip begins, and the repetitions are counted
+ * for the final report.
+ *
+ * @see arpwatch.h
+ * @see arp_watch
+ */
+
+// Global libraries
+#include <net/ethernet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Local header files
+#include "arp.h"
+#include "arpwatch.h"
+#include "format.h"
+#include "packet.h"
+#include "stats.h"
+#include "timestamp.h"
+
+#define ARP_TABLE_MIN 1024 /**< Initial number of slots, must be a power of 2 */
+#define ARP_TOKEN_COST (1000000000ULL / ARP_RATE) /**< Bucket cost of a frame (ns) */
+#define ARP_BUCKET_SIZE (ARP_BURST * ARP_TOKEN_COST) /**< Capacity of a bucket (ns) */
+
+/**
+ * @brief IPv4 to MAC binding
+ *
+ * A null address marks a free slot: 0.0.0.0 is never bound.
+ */
+struct arp_binding {
+    uint64_t last;      /**< Last claim by the bound MAC (ns) */
+    uint32_t ip;        /**< Address, in network order */
+    uint32_t conflicts; /**< Claims by another MAC while the binding was in use */
+    uint8_t mac[ETH_ALEN]; /**< Bound MAC */
+    uint8_t alt[ETH_ALEN]; /**< Other MAC of the last conflict or flip */
+    uint16_t flips;     /**< Changes of the bound MAC */
+};
+
+/**
+ * @brief ARP sender
+ *
+ * The token bucket holds nanoseconds of credit: it refills with the elapsed
+ * time and every frame costs ARP_TOKEN_COST. A null MAC marks a free slot.
+ */
+struct arp_sender {
+    uint64_t mac;           /**< MAC, packed in 48 bits */
+    uint64_t last;          /**< Last frame (ns) */
+    uint64_t tokens;        /**< Credit of the bucket (ns) */
+    uint64_t storm_start;   /**< First frame over the rate (ns) */
+    uint32_t frames;        /**< Frames sent */
+    uint32_t storm_frames;  /**< Frames since the start of the storm, 0 if none */
+};
+
+/**
+ * @brief Open addressing table
+ */
+struct arp_table {
+    void *slots;        /**< Entries */
+    uint32_t mask;      /**< Number of slots - 1 */
+    uint32_t count;     /**< Used slots */
+};
+
+static struct arp_table bindings; /**< struct arp_binding, by address */
+static struct arp_table senders;  /**< struct arp_sender, by MAC */
+
+/**
+ * @brief Counters of the report
+ */
+static struct {
+    uint64_t frames;    /**< ARP frames analyzed */
+    uint64_t probes;    /**< Probes, not bound */
+    uint64_t untracked; /**< Frames whose sender or address didn't fit */
+    uint32_t storms;    /**< Storms begun */
+    uint32_t conflicting; /**< Addresses that had a conflict */
+    uint32_t flipped;   /**< Addresses that changed of MAC */
+} arp_counters;
+
+
+/**
+ * @brief Hash a key
+ *
+ * Fibonacci hashing: the high bits of the product are the best mixed ones.
+ *
+ * @param key The address or the packed MAC
+ * @param mask The number of slots - 1
+ * @return uint32_t The first slot to probe
+ */
+static uint32_t hash_key(uint64_t key, uint32_t mask)
+{
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+
+/**
+ * @brief Pack a MAC in an integer
+ *
+ * @param mac The MAC
+ * @return uint64_t The MAC in the 48 low bits
+ */
+static uint64_t pack_mac(const uint8_t mac[ETH_ALEN])
+{
+    return (uint64_t)mac[0] << 40 | (uint64_t)mac[1] << 32 |
+           (uint64_t)mac[2] << 24 | (uint64_t)mac[3] << 16 |
+           (uint64_t)mac[4] << 8 | mac[5];
+}
+
+
+/**
+ * @brief Format a packed MAC
+ *
+ * @param mac The MAC in the 48 low bits
+ * @param buf The destination, at least MAC_STR_LEN bytes
+ * @return char* The destination
+ */
+static char *packed_mac_str(uint64_t mac, char *buf)
+{
+    uint8_t bytes[ETH_ALEN];
+    for (int i = ETH_ALEN - 1; i >= 0; i--, mac >>= 8)
+        bytes[i] = mac & 0xff;
+    return format_mac(bytes, buf);
+}
+
+
+/**
+ * @brief Print the beginning of an event line
+ *
+ * @param ts The time of the event (ns)
+ */
+static void event_start(uint64_t ts)
+{
+    const char *time_str =
+        timestamp_format(ts / 1000000000, ts % 1000000000);
+    if (time_str)
+        fprintf(current_packet.out, "%s ", time_str);
+}
+
+
+/**
+ * @brief Find the slot of a binding
+ *
+ * @param ip The address, in network order
+ * @return struct arp_binding* The binding, or the free slot where it goes
+ */
+static struct arp_binding *binding_slot(uint32_t ip)
+{
+    struct arp_binding *slots = bindings.slots;
+    uint32_t i = hash_key(ip, bindings.mask);
+    while (slots[i].ip != 0 && slots[i].ip != ip)
+        i = (i + 1) & bindings.mask;
+    return &slots[i];
+}
+
+
+/**
+ * @brief Find the slot of a sender
+ *
+ * @param mac The packed MAC
+ * @return struct arp_sender* The sender, or the free slot where it goes
+ */
+static struct arp_sender *sender_slot(uint64_t mac)
+{
+    struct arp_sender *slots = senders.slots;
+    uint32_t i = hash_key(mac, senders.mask);
+    while (slots[i].mac != 0 && slots[i].mac != mac)
+        i = (i + 1) & senders.mask;
+    return &slots[i];
+}
+
+
+/**
+ * @brief Make room for one more entry
+ *
+ * The table is doubled when it would be more than half full.
+ *
+ * @param table The table
+ * @param size The size of an entry
+ * @param is_sender 1 for the senders table, 0 for the bindings table
+ * @return int 0 if there is room, -1 if the table is full or on allocation
+ * failure
+ */
+static int table_reserve(struct arp_table *table, size_t size, int is_sender)
+{
+    uint32_t nb_slots = table->slots ? table->mask + 1 : 0;
+    if ((table->count + 1) * 2 <= nb_slots)
+        return 0;
+    if (table->count >= ARP_MAX_ENTRIES)
+        return -1;
+
+    uint32_t new_slots = nb_slots ? nb_slots * 2 : ARP_TABLE_MIN;
+    uint8_t *old = table->slots;
+    table->slots = calloc(new_slots, size);
+    if (table->slots == NULL) {
+        table->slots = old;
+        return -1;
+    }
+    table->mask = new_slots - 1;
+
+    for (uint32_t i = 0; i < nb_slots; i++) {
+        if (is_sender) {
+            const struct arp_sender *s = (struct arp_sender *)old + i;
+            if (s->mac != 0)
+                *sender_slot(s->mac) = *s;
+        } else {
+            const struct arp_binding *b = (struct arp_binding *)old + i;
+            if (b->ip != 0)
+                *binding_slot(b->ip) = *b;
+        }
+    }
+    free(old);
+    return 0;
+}
+
+
+/**
+ * @brief Print the end of a storm
+ *
+ * @param s The storming sender
+ */
+static void storm_end(struct arp_sender *s)
+{
+    char mac[MAC_STR_LEN], dur[32];
+    uint64_t len = s->last - s->storm_start;
+    event_start(s->last);
+    fprintf(current_packet.out, "ARP storm ended: %s, %u frames in %s",
+            packed_mac_str(s->mac, mac), s->storm_frames,
+            format_duration(len, dur, sizeof(dur)));
+    if (len > 0)
+        fprintf(current_packet.out,
+                " (%.1f frames/s)", s->storm_frames * 1e9 / len);
+    fprintf(current_packet.out, "\n");
+    s->storm_frames = 0;
+}
+
+
+/**
+ * @brief Account a frame in the bucket of its sender
+ *
+ * @param mac The MAC of the sender
+ * @param ts The capture time of the frame (ns)
+ */
+static void rate_frame(const uint8_t mac[ETH_ALEN], uint64_t ts)
+{
+    uint64_t key = pack_mac(mac);
+    if (key == 0 || (senders.slots == NULL &&
+                     table_reserve(&senders, sizeof(struct arp_sender), 1) < 0))
+        return;
+
+    struct arp_sender *s = sender_slot(key);
+    if (s->mac == 0) {
+        if (table_reserve(&senders, sizeof(struct arp_sender), 1) < 0) {
+            arp_counters.untracked++;
+            return;
+        }
+        s = sender_slot(key);
+        s->mac = key;
+        s->tokens = ARP_BUCKET_SIZE;
+        s->last = ts;
+        senders.count++;
+    }
+
+    s->tokens += ts > s->last ? ts - s->last : 0;
+    if (s->tokens >= ARP_BUCKET_SIZE) {
+        s->tokens = ARP_BUCKET_SIZE;
+        if (s->storm_frames) // Quiet long enough to refill the bucket
+            storm_end(s);
+    }
+    s->last = ts;
+    s->frames++;
+
+    if (s->tokens >= ARP_TOKEN_COST) {
+        s->tokens -= ARP_TOKEN_COST;
+        if (s->storm_frames)
+            s->storm_frames++;
+        return;
+    }
+    if (s->storm_frames++ == 0) {
+        char str[MAC_STR_LEN];
+        s->storm_start = ts;
+        arp_counters.storms++;
+        event_start(ts);
+        fprintf(current_packet.out, "ARP storm started: %s, over %d frames/s\n",
+                packed_mac_str(key, str), ARP_RATE);
+    }
+}
+
+
+/**
+ * @brief Account the claim of an address by a MAC
+ *
+ * @param ip The claimed address, in network order
+ * @param mac The MAC of the sender
+ * @param ts The capture time of the frame (ns)
+ */
+static void bind_address(uint32_t ip, const uint8_t mac[ETH_ALEN],
+                         uint64_t ts)
+{
+    if (bindings.slots == NULL &&
+        table_reserve(&bindings, sizeof(struct arp_binding), 0) < 0)
+        return;
+
+    struct arp_binding *b = binding_slot(ip);
+    if (b->ip == 0) { // New station
+        if (table_reserve(&bindings, sizeof(struct arp_binding), 0) < 0) {
+            arp_counters.untracked++;
+            return;
+        }
+        b = binding_slot(ip);
+        b->ip = ip;
+        memcpy(b->mac, mac, ETH_ALEN);
+        b->last = ts;
+        bindings.count++;
+        return;
+    }
+
+    if (memcmp(b->mac, mac, ETH_ALEN) == 0) {
+        b->last = ts;
+        return;
+    }
+
+    char addr[IPV4_STR_LEN], old_mac[MAC_STR_LEN], new_mac[MAC_STR_LEN];
+    int new_pair = memcmp(b->alt, mac, ETH_ALEN) != 0;
+    if (ts < b->last + ARP_CONFLICT_WINDOW) {
+        // The bound MAC still uses the address: two stations claim it
+        if (b->conflicts++ == 0)
+            arp_counters.conflicting++;
+        if (new_pair) {
+            event_start(ts);
+            fprintf(current_packet.out,
+                    "ARP conflict: %s claimed by %s and %s\n",
+                    format_ipv4((uint8_t *)&ip, addr),
+                    format_mac(b->mac, old_mac), format_mac(mac, new_mac));
+        }
+        memcpy(b->alt, mac, ETH_ALEN);
+        return;
+    }
+
+    // The bound MAC went quiet: the address moved. Moving back to the
+    // previous MAC is only counted.
+    if (b->flips == 0)
+        arp_counters.flipped++;
+    if (b->flips++ == 0 || new_pair) {
+        event_start(ts);
+        fprintf(current_packet.out, "ARP flip: %s moved from %s to %s\n",
+                format_ipv4((uint8_t *)&ip, addr), format_mac(b->mac, old_mac),
+                format_mac(mac, new_mac));
+    }
+    memcpy(b->alt, b->mac, ETH_ALEN);
+    memcpy(b->mac, mac, ETH_ALEN);
+    b->last = ts;
+}
+
+
+/**
+ * @brief Analyze an ARP or RARP packet
+ *
+ * Update the binding of the sender and its rate, print an event when a storm,
+ * a conflict or a flip begins. Probes (sender address 0.0.0.0) only count in
+ * the rate. A RARP reply binds the target: the server tells a station its
+ * address.
+ *
+ * @param info The parsed packet
+ * @param ts The capture time of the packet (ns)
+ * @return int 0 if the packet was analyzed, -1 if it doesn't map an IPv4
+ * address on Ethernet
+ */
+int arp_watch(const struct arp_info *info, uint64_t ts)
+{
+    if (!arp_is_ether_ipv4(info))
+        return -1;
+
+    arp_counters.frames++;
+    rate_frame(info->sha, ts);
+
+    const uint8_t *mac = info->sha, *addr = info->spa;
+    if (info->op == ARPOP_RREQUEST)
+        return 0;
+    if (info->op == ARPOP_RREPLY) {
+        mac = info->tha;
+        addr = info->tpa;
+    }
+
+    uint32_t ip;
+    memcpy(&ip, addr, sizeof(ip));
+    if (ip == 0)
+        arp_counters.probes++;
+    else
+        bind_address(ip, mac, ts);
+    return 0;
+}
+
+
+/**
+ * @brief Print the ARP analysis report
+ *
+ * Close the ongoing storms and summarize the conflicts and flips per address.
+ * Nothing is printed if no ARP packet was analyzed.
+ *
+ * @param events_only 1 to print nothing if there was no storm, conflict or
+ * flip
+ */
+void arp_watch_report(int events_only)
+{
+    if (arp_counters.frames == 0 ||
+        (events_only && arp_counters.storms == 0 &&
+         arp_counters.conflicting == 0 && arp_counters.flipped == 0))
+        return;
+
+    struct arp_sender *s = senders.slots;
+    for (uint32_t i = 0; s && i <= senders.mask; i++)
+        if (s[i].mac != 0 && s[i].storm_frames)
+            storm_end(&s[i]);
+
+    printf("ARP: %lu frames, %lu probes, %u addresses, %u senders, "
+           "%u storms, %u conflicts, %u flips\n",
+           (unsigned long)arp_counters.frames,
+           (unsigned long)arp_counters.probes, bindings.count, senders.count,
+           arp_counters.storms, arp_counters.conflicting,
+           arp_counters.flipped);
+    if (arp_counters.untracked)
+        printf("\t- %lu frames not tracked, tables full\n",
+               (unsigned long)arp_counters.untracked);
+
+    struct arp_binding *b = bindings.slots;
+    for (uint32_t i = 0; b && i <= bindings.mask; i++) {
+        if (b[i].ip == 0 || (b[i].conflicts == 0 && b[i].flips == 0))
+            continue;
+        char addr[IPV4_STR_LEN], mac[MAC_STR_LEN], alt[MAC_STR_LEN];
+        printf("\t- %s: at %s, also %s, %u conflicting claims, %u flips\n",
+               format_ipv4((uint8_t *)&b[i].ip, addr), format_mac(b[i].mac, mac),
+               format_mac(b[i].alt, alt), b[i].conflicts, b[i].flips);
+    }
+}
+
+
+/**
+ * @brief Free the ARP analysis tables
+ */
+void arp_watch_free(void)
+{
+    free(bindings.slots);
+    free(senders.slots);
+    memset(&bindings, 0, sizeof(bindings));
+    memset(&senders, 0, sizeof(senders));
+}
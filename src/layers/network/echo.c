@@ -0,0 +1,596 @@
+/**
+ * @file echo.c
+ * @brief ICMP echo and traceroute tracking definition
+ * @ingroup network
+ *
+ * This file contains the echo correlation. Echo requests wait in a chained
+ * hash table indexed by (source, destination, identifier, sequence) until
+ * their reply or a time exceeded error quoting them comes back. UDP
+ * traceroute probes wait in the same table, their ports taking the place of
+ * the identifier and the sequence, until a time exceeded or a port
+ * unreachable error quotes them. Stale requests are dropped while walking the
+ * buckets, and by a sweep of the whole table every second of capture time,
+ * and count as lost. Both tables are capped, the requests and paths past the
+ * cap are not tracked.
+ *
+ * The statistics are kept per path, a (source, destination) pair. A traced
+ * path also gets a hop list: the hop of a time exceeded error is the TTL of
+ * the quoted probe when the probe was seen, otherwise it is estimated from
+ * the TTL left in the error, assuming the router started at 32, 64, 128 or
+ * 255.
+ *
+ * @see echo.h
+ * @see echo_reply
+ * @see echo_time_exceeded
+ */
+
+// Global libraries
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+// Local header files
+#include "echo.h"
+#include "format.h"
+#include "hash.h"
+#include "packet.h"
+#include "stats.h"
+
+#define ECHO_BUCKETS 1024 /**< Number of buckets, must be a power of 2 */
+#define ECHO_SWEEP_PERIOD 1000000000ULL /**< Time between two sweeps (ns) */
+
+/**
+ * @brief Echo request waiting for its reply
+ */
+struct echo_pending {
+    uint8_t family;
+    uint8_t proto;      /**< ICMP, ICMPv6 or UDP for a traceroute probe */
+    uint8_t ttl;        /**< TTL or hop limit of the request */
+    uint16_t id;        /**< Identifier, or source port of a UDP probe */
+    uint16_t seq;       /**< Sequence, or destination port of a UDP probe */
+    uint8_t src[16];
+    uint8_t dst[16];
+    uint64_t ts;        /**< Time of the request (ns) */
+    struct echo_pending *next; /**< Next request in the same bucket */
+};
+
+/**
+ * @brief Hop of a traced path
+ */
+struct trace_hop {
+    uint8_t addr[16];   /**< Router that sent the time exceeded */
+    uint8_t seen;       /**< 1 once a router answered for this hop */
+    uint8_t estimated;  /**< 1 if the hop was guessed from the TTL */
+    uint8_t multi;      /**< 1 if several routers answered for this hop */
+    uint32_t rtt_count; /**< Answers with a known probe time */
+    uint64_t rtt_sum;
+};
+
+/**
+ * @brief Statistics of a path
+ */
+struct echo_path {
+    uint8_t family;
+    uint8_t max_hop;    /**< Highest hop seen, 0 if not traced */
+    uint8_t src[16];    /**< Sender of the requests or probes */
+    uint8_t dst[16];    /**< Target of the requests or probes */
+    uint32_t requests;  /**< Echo requests sent */
+    uint32_t replies;   /**< Echo replies matched */
+    uint32_t expired;   /**< Echo requests answered by a time exceeded */
+    uint64_t rtt_min;
+    uint64_t rtt_max;
+    uint64_t rtt_sum;
+    uint64_t last_rtt;  /**< RTT of the previous reply (ns) */
+    uint64_t jitter;    /**< Mean deviation of consecutive RTTs (ns) */
+    uint8_t traced;     /**< 1 once a time exceeded quoted a probe */
+    struct trace_hop hops[TRACE_MAX_HOPS]; /**< Hops of a traced path */
+    struct echo_path *next; /**< Next path in the same bucket */
+    struct echo_path *order; /**< Next path in the order of creation */
+};
+
+static struct echo_pending *pending_table[ECHO_BUCKETS]; /**< Pending requests */
+static struct echo_path *path_table[ECHO_BUCKETS]; /**< Paths by endpoints */
+static struct echo_path *first_path = NULL; /**< First path created */
+static struct echo_path **last_path = &first_path; /**< End of the creation list */
+static int nb_pending; /**< Requests and probes waiting */
+static int nb_paths; /**< Paths tracked */
+static uint64_t untracked; /**< Requests or paths that didn't fit */
+static uint64_t next_sweep; /**< Capture time of the next sweep (ns) */
+
+
+/**
+ * @brief Find a path
+ *
+ * @param family The address family
+ * @param src The sender of the requests
+ * @param dst The target of the requests
+ * @param create 1 to create the path if needed
+ * @return struct echo_path* The path, NULL if not found, if the table is full
+ * or on allocation failure
+ */
+static struct echo_path *path_get(uint8_t family, const uint8_t *src,
+                                  const uint8_t *dst, int create)
+{
+    uint32_t h = fnv1a32(fnv1a32(FNV32_OFFSET, &family, 1), src, 16);
+    uint32_t bucket = fnv1a32(h, dst, 16) & (ECHO_BUCKETS - 1);
+    for (struct echo_path *path = path_table[bucket]; path != NULL;
+         path = path->next)
+        if (path->family == family && memcmp(path->src, src, 16) == 0 &&
+            memcmp(path->dst, dst, 16) == 0)
+            return path;
+    if (!create)
+        return NULL;
+    if (nb_paths >= ECHO_MAX_PATHS) {
+        untracked++;
+        return NULL;
+    }
+
+    struct echo_path *path = calloc(1, sizeof(struct echo_path));
+    if (path == NULL)
+        return NULL;
+    nb_paths++;
+    path->family = family;
+    memcpy(path->src, src, 16);
+    memcpy(path->dst, dst, 16);
+    path->next = path_table[bucket];
+    path_table[bucket] = path;
+    *last_path = path;
+    last_path = &path->order;
+    return path;
+}
+
+
+/**
+ * @brief Get the protocol of the echo requests of a family
+ *
+ * @param family AF_INET or AF_INET6
+ * @return uint8_t IPPROTO_ICMP or IPPROTO_ICMPV6
+ */
+static uint8_t echo_proto(uint8_t family)
+{
+    return family == AF_INET6 ? IPPROTO_ICMPV6 : IPPROTO_ICMP;
+}
+
+
+/**
+ * @brief Find a pending request
+ *
+ * Stale requests of the bucket are released on the way.
+ *
+ * @param family The address family
+ * @param proto The protocol of the request
+ * @param src The sender of the request
+ * @param dst The target of the request
+ * @param id The identifier of the request
+ * @param seq The sequence number of the request
+ * @return struct echo_pending** The link pointing to the request, or to the
+ * end of the bucket if not found
+ */
+static struct echo_pending **pending_find(uint8_t family, uint8_t proto,
+                                          const uint8_t *src,
+                                          const uint8_t *dst, uint16_t id,
+                                          uint16_t seq)
+{
+    uint32_t h = fnv1a32(FNV32_OFFSET, &family, 1);
+    h = fnv1a32(fnv1a32(fnv1a32(h, src, 16), dst, 16), &proto, 1);
+    h = fnv1a32(fnv1a32(h, &id, sizeof(id)), &seq, sizeof(seq));
+    struct echo_pending **link = &pending_table[h & (ECHO_BUCKETS - 1)];
+    while (*link != NULL) {
+        struct echo_pending *req = *link;
+        if (current_packet.ts > req->ts + ECHO_TIMEOUT) {
+            *link = req->next;
+            free(req);
+            nb_pending--;
+            continue;
+        }
+        if (req->family == family && req->proto == proto && req->id == id &&
+            req->seq == seq &&
+            memcmp(req->src, src, 16) == 0 && memcmp(req->dst, dst, 16) == 0)
+            return link;
+        link = &req->next;
+    }
+    return link;
+}
+
+
+/**
+ * @brief Record the request or probe in current_packet
+ *
+ * A retransmission restarts the timer of the pending request.
+ *
+ * @param proto The protocol of the request
+ * @param id The identifier of the request
+ * @param seq The sequence number of the request
+ */
+static void pending_add(uint8_t proto, uint16_t id, uint16_t seq)
+{
+    const struct flow_key *key = &current_packet.key;
+    struct echo_pending **link =
+        pending_find(key->family, proto, key->saddr, key->daddr, id, seq);
+    struct echo_pending *req = *link;
+    if (req == NULL) {
+        if (nb_pending >= ECHO_MAX_PENDING) {
+            untracked++;
+            return;
+        }
+        req = calloc(1, sizeof(struct echo_pending));
+        if (req == NULL)
+            return;
+        nb_pending++;
+        req->family = key->family;
+        req->proto = proto;
+        req->id = id;
+        req->seq = seq;
+        memcpy(req->src, key->saddr, 16);
+        memcpy(req->dst, key->daddr, 16);
+        *link = req;
+    }
+    req->ttl = current_packet.ttl;
+    req->ts = current_packet.ts;
+}
+
+
+/**
+ * @brief Record the destination of a traced path
+ *
+ * The sender of current_packet answered a probe that reached it, it becomes
+ * the hop of the probe unless a router already answered for that hop.
+ *
+ * @param path The path
+ * @param ttl The TTL of the probe
+ * @param rtt The round trip time of the probe (ns)
+ */
+static void trace_reached(struct echo_path *path, uint8_t ttl, uint64_t rtt)
+{
+    if (!path->traced || ttl < 1 || ttl > TRACE_MAX_HOPS ||
+        path->hops[ttl - 1].seen)
+        return;
+    struct trace_hop *hop = &path->hops[ttl - 1];
+    memcpy(hop->addr, current_packet.key.saddr, 16);
+    hop->seen = 1;
+    hop->rtt_sum = rtt;
+    hop->rtt_count = 1;
+    if (ttl > path->max_hop)
+        path->max_hop = ttl;
+}
+
+
+/**
+ * @brief Record an echo request
+ *
+ * The addresses, TTL and time of the request are taken from current_packet.
+ *
+ * @param id The identifier of the request
+ * @param seq The sequence number of the request
+ */
+void echo_request(uint16_t id, uint16_t seq)
+{
+    const struct flow_key *key = &current_packet.key;
+    fprintf(current_packet.out, "\t- id %u, seq %u\n", id, seq);
+
+    struct echo_path *path = path_get(key->family, key->saddr, key->daddr, 1);
+    if (path == NULL)
+        return;
+    path->requests++;
+
+    pending_add(echo_proto(key->family), id, seq);
+}
+
+
+/**
+ * @brief Record a UDP traceroute probe
+ *
+ * The datagram in current_packet is kept as a probe if its destination port
+ * is a traceroute port.
+ */
+void echo_udp_probe(void)
+{
+    const struct flow_key *key = &current_packet.key;
+    if (key->dport >= TRACE_UDP_PORT_MIN && key->dport <= TRACE_UDP_PORT_MAX)
+        pending_add(IPPROTO_UDP, key->sport, key->dport);
+}
+
+
+/**
+ * @brief Match an echo reply with its request
+ *
+ * Print the round trip time if the request was seen.
+ *
+ * @param id The identifier of the reply
+ * @param seq The sequence number of the reply
+ */
+void echo_reply(uint16_t id, uint16_t seq)
+{
+    const struct flow_key *key = &current_packet.key;
+    struct echo_pending **link = pending_find(
+        key->family, echo_proto(key->family), key->daddr, key->saddr, id, seq);
+    struct echo_pending *req = *link;
+    struct echo_path *path =
+        path_get(key->family, key->daddr, key->saddr, 0);
+    if (req == NULL || path == NULL) {
+        fprintf(current_packet.out,
+                "\t- id %u, seq %u, request not seen\n", id, seq);
+        return;
+    }
+    *link = req->next;
+    nb_pending--;
+
+    uint64_t rtt = current_packet.ts - req->ts;
+    char dur[32];
+    fprintf(current_packet.out, "\t- id %u, seq %u, RTT %s\n", id, seq,
+            format_duration(rtt, dur, sizeof(dur)));
+    latency_add(latency_stats_get("ICMP echo RTT"), rtt);
+
+    if (path->replies++ == 0 || rtt < path->rtt_min)
+        path->rtt_min = rtt;
+    if (rtt > path->rtt_max)
+        path->rtt_max = rtt;
+    path->rtt_sum += rtt;
+    if (path->replies > 1) { // RFC 3550 interarrival jitter estimator
+        uint64_t d = rtt > path->last_rtt ? rtt - path->last_rtt :
+                                            path->last_rtt - rtt;
+        path->jitter += ((int64_t)d - (int64_t)path->jitter) / 16;
+    }
+    path->last_rtt = rtt;
+
+    // During a traceroute, the destination answers the last probes
+    trace_reached(path, req->ttl, rtt);
+    free(req);
+}
+
+
+/**
+ * @brief Take the pending probe quoted by an ICMP error
+ *
+ * @param probe The key of the quoted probe
+ * @param id The identifier of a quoted echo request
+ * @param seq The sequence number of a quoted echo request
+ * @return struct echo_pending* The probe, to be freed, NULL if not seen
+ */
+static struct echo_pending *probe_take(const struct flow_key *probe,
+                                       uint16_t id, uint16_t seq)
+{
+    if (probe->proto == IPPROTO_UDP) {
+        id = probe->sport;
+        seq = probe->dport;
+    } else if (probe->proto != echo_proto(probe->family)) {
+        return NULL;
+    }
+    struct echo_pending **link = pending_find(
+        probe->family, probe->proto, probe->saddr, probe->daddr, id, seq);
+    struct echo_pending *req = *link;
+    if (req != NULL) {
+        *link = req->next;
+        nb_pending--;
+    }
+    return req;
+}
+
+
+/**
+ * @brief Record a hop of a traced path
+ *
+ * The router is the sender of the time exceeded error in current_packet.
+ *
+ * @param probe The key of the quoted probe
+ * @param id The identifier of a quoted echo request, 0 otherwise
+ * @param seq The sequence number of a quoted echo request, 0 otherwise
+ */
+void echo_time_exceeded(const struct flow_key *probe, uint16_t id,
+                        uint16_t seq)
+{
+    int hop = 0, estimated = 0;
+    uint64_t rtt = 0;
+    struct echo_pending *req = probe_take(probe, id, seq);
+    if (req != NULL) {
+        hop = req->ttl;
+        rtt = current_packet.ts - req->ts;
+        free(req);
+    }
+    if (hop == 0) { // Probe not seen, count the hops back to the router
+        uint8_t ttl = current_packet.ttl;
+        int initial = ttl <= 32 ? 32 : ttl <= 64 ? 64 : ttl <= 128 ? 128 : 255;
+        hop = initial - ttl + 1;
+        estimated = 1;
+    }
+    if (hop < 1 || hop > TRACE_MAX_HOPS)
+        return;
+
+    struct echo_path *path =
+        path_get(probe->family, probe->saddr, probe->daddr, 1);
+    if (path == NULL)
+        return;
+    path->traced = 1;
+    if (!estimated && probe->proto != IPPROTO_UDP) // Not a ping request
+        path->expired++;
+
+    struct trace_hop *h = &path->hops[hop - 1];
+    if (!h->seen) {
+        memcpy(h->addr, current_packet.key.saddr, 16);
+        h->seen = 1;
+        h->estimated = estimated;
+    } else if (memcmp(h->addr, current_packet.key.saddr, 16) != 0) {
+        h->multi = 1;
+    }
+    if (!estimated) {
+        h->rtt_sum += rtt;
+        h->rtt_count++;
+    }
+    if (hop > path->max_hop)
+        path->max_hop = hop;
+
+    char dst[IPV6_STR_LEN], dur[32];
+    fprintf(current_packet.out,
+            "\t- Hop %d%s to %s", hop, estimated ? " (estimated)" : "",
+            format_addr(probe->family, probe->daddr, dst));
+    if (!estimated)
+        fprintf(current_packet.out,
+                ", RTT %s", format_duration(rtt, dur, sizeof(dur)));
+    fprintf(current_packet.out, "\n");
+}
+
+
+/**
+ * @brief Record the end of a UDP traceroute
+ *
+ * The destination answers the last probes with a port unreachable error,
+ * its sender in current_packet becomes the last hop of the path.
+ *
+ * @param probe The key of the quoted probe
+ */
+void echo_unreachable(const struct flow_key *probe)
+{
+    if (probe->proto != IPPROTO_UDP)
+        return;
+    struct echo_pending *req = probe_take(probe, 0, 0);
+    if (req == NULL)
+        return;
+    uint64_t rtt = current_packet.ts - req->ts;
+    struct echo_path *path =
+        path_get(probe->family, probe->saddr, probe->daddr, 0);
+    if (path != NULL && path->traced) {
+        char dur[32];
+        fprintf(current_packet.out,
+                "\t- Hop %u, destination reached, RTT %s\n", req->ttl,
+                format_duration(rtt, dur, sizeof(dur)));
+        trace_reached(path, req->ttl, rtt);
+    }
+    free(req);
+}
+
+
+/**
+ * @brief Advance the clock of the echo tables
+ *
+ * Called before every packet, drop the requests and probes unanswered for
+ * ECHO_TIMEOUT about once per second of capture time.
+ *
+ * @param now The capture time of the packet (ns)
+ */
+void echo_tick(uint64_t now)
+{
+    if (now < next_sweep)
+        return;
+    next_sweep = now + ECHO_SWEEP_PERIOD;
+    if (nb_pending == 0)
+        return;
+    for (int i = 0; i < ECHO_BUCKETS; i++) {
+        struct echo_pending **link = &pending_table[i];
+        while (*link != NULL) {
+            struct echo_pending *req = *link;
+            if (now > req->ts + ECHO_TIMEOUT) {
+                *link = req->next;
+                free(req);
+                nb_pending--;
+            } else {
+                link = &req->next;
+            }
+        }
+    }
+}
+
+
+/**
+ * @brief Print the hops of a traced path
+ *
+ * @param path The path
+ */
+static void print_trace(const struct echo_path *path)
+{
+    char src[IPV6_STR_LEN], dst[IPV6_STR_LEN];
+    printf("Traceroute %s -> %s:\n", format_addr(path->family, path->src, src),
+           format_addr(path->family, path->dst, dst));
+    for (int i = 0; i < path->max_hop; i++) {
+        const struct trace_hop *h = &path->hops[i];
+        if (!h->seen) { // Fold a run of silent hops into one line
+            int last = i;
+            while (last + 1 < path->max_hop && !path->hops[last + 1].seen)
+                last++;
+            if (last > i)
+                printf("\t%2d-%d  *\n", i + 1, last + 1);
+            else
+                printf("\t%2d  *\n", i + 1);
+            i = last;
+            continue;
+        }
+        char addr[IPV6_STR_LEN], dur[32];
+        printf("\t%2d  %s", i + 1, format_addr(path->family, h->addr, addr));
+        if (h->rtt_count)
+            printf("  %s", format_duration(h->rtt_sum / h->rtt_count, dur,
+                                           sizeof(dur)));
+        if (h->estimated)
+            printf("  (estimated hop)");
+        if (h->multi)
+            printf("  (several routers)");
+        printf("\n");
+    }
+}
+
+
+/**
+ * @brief Print the echo and traceroute report
+ *
+ * Print the RTT, loss and jitter of every pinged path, then the hops of every
+ * traced path, and the requests that didn't fit in the tables.
+ */
+void echo_report(void)
+{
+    for (const struct echo_path *path = first_path; path != NULL;
+         path = path->order) {
+        if (path->requests == 0 || path->requests <= path->expired)
+            continue;
+
+        char src[IPV6_STR_LEN], dst[IPV6_STR_LEN];
+        uint32_t sent = path->requests - path->expired;
+        uint32_t lost = sent > path->replies ? sent - path->replies : 0;
+        printf("Ping %s -> %s: %u requests, %u replies, %.1f%% loss",
+               format_addr(path->family, path->src, src),
+               format_addr(path->family, path->dst, dst), sent,
+               path->replies, 100.0 * lost / sent);
+        if (path->replies) {
+            char min[32], avg[32], max[32], jit[32];
+            printf(", RTT min/avg/max %s/%s/%s, jitter %s",
+                   format_duration(path->rtt_min, min, sizeof(min)),
+                   format_duration(path->rtt_sum / path->replies, avg,
+                                   sizeof(avg)),
+                   format_duration(path->rtt_max, max, sizeof(max)),
+                   format_duration(path->jitter, jit, sizeof(jit)));
+        }
+        printf("\n");
+    }
+
+    for (const struct echo_path *path = first_path; path != NULL;
+         path = path->order)
+        if (path->traced)
+            print_trace(path);
+    if (untracked)
+        printf("Echo: %lu requests or paths not tracked, tables full\n",
+               (unsigned long)untracked);
+}
+
+
+/**
+ * @brief Free the echo tables
+ */
+void echo_free(void)
+{
+    for (int i = 0; i < ECHO_BUCKETS; i++) {
+        while (pending_table[i] != NULL) {
+            struct echo_pending *next = pending_table[i]->next;
+            free(pending_table[i]);
+            pending_table[i] = next;
+        }
+        while (path_table[i] != NULL) {
+            struct echo_path *next = path_table[i]->next;
+            free(path_table[i]);
+            path_table[i] = next;
+        }
+    }
+    first_path = NULL;
+    last_path = &first_path;
+    nb_pending = nb_paths = 0;
+    untracked = 0;
+    next_sweep = 0;
+}
@@ -16,6 +16,9 @@
 
 // Local header files
 #include "icmp.h"
+#include "echo.h"
+#include "icmperr.h"
+#include "packet.h"
 
 
 static const char *destination_unreachable_message[] = {
@@ -52,144 +55,170 @@ static const char *extended_echo_reply_message[] = {
 /**
  * @brief Handle an ICMP message
  * 
- * This function handles an ICMP message.
+ * This function handles an ICMP message. The datagram quoted by the error
+ * messages is decoded after the ICMP header.
  * 
  * @param hdr The ICMP header
+ * @param size The size of the message
  * @return int 0 if the message is well handled, -1 otherwise
+ * @see icmp_quote
  */
-static int message_handler(const void *hdr)
+static int message_handler(const void *hdr, int size)
 {
     const struct icmphdr *icmp;
     icmp = (const struct icmphdr *)(hdr);
+    const u_char *quote = (const u_char *)hdr + sizeof(struct icmphdr);
+    int quote_size = size - (int)sizeof(struct icmphdr);
     switch (icmp->type) { // ICMP type
     case ICMP_ECHOREPLY: // ICMP Echo Reply
         if (icmp->code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP ECHO\n");
+        fprintf(current_packet.out, "ICMP Echo Reply\n");
+        echo_reply(be16toh(icmp->un.echo.id), be16toh(icmp->un.echo.sequence));
         break;
     case ICMP_DEST_UNREACH: // ICMP Destination Unreachable
         if (icmp->code > 15) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP Destination Unreachable: %s\n",
-               destination_unreachable_message[icmp->code]);
+        fprintf(current_packet.out, "ICMP Destination Unreachable: %s\n",
+                destination_unreachable_message[icmp->code]);
+        if (icmp->code == ICMP_FRAG_NEEDED) {
+            uint16_t mtu = be16toh(icmp->un.frag.mtu);
+            if (mtu)
+                fprintf(current_packet.out, "\t- Next hop MTU: %u\n", mtu);
+            icmp_quote(quote, quote_size, ICMP_ERR_TOO_BIG, mtu);
+        } else {
+            icmp_quote(quote, quote_size, ICMP_ERR_UNREACH, 0);
+        }
         break;
     case ICMP_SOURCE_QUENCH: // ICMP Source Quench
         if (icmp->code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP Source Quench\n");
+        fprintf(current_packet.out, "ICMP Source Quench\n");
+        icmp_quote(quote, quote_size, ICMP_ERR_OTHER, 0);
         break;
     case ICMP_REDIRECT: // ICMP Redirect
         if (icmp->code > 3) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP Redirect Message: %s\n",
-               redirect_datagram_message[icmp->code]);
+        fprintf(current_packet.out, "ICMP Redirect Message: %s\n",
+                redirect_datagram_message[icmp->code]);
+        icmp_quote(quote, quote_size, ICMP_ERR_OTHER, 0);
         break;
     case ICMP_ECHO: // ICMP Echo Request
         if (icmp->code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP Echo Request\n");
+        fprintf(current_packet.out, "ICMP Echo Request\n");
+        echo_request(be16toh(icmp->un.echo.id),
+                     be16toh(icmp->un.echo.sequence));
         break;
     case ICMP_ROUTER_ADVERT: // ICMP Router Advertisement
         if (icmp->code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP Router Advertisement\n");
+        fprintf(current_packet.out, "ICMP Router Advertisement\n");
         break;
     case ICMP_ROUTER_SOLICIT: // ICMP Router Solicitation
         if (icmp->code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP Router discovery/selection/solicitation\n");
+        fprintf(current_packet.out,
+                "ICMP Router discovery/selection/solicitation\n");
         break;
     case ICMP_TIME_EXCEEDED: // ICMP Time Exceeded
         if (icmp->code > 1) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP Time Exceeded: %s\n", time_exceeded_message[icmp->code]);
+        fprintf(current_packet.out,
+                "ICMP Time Exceeded: %s\n", time_exceeded_message[icmp->code]);
+        icmp_quote(quote, quote_size,
+                   icmp->code == ICMP_EXC_TTL ? ICMP_ERR_TIME_EXCEEDED :
+                                                ICMP_ERR_OTHER, 0);
         break;
     case ICMP_PARAMETERPROB: // ICMP Parameter Problem
         if (icmp->code > 2) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP Bad IP header: %s\n", bad_ip_header_message[icmp->code]);
+        fprintf(current_packet.out,
+                "ICMP Bad IP header: %s\n", bad_ip_header_message[icmp->code]);
+        icmp_quote(quote, quote_size, ICMP_ERR_OTHER, 0);
         break;
     case ICMP_TIMESTAMP: // ICMP Timestamp Request
         if (icmp->code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP Timestamp Request\n");
+        fprintf(current_packet.out, "ICMP Timestamp Request\n");
         break;
     case ICMP_TIMESTAMPREPLY: // ICMP Timestamp Reply
         if (icmp->code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP Timestamp Response\n");
+        fprintf(current_packet.out, "ICMP Timestamp Response\n");
         break;
     case ICMP_INFO_REQUEST: // ICMP Information Request
         if (icmp->code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP Information Request\n");
+        fprintf(current_packet.out, "ICMP Information Request\n");
         break;
     case ICMP_INFO_REPLY: // ICMP Information Reply
         if (icmp->code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP Information Reply\n");
+        fprintf(current_packet.out, "ICMP Information Reply\n");
         break;
     case ICMP_ADDRESS: // ICMP Address Mask Request
         if (icmp->code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP Address mask request\n");
+        fprintf(current_packet.out, "ICMP Address mask request\n");
         break;
     case ICMP_ADDRESSREPLY: // ICMP Address Mask Reply
         if (icmp->code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP Address mask reply\n");
+        fprintf(current_packet.out, "ICMP Address mask reply\n");
         break;
     case ICMP_TRACEROUTE: // ICMP Traceroute
         if (icmp->code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP Information Requestion (Traceroute)\n");
+        fprintf(current_packet.out,
+                "ICMP Information Requestion (Traceroute)\n");
         break;
     case ICMP_EXT_ECHO: // ICMP Extended Echo Request
         if (icmp->code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP Request Extended Echo\n");
+        fprintf(current_packet.out, "ICMP Request Extended Echo\n");
         break;
     case ICMP_EXT_ECHOREPLY: // ICMP Extended Echo Reply
         if (icmp->code > 4) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP Reply Extended Echo: %s\n",
-               extended_echo_reply_message[icmp->code]);
+        fprintf(current_packet.out, "ICMP Reply Extended Echo: %s\n",
+                extended_echo_reply_message[icmp->code]);
         break;
     default:
         fprintf(stderr, "Unknown ICMP type. ICMP TYPE: %x\n", icmp->type);
@@ -206,13 +235,18 @@ static int message_handler(const void *hdr)
  * This function handles an ICMP packet.
  * 
  * @param packet The packet to handle
- * @return int 0 if the packet is well handled
+ * @param size The size of the ICMP message
+ * @return int 0 if the packet is well handled, -1 if truncated
  * @see message_handler
  */
-int cast_icmp(const u_char *packet)
+int cast_icmp(const u_char *packet, int size)
 {
     const struct icmphdr *icmp;
+    if (size < (int)sizeof(struct icmphdr)) {
+        fprintf(stderr, "Truncated ICMP message, %d bytes\n", size);
+        return -1;
+    }
     icmp = (struct icmphdr *)(packet);
-    message_handler(icmp);
+    message_handler(icmp, size);
     return 0;
 }
@@ -0,0 +1,326 @@
+/**
+ * @file icmperr.c
+ * @brief ICMP error quoting definition
+ * @ingroup network
+ *
+ * This file contains the decoder of the datagram quoted by the ICMP and
+ * ICMPv6 error messages: the IP header, its IPv6 extension headers and the
+ * first 8 bytes of the transport header, which hold the ports. The error is
+ * counted in the flow of the quoted datagram, so that the flows hitting an
+ * unreachable host or a too small MTU show up in the final report.
+ *
+ * @see icmperr.h
+ * @see icmp_quote
+ */
+
+// Global libraries
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+// Local header files
+#include "echo.h"
+#include "flow.h"
+#include "format.h"
+#include "icmperr.h"
+#include "packet.h"
+
+#define QUOTE_MAX_EXT 8 /**< IPv6 extension headers skipped at most */
+#define ENDPOINT_STR_LEN (IPV6_STR_LEN + 8) /**< Size of "[address]:port" */
+
+
+/**
+ * @brief Read a 16 bits big endian value
+ *
+ * @param p The value
+ * @return uint16_t The value in host order
+ */
+static uint16_t get16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+
+/**
+ * @brief Name a transport protocol
+ *
+ * @param proto The protocol number
+ * @return const char* The name, NULL if unknown
+ */
+static const char *proto_name(uint8_t proto)
+{
+    switch (proto) {
+    case IPPROTO_TCP:
+        return "TCP";
+    case IPPROTO_UDP:
+        return "UDP";
+    case IPPROTO_ICMP:
+        return "ICMP";
+    case IPPROTO_ICMPV6:
+        return "ICMP6";
+    case IPPROTO_SCTP:
+        return "SCTP";
+    default:
+        return NULL;
+    }
+}
+
+
+/**
+ * @brief Format an endpoint
+ *
+ * IPv6 addresses are bracketed before the port.
+ *
+ * @param family AF_INET or AF_INET6
+ * @param addr The address, in network order
+ * @param port The port, 0 to print the address only
+ * @param buf The destination, at least ENDPOINT_STR_LEN bytes
+ * @return char* The destination
+ */
+static char *format_endpoint(uint8_t family, const uint8_t *addr,
+                             uint16_t port, char *buf)
+{
+    char str[IPV6_STR_LEN];
+    if (family == AF_INET6)
+        format_ipv6(addr, str);
+    else
+        format_ipv4(addr, str);
+
+    if (port == 0)
+        strcpy(buf, str);
+    else if (family == AF_INET6)
+        sprintf(buf, "[%s]:%u", str, port);
+    else
+        sprintf(buf, "%s:%u", str, port);
+    return buf;
+}
+
+
+/**
+ * @brief Count an error in the flow of the quoted datagram
+ *
+ * @param key The key of the quoted datagram
+ * @param kind The kind of error (enum icmp_error)
+ * @param mtu The reported MTU, 0 if unknown
+ */
+static void attribute_error(const struct flow_key *key, int kind, uint32_t mtu)
+{
+    if (kind != ICMP_ERR_UNREACH && kind != ICMP_ERR_TOO_BIG)
+        return;
+
+    struct flow *flow = flow_find(key, NULL); // Don't track unseen flows
+    if (flow == NULL)
+        return;
+
+    if (kind == ICMP_ERR_UNREACH) {
+        flow->unreachables++;
+    } else {
+        flow->too_big++;
+        if (mtu > 0 && mtu <= UINT16_MAX && (flow->pmtu == 0 || mtu < flow->pmtu))
+            flow->pmtu = mtu;
+    }
+    fprintf(current_packet.out,
+            "\t- Errors on this flow: %u unreachable, %u too big",
+            flow->unreachables, flow->too_big);
+    if (flow->pmtu)
+        fprintf(current_packet.out, ", path MTU %u", flow->pmtu);
+    fprintf(current_packet.out, "\n");
+}
+
+
+/**
+ * @brief Skip the IPv6 extension headers of a quote
+ *
+ * @param quote The quoted datagram
+ * @param size The size of the quote
+ * @param proto The next header, updated with the transport protocol
+ * @param first_frag Cleared if the quote is not the first fragment
+ * @return int The offset of the transport header, -1 if truncated
+ */
+static int skip_ipv6_ext(const u_char *quote, int size, uint8_t *proto,
+                         int *first_frag)
+{
+    int off = 40;
+    for (int i = 0; i < QUOTE_MAX_EXT; i++) {
+        switch (*proto) {
+        case IPPROTO_HOPOPTS:
+        case IPPROTO_ROUTING:
+        case IPPROTO_DSTOPTS:
+            if (size < off + 8)
+                return -1;
+            *proto = quote[off];
+            off += (quote[off + 1] + 1) * 8;
+            break;
+        case IPPROTO_FRAGMENT:
+            if (size < off + 8)
+                return -1;
+            if (get16(quote + off + 2) & 0xfff8)
+                *first_frag = 0;
+            *proto = quote[off];
+            off += 8;
+            break;
+        default:
+            return off;
+        }
+    }
+    return -1;
+}
+
+
+/**
+ * @brief Decode the datagram quoted by an ICMP error
+ *
+ * Print the IP header and the first transport bytes of the datagram that
+ * caused the error, and count the error in the flow of the datagram if
+ * the flow was seen. The quote is limited to the captured bytes.
+ *
+ * @param quote The quoted datagram, starting with its IP header
+ * @param size The size of the quote
+ * @param kind The kind of error (enum icmp_error)
+ * @param mtu The MTU reported by a ICMP_ERR_TOO_BIG error, 0 if unknown
+ * @return int 0 on success, -1 if the quote is truncated or unknown
+ */
+int icmp_quote(const u_char *quote, int size, int kind, uint32_t mtu)
+{
+    struct flow_key key;
+    memset(&key, 0, sizeof(key));
+    int off, first_frag = 1;
+    uint8_t proto;
+
+    if (current_packet.end != NULL && size > current_packet.end - quote)
+        size = current_packet.end - quote;
+    if (size < 1) {
+        fprintf(current_packet.out, "\t- No original datagram\n");
+        return -1;
+    }
+    switch (quote[0] >> 4) {
+    case 4:
+        off = (quote[0] & 0x0f) * 4;
+        if (size < 20 || off < 20 || size < off) {
+            fprintf(current_packet.out,
+                    "\t- Original datagram truncated, %d bytes\n", size);
+            return -1;
+        }
+        key.family = AF_INET;
+        memcpy(key.saddr, quote + 12, 4);
+        memcpy(key.daddr, quote + 16, 4);
+        proto = quote[9];
+        first_frag = (get16(quote + 6) & 0x1fff) == 0;
+        break;
+    case 6:
+        if (size < 40) {
+            fprintf(current_packet.out,
+                    "\t- Original datagram truncated, %d bytes\n", size);
+            return -1;
+        }
+        key.family = AF_INET6;
+        memcpy(key.saddr, quote + 8, 16);
+        memcpy(key.daddr, quote + 24, 16);
+        proto = quote[6];
+        off = skip_ipv6_ext(quote, size, &proto, &first_frag);
+        break;
+    default:
+        fprintf(current_packet.out,
+                "\t- Original datagram of unknown version %u\n", quote[0] >> 4);
+        return -1;
+    }
+    key.proto = proto;
+
+    const char *name = proto_name(proto);
+    char src[ENDPOINT_STR_LEN], dst[ENDPOINT_STR_LEN];
+    if (off < 0 || size < off + 8 || !first_frag) { // No transport header
+        fprintf(current_packet.out,
+                "\t- Original: %s %s -> %s%s\n", name ? name : "PROTO",
+                format_endpoint(key.family, key.saddr, 0, src),
+                format_endpoint(key.family, key.daddr, 0, dst),
+                first_frag ? ", transport header truncated" : ", fragment");
+        if (kind == ICMP_ERR_TIME_EXCEEDED)
+            echo_time_exceeded(&key, 0, 0);
+        return 0;
+    }
+
+    const u_char *l4 = quote + off;
+    uint16_t id = 0, seq = 0;
+    switch (proto) {
+    case IPPROTO_TCP:
+    case IPPROTO_UDP:
+    case IPPROTO_SCTP:
+        key.sport = get16(l4);
+        key.dport = get16(l4 + 2);
+        fprintf(current_packet.out, "\t- Original: %s %s -> %s", name,
+                format_endpoint(key.family, key.saddr, key.sport, src),
+                format_endpoint(key.family, key.daddr, key.dport, dst));
+        if (proto == IPPROTO_TCP)
+            fprintf(current_packet.out,
+                    ", seq %u", (unsigned)get16(l4 + 4) << 16 | get16(l4 + 6));
+        else if (proto == IPPROTO_UDP)
+            fprintf(current_packet.out, ", length %u", get16(l4 + 4));
+        fprintf(current_packet.out, "\n");
+        if (proto != IPPROTO_SCTP) // Only TCP and UDP have flows
+            attribute_error(&key, kind, mtu);
+        if (proto == IPPROTO_UDP && kind == ICMP_ERR_UNREACH)
+            echo_unreachable(&key);
+        break;
+    case IPPROTO_ICMP:
+    case IPPROTO_ICMPV6:
+        fprintf(current_packet.out,
+                "\t- Original: %s %s -> %s, type %u code %u, id %u, seq %u\n",
+                name, format_endpoint(key.family, key.saddr, 0, src),
+                format_endpoint(key.family, key.daddr, 0, dst), l4[0], l4[1],
+                get16(l4 + 4), get16(l4 + 6));
+        if (l4[0] == (proto == IPPROTO_ICMP ? 8 : 128)) { // Echo request
+            id = get16(l4 + 4);
+            seq = get16(l4 + 6);
+        }
+        break;
+    default:
+        fprintf(current_packet.out, "\t- Original: PROTO %u %s -> %s\n", proto,
+                format_endpoint(key.family, key.saddr, 0, src),
+                format_endpoint(key.family, key.daddr, 0, dst));
+        break;
+    }
+    if (kind == ICMP_ERR_TIME_EXCEEDED)
+        echo_time_exceeded(&key, id, seq);
+    return 0;
+}
+
+
+/**
+ * @brief Print a flow that received errors
+ *
+ * @param flow The flow
+ * @param arg Number of flows printed so far (int*)
+ */
+static void report_flow(struct flow *flow, void *arg)
+{
+    int *printed = arg;
+    if (flow->unreachables == 0 && flow->too_big == 0)
+        return;
+    if ((*printed)++ == 0)
+        printf("ICMP errors by flow:\n");
+
+    const struct flow_key *key = &flow->key;
+    char src[ENDPOINT_STR_LEN], dst[ENDPOINT_STR_LEN];
+    printf("\t%s %s <-> %s: %u unreachable, %u too big",
+           proto_name(key->proto),
+           format_endpoint(key->family, key->saddr, key->sport, src),
+           format_endpoint(key->family, key->daddr, key->dport, dst),
+           flow->unreachables, flow->too_big);
+    if (flow->pmtu)
+        printf(", path MTU %u", flow->pmtu);
+    printf("\n");
+}
+
+
+/**
+ * @brief Print the ICMP errors per flow
+ *
+ * Print the flows that received destination unreachable or packet too big
+ * errors, with their smallest reported MTU.
+ */
+void icmp_errors_report(void)
+{
+    int printed = 0;
+    flow_table_walk(report_flow, &printed);
+}
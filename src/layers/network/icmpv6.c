@@ -15,7 +15,12 @@
 #include <stdlib.h>
 
 // Local header files
+#include "echo.h"
+#include "icmperr.h"
 #include "icmpv6.h"
+#include "igmp.h"
+#include "ndp.h"
+#include "packet.h"
 
 static const char *destination_unreachable_message_v6[] = {
     "No route to destination",
@@ -39,241 +44,271 @@ static const char *extended_echo_reply_message_v6[] = {
 /**
  * @brief Handle an ICMPv6 message
  * 
- * This function handles an ICMPv6 message.
+ * This function handles an ICMPv6 message. The datagram quoted by the error
+ * messages is decoded after the ICMPv6 header.
  * 
  * @param icmp6 The ICMPv6 header
+ * @param size The size of the message
  * @return int 0 if the message is well handled, -1 otherwise
+ * @see icmp_quote
  */
-static int message_handler(const struct icmp6_hdr *icmp6)
+static int message_handler(const struct icmp6_hdr *icmp6, int size)
 {
+    const u_char *quote = (const u_char *)icmp6 + sizeof(struct icmp6_hdr);
+    int quote_size = size - (int)sizeof(struct icmp6_hdr);
+
     switch (icmp6->icmp6_type) {
     case ICMP6_DST_UNREACH: // ICMPv6 Destination Unreachable
         if (icmp6->icmp6_code > 7) {
             fprintf(stderr, "Bad ICMP6 code\n");
             return (-1);
         }
-        printf("ICMP6 Destination Unreachable: %s\n",
-               destination_unreachable_message_v6[icmp6->icmp6_code]);
+        fprintf(current_packet.out, "ICMP6 Destination Unreachable: %s\n",
+                destination_unreachable_message_v6[icmp6->icmp6_code]);
+        icmp_quote(quote, quote_size, ICMP_ERR_UNREACH, 0);
         break;
     case ICMP6_PACKET_TOO_BIG: // ICMPv6 Packet too big
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP6 code\n");
             return (-1);
         }
-        printf("ICMP6 Packet too big\n");
+        fprintf(current_packet.out,
+                "ICMP6 Packet too big, MTU %u\n", be32toh(icmp6->icmp6_mtu));
+        icmp_quote(quote, quote_size, ICMP_ERR_TOO_BIG,
+                   be32toh(icmp6->icmp6_mtu));
         break;
     case ICMP6_TIME_EXCEEDED: // ICMPv6 Time Exceeded
-        if (icmp6->icmp6_code > 0) {
+        if (icmp6->icmp6_code > 1) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP6 Time Exceeded: %s\n",
-               time_exceeded_message_v6[icmp6->icmp6_code]);
+        fprintf(current_packet.out, "ICMP6 Time Exceeded: %s\n",
+                time_exceeded_message_v6[icmp6->icmp6_code]);
+        icmp_quote(quote, quote_size,
+                   icmp6->icmp6_code == ICMP6_TIME_EXCEED_TRANSIT ?
+                       ICMP_ERR_TIME_EXCEEDED : ICMP_ERR_OTHER, 0);
         break;
     case ICMP6_PARAM_PROB: // ICMPv6 Parameter Problem
-        if (icmp6->icmp6_code > 0) {
+        if (icmp6->icmp6_code > 2) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP6 Bad IP header: %s\n",
-               bad_ip_header_message_v6[icmp6->icmp6_code]);
+        fprintf(current_packet.out, "ICMP6 Bad IP header: %s\n",
+                bad_ip_header_message_v6[icmp6->icmp6_code]);
+        icmp_quote(quote, quote_size, ICMP_ERR_OTHER, 0);
         break;
     case ICMP6_ECHO_REQUEST: // ICMPv6 Echo Request
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP6 Echo Request");
+        fprintf(current_packet.out, "ICMP6 Echo Request\n");
+        echo_request(be16toh(icmp6->icmp6_id), be16toh(icmp6->icmp6_seq));
         break;
     case ICMP6_ECHO_REPLY: // ICMPv6 Echo Reply
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP6 Echo Reply\n");
+        fprintf(current_packet.out, "ICMP6 Echo Reply\n");
+        echo_reply(be16toh(icmp6->icmp6_id), be16toh(icmp6->icmp6_seq));
         break;
     case MLD_LISTENER_QUERY: // MLD Multicast Listener Query
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("MLD Multicast Listener Query\n");
+        fprintf(current_packet.out, "MLD Multicast Listener Query\n");
+        cast_mld(icmp6, size);
         break;
     case MLD_LISTENER_REPORT: // MLD Multicast Listener Report
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("MLD Multicast Listener Report\n");
+        fprintf(current_packet.out, "MLD Multicast Listener Report\n");
+        cast_mld(icmp6, size);
         break;
     case MLD_LISTENER_REDUCTION: // MLD Multicast Listener Reduction
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("MLD Multicast Listener Done\n");
+        fprintf(current_packet.out, "MLD Multicast Listener Done\n");
+        cast_mld(icmp6, size);
         break;
     case ND_ROUTER_SOLICIT: // NDP Router Solicitation
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("NDP Router Solicitation\n");
+        fprintf(current_packet.out, "NDP Router Solicitation\n");
+        cast_ndp(icmp6, size);
         break;
     case ND_ROUTER_ADVERT: // NDP Router Advertisement
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("NDP Router Advertisement\n");
+        fprintf(current_packet.out, "NDP Router Advertisement\n");
+        cast_ndp(icmp6, size);
         break;
     case ND_NEIGHBOR_SOLICIT: // NDP Neighbor Solicitation
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("NDP Neighbor Solicitation\n");
+        fprintf(current_packet.out, "NDP Neighbor Solicitation\n");
+        cast_ndp(icmp6, size);
         break;
     case ND_NEIGHBOR_ADVERT: // NDP Neighbor Advertisement
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("NDP Neighbor Advertisement\n");
+        fprintf(current_packet.out, "NDP Neighbor Advertisement\n");
+        cast_ndp(icmp6, size);
         break;
     case ND_REDIRECT: // NDP Redirect Message
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("NDP Redirect Message\n");
+        fprintf(current_packet.out, "NDP Redirect Message\n");
+        cast_ndp(icmp6, size);
         break;
     case ICMP6_ROUTER_RENUMBERING: // ICMPv6 Router Renumbering
         if (icmp6->icmp6_code > 1 && icmp6->icmp6_code < 255) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP6 Router Renumbering\n");
+        fprintf(current_packet.out, "ICMP6 Router Renumbering\n");
         break;
     case ICMP6_NODE_INFORMATION_QUERY: // ICMPv6 Node Information Query
         if (icmp6->icmp6_code > 2) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP6 Node Information Query\n");
+        fprintf(current_packet.out, "ICMP6 Node Information Query\n");
         break;
     case ICMP6_NODE_INFORMATION_RESPONSE: // ICMPv6 Node Information Response
         if (icmp6->icmp6_code > 2) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP6 Node Information Response\n");
+        fprintf(current_packet.out, "ICMP6 Node Information Response\n");
         break;
     case ICMP6_INVERSE_NEIGHBOR_DISCOVERY_SOLICITATION_MESSAGE: // ICMPv6 Inverse Neighbor Discovery Solicitation
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP6 Inverse Neighbor Discovery Solicitation message\n");
+        fprintf(current_packet.out,
+                "ICMP6 Inverse Neighbor Discovery Solicitation message\n");
         break;
     case ICMP6_INVERSE_NEIGHBOR_DISCOVERY_ADVERTISEMENT_MESSAGE: // ICMPv6 Inverse Neighbor Discovery Advertisement
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP6 Inverse Neighbor Discovery Advertisement messsage\n");
+        fprintf(current_packet.out,
+                "ICMP6 Inverse Neighbor Discovery Advertisement messsage\n");
         break;
     case ICMP6_MULTICAST_LISTENER_DISCOVERY_REPORTS: // ICMPv6 Multicast Listener Discovery Reports
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP6 Multicast Listener Discovery Reports\n");
+        fprintf(current_packet.out,
+                "ICMP6 Multicast Listener Discovery Reports\n");
+        cast_mld(icmp6, size);
         break;
     case ICMP6_HOME_AGENT_ADDRESS_DISCOVERY_REQUEST: // ICMPv6 Home Agent Address Discovery Request
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP6 Home Agent Address Discovery Request\n");
+        fprintf(current_packet.out,
+                "ICMP6 Home Agent Address Discovery Request\n");
         break;
     case ICMP6_HOME_AGENT_ADDRESS_DISCOVERY_REPLY: // ICMPv6 Home Agent Address Discovery Reply
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP6 Home Agent Address Discovery Reply\n");
+        fprintf(current_packet.out,
+                "ICMP6 Home Agent Address Discovery Reply\n");
         break;
     case ICMP6_MOBILE_PREFIX_SOLICITATION: // ICMPv6 Mobile Prefix Solicitation
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP6 Mobile Prefix Solicitation\n");
+        fprintf(current_packet.out, "ICMP6 Mobile Prefix Solicitation\n");
         break;
     case ICMP6_MOBILE_PREFIX_ADVERTISEMENT: // ICMPv6 Mobile Prefix Advertisement
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP6 Mobile Prefix Advertisement\n");
+        fprintf(current_packet.out, "ICMP6 Mobile Prefix Advertisement\n");
         break;
     case ICMP6_CERTIFICATION_PATH_SOLICITATION: // ICMPv6 Certification Path Solicitation
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP6 Certififcation Path Solicitation\n");
+        fprintf(current_packet.out, "ICMP6 Certififcation Path Solicitation\n");
         break;
     case ICMP6_CERTIFICATION_PATH_ADVERTISEMENT: // ICMPv6 Certification Path Advertisement
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP6 Certification Path Advertisement\n");
+        fprintf(current_packet.out, "ICMP6 Certification Path Advertisement\n");
         break;
     case ICMP6_MULTICAST_ROUTER_SOLICITATION: // ICMPv6 Multicast Router Solicitation
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP6 Multicast Router Solicitation\n");
+        fprintf(current_packet.out, "ICMP6 Multicast Router Solicitation\n");
         break;
     case ICMP6_MULTICAST_ROUTER_ADVERTISEMENT: // ICMPv6 Multicast Router Advertisement
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP6 Multicast Router Advertisement\n");
+        fprintf(current_packet.out, "ICMP6 Multicast Router Advertisement\n");
         break;
     case ICMP6_MULTICAST_ROUTER_TERMINATION: // ICMPv6 Multicast Router Termination
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP6 Multicast Router Termination\n");
+        fprintf(current_packet.out, "ICMP6 Multicast Router Termination\n");
         break;
     case ICMP6_RPL_CONTROL_MESSAGE: // ICMPv6 RPL Control Message
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP6 RPL Control Message\n");
+        fprintf(current_packet.out, "ICMP6 RPL Control Message\n");
         break;
     case ICMPV6_EXT_ECHO_REQUEST: // ICMPv6 Extended Echo Request
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP6 Extended Echo Request\n");
+        fprintf(current_packet.out, "ICMP6 Extended Echo Request\n");
         break;
     case ICMPV6_EXT_ECHO_REPLY: // ICMPv6 Extended Echo Reply
         if (icmp6->icmp6_code > 0) {
             fprintf(stderr, "Bad ICMP code\n");
             return (-1);
         }
-        printf("ICMP6 Extended Echo Reply: %s\n",
-               extended_echo_reply_message_v6[icmp6->icmp6_code]);
+        fprintf(current_packet.out, "ICMP6 Extended Echo Reply: %s\n",
+                extended_echo_reply_message_v6[icmp6->icmp6_code]);
         break;
     default:
         fprintf(stderr, "Unknown ICMP type. ICMP TYPE: 0x%x\n",
@@ -290,13 +325,18 @@ static int message_handler(const struct icmp6_hdr *icmp6)
  * This function handles an ICMPv6 packet.
  * 
  * @param packet The packet to handle
- * @return int 0 if the packet is well handled
+ * @param size The size of the ICMPv6 message
+ * @return int 0 if the packet is well handled, -1 if truncated
  * @see message_handler
  */
-int cast_icmp6(const u_char *packet)
+int cast_icmp6(const u_char *packet, int size)
 {
     const struct icmp6_hdr *icmp6;
+    if (size < (int)sizeof(struct icmp6_hdr)) {
+        fprintf(stderr, "Truncated ICMP6 message, %d bytes\n", size);
+        return -1;
+    }
     icmp6 = (struct icmp6_hdr *)(packet);
-    message_handler(icmp6);
+    message_handler(icmp6, size);
     return 0;
 }
@@ -0,0 +1,278 @@
+/**
+ * @file igmp.c
+ * @brief IGMP and MLD definition
+ * @ingroup network
+ *
+ * This file contains the definition of the IGMP and MLD decoders. The
+ * version of a query is told by its size, as routers do. The membership
+ * records are walked within the bounds of the message.
+ *
+ * @see igmp.h
+ * @see cast_igmp
+ * @see cast_mld
+ */
+
+// Global libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+// Local header files
+#include "format.h"
+#include "igmp.h"
+#include "mcast.h"
+#include "packet.h"
+#include "stats.h"
+
+#define ADDR_FAMILY(addr_len) ((addr_len) == 16 ? AF_INET6 : AF_INET) /**< Family of an IGMP or MLD address */
+
+static const char *record_types[] = {
+    "Mode is include", "Mode is exclude", "Change to include",
+    "Change to exclude", "Allow new sources", "Block old sources"}; /**< IGMPv3 and MLDv2 record types */
+
+
+/**
+ * @brief Read a 16 bits integer
+ *
+ * @param p The bytes, in network order
+ * @return uint16_t The integer
+ */
+static uint16_t get16(const u_char *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+
+/**
+ * @brief Decode a maximum response code
+ *
+ * Codes from 128 are a floating point value: 3 bits of exponent and 4 (IGMP)
+ * or 12 (MLD) bits of mantissa.
+ *
+ * @param code The code
+ * @param mant_bits 4 for IGMPv3, 12 for MLDv2
+ * @return uint32_t The value of the code
+ */
+static uint32_t max_resp(uint32_t code, int mant_bits)
+{
+    uint32_t limit = 1u << (mant_bits + 3);
+    if (code < limit)
+        return code;
+    uint32_t exp = (code >> mant_bits) & 0x7;
+    uint32_t mant = code & ((1u << mant_bits) - 1);
+    return (mant | (1u << mant_bits)) << (exp + 3);
+}
+
+
+/**
+ * @brief Print the sources of a query or a record
+ *
+ * @param sources The first source
+ * @param nb_sources The number of sources
+ * @param addr_len The size of an address
+ */
+static void print_sources(const u_char *sources, int nb_sources, int addr_len)
+{
+    char addr[IPV6_STR_LEN];
+    fprintf(current_packet.out, "\t\t- Sources:");
+    for (int i = 0; i < nb_sources; i++)
+        fprintf(current_packet.out, "%s %s", i ? "," : "",
+                format_addr(ADDR_FAMILY(addr_len), sources + i * addr_len,
+                            addr));
+    fprintf(current_packet.out, "\n");
+}
+
+
+/**
+ * @brief Decode the membership records of a report
+ *
+ * @param records The first record
+ * @param size The size of the records
+ * @param nb_records The number of records announced by the report
+ * @param addr_len 4 for IGMPv3, 16 for MLDv2
+ * @return int 0 on success, -1 if a record is truncated
+ */
+static int parse_records(const u_char *records, int size, int nb_records,
+                         int addr_len)
+{
+    char addr[IPV6_STR_LEN];
+    int off = 0;
+    for (int i = 0; i < nb_records; i++) {
+        if (size - off < 4 + addr_len) {
+            fprintf(stderr, "Truncated membership record\n");
+            return -1;
+        }
+        const u_char *record = records + off;
+        int nb_sources = get16(record + 2);
+        int len = 4 + addr_len * (1 + nb_sources) + record[1] * 4;
+        if (len > size - off) {
+            fprintf(stderr, "Truncated membership record\n");
+            return -1;
+        }
+
+        if (record[0] >= MCAST_IS_INCLUDE && record[0] <= MCAST_BLOCK)
+            fprintf(current_packet.out,
+                    "\t- %s %s, %d sources\n", record_types[record[0] - 1],
+                    format_addr(ADDR_FAMILY(addr_len), record + 4, addr),
+                    nb_sources);
+        else
+            fprintf(current_packet.out, "\t- Record %u, group %s\n", record[0],
+                    format_addr(ADDR_FAMILY(addr_len), record + 4, addr));
+        if (nb_sources)
+            print_sources(record + 4 + addr_len, nb_sources, addr_len);
+        if (record[0] >= MCAST_IS_INCLUDE && record[0] <= MCAST_BLOCK)
+            mcast_record(record + 4, record[0], nb_sources);
+        off += len;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Decode a query
+ *
+ * @param group The group, unspecified for a general query
+ * @param addr_len 4 for IGMP, 16 for MLD
+ * @param resp The maximum response time (ms)
+ * @param sources The sources of a version 3 query, NULL otherwise
+ * @param nb_sources The number of sources
+ */
+static void print_query(const u_char *group, int addr_len, uint32_t resp,
+                        const u_char *sources, int nb_sources)
+{
+    static const uint8_t zero[16];
+    char addr[IPV6_STR_LEN], dur[32];
+    if (memcmp(group, zero, addr_len) == 0)
+        fprintf(current_packet.out, "\t- General query");
+    else
+        fprintf(current_packet.out, "\t- Group %s",
+                format_addr(ADDR_FAMILY(addr_len), group, addr));
+    fprintf(current_packet.out, ", max response %s\n",
+            format_duration((uint64_t)resp * 1000000, dur, sizeof(dur)));
+    if (sources && nb_sources)
+        print_sources(sources, nb_sources, addr_len);
+    mcast_query();
+}
+
+
+/**
+ * @brief Handle an IGMP packet
+ *
+ * Print the message and its membership records, and account them in the
+ * multicast group membership table.
+ *
+ * @param packet The packet to handle
+ * @param size The size of the IGMP message
+ * @return int 0 if the packet is well handled, -1 if truncated
+ */
+int cast_igmp(const u_char *packet, int size)
+{
+    char addr[IPV4_STR_LEN];
+    if (size < IGMP_MINLEN) {
+        fprintf(stderr, "Truncated IGMP message, %d bytes\n", size);
+        return -1;
+    }
+    const struct igmp *igmp = (const struct igmp *)packet;
+    const u_char *group = (const u_char *)&igmp->igmp_group;
+
+    switch (igmp->igmp_type) {
+    case IGMP_MEMBERSHIP_QUERY:
+        if (size >= IGMP_V3_QUERY_MINLEN) {
+            int nb_sources = get16(packet + 10);
+            if (size < IGMP_V3_QUERY_MINLEN + nb_sources * 4) {
+                fprintf(stderr, "Truncated IGMP query, %d bytes\n", size);
+                return -1;
+            }
+            fprintf(current_packet.out, "IGMPv3 Membership Query\n");
+            print_query(group, 4, max_resp(igmp->igmp_code, 4) * 100,
+                        packet + IGMP_V3_QUERY_MINLEN, nb_sources);
+        } else {
+            fprintf(current_packet.out,
+                    "IGMPv%d Membership Query\n", igmp->igmp_code ? 2 : 1);
+            print_query(group, 4, igmp->igmp_code ? igmp->igmp_code * 100 :
+                                                    10000, NULL, 0);
+        }
+        break;
+    case IGMP_V1_MEMBERSHIP_REPORT:
+    case IGMP_V2_MEMBERSHIP_REPORT:
+        fprintf(current_packet.out, "IGMPv%d Membership Report\n",
+                igmp->igmp_type == IGMP_V1_MEMBERSHIP_REPORT ? 1 : 2);
+        fprintf(current_packet.out, "\t- Group %s\n", format_ipv4(group, addr));
+        mcast_record(group, MCAST_JOIN, 0);
+        break;
+    case IGMP_V2_LEAVE_GROUP:
+        fprintf(current_packet.out, "IGMPv2 Leave Group\n");
+        fprintf(current_packet.out, "\t- Group %s\n", format_ipv4(group, addr));
+        mcast_record(group, MCAST_LEAVE, 0);
+        break;
+    case IGMP_V3_MEMBERSHIP_REPORT:
+        fprintf(current_packet.out,
+                "IGMPv3 Membership Report, %d records\n", get16(packet + 6));
+        parse_records(packet + 8, size - 8, get16(packet + 6), 4);
+        break;
+    default:
+        fprintf(current_packet.out, "IGMP type 0x%x\n", igmp->igmp_type);
+        break;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Decode an MLD message
+ *
+ * Print the group or the membership records of a query, report or done
+ * message, and account them in the multicast group membership table.
+ *
+ * @param icmp6 The ICMPv6 header of the message
+ * @param size The size of the message
+ * @return int 0 if the message is well decoded, -1 if truncated
+ */
+int cast_mld(const struct icmp6_hdr *icmp6, int size)
+{
+    const u_char *msg = (const u_char *)icmp6;
+    char addr[IPV6_STR_LEN];
+
+    if (icmp6->icmp6_type == MLD_V2_LISTENER_REPORT) {
+        if (size < 8) {
+            fprintf(stderr, "Truncated MLD report, %d bytes\n", size);
+            return -1;
+        }
+        fprintf(current_packet.out, "\t- MLDv2, %d records\n", get16(msg + 6));
+        return parse_records(msg + 8, size - 8, get16(msg + 6), 16);
+    }
+    if (size < MLD_MINLEN) {
+        fprintf(stderr, "Truncated MLD message, %d bytes\n", size);
+        return -1;
+    }
+
+    const u_char *group = msg + 8;
+    switch (icmp6->icmp6_type) {
+    case MLD_LISTENER_QUERY:
+        if (size >= MLD_V2_QUERY_MINLEN) {
+            int nb_sources = get16(msg + 26);
+            if (size < MLD_V2_QUERY_MINLEN + nb_sources * 16) {
+                fprintf(stderr, "Truncated MLD query, %d bytes\n", size);
+                return -1;
+            }
+            fprintf(current_packet.out, "\t- MLDv2\n");
+            print_query(group, 16, max_resp(get16(msg + 4), 12), msg + 28,
+                        nb_sources);
+        } else {
+            print_query(group, 16, get16(msg + 4), NULL, 0);
+        }
+        break;
+    case MLD_LISTENER_REPORT:
+        fprintf(current_packet.out, "\t- Group %s\n", format_ipv6(group, addr));
+        mcast_record(group, MCAST_JOIN, 0);
+        break;
+    case MLD_LISTENER_REDUCTION:
+        fprintf(current_packet.out, "\t- Group %s\n", format_ipv6(group, addr));
+        mcast_record(group, MCAST_LEAVE, 0);
+        break;
+    default:
+        return -1;
+    }
+    return 0;
+}
@@ -13,38 +13,20 @@
 // Global libraries
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 // Local header files
+#include "format.h"
 #include "icmp.h"
+#include "igmp.h"
 #include "ipv4.h"
 #include "ipv6.h"
+#include "mcast.h"
+#include "packet.h"
 #include "tcp.h"
 #include "udp.h"
 
 
-/**
- * @brief Format an IPv4 address
- * 
- * This function formats an IPv4 address in the format A.B.C.D.
- * 
- * @param ip_addr The IPv4 address to format
- * @return char* The formatted IPv4 address
- * 
- * @note The returned string must be freed by the caller
- */
-#define STR_IPv4_ADDR_LEN 16
-static char *format_ipv4(uint32_t ip_addr)
-{
-    char *res = malloc(STR_IPv4_ADDR_LEN * sizeof(char));
-    if (res == NULL) {
-        return NULL;
-    }
-    sprintf(res, "%u.%u.%u.%u", (ip_addr >> 24) & 0xFF, (ip_addr >> 16) & 0xFF,
-            (ip_addr >> 8) & 0xFF, (ip_addr) & 0xFF);
-
-    return res;
-}
-
 /**
  * @brief Handle an IPv4 packet
  * 
@@ -56,27 +38,48 @@ static char *format_ipv4(uint32_t ip_addr)
  * @see cast_tcp
  * @see cast_udp
  * @see cast_icmp
+ * @see cast_igmp
  * @see cast_ipv6
  */
 int ip_handler(const u_char *packet, const struct iphdr *ip)
 {
     /* Print IPv4 source and destination */
-    char *ipv4_src, *ipv4_dst;
-    ipv4_src = format_ipv4(ntohl(ip->saddr));
-    ipv4_dst = format_ipv4(ntohl(ip->daddr));
-    printf("IP: %s -> %s\n", ipv4_src, ipv4_dst);
-    free(ipv4_src);
-    free(ipv4_dst);
+    char ipv4_src[IPV4_STR_LEN], ipv4_dst[IPV4_STR_LEN];
+    fprintf(current_packet.out,
+            "IP: %s -> %s\n", format_ipv4((uint8_t *)&ip->saddr, ipv4_src),
+            format_ipv4((uint8_t *)&ip->daddr, ipv4_dst));
+
+    /* Addresses of the flow, the transport layer adds the ports */
+    memset(&current_packet.key, 0, sizeof(current_packet.key));
+    current_packet.key.family = AF_INET;
+    memcpy(current_packet.key.saddr, &ip->saddr, sizeof(ip->saddr));
+    memcpy(current_packet.key.daddr, &ip->daddr, sizeof(ip->daddr));
+    current_packet.key.proto = ip->protocol;
+    current_packet.ttl = ip->ttl;
+    current_packet.ip_len = be16toh(ip->tot_len);
+    if (IN_MULTICAST(be32toh(ip->daddr)) && ip->protocol != IPPROTO_IGMP)
+        mcast_data(be16toh(ip->tot_len) - ip->ihl * 4);
+
+    /* The upper layers only get the captured bytes of the payload */
+    const u_char *payload = packet + ip->ihl * 4;
+    int size = be16toh(ip->tot_len) - ip->ihl * 4;
+    if (size > current_packet.end - payload)
+        size = current_packet.end - payload;
+    if (size < 0)
+        size = 0;
 
     switch (ip->protocol) {
     case IPPROTO_TCP:
-        cast_tcp(packet + ip->ihl * 4, be16toh(ip->tot_len) - ip->ihl * 4);
+        cast_tcp(payload, size);
         break;
     case IPPROTO_UDP:
-        cast_udp(packet + ip->ihl * 4);
+        cast_udp(payload, size);
         break;
     case IPPROTO_ICMP:
-        cast_icmp(packet + ip->ihl * 4);
+        cast_icmp(payload, size);
+        break;
+    case IPPROTO_IGMP:
+        cast_igmp(payload, size);
         break;
     case IPPROTO_IPV6:
         cast_ipv6(packet + ip->ihl * 4);
@@ -103,6 +106,10 @@ int ip_handler(const u_char *packet, const struct iphdr *ip)
 int cast_ipv4(const u_char *packet)
 {
     const struct iphdr *ip;
+    if (current_packet.end - packet < (long)sizeof(struct iphdr)) {
+        fprintf(stderr, "Truncated IPv4 header\n");
+        return (-1);
+    }
     ip = (struct iphdr *)(packet);
     ip_handler(packet, ip);
     return 0;
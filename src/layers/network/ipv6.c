@@ -13,39 +13,18 @@
 // Global libraries
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 // Local header files
+#include "format.h"
 #include "ipv6.h"
+#include "mcast.h"
+#include "packet.h"
 #include "tcp.h"
 #include "udp.h"
 #include "icmpv6.h"
 
 
-/**
- * @brief Format an IPv6 address
- * 
- * This function format an IPv6 address in the format XXXX:XXXX:XXXX:XXXX:XXXX:XXXX.
- * 
- * @param ip6 The IPv6 header
- * @return char* The formatted IPv6 address
- * 
- * @note The returned string must be freed by the caller
- */
-#define STR_IPv6_ADDR_LEN 5*8
-static char *format_ipv6(const struct in6_addr ip6) {
-    char *res = malloc(STR_IPv6_ADDR_LEN * sizeof(char));
-    if (res == NULL)
-        return NULL;
-    
-    if (inet_ntop(AF_INET6, &ip6, res, STR_IPv6_ADDR_LEN) == NULL) {
-        free(res);
-        return NULL;
-    }
-
-    return res;
-}
-
-
 /**
  * @brief Handle an IPv6 packet
  * 
@@ -59,25 +38,59 @@ static char *format_ipv6(const struct in6_addr ip6) {
  * @see cast_icmp6
  */
 int ip6_handler (const u_char* packet, const struct ip6_hdr* ip6) {
-    char *ipv6_src, *ipv6_dst;
-    ipv6_src = format_ipv6(ip6->ip6_src);
-    ipv6_dst = format_ipv6(ip6->ip6_dst);
-    printf("IPv6: %s -> %s\n", ipv6_src, ipv6_dst);
-    free(ipv6_src);
-    free(ipv6_dst);
+    char ipv6_src[IPV6_STR_LEN], ipv6_dst[IPV6_STR_LEN];
+    fprintf(current_packet.out, "IPv6: %s -> %s\n",
+            format_ipv6((uint8_t *)&ip6->ip6_src, ipv6_src),
+            format_ipv6((uint8_t *)&ip6->ip6_dst, ipv6_dst));
+
+    /* Addresses of the flow, the transport layer adds the ports */
+    memset(&current_packet.key, 0, sizeof(current_packet.key));
+    current_packet.key.family = AF_INET6;
+    memcpy(current_packet.key.saddr, &ip6->ip6_src, sizeof(ip6->ip6_src));
+    memcpy(current_packet.key.daddr, &ip6->ip6_dst, sizeof(ip6->ip6_dst));
+    current_packet.ttl = ip6->ip6_ctlun.ip6_un1.ip6_un1_hlim;
+    current_packet.ip_len = sizeof(struct ip6_hdr) +
+                            be16toh(ip6->ip6_ctlun.ip6_un1.ip6_un1_plen);
+
+    /* Hop-by-hop options come with MLD, skip the options headers */
+    uint8_t next = ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt;
+    const u_char *payload = packet + sizeof(struct ip6_hdr);
+    int plen = be16toh(ip6->ip6_ctlun.ip6_un1.ip6_un1_plen);
+    while (next == IPPROTO_HOPOPTS || next == IPPROTO_DSTOPTS ||
+           next == IPPROTO_ROUTING) {
+        if (plen < 8 || current_packet.end - payload < 8 ||
+            plen < (payload[1] + 1) * 8) {
+            fprintf(stderr, "Truncated IPv6 extension header\n");
+            return (-1);
+        }
+        int len = (payload[1] + 1) * 8;
+        next = payload[0];
+        payload += len;
+        plen -= len;
+    }
+    current_packet.key.proto = next;
+    if (ip6->ip6_dst.s6_addr[0] == 0xff && next != IPPROTO_ICMPV6)
+        mcast_data(plen);
 
-    switch (ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt) {
+    /* The upper layers only get the captured bytes of the payload */
+    int size = plen;
+    if (size > current_packet.end - payload)
+        size = current_packet.end - payload;
+    if (size < 0)
+        size = 0;
+
+    switch (next) {
         case IPPROTO_TCP:
-            cast_tcp(packet + sizeof(struct ip6_hdr), ip6->ip6_ctlun.ip6_un1.ip6_un1_plen - sizeof(struct ip6_hdr));
+            cast_tcp(payload, size);
             break;
         case IPPROTO_UDP:
-            cast_udp(packet + sizeof(struct ip6_hdr));
+            cast_udp(payload, size);
             break;
         case IPPROTO_ICMPV6:
-            cast_icmp6(packet + sizeof(struct ip6_hdr));
+            cast_icmp6(payload, size);
             break;
         default:
-            fprintf(stderr, "Unknown protocol on network layer. IP PROTOCOL: 0X%x\n", ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt);
+            fprintf(stderr, "Unknown protocol on network layer. IP PROTOCOL: 0X%x\n", next);
             return (-1);
     }
     return 0;
@@ -96,6 +109,10 @@ int ip6_handler (const u_char* packet, const struct ip6_hdr* ip6) {
  */
 int cast_ipv6(const u_char* packet) {
     const struct ip6_hdr* ip;
+    if (current_packet.end - packet < (long)sizeof(struct ip6_hdr)) {
+        fprintf(stderr, "Truncated IPv6 header\n");
+        return (-1);
+    }
     ip = (struct ip6_hdr*)(packet);
     ip6_handler(packet, ip);
     return 0;
@@ -0,0 +1,512 @@
+/**
+ * @file mcast.c
+ * @brief Multicast group membership definition
+ * @ingroup network
+ *
+ * This file contains the definition of the multicast group membership table.
+ * A group is identified by its VLAN, family and address, and holds the list
+ * of its listeners. The listeners not heard from for the membership interval
+ * are dropped lazily, when their group is next used.
+ *
+ * The join latency is the time between the join of the first listener of a
+ * group that wasn't flowing and its first data packet. The leave latency is
+ * the time between the leave of the last listener and the last data packet
+ * that followed it: it is known once the group is joined again or at the end
+ * of the capture.
+ *
+ * @see mcast.h
+ * @see mcast_record
+ */
+
+// Global libraries
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+// Local header files
+#include "format.h"
+#include "hash.h"
+#include "mcast.h"
+#include "packet.h"
+#include "stats.h"
+#include "timestamp.h"
+
+/**
+ * @brief Listener of a group
+ */
+struct mcast_listener {
+    uint8_t addr[16];   /**< Address of the listener */
+    uint8_t exclude;    /**< 1 in exclude mode, 0 in include mode */
+    uint16_t sources;   /**< Sources included or excluded */
+    uint64_t joined;    /**< Join (ns) */
+    uint64_t last;      /**< Last report (ns) */
+    struct mcast_listener *next; /**< Next listener of the group */
+};
+
+/**
+ * @brief Group of a VLAN
+ */
+struct mcast_group {
+    uint16_t vlan;
+    uint8_t family;
+    uint8_t addr[16];   /**< Address of the group */
+    uint32_t nb_listeners;
+    uint32_t joins;     /**< Listeners that joined */
+    uint32_t leaves;    /**< Listeners that left */
+    uint32_t timeouts;  /**< Listeners dropped for silence */
+    uint32_t unpruned;  /**< Last leaves after which the data never stopped */
+    uint64_t join_ts;   /**< First join, waiting for the first data (ns), 0 if none */
+    uint64_t leave_ts;  /**< Last leave, waiting for the data to stop (ns), 0 if none */
+    uint64_t last_data; /**< Last data packet (ns) */
+    uint64_t packets;   /**< Data packets */
+    uint64_t bytes;     /**< Data bytes, IP payload */
+    struct mcast_listener *listeners;
+    struct mcast_group *next;  /**< Next group in the same bucket */
+    struct mcast_group *order; /**< Next group in the order of creation */
+};
+
+/**
+ * @brief Querier of a VLAN
+ */
+struct mcast_querier {
+    uint16_t vlan;
+    uint8_t family;
+    uint8_t addr[16];
+    uint32_t queries;
+};
+
+static struct mcast_group *group_table[MCAST_BUCKETS]; /**< Groups */
+static struct mcast_group *first_group = NULL; /**< First group created */
+static struct mcast_group **last_group = &first_group; /**< End of the creation list */
+static struct mcast_querier queriers[MCAST_MAX_QUERIERS]; /**< Queriers, by first query */
+static int nb_queriers; /**< Queriers tracked */
+static uint64_t snapshot_ts; /**< Time of the listener snapshot (ns), 0 if none */
+static uint64_t last_ts; /**< Capture time of the last packet (ns) */
+
+/**
+ * @brief Counters of the report
+ */
+static struct {
+    uint64_t records;   /**< Membership records */
+    uint64_t queries;   /**< Membership queries */
+    uint32_t groups;    /**< Groups created */
+} mcast_counters;
+
+
+/**
+ * @brief Check for a group that is never routed
+ *
+ * @param family AF_INET or AF_INET6
+ * @param addr The group
+ * @return int 1 for 224.0.0.0/24 and the interface or link-local scopes of
+ * IPv6, 0 otherwise
+ */
+static int is_link_local(uint8_t family, const uint8_t *addr)
+{
+    if (family == AF_INET6)
+        return (addr[1] & 0x0f) <= 2;
+    return addr[0] == 224 && addr[1] == 0 && addr[2] == 0;
+}
+
+
+/**
+ * @brief Find a group
+ *
+ * @param vlan The VLAN
+ * @param family The address family
+ * @param addr The group, 16 bytes padded with zeros
+ * @param create 1 to create the group if needed
+ * @return struct mcast_group* The group, NULL if not found or on allocation
+ * failure
+ */
+static struct mcast_group *group_get(uint16_t vlan, uint8_t family,
+                                     const uint8_t *addr, int create)
+{
+    uint32_t h = fnv1a32(fnv1a32(FNV32_OFFSET, &vlan, 2), &family, 1);
+    uint32_t bucket = fnv1a32(h, addr, 16) & (MCAST_BUCKETS - 1);
+    for (struct mcast_group *g = group_table[bucket]; g != NULL; g = g->next)
+        if (g->vlan == vlan && g->family == family &&
+            memcmp(g->addr, addr, 16) == 0)
+            return g;
+    if (!create)
+        return NULL;
+
+    struct mcast_group *g = calloc(1, sizeof(struct mcast_group));
+    if (g == NULL)
+        return NULL;
+    g->vlan = vlan;
+    g->family = family;
+    memcpy(g->addr, addr, 16);
+    g->next = group_table[bucket];
+    group_table[bucket] = g;
+    *last_group = g;
+    last_group = &g->order;
+    mcast_counters.groups++;
+    return g;
+}
+
+
+/**
+ * @brief Measure the leave latency of a group
+ *
+ * @param g The group
+ */
+static void finish_leave(struct mcast_group *g)
+{
+    if (g->leave_ts == 0)
+        return;
+    if (g->packets && g->last_data > g->leave_ts) {
+        if (g->last_data - g->leave_ts > MCAST_PRUNE_TIMEOUT)
+            g->unpruned++;
+        else
+            latency_add(latency_stats_get("Multicast leave latency"),
+                        g->last_data - g->leave_ts);
+    }
+    g->leave_ts = 0;
+}
+
+
+/**
+ * @brief Remove a listener
+ *
+ * @param g The group
+ * @param link The link pointing to the listener
+ * @param ts The time of the leave (ns)
+ */
+static void listener_remove(struct mcast_group *g,
+                            struct mcast_listener **link, uint64_t ts)
+{
+    struct mcast_listener *l = *link;
+    *link = l->next;
+    free(l);
+    if (--g->nb_listeners == 0) {
+        g->leave_ts = ts;
+        g->join_ts = 0;
+    }
+}
+
+
+/**
+ * @brief Drop the silent listeners of a group
+ *
+ * @param g The group
+ * @param ts The current time (ns)
+ */
+static void expire_listeners(struct mcast_group *g, uint64_t ts)
+{
+    struct mcast_listener **link = &g->listeners;
+    while (*link != NULL) {
+        if ((*link)->last + MCAST_MEMBERSHIP_INTERVAL <= ts) {
+            g->timeouts++;
+            listener_remove(g, link, (*link)->last + MCAST_MEMBERSHIP_INTERVAL);
+        } else {
+            link = &(*link)->next;
+        }
+    }
+}
+
+
+/**
+ * @brief Account a membership record
+ *
+ * The listener, family, VLAN and time are taken from current_packet. The
+ * link-local groups are ignored. The sources are only counted: a record that
+ * blocks sources of an include mode listener leaves once none is left.
+ *
+ * @param group The group, in network order
+ * @param type The record type (enum mcast_record)
+ * @param nb_sources The number of sources of the record
+ */
+void mcast_record(const uint8_t *group, int type, int nb_sources)
+{
+    static const uint8_t zero[16];
+    uint8_t family = current_packet.key.family;
+    const uint8_t *host = current_packet.key.saddr;
+    uint64_t ts = current_packet.ts;
+    uint8_t addr[16] = {0};
+
+    memcpy(addr, group, family == AF_INET6 ? 16 : 4);
+    if (is_link_local(family, addr) || memcmp(host, zero, 16) == 0)
+        return;
+    mcast_counters.records++;
+    struct mcast_group *g =
+        group_get(current_packet.vlan, family, addr, 1);
+    if (g == NULL)
+        return;
+    expire_listeners(g, ts);
+
+    struct mcast_listener **link = &g->listeners;
+    while (*link != NULL && memcmp((*link)->addr, host, 16) != 0)
+        link = &(*link)->next;
+    struct mcast_listener *l = *link;
+
+    int exclude = l ? l->exclude : 0, sources = l ? l->sources : 0;
+    switch (type) {
+    case MCAST_JOIN:
+    case MCAST_IS_EXCLUDE:
+    case MCAST_TO_EXCLUDE:
+        exclude = 1;
+        sources = nb_sources;
+        break;
+    case MCAST_IS_INCLUDE:
+    case MCAST_TO_INCLUDE:
+        exclude = 0;
+        sources = nb_sources;
+        break;
+    case MCAST_ALLOW:
+        sources += exclude ? -(nb_sources < sources ? nb_sources : sources) :
+                             nb_sources;
+        break;
+    case MCAST_BLOCK:
+        sources += exclude ? nb_sources :
+                             -(nb_sources < sources ? nb_sources : sources);
+        break;
+    case MCAST_LEAVE:
+        exclude = 0;
+        sources = 0;
+        break;
+    default:
+        return;
+    }
+    int member = exclude || sources > 0;
+
+    char str[IPV6_STR_LEN], grp[IPV6_STR_LEN];
+    if (member && l == NULL) {
+        l = calloc(1, sizeof(struct mcast_listener));
+        if (l == NULL)
+            return;
+        memcpy(l->addr, host, 16);
+        l->joined = ts;
+        l->next = g->listeners;
+        g->listeners = l;
+        if (g->nb_listeners++ == 0) {
+            finish_leave(g);
+            if (g->packets == 0 || g->last_data + MCAST_IDLE <= ts)
+                g->join_ts = ts;
+        }
+        g->joins++;
+        fprintf(current_packet.out, "\t- %s joined %s, %u listeners\n",
+                format_addr(family, host, str), format_addr(family, addr, grp),
+                g->nb_listeners);
+    } else if (!member && l != NULL) {
+        g->leaves++;
+        listener_remove(g, link, ts);
+        fprintf(current_packet.out, "\t- %s left %s, %u listeners\n",
+                format_addr(family, host, str),
+                format_addr(family, addr, grp), g->nb_listeners);
+        return;
+    } else if (l == NULL) {
+        return;
+    }
+    l->exclude = exclude;
+    l->sources = sources;
+    l->last = ts;
+}
+
+
+/**
+ * @brief Account a membership query
+ *
+ * The querier is the source of current_packet, queries from the unspecified
+ * address are only counted.
+ */
+void mcast_query(void)
+{
+    static const uint8_t zero[16];
+    mcast_counters.queries++;
+    if (memcmp(current_packet.key.saddr, zero, 16) == 0)
+        return; // Sent by a snooping switch on behalf of no querier
+    for (int i = 0; i < nb_queriers; i++) {
+        struct mcast_querier *q = &queriers[i];
+        if (q->vlan == current_packet.vlan &&
+            q->family == current_packet.key.family &&
+            memcmp(q->addr, current_packet.key.saddr, 16) == 0) {
+            q->queries++;
+            return;
+        }
+    }
+    if (nb_queriers == MCAST_MAX_QUERIERS)
+        return;
+    struct mcast_querier *q = &queriers[nb_queriers++];
+    q->vlan = current_packet.vlan;
+    q->family = current_packet.key.family;
+    memcpy(q->addr, current_packet.key.saddr, 16);
+    q->queries = 1;
+}
+
+
+/**
+ * @brief Account a packet sent to a multicast group
+ *
+ * Print the join latency if this is the first packet after a join.
+ *
+ * @param size The size of the IP payload
+ */
+void mcast_data(int size)
+{
+    struct mcast_group *g = group_get(
+        current_packet.vlan, current_packet.key.family,
+        current_packet.key.daddr, 0);
+    if (g == NULL)
+        return;
+
+    uint64_t ts = current_packet.ts;
+    g->packets++;
+    g->bytes += size > 0 ? size : 0;
+    g->last_data = ts;
+    if (g->join_ts) {
+        char dur[32];
+        latency_add(latency_stats_get("Multicast join latency"),
+                    ts - g->join_ts);
+        fprintf(current_packet.out,
+                "\t- First data of the group, %s after the join\n",
+                format_duration(ts - g->join_ts, dur, sizeof(dur)));
+        g->join_ts = 0;
+    }
+}
+
+
+/**
+ * @brief Print the listeners of every group at a time
+ *
+ * @param ts The time (ns)
+ */
+static void print_snapshot(uint64_t ts)
+{
+    const char *time_str =
+        timestamp_format(ts / 1000000000, ts % 1000000000);
+    fprintf(current_packet.out,
+            "Multicast listeners at %s:\n", time_str ? time_str : "snapshot");
+    for (const struct mcast_group *g = first_group; g != NULL; g = g->order) {
+        char addr[IPV6_STR_LEN];
+        int n = 0;
+        for (const struct mcast_listener *l = g->listeners; l != NULL;
+             l = l->next) {
+            if (l->last + MCAST_MEMBERSHIP_INTERVAL <= ts)
+                continue;
+            if (n++ == 0) {
+                fprintf(current_packet.out,
+                        "\t- %s", format_addr(g->family, g->addr, addr));
+                if (g->vlan)
+                    fprintf(current_packet.out, " on VLAN %u", g->vlan);
+                fprintf(current_packet.out, ":");
+            }
+            fprintf(current_packet.out, "%s %s", n > 1 ? "," : "",
+                    format_addr(g->family, l->addr, addr));
+        }
+        if (n)
+            fprintf(current_packet.out, "\n");
+    }
+}
+
+
+/**
+ * @brief Set the time of the listener snapshot
+ *
+ * @param ts The time (ns), 0 for no snapshot
+ */
+void mcast_snapshot_at(uint64_t ts)
+{
+    snapshot_ts = ts;
+}
+
+
+/**
+ * @brief Print the listener snapshot when its time has come
+ *
+ * The table only changes with the membership messages, so its state before
+ * the first packet past the snapshot time is the state at that time.
+ *
+ * @param ts The capture time of the current packet (ns)
+ */
+void mcast_tick(uint64_t ts)
+{
+    last_ts = ts;
+    if (snapshot_ts == 0 || ts < snapshot_ts)
+        return;
+    print_snapshot(snapshot_ts);
+    snapshot_ts = 0;
+}
+
+
+/**
+ * @brief Print the multicast report
+ *
+ * Print the pending snapshot, the queriers, and the groups with their
+ * listeners. Nothing is printed if no membership message was seen. The leave
+ * latencies still pending are measured, so this report comes before the
+ * latency statistics.
+ */
+void mcast_report(void)
+{
+    if (snapshot_ts) {
+        print_snapshot(snapshot_ts);
+        snapshot_ts = 0;
+    }
+    if (mcast_counters.records == 0 && mcast_counters.queries == 0)
+        return;
+
+    for (struct mcast_group *g = first_group; g != NULL; g = g->order) {
+        expire_listeners(g, last_ts);
+        finish_leave(g);
+    }
+
+    printf("Multicast: %u groups, %lu records, %lu queries\n",
+           mcast_counters.groups, (unsigned long)mcast_counters.records,
+           (unsigned long)mcast_counters.queries);
+    char addr[IPV6_STR_LEN], dur[32];
+    for (int i = 0; i < nb_queriers; i++) {
+        printf("\t- Querier %s",
+               format_addr(queriers[i].family, queriers[i].addr, addr));
+        if (queriers[i].vlan)
+            printf(" on VLAN %u", queriers[i].vlan);
+        printf(": %u queries\n", queriers[i].queries);
+    }
+    for (const struct mcast_group *g = first_group; g != NULL; g = g->order) {
+        printf("\t- Group %s", format_addr(g->family, g->addr, addr));
+        if (g->vlan)
+            printf(" on VLAN %u", g->vlan);
+        printf(": %u listeners, %u joins, %u leaves, %u timeouts, "
+               "%lu packets, %lu bytes\n",
+               g->nb_listeners, g->joins, g->leaves, g->timeouts,
+               (unsigned long)g->packets, (unsigned long)g->bytes);
+        if (g->unpruned)
+            printf("\t\t- Data still flowing after %u last leaves\n",
+                   g->unpruned);
+        for (const struct mcast_listener *l = g->listeners; l != NULL;
+             l = l->next) {
+            printf("\t\t- %s, member for %s, %s mode",
+                   format_addr(g->family, l->addr, addr),
+                   format_duration(last_ts - l->joined, dur, sizeof(dur)),
+                   l->exclude ? "exclude" : "include");
+            if (l->sources)
+                printf(", %u sources", l->sources);
+            printf("\n");
+        }
+    }
+}
+
+
+/**
+ * @brief Free the group table
+ */
+void mcast_free(void)
+{
+    for (int i = 0; i < MCAST_BUCKETS; i++) {
+        while (group_table[i] != NULL) {
+            struct mcast_group *next = group_table[i]->next;
+            while (group_table[i]->listeners != NULL) {
+                struct mcast_listener *l = group_table[i]->listeners->next;
+                free(group_table[i]->listeners);
+                group_table[i]->listeners = l;
+            }
+            free(group_table[i]);
+            group_table[i] = next;
+        }
+    }
+    first_group = NULL;
+    last_group = &first_group;
+    nb_queriers = 0;
+}
@@ -0,0 +1,846 @@
+/**
+ * @file ndp.c
+ * @brief ICMPv6 Neighbor Discovery definition
+ * @ingroup network
+ *
+ * This file contains the definition of the Neighbor Discovery decoder. The
+ * options are walked within the bounds of the message and a malformed option
+ * discards the whole message, as a host would. The neighbors (IPv6 address to
+ * link-layer address) are kept in an open addressing table of fixed size
+ * entries like the ARP bindings, and the few routers in a fixed array.
+ *
+ * Only the messages sent with a hop limit of 255 update the cache: the others
+ * did not originate on the link.
+ *
+ * @see ndp.h
+ * @see cast_ndp
+ */
+
+// Global libraries
+#include <net/ethernet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Local header files
+#include "format.h"
+#include "ndp.h"
+#include "packet.h"
+#include "stats.h"
+#include "timestamp.h"
+
+#define ND_TABLE_MIN 1024 /**< Initial number of slots, must be a power of 2 */
+#define ND_TOKEN_COST (1000000000ULL / ND_RA_RATE) /**< Bucket cost of an advertisement (ns) */
+#define ND_BUCKET_SIZE (ND_RA_BURST * ND_TOKEN_COST) /**< Capacity of the bucket (ns) */
+#define ND_INFINITE 0xffffffff /**< Infinite lifetime */
+
+/**
+ * @brief Prefix information
+ */
+struct nd_prefix {
+    uint8_t prefix[16]; /**< Prefix */
+    uint8_t len;        /**< Length of the prefix (bits) */
+    uint8_t flags;      /**< On-link and autonomous flags */
+    uint32_t valid;     /**< Valid lifetime (s) */
+    uint32_t preferred; /**< Preferred lifetime (s) */
+};
+
+/**
+ * @brief Options of a message
+ */
+struct nd_options {
+    const uint8_t *slla;   /**< Source link-layer address, NULL if absent */
+    const uint8_t *tlla;   /**< Target link-layer address, NULL if absent */
+    uint32_t mtu;          /**< Link MTU, 0 if absent */
+    int nb_prefixes;       /**< Prefixes kept */
+    struct nd_prefix prefixes[ND_MAX_PREFIXES]; /**< Prefix information */
+    int nb_dns;            /**< DNS servers kept */
+    uint8_t dns[ND_MAX_DNS][16]; /**< DNS servers */
+};
+
+/**
+ * @brief Neighbor
+ *
+ * The unspecified address marks a free slot: it is never bound.
+ */
+struct nd_neighbor {
+    uint64_t last;        /**< Last claim by the bound link-layer address (ns) */
+    uint64_t dad_probe;   /**< Last duplicate address detection probe (ns) */
+    uint8_t addr[16];     /**< Address */
+    uint8_t dad_mac[ETH_ALEN]; /**< Link-layer address of the last prober */
+    uint8_t mac[ETH_ALEN]; /**< Bound link-layer address */
+    uint8_t alt[ETH_ALEN]; /**< Other link-layer address of the last conflict or flip */
+    uint8_t has_mac;      /**< 1 once a link-layer address was bound */
+    uint8_t router;       /**< 1 if the neighbor claims to be a router */
+    uint16_t flips;       /**< Changes of the bound link-layer address */
+    uint32_t conflicts;   /**< Claims by another address while the binding was in use */
+};
+
+/**
+ * @brief Router, from its advertisements
+ */
+struct nd_router {
+    uint8_t addr[16];     /**< Link-local address */
+    uint8_t mac[ETH_ALEN]; /**< Link-layer address, if advertised */
+    uint8_t has_mac;      /**< 1 if the link-layer address was advertised */
+    uint8_t hop_limit;    /**< Advertised hop limit */
+    uint8_t flags;        /**< Managed and other configuration flags */
+    uint16_t lifetime;    /**< Router lifetime (s) */
+    uint32_t mtu;         /**< Advertised MTU, 0 if none */
+    uint32_t ras;         /**< Advertisements sent */
+    int nb_prefixes;      /**< Prefixes kept */
+    struct nd_prefix prefixes[ND_MAX_PREFIXES]; /**< Advertised prefixes */
+    int nb_dns;           /**< DNS servers kept */
+    uint8_t dns[ND_MAX_DNS][16]; /**< Advertised DNS servers */
+};
+
+/**
+ * @brief Neighbor table
+ */
+static struct {
+    struct nd_neighbor *slots; /**< Entries */
+    uint32_t mask;      /**< Number of slots - 1 */
+    uint32_t count;     /**< Used slots */
+} neighbors;
+
+static struct nd_router routers[ND_MAX_ROUTERS]; /**< Routers, by first advertisement */
+static int nb_routers; /**< Routers tracked */
+
+/**
+ * @brief Router advertisement bucket of the link
+ *
+ * A flood usually forges a new source for every advertisement, so the rate is
+ * measured on the whole link rather than per router.
+ */
+static struct {
+    uint64_t tokens;      /**< Credit of the bucket (ns) */
+    uint64_t last;        /**< Last advertisement (ns) */
+    uint64_t flood_start; /**< First advertisement over the rate (ns) */
+    uint32_t flood_ras;   /**< Advertisements since the start of the flood, 0 if none */
+    uint32_t flood_sources; /**< Routers tracked at the start of the flood */
+} ra_bucket;
+
+/**
+ * @brief Counters of the report
+ */
+static struct {
+    uint64_t messages;  /**< Messages decoded */
+    uint64_t off_link;  /**< Messages not sent on the link */
+    uint64_t ras;       /**< Router advertisements */
+    uint64_t untracked; /**< Claims of neighbors or routers that didn't fit */
+    uint32_t dad_probes;   /**< Duplicate address detection probes */
+    uint32_t dad_failures; /**< Probed addresses defended by their owner */
+    uint32_t floods;    /**< Advertisement floods begun */
+    uint32_t conflicting; /**< Addresses that had a conflict */
+    uint32_t flipped;   /**< Addresses that changed of link-layer address */
+} nd_counters;
+
+
+/**
+ * @brief Check for the unspecified address
+ *
+ * @param addr The address
+ * @return int 1 if the address is ::, 0 otherwise
+ */
+static int is_unspecified(const uint8_t addr[16])
+{
+    static const uint8_t zero[16];
+    return memcmp(addr, zero, sizeof(zero)) == 0;
+}
+
+
+/**
+ * @brief Format a lifetime
+ *
+ * @param lifetime The lifetime (s)
+ * @param buf The destination
+ * @param size The size of the destination
+ * @return char* The destination
+ */
+static char *format_lifetime(uint32_t lifetime, char *buf, size_t size)
+{
+    if (lifetime == ND_INFINITE)
+        snprintf(buf, size, "infinite");
+    else
+        snprintf(buf, size, "%u s", lifetime);
+    return buf;
+}
+
+
+/**
+ * @brief Print the beginning of an event line
+ *
+ * @param ts The time of the event (ns)
+ */
+static void event_start(uint64_t ts)
+{
+    const char *time_str =
+        timestamp_format(ts / 1000000000, ts % 1000000000);
+    if (time_str)
+        fprintf(current_packet.out, "%s ", time_str);
+}
+
+
+/**
+ * @brief Print and keep a prefix information option
+ *
+ * @param opt The option, 32 bytes
+ * @param options The options of the message
+ */
+static void option_prefix(const struct nd_opt_prefix_info *opt,
+                          struct nd_options *options)
+{
+    char addr[IPV6_STR_LEN], valid[16], preferred[16];
+    struct nd_prefix prefix;
+    memcpy(prefix.prefix, &opt->nd_opt_pi_prefix, sizeof(prefix.prefix));
+    prefix.len = opt->nd_opt_pi_prefix_len;
+    prefix.flags = opt->nd_opt_pi_flags_reserved &
+                   (ND_OPT_PI_FLAG_ONLINK | ND_OPT_PI_FLAG_AUTO);
+    prefix.valid = be32toh(opt->nd_opt_pi_valid_time);
+    prefix.preferred = be32toh(opt->nd_opt_pi_preferred_time);
+
+    fprintf(current_packet.out,
+            "\t- Prefix: %s/%u, valid %s, preferred %s%s%s\n",
+            format_ipv6(prefix.prefix, addr), prefix.len,
+            format_lifetime(prefix.valid, valid, sizeof(valid)),
+            format_lifetime(prefix.preferred, preferred, sizeof(preferred)),
+            prefix.flags & ND_OPT_PI_FLAG_ONLINK ? ", on-link" : "",
+            prefix.flags & ND_OPT_PI_FLAG_AUTO ? ", autonomous" : "");
+    if (options->nb_prefixes < ND_MAX_PREFIXES)
+        options->prefixes[options->nb_prefixes++] = prefix;
+}
+
+
+/**
+ * @brief Print and keep a recursive DNS server option
+ *
+ * @param opt The option
+ * @param len The length of the option, 24 bytes or more
+ * @param options The options of the message
+ */
+static void option_rdnss(const uint8_t *opt, int len,
+                         struct nd_options *options)
+{
+    char addr[IPV6_STR_LEN], lifetime[16];
+    uint32_t value;
+    memcpy(&value, opt + 4, sizeof(value));
+    fprintf(current_packet.out, "\t- DNS servers, lifetime %s:",
+            format_lifetime(be32toh(value), lifetime, sizeof(lifetime)));
+    options->nb_dns = 0;
+    for (int off = 8; off + 16 <= len; off += 16) {
+        fprintf(current_packet.out,
+                "%s %s", off == 8 ? "" : ",", format_ipv6(opt + off, addr));
+        if (options->nb_dns < ND_MAX_DNS)
+            memcpy(options->dns[options->nb_dns++], opt + off, 16);
+    }
+    fprintf(current_packet.out, "\n");
+}
+
+
+/**
+ * @brief Decode the options of a message
+ *
+ * Every option is at least 8 bytes long and must fit in the message, so the
+ * walk ends after size / 8 options at most.
+ *
+ * @param opt The first option
+ * @param size The size of the options
+ * @param options The decoded options
+ * @return int 0 on success, -1 if an option is malformed
+ */
+static int parse_options(const uint8_t *opt, int size,
+                         struct nd_options *options)
+{
+    memset(options, 0, sizeof(*options));
+    while (size > 0) {
+        if (size < 2 || opt[1] == 0 || opt[1] * 8 > size) {
+            fprintf(stderr, "Bad NDP option length\n");
+            return -1;
+        }
+        int len = opt[1] * 8;
+        char str[HADDR_STR_LEN];
+        switch (opt[0]) {
+        case ND_OPT_SOURCE_LINKADDR:
+        case ND_OPT_TARGET_LINKADDR:
+            fprintf(current_packet.out, "\t- %s link-layer address: %s\n",
+                    opt[0] == ND_OPT_SOURCE_LINKADDR ? "Source" : "Target",
+                    format_haddr(opt + 2, len == 8 ? ETH_ALEN : len - 2, str));
+            if (len == 8 && opt[0] == ND_OPT_SOURCE_LINKADDR)
+                options->slla = opt + 2;
+            else if (len == 8)
+                options->tlla = opt + 2;
+            break;
+        case ND_OPT_PREFIX_INFORMATION:
+            if (len != sizeof(struct nd_opt_prefix_info)) {
+                fprintf(stderr, "Bad NDP prefix option length\n");
+                return -1;
+            }
+            option_prefix((const struct nd_opt_prefix_info *)opt, options);
+            break;
+        case ND_OPT_REDIRECTED_HEADER:
+            fprintf(current_packet.out,
+                    "\t- Redirected header: %d bytes\n", len - 8);
+            break;
+        case ND_OPT_MTU:
+            if (len != sizeof(struct nd_opt_mtu)) {
+                fprintf(stderr, "Bad NDP MTU option length\n");
+                return -1;
+            }
+            options->mtu = be32toh(((const struct nd_opt_mtu *)opt)->nd_opt_mtu_mtu);
+            fprintf(current_packet.out, "\t- MTU: %u\n", options->mtu);
+            break;
+        case ND_OPT_RDNSS:
+            if (len < 24) {
+                fprintf(stderr, "Bad NDP RDNSS option length\n");
+                return -1;
+            }
+            option_rdnss(opt, len, options);
+            break;
+        default:
+            fprintf(current_packet.out,
+                    "\t- Option %u, %d bytes\n", opt[0], len);
+            break;
+        }
+        opt += len;
+        size -= len;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Hash an address
+ *
+ * Fibonacci hashing of the two halves folded together.
+ *
+ * @param addr The address
+ * @return uint32_t The first slot to probe
+ */
+static uint32_t hash_addr(const uint8_t addr[16])
+{
+    uint64_t high, low;
+    memcpy(&high, addr, sizeof(high));
+    memcpy(&low, addr + 8, sizeof(low));
+    return (uint32_t)(((high ^ low) * 0x9E3779B97F4A7C15ULL) >> 32) &
+           neighbors.mask;
+}
+
+
+/**
+ * @brief Find the slot of a neighbor
+ *
+ * @param addr The address
+ * @return struct nd_neighbor* The neighbor, or the free slot where it goes
+ */
+static struct nd_neighbor *neighbor_slot(const uint8_t addr[16])
+{
+    uint32_t i = hash_addr(addr);
+    while (!is_unspecified(neighbors.slots[i].addr) &&
+           memcmp(neighbors.slots[i].addr, addr, 16) != 0)
+        i = (i + 1) & neighbors.mask;
+    return &neighbors.slots[i];
+}
+
+
+/**
+ * @brief Make room for one more neighbor
+ *
+ * The table is doubled when it would be more than half full.
+ *
+ * @return int 0 if there is room, -1 if the table is full or on allocation
+ * failure
+ */
+static int neighbors_reserve(void)
+{
+    uint32_t nb_slots = neighbors.slots ? neighbors.mask + 1 : 0;
+    if ((neighbors.count + 1) * 2 <= nb_slots)
+        return 0;
+    if (neighbors.count >= ND_MAX_ENTRIES)
+        return -1;
+
+    uint32_t new_slots = nb_slots ? nb_slots * 2 : ND_TABLE_MIN;
+    struct nd_neighbor *old = neighbors.slots;
+    neighbors.slots = calloc(new_slots, sizeof(struct nd_neighbor));
+    if (neighbors.slots == NULL) {
+        neighbors.slots = old;
+        return -1;
+    }
+    neighbors.mask = new_slots - 1;
+    for (uint32_t i = 0; i < nb_slots; i++)
+        if (!is_unspecified(old[i].addr))
+            *neighbor_slot(old[i].addr) = old[i];
+    free(old);
+    return 0;
+}
+
+
+/**
+ * @brief Find or add a neighbor
+ *
+ * @param addr The address, neither unspecified nor multicast
+ * @param create 1 to add the neighbor if it is missing
+ * @return struct nd_neighbor* The neighbor, NULL if missing or if the table
+ * is full
+ */
+static struct nd_neighbor *neighbor_get(const uint8_t addr[16], int create)
+{
+    if (neighbors.slots == NULL && (!create || neighbors_reserve() < 0))
+        return NULL;
+
+    struct nd_neighbor *n = neighbor_slot(addr);
+    if (!is_unspecified(n->addr))
+        return n;
+    if (!create)
+        return NULL;
+    if (neighbors_reserve() < 0) {
+        nd_counters.untracked++;
+        return NULL;
+    }
+    n = neighbor_slot(addr);
+    memcpy(n->addr, addr, 16);
+    neighbors.count++;
+    return n;
+}
+
+
+/**
+ * @brief Account the claim of an address by a link-layer address
+ *
+ * A claim by another link-layer address while the binding is in use is a
+ * conflict. Once the bound one went quiet, the address moves, unless an
+ * advertisement without the override flag makes the claim.
+ *
+ * @param addr The claimed address
+ * @param mac The link-layer address
+ * @param override 0 if the claim must not replace a binding
+ * @param ts The capture time of the message (ns)
+ * @return struct nd_neighbor* The neighbor, NULL if it isn't tracked
+ */
+static struct nd_neighbor *bind_neighbor(const uint8_t addr[16],
+                                         const uint8_t mac[ETH_ALEN],
+                                         int override, uint64_t ts)
+{
+    if (is_unspecified(addr) || addr[0] == 0xff)
+        return NULL;
+    struct nd_neighbor *n = neighbor_get(addr, 1);
+    if (n == NULL)
+        return NULL;
+
+    if (!n->has_mac || memcmp(n->mac, mac, ETH_ALEN) == 0) {
+        memcpy(n->mac, mac, ETH_ALEN);
+        n->has_mac = 1;
+        n->last = ts;
+        return n;
+    }
+
+    char str[IPV6_STR_LEN], old_mac[MAC_STR_LEN], new_mac[MAC_STR_LEN];
+    int new_pair = memcmp(n->alt, mac, ETH_ALEN) != 0;
+    if (ts < n->last + ND_CONFLICT_WINDOW) {
+        if (n->conflicts++ == 0)
+            nd_counters.conflicting++;
+        if (new_pair) {
+            event_start(ts);
+            fprintf(current_packet.out,
+                    "ND conflict: %s claimed by %s and %s\n",
+                    format_ipv6(addr, str), format_mac(n->mac, old_mac),
+                    format_mac(mac, new_mac));
+        }
+        memcpy(n->alt, mac, ETH_ALEN);
+        return n;
+    }
+    if (!override)
+        return n;
+
+    if (n->flips == 0)
+        nd_counters.flipped++;
+    if (n->flips++ == 0 || new_pair) {
+        event_start(ts);
+        fprintf(current_packet.out,
+                "ND flip: %s moved from %s to %s\n", format_ipv6(addr, str),
+                format_mac(n->mac, old_mac), format_mac(mac, new_mac));
+    }
+    memcpy(n->alt, n->mac, ETH_ALEN);
+    memcpy(n->mac, mac, ETH_ALEN);
+    n->last = ts;
+    return n;
+}
+
+
+/**
+ * @brief Print the end of an advertisement flood
+ */
+static void flood_end(void)
+{
+    char dur[32];
+    uint64_t len = ra_bucket.last - ra_bucket.flood_start;
+    event_start(ra_bucket.last);
+    fprintf(current_packet.out,
+            "RA flood ended: %u advertisements in %s", ra_bucket.flood_ras,
+            format_duration(len, dur, sizeof(dur)));
+    if (len > 0)
+        fprintf(current_packet.out,
+                " (%.1f/s)", ra_bucket.flood_ras * 1e9 / len);
+    fprintf(current_packet.out,
+            ", %d new routers", nb_routers - (int)ra_bucket.flood_sources);
+    if (nb_routers == ND_MAX_ROUTERS)
+        fprintf(current_packet.out, " or more");
+    fprintf(current_packet.out, "\n");
+    ra_bucket.flood_ras = 0;
+}
+
+
+/**
+ * @brief Account an advertisement in the bucket of the link
+ *
+ * @param ts The capture time of the advertisement (ns)
+ */
+static void rate_advert(uint64_t ts)
+{
+    if (nd_counters.ras++ == 0) {
+        ra_bucket.tokens = ND_BUCKET_SIZE;
+        ra_bucket.last = ts;
+    }
+    ra_bucket.tokens += ts > ra_bucket.last ? ts - ra_bucket.last : 0;
+    if (ra_bucket.tokens >= ND_BUCKET_SIZE) {
+        ra_bucket.tokens = ND_BUCKET_SIZE;
+        if (ra_bucket.flood_ras) // Quiet long enough to refill the bucket
+            flood_end();
+    }
+    ra_bucket.last = ts;
+
+    if (ra_bucket.tokens >= ND_TOKEN_COST) {
+        ra_bucket.tokens -= ND_TOKEN_COST;
+        if (ra_bucket.flood_ras)
+            ra_bucket.flood_ras++;
+        return;
+    }
+    if (ra_bucket.flood_ras++ == 0) {
+        ra_bucket.flood_start = ts;
+        ra_bucket.flood_sources = nb_routers;
+        nd_counters.floods++;
+        event_start(ts);
+        fprintf(current_packet.out,
+                "RA flood started: over %d advertisements/s\n", ND_RA_RATE);
+    }
+}
+
+
+/**
+ * @brief Update a router from its advertisement
+ *
+ * The prefixes are merged with the ones already advertised, the DNS servers
+ * replaced.
+ *
+ * @param ra The advertisement
+ * @param options The options of the advertisement
+ */
+static void update_router(const struct nd_router_advert *ra,
+                          const struct nd_options *options)
+{
+    const uint8_t *src = current_packet.key.saddr;
+    struct nd_router *r = NULL;
+    for (int i = 0; i < nb_routers && r == NULL; i++)
+        if (memcmp(routers[i].addr, src, 16) == 0)
+            r = &routers[i];
+    if (r == NULL) {
+        if (nb_routers == ND_MAX_ROUTERS) {
+            nd_counters.untracked++;
+            return;
+        }
+        r = &routers[nb_routers++];
+        memset(r, 0, sizeof(*r));
+        memcpy(r->addr, src, 16);
+    }
+
+    r->ras++;
+    r->hop_limit = ra->nd_ra_curhoplimit;
+    r->flags = ra->nd_ra_flags_reserved &
+               (ND_RA_FLAG_MANAGED | ND_RA_FLAG_OTHER);
+    r->lifetime = be16toh(ra->nd_ra_router_lifetime);
+    if (options->slla) {
+        memcpy(r->mac, options->slla, ETH_ALEN);
+        r->has_mac = 1;
+    }
+    if (options->mtu)
+        r->mtu = options->mtu;
+    if (options->nb_dns) {
+        r->nb_dns = options->nb_dns;
+        memcpy(r->dns, options->dns, sizeof(r->dns));
+    }
+
+    for (int i = 0; i < options->nb_prefixes; i++) {
+        const struct nd_prefix *p = &options->prefixes[i];
+        int j = 0;
+        while (j < r->nb_prefixes &&
+               (r->prefixes[j].len != p->len ||
+                memcmp(r->prefixes[j].prefix, p->prefix, 16) != 0))
+            j++;
+        if (j < ND_MAX_PREFIXES) {
+            r->prefixes[j] = *p;
+            if (j == r->nb_prefixes)
+                r->nb_prefixes++;
+        }
+    }
+}
+
+
+/**
+ * @brief Check a duplicate address detection probe against the advertisement
+ * of its target
+ *
+ * The prober announces its new address once the detection succeeded: an
+ * advertisement sent from or for its link-layer address ends the detection
+ * instead of defending the address.
+ *
+ * @param target The target of the advertisement
+ * @param mac The advertised link-layer address, NULL if absent
+ * @param ts The capture time of the advertisement (ns)
+ */
+static void check_dad(const uint8_t target[16], const uint8_t *mac,
+                      uint64_t ts)
+{
+    struct nd_neighbor *n = neighbor_get(target, 0);
+    if (n == NULL || n->dad_probe == 0 || ts >= n->dad_probe + ND_DAD_WINDOW)
+        return;
+    if (memcmp(current_packet.src_mac, n->dad_mac, ETH_ALEN) == 0 ||
+        (mac && memcmp(mac, n->dad_mac, ETH_ALEN) == 0)) {
+        n->dad_probe = 0;
+        return;
+    }
+
+    char addr[IPV6_STR_LEN], str[MAC_STR_LEN];
+    nd_counters.dad_failures++;
+    n->dad_probe = 0;
+    event_start(ts);
+    fprintf(current_packet.out,
+            "DAD failed: %s defended by %s\n", format_ipv6(target, addr),
+            mac ? format_mac(mac, str) : "an unknown station");
+}
+
+
+/**
+ * @brief Decode a Neighbor Discovery message
+ *
+ * Print the fixed fields and the options of a router solicitation, router
+ * advertisement, neighbor solicitation, neighbor advertisement or redirect,
+ * then update the neighbor and router cache. The addresses and hop limit are
+ * taken from current_packet.
+ *
+ * @param icmp6 The ICMPv6 header of the message
+ * @param size The size of the message, bounded by the captured bytes
+ * @return int 0 if the message is well decoded, -1 if it is truncated
+ */
+int cast_ndp(const struct icmp6_hdr *icmp6, int size)
+{
+    const uint8_t *msg = (const uint8_t *)icmp6;
+    const uint8_t *src = current_packet.key.saddr;
+    uint64_t ts = current_packet.ts;
+    char addr[IPV6_STR_LEN], dst[IPV6_STR_LEN];
+    struct nd_options options;
+    int fixed;
+
+    switch (icmp6->icmp6_type) {
+    case ND_ROUTER_SOLICIT:
+        fixed = sizeof(struct nd_router_solicit);
+        break;
+    case ND_ROUTER_ADVERT:
+        fixed = sizeof(struct nd_router_advert);
+        break;
+    case ND_NEIGHBOR_SOLICIT:
+        fixed = sizeof(struct nd_neighbor_solicit);
+        break;
+    case ND_NEIGHBOR_ADVERT:
+        fixed = sizeof(struct nd_neighbor_advert);
+        break;
+    case ND_REDIRECT:
+        fixed = sizeof(struct nd_redirect);
+        break;
+    default:
+        return -1;
+    }
+    if (size > current_packet.end - msg)
+        size = current_packet.end - msg; // Only the captured options
+    if (size < fixed) {
+        fprintf(stderr, "Truncated NDP message, %d bytes\n", size);
+        return -1;
+    }
+    nd_counters.messages++;
+
+    const struct nd_router_advert *ra = (const struct nd_router_advert *)msg;
+    const struct nd_neighbor_solicit *ns =
+        (const struct nd_neighbor_solicit *)msg;
+    const struct nd_neighbor_advert *na =
+        (const struct nd_neighbor_advert *)msg;
+    const struct nd_redirect *rd = (const struct nd_redirect *)msg;
+    switch (icmp6->icmp6_type) {
+    case ND_ROUTER_ADVERT:
+        fprintf(current_packet.out,
+                "\t- Hop limit %u, router lifetime %u s, reachable %u ms, "
+                "retransmit %u ms%s%s\n",
+                ra->nd_ra_curhoplimit, be16toh(ra->nd_ra_router_lifetime),
+                be32toh(ra->nd_ra_reachable), be32toh(ra->nd_ra_retransmit),
+                ra->nd_ra_flags_reserved & ND_RA_FLAG_MANAGED ?
+                    ", managed" : "",
+                ra->nd_ra_flags_reserved & ND_RA_FLAG_OTHER ?
+                    ", other config" : "");
+        break;
+    case ND_NEIGHBOR_SOLICIT:
+        fprintf(current_packet.out, "\t- Target: %s%s\n",
+                format_ipv6((const uint8_t *)&ns->nd_ns_target, addr),
+                is_unspecified(src) ? " (duplicate address detection)" : "");
+        break;
+    case ND_NEIGHBOR_ADVERT:
+        fprintf(current_packet.out, "\t- Target: %s%s%s%s\n",
+                format_ipv6((const uint8_t *)&na->nd_na_target, addr),
+                na->nd_na_flags_reserved & ND_NA_FLAG_ROUTER ? ", router" : "",
+                na->nd_na_flags_reserved & ND_NA_FLAG_SOLICITED ?
+                    ", solicited" : "",
+                na->nd_na_flags_reserved & ND_NA_FLAG_OVERRIDE ?
+                    ", override" : "");
+        break;
+    case ND_REDIRECT:
+        fprintf(current_packet.out, "\t- Target: %s, destination: %s\n",
+                format_ipv6((const uint8_t *)&rd->nd_rd_target, addr),
+                format_ipv6((const uint8_t *)&rd->nd_rd_dst, dst));
+        break;
+    default:
+        break;
+    }
+
+    if (parse_options(msg + fixed, size - fixed, &options) < 0)
+        return 0;
+    if (current_packet.ttl != ND_HOP_LIMIT) {
+        fprintf(current_packet.out,
+                "\t- Hop limit %u, not sent on the link\n", current_packet.ttl);
+        nd_counters.off_link++;
+        return 0;
+    }
+
+    struct nd_neighbor *n;
+    switch (icmp6->icmp6_type) {
+    case ND_ROUTER_SOLICIT:
+        if (options.slla)
+            bind_neighbor(src, options.slla, 1, ts);
+        break;
+    case ND_ROUTER_ADVERT:
+        rate_advert(ts);
+        update_router(ra, &options);
+        if (options.slla && (n = bind_neighbor(src, options.slla, 1, ts)))
+            n->router = 1;
+        break;
+    case ND_NEIGHBOR_SOLICIT: {
+        if (!is_unspecified(src)) {
+            if (options.slla)
+                bind_neighbor(src, options.slla, 1, ts);
+            break;
+        }
+        nd_counters.dad_probes++;
+        const uint8_t *target = (const uint8_t *)&ns->nd_ns_target;
+        if (is_unspecified(target) || target[0] == 0xff)
+            break; // Not an address a node can claim
+        n = neighbor_get(target, 1);
+        if (n) { // The probe has no source link-layer address option
+            n->dad_probe = ts;
+            memcpy(n->dad_mac, current_packet.src_mac, ETH_ALEN);
+        }
+        break;
+    }
+    case ND_NEIGHBOR_ADVERT: {
+        const uint8_t *target = (const uint8_t *)&na->nd_na_target;
+        check_dad(target, options.tlla, ts);
+        if (options.tlla &&
+            (n = bind_neighbor(target, options.tlla,
+                               na->nd_na_flags_reserved & ND_NA_FLAG_OVERRIDE,
+                               ts)))
+            n->router = (na->nd_na_flags_reserved & ND_NA_FLAG_ROUTER) != 0;
+        break;
+    }
+    case ND_REDIRECT:
+        if (options.tlla)
+            bind_neighbor((const uint8_t *)&rd->nd_rd_target, options.tlla, 1,
+                          ts);
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Print a router of the report
+ *
+ * @param r The router
+ */
+static void print_router(const struct nd_router *r)
+{
+    char addr[IPV6_STR_LEN], mac[MAC_STR_LEN], valid[16];
+    printf("\t- Router %s", format_ipv6(r->addr, addr));
+    if (r->has_mac)
+        printf(" at %s", format_mac(r->mac, mac));
+    printf(": %u advertisements, lifetime %u s, hop limit %u", r->ras,
+           r->lifetime, r->hop_limit);
+    if (r->mtu)
+        printf(", MTU %u", r->mtu);
+    printf("%s%s\n", r->flags & ND_RA_FLAG_MANAGED ? ", managed" : "",
+           r->flags & ND_RA_FLAG_OTHER ? ", other config" : "");
+    for (int i = 0; i < r->nb_prefixes; i++)
+        printf("\t\t- Prefix %s/%u, valid %s\n",
+               format_ipv6(r->prefixes[i].prefix, addr), r->prefixes[i].len,
+               format_lifetime(r->prefixes[i].valid, valid, sizeof(valid)));
+    for (int i = 0; i < r->nb_dns; i++)
+        printf("\t\t- DNS server %s\n", format_ipv6(r->dns[i], addr));
+}
+
+
+/**
+ * @brief Print the Neighbor Discovery report
+ *
+ * Close an ongoing flood, list the routers with their prefixes and DNS
+ * servers, and the neighbors that had a conflict or a flip. Nothing is
+ * printed if no Neighbor Discovery message was decoded.
+ */
+void ndp_report(void)
+{
+    if (nd_counters.messages == 0)
+        return;
+    if (ra_bucket.flood_ras)
+        flood_end();
+
+    printf("NDP: %lu messages, %u neighbors, %d routers, %u RA floods, "
+           "%u DAD probes, %u DAD failures, %u conflicts, %u flips\n",
+           (unsigned long)nd_counters.messages, neighbors.count, nb_routers,
+           nd_counters.floods, nd_counters.dad_probes,
+           nd_counters.dad_failures, nd_counters.conflicting,
+           nd_counters.flipped);
+    if (nd_counters.off_link)
+        printf("\t- %lu messages not sent on the link\n",
+               (unsigned long)nd_counters.off_link);
+    if (nd_counters.untracked)
+        printf("\t- %lu claims not tracked, tables full\n",
+               (unsigned long)nd_counters.untracked);
+
+    for (int i = 0; i < nb_routers; i++)
+        print_router(&routers[i]);
+
+    for (uint32_t i = 0; neighbors.slots && i <= neighbors.mask; i++) {
+        const struct nd_neighbor *n = &neighbors.slots[i];
+        if (is_unspecified(n->addr) || (n->conflicts == 0 && n->flips == 0))
+            continue;
+        char addr[IPV6_STR_LEN], mac[MAC_STR_LEN], alt[MAC_STR_LEN];
+        printf("\t- %s: at %s, also %s, %u conflicting claims, %u flips\n",
+               format_ipv6(n->addr, addr), format_mac(n->mac, mac),
+               format_mac(n->alt, alt), n->conflicts, n->flips);
+    }
+}
+
+
+/**
+ * @brief Free the neighbor cache
+ */
+void ndp_free(void)
+{
+    free(neighbors.slots);
+    memset(&neighbors, 0, sizeof(neighbors));
+    nb_routers = 0;
+}
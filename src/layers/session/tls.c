@@ -0,0 +1,599 @@
+/**
+ * @file tls.c
+ * @brief TLS layer
+ * @ingroup session
+ *
+ * This file contains the implementation of the TLS layer. The records of each
+ * direction are reassembled until both hello messages are decoded, which gives
+ * the server name, the ALPN, the negotiated version and cipher and the JA3/JA3S
+ * fingerprints of the connection. Once the handshake is over, the connection
+ * isn't parsed anymore.
+ *
+ * @see tls.h
+ * @see cast_tls
+ */
+
+// Global libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Local header files
+#include "dfilter.h"
+#include "md5.h"
+#include "packet.h"
+#include "stream.h"
+#include "tls.h"
+
+#define TLS_EXT_SERVER_NAME 0
+#define TLS_EXT_SUPPORTED_GROUPS 10
+#define TLS_EXT_EC_POINT_FORMATS 11
+#define TLS_EXT_ALPN 16
+#define TLS_EXT_SUPPORTED_VERSIONS 43
+
+#define TLS_FP_LEN 1024 /**< Maximum length of a JA3 string */
+#define IS_GREASE(v) (((v) & 0x0F0F) == 0x0A0A && ((v) >> 8) == ((v) & 0xFF)) /**< RFC 8701 values */
+
+/**
+ * @brief State of a TLS direction
+ */
+struct tls_dir {
+    struct stream records;   /**< TCP payload not parsed yet */
+    struct stream handshake; /**< Handshake bytes not parsed yet */
+    uint8_t encrypted;       /**< ChangeCipherSpec or data seen */
+};
+
+/**
+ * @brief State of a TLS connection
+ */
+struct tls_session {
+    struct tls_dir dir[2];   /**< Indexed by FLOW_DIR_* */
+    uint8_t client_hello;    /**< ClientHello decoded */
+    uint8_t server_hello;    /**< ServerHello decoded */
+    uint8_t done;            /**< Handshake over, nothing more to parse */
+    uint16_t version;        /**< Negotiated version */
+    uint16_t cipher;         /**< Negotiated cipher suite */
+    char sni[256];           /**< Server name requested by the client */
+    char alpn[64];           /**< Protocol selected by the server */
+    char ja3[MD5_HEX_LEN];   /**< Client fingerprint */
+    char ja3s[MD5_HEX_LEN];  /**< Server fingerprint */
+};
+
+/**
+ * @brief Bounded reader
+ *
+ * Reads past the end of the buffer return 0 and set the error flag.
+ */
+struct reader {
+    const u_char *p;
+    size_t len;
+    size_t off;
+    int err;
+};
+
+
+/**
+ * @brief Read a byte
+ *
+ * @param r The reader
+ * @return uint8_t The byte, 0 past the end
+ */
+static uint8_t rd_u8(struct reader *r)
+{
+    if (r->off + 1 > r->len) {
+        r->err = 1;
+        return 0;
+    }
+    return r->p[r->off++];
+}
+
+
+/**
+ * @brief Read a 16 bits big endian integer
+ *
+ * @param r The reader
+ * @return uint16_t The integer, 0 past the end
+ */
+static uint16_t rd_u16(struct reader *r)
+{
+    if (r->off + 2 > r->len) {
+        r->err = 1;
+        return 0;
+    }
+    uint16_t v = (r->p[r->off] << 8) | r->p[r->off + 1];
+    r->off += 2;
+    return v;
+}
+
+
+/**
+ * @brief Get a sub reader over the next bytes
+ *
+ * @param r The reader
+ * @param len The number of bytes
+ * @return struct reader The sub reader, empty past the end
+ */
+static struct reader rd_sub(struct reader *r, size_t len)
+{
+    struct reader sub = {r->p + r->off, len, 0, 0};
+    if (r->off + len > r->len) {
+        r->err = 1;
+        sub.len = 0;
+        sub.err = 1;
+        return sub;
+    }
+    r->off += len;
+    return sub;
+}
+
+
+/**
+ * @brief Get the name of a TLS version
+ *
+ * @param version The version
+ * @return const char* The name of the version
+ */
+static const char *tls_version_name(uint16_t version)
+{
+    switch (version) {
+    case 0x0300:
+        return "SSL 3.0";
+    case 0x0301:
+        return "TLS 1.0";
+    case 0x0302:
+        return "TLS 1.1";
+    case 0x0303:
+        return "TLS 1.2";
+    case 0x0304:
+        return "TLS 1.3";
+    default:
+        return "Unknown version";
+    }
+}
+
+
+/**
+ * @brief Get the name of a record content type
+ *
+ * @param ct The content type
+ * @return const char* The name of the content type
+ */
+static const char *tls_content_name(uint8_t ct)
+{
+    switch (ct) {
+    case TLS_CT_CHANGE_CIPHER_SPEC:
+        return "ChangeCipherSpec";
+    case TLS_CT_ALERT:
+        return "Alert";
+    case TLS_CT_HANDSHAKE:
+        return "Handshake";
+    case TLS_CT_APPLICATION_DATA:
+        return "ApplicationData";
+    default:
+        return "Unknown";
+    }
+}
+
+
+/**
+ * @brief Append a number to a fingerprint list
+ *
+ * @param fp The fingerprint string
+ * @param first 1 for the first number of the list
+ * @param value The number
+ */
+static void fp_append(char fp[TLS_FP_LEN], int first, unsigned int value)
+{
+    size_t len = strlen(fp);
+    if (len < TLS_FP_LEN)
+        snprintf(fp + len, TLS_FP_LEN - len, first ? "%u" : "-%u", value);
+}
+
+
+/**
+ * @brief Append a field separator to a fingerprint
+ *
+ * @param fp The fingerprint string
+ */
+static void fp_next(char fp[TLS_FP_LEN])
+{
+    size_t len = strlen(fp);
+    if (len + 1 < TLS_FP_LEN) {
+        fp[len] = ',';
+        fp[len + 1] = '\0';
+    }
+}
+
+
+/**
+ * @brief Append a list of 16 bits values to a fingerprint
+ *
+ * @param fp The fingerprint string
+ * @param r Reader over the list
+ * @return int Number of values appended, GREASE values excluded
+ */
+static int fp_append_u16_list(char fp[TLS_FP_LEN], struct reader *r)
+{
+    int n = 0;
+    while (r->off + 2 <= r->len) {
+        uint16_t v = rd_u16(r);
+        if (!IS_GREASE(v))
+            fp_append(fp, n++ == 0, v);
+    }
+    return n;
+}
+
+
+/**
+ * @brief Copy the first ALPN protocol of a list
+ *
+ * @param r Reader over the protocol_name_list
+ * @param dst The destination
+ * @param size The size of the destination
+ */
+static void copy_alpn(struct reader *r, char *dst, size_t size)
+{
+    size_t out = 0;
+    dst[0] = '\0';
+    while (r->off < r->len && !r->err) {
+        uint8_t len = rd_u8(r);
+        struct reader name = rd_sub(r, len);
+        if (name.err)
+            break;
+        if (out > 0 && out + 1 < size)
+            dst[out++] = ',';
+        for (size_t i = 0; i < name.len && out + 1 < size; i++)
+            dst[out++] = (name.p[i] >= 32 && name.p[i] <= 126) ? name.p[i] : '.';
+        dst[out] = '\0';
+    }
+}
+
+
+/**
+ * @brief Decode a ClientHello
+ *
+ * @param tls The TLS connection
+ * @param r Reader over the message body
+ */
+static void client_hello(struct tls_session *tls, struct reader *r)
+{
+    char ja3[TLS_FP_LEN] = "";
+    char alpn[sizeof(tls->alpn)] = "";
+    char groups[TLS_FP_LEN] = "";
+    char formats[TLS_FP_LEN] = "";
+    uint16_t best = 0;
+
+    uint16_t version = rd_u16(r);
+    rd_sub(r, 32); // Random
+    rd_sub(r, rd_u8(r)); // Session ID
+    struct reader ciphers = rd_sub(r, rd_u16(r));
+    rd_sub(r, rd_u8(r)); // Compression methods
+    if (r->err) {
+        fprintf(stderr, "Truncated TLS ClientHello\n");
+        return;
+    }
+
+    fp_append(ja3, 1, version);
+    fp_next(ja3);
+    fp_append_u16_list(ja3, &ciphers);
+    fp_next(ja3);
+
+    struct reader exts = rd_sub(r, r->off < r->len ? rd_u16(r) : 0);
+    int n = 0;
+    while (exts.off + 4 <= exts.len) {
+        uint16_t type = rd_u16(&exts);
+        struct reader ext = rd_sub(&exts, rd_u16(&exts));
+        if (ext.err)
+            break;
+        if (!IS_GREASE(type))
+            fp_append(ja3, n++ == 0, type);
+
+        switch (type) {
+        case TLS_EXT_SERVER_NAME: {
+            struct reader list = rd_sub(&ext, rd_u16(&ext));
+            while (list.off + 3 <= list.len) {
+                uint8_t name_type = rd_u8(&list);
+                struct reader name = rd_sub(&list, rd_u16(&list));
+                if (name_type == 0 && !name.err) {
+                    size_t len = name.len < sizeof(tls->sni) - 1 ?
+                                     name.len :
+                                     sizeof(tls->sni) - 1;
+                    for (size_t i = 0; i < len; i++)
+                        tls->sni[i] = (name.p[i] >= 32 && name.p[i] <= 126) ?
+                                          name.p[i] :
+                                          '.';
+                    tls->sni[len] = '\0';
+                    break;
+                }
+            }
+            break;
+        }
+        case TLS_EXT_SUPPORTED_GROUPS: {
+            struct reader list = rd_sub(&ext, rd_u16(&ext));
+            fp_append_u16_list(groups, &list);
+            break;
+        }
+        case TLS_EXT_EC_POINT_FORMATS: {
+            struct reader list = rd_sub(&ext, rd_u8(&ext));
+            for (size_t i = 0; i < list.len; i++)
+                fp_append(formats, i == 0, list.p[i]);
+            break;
+        }
+        case TLS_EXT_ALPN: {
+            struct reader list = rd_sub(&ext, rd_u16(&ext));
+            copy_alpn(&list, alpn, sizeof(alpn));
+            break;
+        }
+        case TLS_EXT_SUPPORTED_VERSIONS: {
+            struct reader list = rd_sub(&ext, rd_u8(&ext));
+            while (list.off + 2 <= list.len) {
+                uint16_t v = rd_u16(&list);
+                if (!IS_GREASE(v) && v > best)
+                    best = v;
+            }
+            break;
+        }
+        }
+    }
+    fp_next(ja3);
+    strncat(ja3, groups, TLS_FP_LEN - strlen(ja3) - 1);
+    fp_next(ja3);
+    strncat(ja3, formats, TLS_FP_LEN - strlen(ja3) - 1);
+    md5_hex(ja3, strlen(ja3), tls->ja3);
+    tls->client_hello = 1;
+
+    fprintf(current_packet.out,
+            "ClientHello: %s\n", tls_version_name(best ? best : version));
+    if (tls->sni[0] != '\0')
+        fprintf(current_packet.out, "\t- SNI: %s\n", tls->sni);
+    if (alpn[0] != '\0')
+        fprintf(current_packet.out, "\t- ALPN: %s\n", alpn);
+    fprintf(current_packet.out, "\t- JA3: %s\n", tls->ja3);
+}
+
+
+/**
+ * @brief Decode a ServerHello
+ *
+ * @param tls The TLS connection
+ * @param r Reader over the message body
+ */
+static void server_hello(struct tls_session *tls, struct reader *r)
+{
+    char ja3s[TLS_FP_LEN] = "";
+
+    uint16_t version = rd_u16(r);
+    rd_sub(r, 32); // Random
+    rd_sub(r, rd_u8(r)); // Session ID
+    uint16_t cipher = rd_u16(r);
+    rd_u8(r); // Compression method
+    if (r->err) {
+        fprintf(stderr, "Truncated TLS ServerHello\n");
+        return;
+    }
+
+    fp_append(ja3s, 1, version);
+    fp_next(ja3s);
+    fp_append(ja3s, 1, cipher);
+    fp_next(ja3s);
+
+    tls->version = version;
+    tls->cipher = cipher;
+    struct reader exts = rd_sub(r, r->off < r->len ? rd_u16(r) : 0);
+    int n = 0;
+    while (exts.off + 4 <= exts.len) {
+        uint16_t type = rd_u16(&exts);
+        struct reader ext = rd_sub(&exts, rd_u16(&exts));
+        if (ext.err)
+            break;
+        fp_append(ja3s, n++ == 0, type);
+
+        switch (type) {
+        case TLS_EXT_ALPN: {
+            struct reader list = rd_sub(&ext, rd_u16(&ext));
+            copy_alpn(&list, tls->alpn, sizeof(tls->alpn));
+            break;
+        }
+        case TLS_EXT_SUPPORTED_VERSIONS:
+            tls->version = rd_u16(&ext);
+            break;
+        }
+    }
+    md5_hex(ja3s, strlen(ja3s), tls->ja3s);
+    tls->server_hello = 1;
+
+    fprintf(current_packet.out,
+            "ServerHello: %s, cipher 0x%04x\n", tls_version_name(tls->version),
+            tls->cipher);
+    if (tls->alpn[0] != '\0')
+        fprintf(current_packet.out, "\t- ALPN: %s\n", tls->alpn);
+    fprintf(current_packet.out, "\t- JA3S: %s\n", tls->ja3s);
+}
+
+
+/**
+ * @brief Decode the complete handshake messages of a direction
+ *
+ * @param tls The TLS connection
+ * @param dir The direction
+ */
+static void handshake_messages(struct tls_session *tls, struct tls_dir *dir)
+{
+    struct stream *hs = &dir->handshake;
+    while (hs->len >= 4) {
+        size_t len = (hs->buf[1] << 16) | (hs->buf[2] << 8) | hs->buf[3];
+        if (hs->len < 4 + len)
+            break;
+
+        struct reader r = {hs->buf + 4, len, 0, 0};
+        switch (hs->buf[0]) {
+        case TLS_HS_CLIENT_HELLO:
+            client_hello(tls, &r);
+            break;
+        case TLS_HS_SERVER_HELLO:
+            server_hello(tls, &r);
+            break;
+        }
+        stream_consume(hs, 4 + len);
+    }
+}
+
+
+/**
+ * @brief Release the state of a TLS connection
+ *
+ * @param data The TLS connection
+ */
+static void tls_session_free(void *data)
+{
+    struct tls_session *tls = data;
+    for (int i = 0; i < 2; i++) {
+        stream_free(&tls->dir[i].records);
+        stream_free(&tls->dir[i].handshake);
+    }
+    free(tls);
+}
+
+
+/**
+ * @brief Stop parsing a TLS connection
+ *
+ * The buffers are released, only the decoded information is kept.
+ *
+ * @param tls The TLS connection
+ */
+static void tls_session_done(struct tls_session *tls)
+{
+    tls->done = 1;
+    for (int i = 0; i < 2; i++) {
+        stream_free(&tls->dir[i].records);
+        stream_free(&tls->dir[i].handshake);
+    }
+}
+
+
+/**
+ * @brief Get the TLS state of the current flow
+ *
+ * The state of another dissector (e.g. before a STARTTLS upgrade) is replaced.
+ *
+ * @return struct tls_session* The TLS connection, NULL on error
+ */
+static struct tls_session *tls_session_get(void)
+{
+    struct flow *flow = current_packet.flow;
+    if (flow == NULL)
+        return NULL;
+    if (flow->free_data == tls_session_free)
+        return flow->data;
+
+    struct tls_session *tls = calloc(1, sizeof(struct tls_session));
+    if (tls == NULL)
+        return NULL;
+    if (flow->free_data != NULL)
+        flow->free_data(flow->data);
+    flow->data = tls;
+    flow->free_data = tls_session_free;
+    return tls;
+}
+
+
+/**
+ * @brief Check if a packet starts with a TLS record
+ *
+ * @param packet The packet to check
+ * @param data_size The size of the data
+ * @return int 1 if the packet starts with a TLS record header, 0 otherwise
+ */
+int is_tls(const u_char *packet, int data_size)
+{
+    if (data_size < (int)sizeof(struct tlshdr))
+        return 0;
+    const struct tlshdr *tls = (const struct tlshdr *)packet;
+    if (tls->tls_ct < TLS_CT_CHANGE_CIPHER_SPEC ||
+        tls->tls_ct > TLS_CT_APPLICATION_DATA)
+        return 0;
+    if (TLS_V(tls) < 0x0300 || TLS_V(tls) > 0x0304)
+        return 0;
+    return TLS_LEN(tls) <= TLS_MAX_RECORD;
+}
+
+
+/**
+ * @brief Handle a TLS segment
+ *
+ * This function reassembles the records of the connection and decodes the
+ * ClientHello and ServerHello messages. Once the handshake is over, the
+ * segments are only counted.
+ *
+ * @param packet The TCP payload
+ * @param data_size The size of the payload
+ * @param seq The TCP sequence number of the payload
+ * @return int 0 if the segment is well handled, -1 otherwise
+ */
+int cast_tls(const u_char *packet, int data_size, uint32_t seq)
+{
+    struct tls_session *tls = tls_session_get();
+    if (tls == NULL) {
+        fprintf(stderr, "malloc\n");
+        return -1;
+    }
+    if (tls->done) {
+        fprintf(current_packet.out, "Encrypted data: %d bytes\n", data_size);
+        if (tls->sni[0] != '\0')
+            dfilter_set(DF_TLS_SNI, tls->sni);
+        return 0;
+    }
+
+    struct tls_dir *dir = &tls->dir[current_packet.dir];
+    if (stream_append(&dir->records, seq, packet, data_size) < 0) {
+        fprintf(current_packet.out,
+                "TLS stream incomplete, handshake not decoded\n");
+        tls_session_done(tls);
+        return -1;
+    }
+
+    while (dir->records.len >= sizeof(struct tlshdr)) {
+        if (!is_tls(dir->records.buf, dir->records.len)) {
+            fprintf(current_packet.out,
+                    "Not at a TLS record boundary, handshake not decoded\n");
+            tls_session_done(tls);
+            return -1;
+        }
+        const struct tlshdr *hdr = (const struct tlshdr *)dir->records.buf;
+        size_t len = sizeof(struct tlshdr) + TLS_LEN(hdr);
+        if (dir->records.len < len)
+            break;
+
+        fprintf(current_packet.out,
+                "%s record, %s, %u bytes\n", tls_content_name(hdr->tls_ct),
+                tls_version_name(TLS_V(hdr)), TLS_LEN(hdr));
+        switch (hdr->tls_ct) {
+        case TLS_CT_HANDSHAKE:
+            if (dir->encrypted)
+                break;
+            if (stream_push(&dir->handshake, dir->records.buf + sizeof(*hdr),
+                            TLS_LEN(hdr)) < 0) {
+                tls_session_done(tls);
+                return -1;
+            }
+            handshake_messages(tls, dir);
+            break;
+        case TLS_CT_CHANGE_CIPHER_SPEC:
+        case TLS_CT_APPLICATION_DATA:
+            dir->encrypted = 1;
+            break;
+        }
+        stream_consume(&dir->records, len);
+    }
+    if (tls->sni[0] != '\0')
+        dfilter_set(DF_TLS_SNI, tls->sni);
+
+    // TLS 1.3 encrypts everything after the ServerHello
+    if ((tls->server_hello && tls->version == 0x0304) ||
+        (tls->dir[0].encrypted && tls->dir[1].encrypted)) {
+        fprintf(current_packet.out, "Handshake complete\n");
+        tls_session_done(tls);
+    }
+    return 0;
+}
@@ -0,0 +1,145 @@
+/**
+ * @file stream.c
+ * @brief TCP stream reassembly
+ * @ingroup transport
+ *
+ * This file contains the implementation of the reassembly buffer. Only in
+ * order segments are kept: a dissector that needs a stream gives up when a
+ * segment is missing.
+ *
+ * @see stream.h
+ * @see stream_append
+ */
+
+// Global libraries
+#include <stdlib.h>
+#include <string.h>
+
+// Local header files
+#include "stream.h"
+
+
+/**
+ * @brief Append bytes to a stream
+ *
+ * @param stream The stream
+ * @param data The bytes to append
+ * @param len The number of bytes
+ * @return int 0 on success, -1 if the stream would exceed STREAM_MAX_LEN
+ */
+int stream_push(struct stream *stream, const u_char *data, size_t len)
+{
+    if (len == 0)
+        return 0; // The buffer may not be allocated yet
+    if (stream->len + len > STREAM_MAX_LEN)
+        return -1;
+
+    if (stream->len + len > stream->cap) {
+        size_t cap = stream->cap ? stream->cap : 1024;
+        while (cap < stream->len + len)
+            cap *= 2;
+        u_char *buf = realloc(stream->buf, cap);
+        if (buf == NULL)
+            return -1;
+        stream->buf = buf;
+        stream->cap = cap;
+    }
+    memcpy(stream->buf + stream->len, data, len);
+    stream->len += len;
+    return 0;
+}
+
+
+/**
+ * @brief Append a TCP segment to a stream
+ *
+ * Retransmitted bytes are dropped. A segment starting after the expected
+ * sequence number means bytes were lost: the stream can't be parsed anymore.
+ * Bytes still to skip are dropped instead of being appended.
+ *
+ * @param stream The stream
+ * @param seq The sequence number of the segment
+ * @param data The payload of the segment
+ * @param len The length of the payload
+ * @return int Number of new bytes appended, -1 on a gap or overflow
+ */
+int stream_append(struct stream *stream, uint32_t seq, const u_char *data,
+                  int len)
+{
+    if (len <= 0)
+        return 0;
+
+    if (!stream->synced) {
+        stream->next_seq = seq;
+        stream->synced = 1;
+    }
+
+    int32_t delta = (int32_t)(stream->next_seq - seq);
+    if (delta < 0) // Segment missing before this one
+        return -1;
+    if (delta >= len) // Pure retransmission
+        return 0;
+    stream->next_seq += len - delta;
+
+    size_t skip = (size_t)(len - delta) < stream->skip ? (size_t)(len - delta) :
+                                                          stream->skip;
+    stream->skip -= skip;
+    delta += skip;
+    if (delta == len)
+        return 0;
+
+    if (stream_push(stream, data + delta, len - delta) < 0)
+        return -1;
+    return len - delta;
+}
+
+
+/**
+ * @brief Drop bytes from the front of a stream
+ *
+ * @param stream The stream
+ * @param len The number of bytes parsed by the dissector
+ */
+void stream_consume(struct stream *stream, size_t len)
+{
+    if (len >= stream->len) {
+        stream->len = 0;
+        return;
+    }
+    memmove(stream->buf, stream->buf + len, stream->len - len);
+    stream->len -= len;
+}
+
+
+/**
+ * @brief Skip bytes of a stream
+ *
+ * Drop the bytes waiting in the stream, and the ones still to come, without
+ * buffering them. Used to jump over length-prefixed data.
+ *
+ * @param stream The stream
+ * @param len The number of bytes to skip
+ */
+void stream_skip(struct stream *stream, size_t len)
+{
+    if (len <= stream->len) {
+        stream_consume(stream, len);
+        return;
+    }
+    stream->skip += len - stream->len;
+    stream->len = 0;
+}
+
+
+/**
+ * @brief Release the buffer of a stream
+ *
+ * @param stream The stream
+ */
+void stream_free(struct stream *stream)
+{
+    free(stream->buf);
+    stream->buf = NULL;
+    stream->len = 0;
+    stream->cap = 0;
+}
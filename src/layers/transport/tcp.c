@@ -13,16 +13,21 @@
 // Global libraries
 #include <arpa/inet.h>
 #include <stdio.h>
+#include <string.h>
 
 // Local header files
 #include "tls.h"
 #include "dns.h"
+#include "dpi.h"
+#include "expect.h"
 #include "ftp.h"
 #include "http.h"
+#include "imap.h"
 #include "pop.h"
 #include "smtp.h"
 #include "telnet.h"
 #include "tcp.h"
+#include "packet.h"
 
 /**
  * @brief Check the flags of a TCP packet
@@ -34,139 +39,134 @@
 void check_flags(const struct tcphdr *tcp)
 {
     if (tcp->th_flags & TH_FIN)
-        printf("FIN ");
+        fprintf(current_packet.out, "FIN ");
     if (tcp->th_flags & TH_SYN)
-        printf("SYN ");
+        fprintf(current_packet.out, "SYN ");
     if (tcp->th_flags & TH_RST)
-        printf("RST ");
+        fprintf(current_packet.out, "RST ");
     if (tcp->th_flags & TH_PUSH)
-        printf("PSH ");
+        fprintf(current_packet.out, "PSH ");
     if (tcp->th_flags & TH_ACK)
-        printf("ACK ");
+        fprintf(current_packet.out, "ACK ");
     if (tcp->th_flags & TH_URG)
-        printf("URG ");
-    printf("\n");
+        fprintf(current_packet.out, "URG ");
+    fprintf(current_packet.out, "\n");
 }
 
 
 /**
  * @brief Handle a TCP packet
  * 
- * This function handles a TCP packet.
+ * This function handles a TCP packet. The application protocol comes from the
+ * verdict of the flow, whatever the ports used.
  * 
  * @param packet The packet to handle
  * @param tcp The TCP header
  * @param remain_size The remaining size of the packet
  * @return int 0 if the packet is well handled
  * 
+ * @see dpi_classify
  * @see is_http
- * @see is_smtp
- * @see is_ftp
+ * @see cast_tls
+ * @see cast_smtp
+ * @see cast_ftp
+ * @see cast_ftp_data
  * @see cast_dns
- * @see is_pop
+ * @see cast_pop
  * @see telnet_handler
  */
 int tcp_handling(const u_char *packet, const struct tcphdr *tcp,
                  int remain_size)
 {
-    if (be16toh(tcp->th_sport) == 80 || be16toh(tcp->th_dport) == 80) {
-        if (is_http(packet + tcp->doff * 4)) {
-            printf("\t\tHTTP\n");
-            printf("------------------------------------------------\n");
-            printf("%.*s\n", remain_size, packet + tcp->doff * 4);
-            printf("------------------------------------------------\n");
-        }
-    } else if (be16toh(tcp->th_sport) == 443 || be16toh(tcp->th_dport) == 443) {
-        const struct tlshdr *tls;
-        tls = (struct tlshdr *)(packet + tcp->th_off * 4);
-        printf("\t\tHTTPS\n");
-        printf("------------------------------------------------\n");
-        printf("Encryption with ");
-        switch (TLS_V(tls)) {
-        case 0x00:
-            printf("SSL 3.0\n");
-            break;
-        case 0x01:
-            printf("TLS 1.0\n");
-            break;
-        case 0x02:
-            printf("TLS 1.1\n");
-            break;
-        case 0x03:
-            printf("TLS 1.2\n");
-            break;
-        case 0x04:
-            printf("TLS 1.3\n");
-            break;
-        default:
-            fprintf(stderr, "Unknown SSL/TLS version. VERSION: 0x%x\n",
-                    TLS_V(tls));
-        }
-        // printf("%s\n", packet + tcp->th_off * 4 + sizeof(struct tlshdr));
-        printf("------------------------------------------------\n");
-    } else if (be16toh(tcp->th_sport) == 25 || be16toh(tcp->th_dport) == 25) {
-        if (is_smtp(packet + tcp->doff * 4)) {
-            printf("\t\tSMTP\n");
-            printf("------------------------------------------------\n");
-            printf("%.*s\n", remain_size, packet + tcp->doff * 4);
-            printf("------------------------------------------------\n");
-        }
-    } else if (be16toh(tcp->th_sport) == 21 || be16toh(tcp->th_dport) == 21 ||
-               be16toh(tcp->th_sport) == 20 || be16toh(tcp->th_dport) == 20) {
-        if (is_ftp(packet + tcp->doff * 4)) {
-            printf("\t\tFTP\n");
-            printf("------------------------------------------------\n");
-            printf("%.*s\n", remain_size, packet + tcp->doff * 4);
-            printf("------------------------------------------------\n");
-        }
-    } else if (be16toh(tcp->th_sport) == 53 || be16toh(tcp->th_dport) == 53) {
-        printf("\t\tDNS\n");
-        printf("------------------------------------------------\n");
-        cast_dns(packet + tcp->doff * 4, remain_size);
-        printf("------------------------------------------------\n");
-    } else if (be16toh(tcp->th_sport) == 110 || be16toh(tcp->th_dport) == 110) {
-        if (is_pop(packet + tcp->doff * 4)) {
-            printf("\t\tPOP3\n");
-            printf("------------------------------------------------\n");
-            printf("%.*s\n", remain_size, packet + tcp->doff * 4);
-            printf("------------------------------------------------\n");
+    const u_char *payload = packet + tcp->doff * 4;
+    if (current_packet.flow == NULL) {
+        return 0;
+    }
+
+    // NUL padded copy for the text checks of short payloads
+    u_char probe[DPI_PROBE_LEN + 1] = {0};
+    memcpy(probe, payload,
+           remain_size < DPI_PROBE_LEN ? remain_size : DPI_PROBE_LEN);
+
+    switch (dpi_classify(current_packet.flow, payload, remain_size)) {
+    case APP_HTTP:
+        if (is_http(probe)) {
+            http_fields(payload, remain_size);
+            fprintf(current_packet.out, "\t\tHTTP\n");
+            fprintf(current_packet.out,
+                    "------------------------------------------------\n");
+            fprintf(current_packet.out, "%.*s\n", remain_size, payload);
+            fprintf(current_packet.out,
+                    "------------------------------------------------\n");
         }
-    } else if (be16toh(tcp->th_sport) == 143 || be16toh(tcp->th_dport) == 143) {
-        printf("\t\tIMAP\n");
-        printf("------------------------------------------------\n");
-        printf("%s\n", packet + tcp->doff * 4);
-        printf("------------------------------------------------\n");
-    } else if (be16toh(tcp->th_sport) == 993 || be16toh(tcp->th_dport) == 993) {
-        const struct tlshdr *tls;
-        tls = (struct tlshdr *)(packet + tcp->th_off * 4);
-        printf("\t\tIMAP\n");
-        printf("------------------------------------------------\n");
-        printf("Encryption with ");
-        switch (TLS_V(tls)) {
-        case 0x00:
-            printf("SSL 3.0\n");
-            break;
-        case 0x01:
-            printf("TLS 1.0\n");
-            break;
-        case 0x02:
-            printf("TLS 1.1\n");
-            break;
-        case 0x03:
-            printf("TLS 1.2\n");
-            break;
-        case 0x04:
-            printf("TLS 1.3\n");
-            break;
-        default:
-            fprintf(stderr, "Unknown SSL/TLS version. VERSION: 0x%x\n",
-                    TLS_V(tls));
+        break;
+    case APP_TLS:
+        fprintf(current_packet.out, "\t\tTLS\n");
+        fprintf(current_packet.out,
+                "------------------------------------------------\n");
+        cast_tls(payload, remain_size, be32toh(tcp->th_seq));
+        fprintf(current_packet.out,
+                "------------------------------------------------\n");
+        break;
+    case APP_SMTP:
+        fprintf(current_packet.out, "\t\tSMTP\n");
+        fprintf(current_packet.out,
+                "------------------------------------------------\n");
+        cast_smtp(payload, remain_size, be32toh(tcp->th_seq));
+        fprintf(current_packet.out,
+                "------------------------------------------------\n");
+        break;
+    case APP_FTP:
+        if (is_ftp(probe)) {
+            fprintf(current_packet.out, "\t\tFTP\n");
+            fprintf(current_packet.out,
+                    "------------------------------------------------\n");
+            fprintf(current_packet.out, "%.*s\n", remain_size, payload);
+            cast_ftp(payload, remain_size);
+            fprintf(current_packet.out,
+                    "------------------------------------------------\n");
         }
-    } else if (be16toh(tcp->th_sport) == 23 || be16toh(tcp->th_dport) == 23) {
-        printf("\t\ttelnet\n");
-        printf("------------------------------------------------\n");
-        telnet_handler(packet + tcp->doff * 4);
-        printf("------------------------------------------------\n");
+        break;
+    case APP_FTP_DATA:
+        fprintf(current_packet.out, "\t\tFTP-DATA\n");
+        fprintf(current_packet.out,
+                "------------------------------------------------\n");
+        cast_ftp_data(payload, remain_size);
+        fprintf(current_packet.out,
+                "------------------------------------------------\n");
+        break;
+    case APP_DNS:
+        fprintf(current_packet.out, "\t\tDNS\n");
+        fprintf(current_packet.out,
+                "------------------------------------------------\n");
+        cast_dns(payload, remain_size);
+        fprintf(current_packet.out,
+                "------------------------------------------------\n");
+        break;
+    case APP_POP:
+        fprintf(current_packet.out, "\t\tPOP3\n");
+        fprintf(current_packet.out,
+                "------------------------------------------------\n");
+        cast_pop(payload, remain_size, be32toh(tcp->th_seq));
+        fprintf(current_packet.out,
+                "------------------------------------------------\n");
+        break;
+    case APP_IMAP:
+        fprintf(current_packet.out, "\t\tIMAP\n");
+        fprintf(current_packet.out,
+                "------------------------------------------------\n");
+        cast_imap(payload, remain_size, be32toh(tcp->th_seq));
+        fprintf(current_packet.out,
+                "------------------------------------------------\n");
+        break;
+    case APP_TELNET:
+        fprintf(current_packet.out, "\t\ttelnet\n");
+        fprintf(current_packet.out,
+                "------------------------------------------------\n");
+        telnet_handler(payload, remain_size, be32toh(tcp->th_seq));
+        fprintf(current_packet.out,
+                "------------------------------------------------\n");
+        break;
     }
     return 0;
 }
@@ -178,22 +178,48 @@ int tcp_handling(const u_char *packet, const struct tcphdr *tcp,
  * Get TCP header from packet.
  * 
  * @param packet Pointer to the packet
- * @param remain_size Remaining size of the packet
+ * @param remain_size The captured size of the IP payload
  * @return int 0 on success, -1 on error
  * 
  * @see check_flags
+ * @see flow_lookup
+ * @see expect_match
  * @see tcp_handling
  */
 int cast_tcp(const u_char *packet, int remain_size)
 {
     const struct tcphdr *tcp;
+    if (remain_size < (int)sizeof(struct tcphdr)) {
+        fprintf(stderr, "Truncated TCP header\n");
+        return (-1);
+    }
     tcp = (struct tcphdr *)packet;
-    printf("TCP.port: %d->%d\n", be16toh(tcp->th_sport),
-           be16toh(tcp->th_dport));
-    if (remain_size != tcp->doff * 4) {
+    fprintf(current_packet.out, "TCP.port: %d->%d\n", be16toh(tcp->th_sport),
+            be16toh(tcp->th_dport));
+
+    current_packet.key.proto = IPPROTO_TCP;
+    current_packet.key.sport = be16toh(tcp->th_sport);
+    current_packet.key.dport = be16toh(tcp->th_dport);
+    current_packet.flow = flow_lookup(&current_packet.key, &current_packet.dir);
+    if (current_packet.flow != NULL)
+        flow_count(current_packet.flow, current_packet.dir,
+                   current_packet.ip_len, tcp->th_flags);
+    if (current_packet.flow != NULL &&
+        (tcp->th_flags & (TH_SYN | TH_ACK)) == TH_SYN) {
+        // Connection negotiated by another flow (e.g. FTP data)
+        expect_match(current_packet.flow, &current_packet.key);
+    }
+
+    if (remain_size > tcp->doff * 4) {
         tcp_handling(packet, tcp, remain_size - tcp->doff * 4);
     } else {
         check_flags(tcp);
     }
+
+    if (current_packet.flow != NULL &&
+        current_packet.flow->app == APP_FTP_DATA &&
+        (tcp->th_flags & (TH_FIN | TH_RST))) {
+        ftp_data_close();
+    }
     return 0;
 }
\ No newline at end of file
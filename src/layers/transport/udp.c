@@ -11,12 +11,17 @@
  */
 
 // Global libraries
+#include <netinet/in.h>
 #include <stdio.h>
 
 // Local header files
 #include "udp.h"
 #include "bootp.h"
+#include "dhcpv6.h"
 #include "dns.h"
+#include "dpi.h"
+#include "echo.h"
+#include "packet.h"
 
 /**
  * @brief Handle a UDP packet
@@ -28,20 +33,40 @@
  * @param data_size The size of the data
  * @return int 0 if the packet is well handled
  * 
+ * @see dpi_classify
  * @see cast_bootp
+ * @see cast_dhcpv6
  * @see cast_dns
  */
 int udp_handling(const u_char *packet, const struct udphdr *udp, int data_size)
 {
-    if (be16toh(udp->uh_sport) == 67 || be16toh(udp->uh_dport) == 67 ||
-        be16toh(udp->uh_dport) == 68 || be16toh(udp->uh_dport) == 68) {
-        printf("------------------------------------------------\n");
-        cast_bootp(packet + 8);
-        printf("------------------------------------------------\n");
-    } else if (be16toh(udp->uh_sport) == 53 || be16toh(udp->uh_dport) == 53) {
-        printf("------------------------------------------------\n");
-        cast_dns(packet + 8, data_size);
-        printf("------------------------------------------------\n");
+    const u_char *payload = packet + sizeof(*udp);
+    if (current_packet.flow == NULL) {
+        return 0;
+    }
+
+    switch (dpi_classify(current_packet.flow, payload, data_size)) {
+    case APP_BOOTP:
+        fprintf(current_packet.out,
+                "------------------------------------------------\n");
+        cast_bootp(payload, data_size);
+        fprintf(current_packet.out,
+                "------------------------------------------------\n");
+        break;
+    case APP_DHCPV6:
+        fprintf(current_packet.out,
+                "------------------------------------------------\n");
+        cast_dhcpv6(payload, data_size);
+        fprintf(current_packet.out,
+                "------------------------------------------------\n");
+        break;
+    case APP_DNS:
+        fprintf(current_packet.out,
+                "------------------------------------------------\n");
+        cast_dns(payload, data_size);
+        fprintf(current_packet.out,
+                "------------------------------------------------\n");
+        break;
     }
     return 0;
 }
@@ -53,15 +78,39 @@ int udp_handling(const u_char *packet, const struct udphdr *udp, int data_size)
  * This function handles a UDP packet.
  * 
  * @param packet The packet to handle
+ * @param size The captured size of the IP payload
  * @return int 0 if the packet is well handled
+ * 
+ * @see flow_lookup
+ * @see echo_udp_probe
+ * @see udp_handling
  */
-int cast_udp(const u_char *packet)
+int cast_udp(const u_char *packet, int size)
 {
     const struct udphdr *udp;
+    if (size < (int)sizeof(struct udphdr)) {
+        fprintf(stderr, "Truncated UDP header\n");
+        return (-1);
+    }
     udp = (struct udphdr *)packet;
-    printf("UDP.port: %d->%d\n", be16toh(udp->uh_sport), be16toh(udp->uh_dport));
-    if (be16toh(udp->uh_ulen) > 8) {
-        udp_handling(packet, udp, be16toh(udp->uh_ulen) - 8);
+    fprintf(current_packet.out, "UDP.port: %d->%d\n",
+            be16toh(udp->uh_sport), be16toh(udp->uh_dport));
+
+    current_packet.key.proto = IPPROTO_UDP;
+    current_packet.key.sport = be16toh(udp->uh_sport);
+    current_packet.key.dport = be16toh(udp->uh_dport);
+    current_packet.flow = flow_lookup(&current_packet.key, &current_packet.dir);
+    if (current_packet.flow != NULL)
+        flow_count(current_packet.flow, current_packet.dir,
+                   current_packet.ip_len, 0);
+    echo_udp_probe();
+
+    // Payload within the captured bytes
+    int data_size = be16toh(udp->uh_ulen) - (int)sizeof(struct udphdr);
+    if (data_size > size - (int)sizeof(struct udphdr))
+        data_size = size - sizeof(struct udphdr);
+    if (data_size > 0) {
+        udp_handling(packet, udp, data_size);
     }
     return 0;
 }
\ No newline at end of file